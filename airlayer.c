@@ -16,7 +16,7 @@ static void physics_air_layer_sub(struct level_t *l, int16_t x, int16_t y, int16
 	if (!level_valid_xyz(l, x, y, z)) return;
 
 	unsigned index = level_get_index(l, x, y, z);
-	switch (l->blocks[index].type)
+	switch (level_block_type(l, index))
 	{
 		case WATER:
 		case WATERSTILL:
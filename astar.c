@@ -3,13 +3,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
-#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
 #include "astar.h"
 #include "block.h"
 #include "level.h"
 #include "client.h"
 #include "packet.h"
-#include "hash.h"
 
 #define RADIUS (9.0f / 32.0f)
 
@@ -126,182 +126,337 @@ float point_dist(const struct point *a, const struct point *b, bool guess)
 struct node
 {
 	struct node *parent;
-	struct node *prev;
-	struct node *next;
 	float f, g, h;
 	struct point point;
+	unsigned index;
+
+	/* Position in the open heap + 1, or 0 once closed */
+	unsigned heap;
 };
 
-static bool node_match(const struct node *a, const struct node *b)
-{
-	return a->point.x == b->point.x && a->point.y == b->point.y && a->point.z == b->point.z;
-}
+/* Nodes are taken from blocks that are kept between searches */
+#define NODE_BLOCK_SIZE 1024
 
 struct as
 {
 	const struct level_t *level;
-	struct node *openlist;
-	struct hash closedhash;
+
+	/* Nodes outside these bounds are not visited */
+	int x1, y1, x2, y2;
+
+	/* Binary heap of open nodes, lowest f first */
+	struct node **heap;
+	size_t heap_used;
+	size_t heap_size;
+
+	/* Open addressed map from block index to node, open or closed */
+	struct node **slots;
+	size_t slots_used;
+	size_t slots_size;
+
+	struct node **blocks;
+	size_t blocks_size;
+	size_t nodes_used;
 };
 
-static void openlist_add(struct node **headref, struct node *node)
-{
-	struct node *prev = NULL;
-	struct node *curr = *headref;
+/* Each thread keeps its own search state, so memory is reused. It is freed
+ * when the thread exits, as idle worker threads do. */
+static pthread_key_t s_as_key;
+static pthread_once_t s_as_once = PTHREAD_ONCE_INIT;
 
-	assert(node->prev == NULL);
-	assert(node->next == NULL);
+static void as_free(void *arg)
+{
+	struct as *as = arg;
 
-	if (*headref == NULL || node->f <= (*headref)->f)
+	size_t i;
+	for (i = 0; i < as->blocks_size; i++)
 	{
-		node->next = *headref;
-		*headref = node;
+		free(as->blocks[i]);
 	}
-	else
-	{
-		while (curr != NULL && curr->f <= node->f)
-		{
-			prev = curr;
-			curr = curr->next;
-		}
 
-		assert(prev != NULL);
-		prev->next = node;
-		node->prev = prev;
-		node->next = curr;
-		if (curr != NULL) curr->prev = node;
-	}
+	free(as->blocks);
+	free(as->slots);
+	free(as->heap);
+	free(as);
+}
+
+static void as_key_init(void)
+{
+	pthread_key_create(&s_as_key, &as_free);
 }
 
-static struct node *openlist_pop(struct node **headref)
+static struct as *as_get(void)
 {
-	struct node *top = *headref;
-	*headref = top->next;
-	top->next = NULL;
-	if (*headref != NULL) (*headref)->prev = NULL;
+	pthread_once(&s_as_once, &as_key_init);
 
-	return top;
+	struct as *as = pthread_getspecific(s_as_key);
+	if (as != NULL) return as;
+
+	as = calloc(1, sizeof *as);
+	if (as == NULL) return NULL;
+
+	if (pthread_setspecific(s_as_key, as) != 0)
+	{
+		free(as);
+		return NULL;
+	}
+
+	return as;
 }
 
-static void openlist_del(struct node **headref, struct node *node)
+static void as_reset(struct as *as, const struct level_t *level, int x1, int y1, int x2, int y2)
 {
-	if (node->prev == NULL)
+	as->level = level;
+	as->x1 = x1;
+	as->y1 = y1;
+	as->x2 = x2;
+	as->y2 = y2;
+	as->heap_used = 0;
+	if (as->slots_used > 0) memset(as->slots, 0, as->slots_size * sizeof *as->slots);
+	as->slots_used = 0;
+	as->nodes_used = 0;
+}
+
+static struct node *node_alloc(struct as *as)
+{
+	size_t block = as->nodes_used / NODE_BLOCK_SIZE;
+	if (block >= as->blocks_size)
 	{
-		*headref = node->next;
+		size_t size = as->blocks_size == 0 ? 16 : as->blocks_size * 2;
+		struct node **blocks = realloc(as->blocks, size * sizeof *blocks);
+		if (blocks == NULL) return NULL;
+		memset(blocks + as->blocks_size, 0, (size - as->blocks_size) * sizeof *blocks);
+		as->blocks = blocks;
+		as->blocks_size = size;
 	}
-	else
+
+	if (as->blocks[block] == NULL)
 	{
-		node->prev->next = node->next;
+		as->blocks[block] = malloc(NODE_BLOCK_SIZE * sizeof **as->blocks);
+		if (as->blocks[block] == NULL) return NULL;
 	}
-	if (node->next != NULL)
+
+	struct node *node = &as->blocks[block][as->nodes_used % NODE_BLOCK_SIZE];
+	as->nodes_used++;
+
+	memset(node, 0, sizeof *node);
+	return node;
+}
+
+static inline size_t node_hash(const struct as *as, unsigned index)
+{
+	return (index * 2654435761U) & (as->slots_size - 1);
+}
+
+static struct node *node_find(const struct as *as, unsigned index)
+{
+	if (as->slots_used == 0) return NULL;
+
+	size_t h;
+	for (h = node_hash(as, index); as->slots[h] != NULL; h = (h + 1) & (as->slots_size - 1))
 	{
-		node->next->prev = node->prev;
+		if (as->slots[h]->index == index) return as->slots[h];
 	}
-	free(node);
+
+	return NULL;
 }
 
-static void openlist_wipe(struct node **headref)
+static void node_insert(struct as *as, struct node *node)
 {
-	struct node *prev;
-	struct node *curr = *headref;
+	size_t h;
+	for (h = node_hash(as, node->index); as->slots[h] != NULL; h = (h + 1) & (as->slots_size - 1));
+
+	as->slots[h] = node;
+	as->slots_used++;
+}
 
-	while (curr != NULL)
+static bool node_add(struct as *as, struct node *node)
+{
+	if ((as->slots_used + 1) * 2 > as->slots_size)
 	{
-		prev = curr;
-		curr = curr->next;
-		free(prev);
+		/* Grow, and map every node again */
+		size_t size = as->slots_size == 0 ? 4096 : as->slots_size * 2;
+		struct node **slots = calloc(size, sizeof *slots);
+		if (slots == NULL) return false;
+
+		struct node **old = as->slots;
+		size_t old_size = as->slots_size;
+
+		as->slots = slots;
+		as->slots_size = size;
+		as->slots_used = 0;
+
+		size_t i;
+		for (i = 0; i < old_size; i++)
+		{
+			if (old[i] != NULL) node_insert(as, old[i]);
+		}
+		free(old);
 	}
 
-	*headref = NULL;
+	node_insert(as, node);
+	return true;
+}
+
+/* Ties go to the node nearer the end */
+static inline bool node_less(const struct node *a, const struct node *b)
+{
+	return a->f < b->f || (a->f == b->f && a->h < b->h);
 }
 
-static struct node *as_isinlist(struct node **headref, struct node *node)
+static inline void heap_set(struct as *as, size_t pos, struct node *node)
 {
-	struct node *curr = *headref;
+	as->heap[pos] = node;
+	node->heap = pos + 1;
+}
 
-	while (curr != NULL && !node_match(curr, node))
+static void heap_up(struct as *as, size_t pos)
+{
+	struct node *node = as->heap[pos];
+	while (pos > 0)
 	{
-		curr = curr->next;
+		size_t parent = (pos - 1) / 2;
+		if (!node_less(node, as->heap[parent])) break;
+		heap_set(as, pos, as->heap[parent]);
+		pos = parent;
 	}
+	heap_set(as, pos, node);
+}
 
-	return curr;
+static void heap_down(struct as *as, size_t pos)
+{
+	struct node *node = as->heap[pos];
+	for (;;)
+	{
+		size_t child = pos * 2 + 1;
+		if (child >= as->heap_used) break;
+		if (child + 1 < as->heap_used && node_less(as->heap[child + 1], as->heap[child])) child++;
+		if (!node_less(as->heap[child], node)) break;
+		heap_set(as, pos, as->heap[child]);
+		pos = child;
+	}
+	heap_set(as, pos, node);
 }
 
-static void as_maybe(struct as *as, struct node *curr, const struct node *end, struct point n)
+static bool heap_push(struct as *as, struct node *node)
 {
-	if (hashnode_get(&as->closedhash, level_get_index(as->level, n.x, n.z, n.y), 0) != NULL)
+	if (as->heap_used == as->heap_size)
 	{
-		return;
+		size_t size = as->heap_size == 0 ? 1024 : as->heap_size * 2;
+		struct node **heap = realloc(as->heap, size * sizeof *heap);
+		if (heap == NULL) return false;
+		as->heap = heap;
+		as->heap_size = size;
+	}
+
+	as->heap[as->heap_used] = node;
+	heap_up(as, as->heap_used++);
+	return true;
+}
+
+static struct node *heap_pop(struct as *as)
+{
+	struct node *top = as->heap[0];
+	top->heap = 0;
+
+	if (--as->heap_used > 0)
+	{
+		as->heap[0] = as->heap[as->heap_used];
+		heap_down(as, 0);
 	}
 
-	struct node *tentative = calloc(1, sizeof *tentative);
-	tentative->point = n;
+	return top;
+}
 
+static void as_maybe(struct as *as, struct node *curr, const struct point *end, struct point n)
+{
+	if (n.x < as->x1 || n.x > as->x2 || n.y < as->y1 || n.y > as->y2) return;
+
+	unsigned index = level_get_index(as->level, n.x, n.z, n.y);
 	float g = curr->g + point_dist(&curr->point, &n, false);
 
-	struct node *maybe = as_isinlist(&as->openlist, tentative);
-	if (maybe != NULL)
+	struct node *node = node_find(as, index);
+	if (node != NULL)
 	{
-		if (g < maybe->g)
-		{
-			openlist_del(&as->openlist, maybe);
-		}
-		else
-		{
-			free(tentative);
-			return;
-		}
+		/* Closed, or already open by a path at least as short */
+		if (node->heap == 0 || g >= node->g) return;
+
+		node->parent = curr;
+		node->g = g;
+		node->f = g + node->h;
+		heap_up(as, node->heap - 1);
+		return;
 	}
 
-	tentative->parent = curr;
-	tentative->h = point_dist(&n, &end->point, true);
-	tentative->g = g;
-	tentative->f = tentative->g + tentative->h;
+	node = node_alloc(as);
+	if (node == NULL) return;
 
-	openlist_add(&as->openlist, tentative);
+	node->point = n;
+	node->index = index;
+	node->parent = curr;
+	node->h = end == NULL ? 0.0f : point_dist(&n, end, true);
+	node->g = g;
+	node->f = node->g + node->h;
+
+	if (!node_add(as, node)) return;
+	heap_push(as, node);
 }
 
-#define HASH_BITS 12
-#define HASH_SIZE (1 << (HASH_BITS))
+static void as_expand(struct as *as, struct node *curr, const struct point *end)
+{
+	int i;
+	int c[8];
+	struct point p[8];
 
-#define HASH_HALFBITS ((HASH_BITS) / 2)
-#define HASH_HALFMASK ((1 << (HASH_HALFBITS)) - 1)
+	for (i = 0; i < 8; i += 2)
+	{
+		c[i] = point_add(as->level, &curr->point, i, &p[i]);
 
-static unsigned as_hash(int key1, int key2)
-{
-	int part1 = key1 & HASH_HALFMASK;
-	int part2 = key2 & HASH_HALFMASK;
+		if (c[i] > 0) as_maybe(as, curr, end, p[i]);
+	}
 
-	return ((part1 << HASH_HALFBITS) | part2) % HASH_SIZE;
+	for (i = 1; i < 8; i += 2)
+	{
+		if (c[i - 1] == 1 && c[(i + 1) % 8] == 1)
+		{
+			c[i] = point_add(as->level, &curr->point, i, &p[i]);
+			if (c[i] > 0) as_maybe(as, curr, end, p[i]);
+		}
+	}
 }
 
-struct point *as_find(const struct level_t *level, const struct point *a, const struct point *b)
+static bool as_start(struct as *as, const struct point *a, const struct point *end)
 {
-	int i;
-
-	struct as as;
-	memset(&as, 0, sizeof as);
-	as.level = level;
+	struct node *start = node_alloc(as);
+	if (start == NULL) return false;
 
-	struct node *start = calloc(1, sizeof *start);
 	start->point = *a;
+	start->index = level_get_index(as->level, a->x, a->z, a->y);
+	start->h = end == NULL ? 0.0f : point_dist(&start->point, end, true);
+	start->f = start->h;
 
-	struct node end;
-	end.point = *b;
+	return node_add(as, start) && heap_push(as, start);
+}
 
-//	printf("Pathfinding from %d %d %d to %d %d %d\n", a->x, a->y, a->z, b->x, b->y, b->z);
+static inline bool point_match(const struct point *a, const struct point *b)
+{
+	return a->x == b->x && a->y == b->y && a->z == b->z;
+}
 
-	hash_init(&as.closedhash, &as_hash, HASH_SIZE);
+struct point *as_find(const struct level_t *level, const struct point *a, const struct point *b)
+{
+	struct as *as = as_get();
+	if (as == NULL) return NULL;
+	as_reset(as, level, INT_MIN, INT_MIN, INT_MAX, INT_MAX);
 
-	start->h = point_dist(&start->point, &end.point, true);
-	start->f = start->h;
+//	printf("Pathfinding from %d %d %d to %d %d %d\n", a->x, a->y, a->z, b->x, b->y, b->z);
 
-	openlist_add(&as.openlist, start);
+	if (!as_start(as, a, b)) return NULL;
 
-	while (as.openlist != NULL)
+	while (as->heap_used > 0)
 	{
-		struct node *curr = openlist_pop(&as.openlist);
-		if (node_match(curr, &end))
+		struct node *curr = heap_pop(as);
+		if (point_match(&curr->point, b))
 		{
 			struct node *n;
 
@@ -335,7 +490,7 @@ struct point *as_find(const struct level_t *level, const struct point *a, const
 				struct point *ps2 = ps + 1;
 				do {
 					ps2++;
-					if (path_iswalkable(as.level, ps, ps2))
+					if (path_iswalkable(as->level, ps, ps2))
 					{
 						*(ps + 1) = *ps2;
 					}
@@ -350,38 +505,43 @@ struct point *as_find(const struct level_t *level, const struct point *a, const
 				ps->x = -1;
 			}
 
-			hash_delete(&as.closedhash, true);
-			openlist_wipe(&as.openlist);
-
 			return s;
 		}
 
-		hashnode_set(&as.closedhash, level_get_index(level, curr->point.x, curr->point.z, curr->point.y), 0, curr);
+		as_expand(as, curr, b);
+	}
 
-		int c[8];
-		struct point p[8];
+//	printf("Path not found\n");
 
-		for (i = 0; i < 8; i += 2)
-		{
-			c[i] = point_add(as.level, &curr->point, i, &p[i]);
+	return NULL;
+}
 
-			if (c[i] > 0) as_maybe(&as, curr, &end, p[i]);
-		}
+void as_costs(const struct level_t *level, const struct point *a, const struct point *targets, int n, float *costs, int x1, int y1, int x2, int y2)
+{
+	int i;
+	for (i = 0; i < n; i++) costs[i] = INFINITY;
 
-		for (i = 1; i < 8; i += 2)
-		{
-			if (c[i - 1] == 1 && c[(i + 1) % 8] == 1)
-			{
-				c[i] = point_add(as.level, &curr->point, i, &p[i]);
-				if (c[i] > 0) as_maybe(&as, curr, &end, p[i]);
-			}
-		}
-	}
+	struct as *as = as_get();
+	if (as == NULL) return;
+	as_reset(as, level, x1, y1, x2, y2);
 
-	hash_delete(&as.closedhash, true);
-	openlist_wipe(&as.openlist);
+	/* A single target can be aimed for, otherwise search everywhere
+	 * within the bounds */
+	const struct point *end = n == 1 ? targets : NULL;
+	if (!as_start(as, a, end)) return;
 
-//	printf("Path not found\n");
+	while (as->heap_used > 0)
+	{
+		struct node *curr = heap_pop(as);
+		if (end != NULL && point_match(&curr->point, end)) break;
 
-	return NULL;
+		as_expand(as, curr, end);
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		const struct point *t = &targets[i];
+		struct node *node = node_find(as, level_get_index(level, t->x, t->z, t->y));
+		if (node != NULL && node->heap == 0 && point_match(&node->point, t)) costs[i] = node->g;
+	}
 }
@@ -1,6 +1,8 @@
 #ifndef ASTAR_H
 #define ASTAR_H
 
+#include <stdbool.h>
+
 struct level_t;
 
 struct point
@@ -8,6 +10,12 @@ struct point
 	int x, y, z;
 };
 
+int point_add(const struct level_t *l, const struct point *p, int d, struct point *q);
+float point_dist(const struct point *a, const struct point *b, bool guess);
 struct point *as_find(const struct level_t *level, const struct point *a, const struct point *b);
 
+/* Cost of the shortest path from a to each target, staying within x1..x2
+ * and y1..y2, or INFINITY if there is none */
+void as_costs(const struct level_t *level, const struct point *a, const struct point *targets, int n, float *costs, int x1, int y1, int x2, int y2);
+
 #endif /* ASTAR_H */
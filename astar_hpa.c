@@ -0,0 +1,631 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include "astar.h"
+#include "astar_hpa.h"
+#include "block.h"
+#include "level.h"
+
+/* Clusters are columns of level regions, so the region generations tell
+ * when one needs rebuilding */
+#define HPA_BITS LEVEL_REGION_BITS
+#define HPA_SIZE LEVEL_REGION_SIZE
+
+/* Routes shorter than this are searched directly */
+#define HPA_MIN_DISTANCE (HPA_SIZE * 2)
+
+struct hpa_entrance
+{
+	/* Cluster a step from here crosses into, and where it lands, or -1 */
+	int next;
+	struct point q;
+};
+
+/* Entrances of a cluster. Built outside the lock and never changed after,
+ * so searches use them unlocked while holding a reference; a rebuild just
+ * replaces the cluster's reference. */
+struct hpa_data
+{
+	unsigned refs;
+	unsigned generation;
+
+	/* Entrances on the border, and the cost between each pair without
+	 * leaving the cluster */
+	int n;
+	int size;
+	struct point *points;
+	struct hpa_entrance *entrances;
+	float *cost;
+};
+
+struct hpa_cluster
+{
+	struct hpa_data *data;
+	/* Being built by a search, others wait for it on cond */
+	bool building;
+};
+
+struct astar_hpa
+{
+	/* Held to look up and publish cluster data only */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int cx, cz;
+	struct hpa_cluster *clusters;
+};
+
+/* Search state of an entrance */
+struct hpa_node
+{
+	float g;
+	int parent_cluster, parent_node;
+	bool closed;
+};
+
+struct hpa_open
+{
+	float f;
+	int cluster;
+	/* -1 for the goal */
+	int node;
+};
+
+/* A cluster as seen by one search */
+struct hpa_reached
+{
+	bool seen;
+	struct hpa_data *data;
+	struct hpa_node *nodes;
+};
+
+struct hpa_search
+{
+	struct astar_hpa *h;
+	const struct level_t *l;
+
+	struct hpa_reached *reached;
+	int *seen;
+	int seen_used;
+
+	struct hpa_open *open;
+	size_t open_used;
+	size_t open_size;
+};
+
+static inline bool point_same(const struct point *a, const struct point *b)
+{
+	return a->x == b->x && a->y == b->y && a->z == b->z;
+}
+
+static inline int hpa_cluster_of(const struct astar_hpa *h, int x, int y)
+{
+	return (x >> HPA_BITS) + (y >> HPA_BITS) * h->cx;
+}
+
+static void hpa_bounds(const struct astar_hpa *h, const struct level_t *l, int c, int *x1, int *y1, int *x2, int *y2)
+{
+	*x1 = (c % h->cx) << HPA_BITS;
+	*y1 = (c / h->cx) << HPA_BITS;
+	*x2 = *x1 + HPA_SIZE > l->x ? l->x - 1 : *x1 + HPA_SIZE - 1;
+	*y2 = *y1 + HPA_SIZE > l->z ? l->z - 1 : *y1 + HPA_SIZE - 1;
+}
+
+/* Cluster next to c in point_add() direction d, or -1 */
+static int hpa_neighbour(const struct astar_hpa *h, int c, int d)
+{
+	int x = c % h->cx;
+	int y = c / h->cx;
+
+	switch (d)
+	{
+		case 0: x--; break;
+		case 2: y--; break;
+		case 4: x++; break;
+		case 6: y++; break;
+	}
+
+	if (x < 0 || x >= h->cx || y < 0 || y >= h->cz) return -1;
+	return x + y * h->cx;
+}
+
+static struct astar_hpa *hpa_get(struct level_t *level)
+{
+	struct astar_hpa *h = __atomic_load_n(&level->path_hpa, __ATOMIC_ACQUIRE);
+	if (h != NULL) return h;
+
+	h = calloc(1, sizeof *h);
+	if (h == NULL) return NULL;
+
+	h->cx = (level->x + HPA_SIZE - 1) >> HPA_BITS;
+	h->cz = (level->z + HPA_SIZE - 1) >> HPA_BITS;
+	h->clusters = calloc(h->cx * h->cz, sizeof *h->clusters);
+	if (h->clusters == NULL)
+	{
+		free(h);
+		return NULL;
+	}
+	pthread_mutex_init(&h->mutex, NULL);
+	pthread_cond_init(&h->cond, NULL);
+
+	/* Another worker may have got there first */
+	if (!__sync_bool_compare_and_swap(&level->path_hpa, NULL, h))
+	{
+		pthread_cond_destroy(&h->cond);
+		pthread_mutex_destroy(&h->mutex);
+		free(h->clusters);
+		free(h);
+	}
+
+	return __atomic_load_n(&level->path_hpa, __ATOMIC_ACQUIRE);
+}
+
+static void hpa_data_free(struct hpa_data *d)
+{
+	free(d->points);
+	free(d->entrances);
+	free(d->cost);
+	free(d);
+}
+
+/* Drop a reference to cluster data. Called with the mutex held. */
+static void hpa_data_release(struct hpa_data *d)
+{
+	if (d != NULL && --d->refs == 0) hpa_data_free(d);
+}
+
+void hpa_free(struct level_t *level)
+{
+	struct astar_hpa *h = level->path_hpa;
+	if (h == NULL) return;
+
+	int c;
+	for (c = 0; c < h->cx * h->cz; c++)
+	{
+		hpa_data_release(h->clusters[c].data);
+	}
+
+	free(h->clusters);
+	pthread_cond_destroy(&h->cond);
+	pthread_mutex_destroy(&h->mutex);
+	free(h);
+	level->path_hpa = NULL;
+}
+
+/* Add an entrance, or for one that only leads in, reuse any node already
+ * at that point */
+static bool hpa_data_add(struct hpa_data *d, const struct point *p, int next, const struct point *q)
+{
+	int i;
+	if (next == -1)
+	{
+		for (i = 0; i < d->n; i++)
+		{
+			if (point_same(&d->points[i], p)) return true;
+		}
+	}
+
+	if (d->n == d->size)
+	{
+		int size = d->size == 0 ? 16 : d->size * 2;
+		struct point *points = realloc(d->points, size * sizeof *points);
+		if (points == NULL) return false;
+		d->points = points;
+
+		struct hpa_entrance *entrances = realloc(d->entrances, size * sizeof *entrances);
+		if (entrances == NULL) return false;
+		d->entrances = entrances;
+
+		d->size = size;
+	}
+
+	d->points[d->n] = *p;
+	memset(&d->entrances[d->n], 0, sizeof d->entrances[d->n]);
+	d->entrances[d->n].next = next;
+	if (q != NULL) d->entrances[d->n].q = *q;
+	d->n++;
+
+	return true;
+}
+
+static bool hpa_standable(const struct level_t *l, int x, int y, int z)
+{
+	return blocktype_passable(level_get_blocktype(l, x, z, y)) &&
+	       blocktype_passable(level_get_blocktype(l, x, z + 1, y)) &&
+	       !blocktype_passable(level_get_blocktype(l, x, z - 1, y));
+}
+
+/* Edge cell k of cluster c facing direction d */
+static void hpa_edge(const struct astar_hpa *h, const struct level_t *l, int c, int d, int k, int z, struct point *p)
+{
+	int x1, y1, x2, y2;
+	hpa_bounds(h, l, c, &x1, &y1, &x2, &y2);
+
+	switch (d)
+	{
+		case 0: p->x = x1; p->y = y1 + k; break;
+		case 2: p->x = x1 + k; p->y = y1; break;
+		case 4: p->x = x2; p->y = y1 + k; break;
+		case 6: p->x = x1 + k; p->y = y2; break;
+	}
+	p->z = z;
+}
+
+static bool hpa_crossing(const struct astar_hpa *h, const struct level_t *l, int c, int d, int k, int z, struct point *p, struct point *q)
+{
+	hpa_edge(h, l, c, d, k, z, p);
+	if (!hpa_standable(l, p->x, p->y, p->z)) return false;
+	return point_add(l, p, d, q) > 0;
+}
+
+/* Find the ways across the border of cluster c facing direction d, and add
+ * them to the cluster's data d. Each run of neighbouring crossings at the
+ * same heights becomes one entrance, at its middle. If landing is set, d
+ * is the data of the cluster across the border, and the landing points are
+ * added instead. */
+static bool hpa_scan(const struct astar_hpa *h, const struct level_t *l, int c, int dir, struct hpa_data *d, bool landing)
+{
+	int next = hpa_neighbour(h, c, dir);
+	if (next == -1) return true;
+
+	int x1, y1, x2, y2;
+	hpa_bounds(h, l, c, &x1, &y1, &x2, &y2);
+	int len = (dir == 0 || dir == 4) ? y2 - y1 + 1 : x2 - x1 + 1;
+
+	int k, z;
+	for (z = 1; z <= l->y; z++)
+	{
+		int start = -1;
+		int qz = 0;
+
+		for (k = 0; k <= len; k++)
+		{
+			struct point p, q;
+			bool valid = k < len && hpa_crossing(h, l, c, dir, k, z, &p, &q);
+			if (valid && start >= 0 && q.z == qz) continue;
+
+			if (start >= 0)
+			{
+				hpa_crossing(h, l, c, dir, (start + k - 1) / 2, z, &p, &q);
+
+				bool ok;
+				if (!landing) ok = hpa_data_add(d, &p, next, &q);
+				else ok = hpa_data_add(d, &q, -1, NULL);
+				if (!ok) return false;
+
+				/* Scanning clobbered this cell's crossing */
+				valid = k < len && hpa_crossing(h, l, c, dir, k, z, &p, &q);
+			}
+
+			start = valid ? k : -1;
+			if (valid) qz = q.z;
+		}
+	}
+
+	return true;
+}
+
+/* Build the data of cluster c. Reads the level without the mutex. */
+static struct hpa_data *hpa_build(const struct astar_hpa *h, const struct level_t *l, int c)
+{
+	struct hpa_data *d = calloc(1, sizeof *d);
+	if (d == NULL) return NULL;
+
+	d->refs = 1;
+	d->generation = l->generation;
+
+	int dir;
+	for (dir = 0; dir < 8; dir += 2)
+	{
+		if (!hpa_scan(h, l, c, dir, d, false)) goto fail;
+	}
+
+	for (dir = 0; dir < 8; dir += 2)
+	{
+		int next = hpa_neighbour(h, c, dir);
+		if (next != -1 && !hpa_scan(h, l, next, (dir + 4) % 8, d, true)) goto fail;
+	}
+
+	if (d->n > 0)
+	{
+		d->cost = malloc(d->n * d->n * sizeof *d->cost);
+		if (d->cost == NULL) goto fail;
+
+		int x1, y1, x2, y2;
+		hpa_bounds(h, l, c, &x1, &y1, &x2, &y2);
+
+		int i;
+		for (i = 0; i < d->n; i++)
+		{
+			as_costs(l, &d->points[i], d->points, d->n, &d->cost[i * d->n], x1, y1, x2, y2);
+		}
+	}
+
+	return d;
+
+fail:
+	hpa_data_free(d);
+	return NULL;
+}
+
+/* A cluster depends on its own blocks and those of the borders it shares */
+static bool hpa_valid(const struct astar_hpa *h, const struct level_t *l, int c, const struct hpa_data *d)
+{
+	unsigned rx = level_regions_x(l);
+	unsigned rz = level_regions_z(l);
+	unsigned ry = level_regions_y(l);
+
+	int dir;
+	for (dir = -2; dir < 8; dir += 2)
+	{
+		int n = dir < 0 ? c : hpa_neighbour(h, c, dir);
+		if (n == -1) continue;
+
+		unsigned x = n % h->cx;
+		unsigned z = n / h->cx;
+		unsigned y;
+		for (y = 0; y < ry; y++)
+		{
+			if (l->region_generation[x + (z + y * rz) * rx] > d->generation) return false;
+		}
+	}
+
+	return true;
+}
+
+/* Get a reference to up to date data of cluster c, building it if needed.
+ * Only one search builds a cluster at a time, and without the mutex, so
+ * other clusters can be looked up meanwhile. NULL if it couldn't be built. */
+static struct hpa_data *hpa_acquire(struct astar_hpa *h, const struct level_t *l, int c)
+{
+	struct hpa_cluster *cl = &h->clusters[c];
+
+	pthread_mutex_lock(&h->mutex);
+	while (cl->building) pthread_cond_wait(&h->cond, &h->mutex);
+
+	if (cl->data == NULL || !hpa_valid(h, l, c, cl->data))
+	{
+		cl->building = true;
+		pthread_mutex_unlock(&h->mutex);
+
+		struct hpa_data *d = hpa_build(h, l, c);
+
+		pthread_mutex_lock(&h->mutex);
+		hpa_data_release(cl->data);
+		cl->data = d;
+		cl->building = false;
+		pthread_cond_broadcast(&h->cond);
+	}
+
+	struct hpa_data *d = cl->data;
+	if (d != NULL) d->refs++;
+	pthread_mutex_unlock(&h->mutex);
+
+	return d;
+}
+
+/* Reach a cluster in a search, returning its data or NULL if it has no
+ * entrances to use */
+static struct hpa_data *hpa_touch(struct hpa_search *s, int c)
+{
+	struct hpa_reached *r = &s->reached[c];
+	if (r->seen) return r->nodes != NULL ? r->data : NULL;
+
+	r->seen = true;
+	s->seen[s->seen_used++] = c;
+
+	/* Released when the search ends, even if unused */
+	struct hpa_data *d = hpa_acquire(s->h, s->l, c);
+	r->data = d;
+	if (d == NULL || d->n == 0) return NULL;
+
+	r->nodes = malloc(d->n * sizeof *r->nodes);
+	if (r->nodes == NULL) return NULL;
+
+	int i;
+	for (i = 0; i < d->n; i++)
+	{
+		r->nodes[i].g = INFINITY;
+		r->nodes[i].closed = false;
+	}
+
+	return d;
+}
+
+static bool hpa_push(struct hpa_search *s, float f, int cluster, int node)
+{
+	if (s->open_used == s->open_size)
+	{
+		size_t size = s->open_size == 0 ? 256 : s->open_size * 2;
+		struct hpa_open *open = realloc(s->open, size * sizeof *open);
+		if (open == NULL) return false;
+		s->open = open;
+		s->open_size = size;
+	}
+
+	size_t pos = s->open_used++;
+	while (pos > 0 && s->open[(pos - 1) / 2].f > f)
+	{
+		s->open[pos] = s->open[(pos - 1) / 2];
+		pos = (pos - 1) / 2;
+	}
+	s->open[pos].f = f;
+	s->open[pos].cluster = cluster;
+	s->open[pos].node = node;
+
+	return true;
+}
+
+static struct hpa_open hpa_pop(struct hpa_search *s)
+{
+	struct hpa_open top = s->open[0];
+	struct hpa_open last = s->open[--s->open_used];
+
+	size_t pos = 0;
+	for (;;)
+	{
+		size_t child = pos * 2 + 1;
+		if (child >= s->open_used) break;
+		if (child + 1 < s->open_used && s->open[child + 1].f < s->open[child].f) child++;
+		if (s->open[child].f >= last.f) break;
+		s->open[pos] = s->open[child];
+		pos = child;
+	}
+	if (s->open_used > 0) s->open[pos] = last;
+
+	return top;
+}
+
+static void hpa_relax(struct hpa_search *s, int c, int i, float g, int pc, int pi, const struct point *b)
+{
+	struct hpa_reached *r = &s->reached[c];
+	struct hpa_node *node = &r->nodes[i];
+	if (node->closed || g >= node->g) return;
+
+	node->g = g;
+	node->parent_cluster = pc;
+	node->parent_node = pi;
+	hpa_push(s, g + point_dist(&r->data->points[i], b, true), c, i);
+}
+
+/* Search between entrances, and return the first entrance on the route
+ * outside the start cluster */
+static bool hpa_route(struct hpa_search *s, const struct point *a, const struct point *b, struct point *first)
+{
+	struct astar_hpa *h = s->h;
+	const struct level_t *l = s->l;
+
+	int ca = hpa_cluster_of(h, a->x, a->y);
+	int cb = hpa_cluster_of(h, b->x, b->y);
+	int x1, y1, x2, y2;
+	int i;
+
+	struct hpa_data *d = hpa_touch(s, ca);
+	if (hpa_touch(s, cb) == NULL || d == NULL) return false;
+
+	float *costs = malloc(d->n * sizeof *costs);
+	if (costs == NULL) return false;
+
+	hpa_bounds(h, l, ca, &x1, &y1, &x2, &y2);
+	as_costs(l, a, d->points, d->n, costs, x1, y1, x2, y2);
+	for (i = 0; i < d->n; i++)
+	{
+		if (costs[i] != INFINITY) hpa_relax(s, ca, i, costs[i], -1, -1, b);
+	}
+	free(costs);
+
+	float goal_g = INFINITY;
+	int goal_cluster = -1, goal_node = -1;
+
+	hpa_bounds(h, l, cb, &x1, &y1, &x2, &y2);
+
+	while (s->open_used > 0)
+	{
+		struct hpa_open e = hpa_pop(s);
+		if (e.node == -1) break;
+
+		d = s->reached[e.cluster].data;
+		struct hpa_node *node = &s->reached[e.cluster].nodes[e.node];
+		const struct hpa_entrance *en = &d->entrances[e.node];
+		if (node->closed) continue;
+		node->closed = true;
+
+		if (e.cluster == cb)
+		{
+			float cost;
+			as_costs(l, &d->points[e.node], b, 1, &cost, x1, y1, x2, y2);
+			if (node->g + cost < goal_g)
+			{
+				goal_g = node->g + cost;
+				goal_cluster = e.cluster;
+				goal_node = e.node;
+				hpa_push(s, goal_g, e.cluster, -1);
+			}
+		}
+
+		for (i = 0; i < d->n; i++)
+		{
+			float cost = d->cost[e.node * d->n + i];
+			if (i != e.node && cost != INFINITY) hpa_relax(s, e.cluster, i, node->g + cost, e.cluster, e.node, b);
+		}
+
+		if (en->next != -1)
+		{
+			const struct hpa_data *next = hpa_touch(s, en->next);
+			for (i = 0; next != NULL && i < next->n; i++)
+			{
+				if (point_same(&next->points[i], &en->q))
+				{
+					hpa_relax(s, en->next, i, node->g + point_dist(&d->points[e.node], &en->q, false), e.cluster, e.node, b);
+					break;
+				}
+			}
+		}
+	}
+
+	if (goal_cluster == -1) return false;
+
+	/* Walk back to the start, keeping the earliest entrance outside it */
+	int c = goal_cluster, n = goal_node;
+	bool found = false;
+	while (c != -1)
+	{
+		const struct hpa_reached *r = &s->reached[c];
+		if (c != ca)
+		{
+			*first = r->data->points[n];
+			found = true;
+		}
+
+		c = r->nodes[n].parent_cluster;
+		n = r->nodes[n].parent_node;
+	}
+
+	return found;
+}
+
+struct point *hpa_find(struct level_t *level, const struct point *a, const struct point *b)
+{
+	if (level->region_generation == NULL ||
+		abs(a->x - b->x) + abs(a->y - b->y) < HPA_MIN_DISTANCE ||
+		!level_valid_xyz(level, a->x, 0, a->y) || !level_valid_xyz(level, b->x, 0, b->y))
+	{
+		return as_find(level, a, b);
+	}
+
+	struct astar_hpa *h = hpa_get(level);
+	if (h == NULL) return as_find(level, a, b);
+
+	if (hpa_cluster_of(h, a->x, a->y) == hpa_cluster_of(h, b->x, b->y)) return as_find(level, a, b);
+
+	struct hpa_search s;
+	memset(&s, 0, sizeof s);
+	s.h = h;
+	s.l = level;
+	s.reached = calloc(h->cx * h->cz, sizeof *s.reached);
+	s.seen = malloc(h->cx * h->cz * sizeof *s.seen);
+
+	struct point first;
+	bool found = s.reached != NULL && s.seen != NULL && hpa_route(&s, a, b, &first);
+
+	int i;
+	pthread_mutex_lock(&h->mutex);
+	for (i = 0; i < s.seen_used; i++)
+	{
+		hpa_data_release(s.reached[s.seen[i]].data);
+	}
+	pthread_mutex_unlock(&h->mutex);
+
+	for (i = 0; i < s.seen_used; i++)
+	{
+		free(s.reached[s.seen[i]].nodes);
+	}
+	free(s.reached);
+	free(s.seen);
+	free(s.open);
+
+	if (!found) return NULL;
+
+	return as_find(level, a, &first);
+}
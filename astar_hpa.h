@@ -0,0 +1,14 @@
+#ifndef ASTAR_HPA_H
+#define ASTAR_HPA_H
+
+struct level_t;
+struct point;
+
+/* Find a path for a long route by first searching between the entrances
+ * of level regions. Only the leg into the next region on the route is
+ * returned at block resolution, so callers ask again once they reach its
+ * end. Short routes are searched directly with as_find(). */
+struct point *hpa_find(struct level_t *level, const struct point *a, const struct point *b);
+void hpa_free(struct level_t *level);
+
+#endif /* ASTAR_HPA_H */
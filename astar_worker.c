@@ -1,52 +1,298 @@
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <pthread.h>
 #include "astar.h"
+#include "astar_hpa.h"
 #include "astar_worker.h"
+#include "config.h"
 #include "level.h"
+#include "list.h"
 #include "worker.h"
 
 static struct worker s_astar_worker;
 
+/* Each caller of astar_queue(), sharing a search with any others that
+ * asked for the same path before it finished */
+struct astar_waiter
+{
+	astar_callback callback;
+	void *data;
+	struct astar_waiter *next;
+};
+
 struct astar_job
 {
 	struct level_t *level;
 	struct point a;
 	struct point b;
-	astar_callback callback;
-	void *data;
+	struct astar_waiter *waiters;
 };
 
-static void astar_worker(void *arg)
+static inline bool astar_job_compare(struct astar_job **a, struct astar_job **b)
 {
-	struct astar_job *job = arg;
+	return *a == *b;
+}
+LIST(astar_job, struct astar_job *, astar_job_compare)
+
+/* Jobs queued or running, protected by s_astar_mutex */
+static struct astar_job_list_t s_astar_jobs;
+static pthread_mutex_t s_astar_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Recent results per level, held until a block changes in the regions a
+ * path passes through. A failed search depends on the whole level. */
+#define ASTAR_CACHE_SIZE 64
+
+struct astar_cache_entry
+{
+	bool used;
+	struct point a;
+	struct point b;
+	struct point *path;
+	unsigned generation;
+	unsigned rx1, ry1, rz1;
+	unsigned rx2, ry2, rz2;
+};
+
+struct astar_cache
+{
+	pthread_mutex_t mutex;
+	struct astar_cache_entry entries[ASTAR_CACHE_SIZE];
+};
+
+static inline bool point_equal(const struct point *a, const struct point *b)
+{
+	return a->x == b->x && a->y == b->y && a->z == b->z;
+}
+
+static struct point *path_copy(const struct point *path)
+{
+	size_t n;
+	for (n = 0; path[n].x != -1; n++);
 
-	if (job->callback != NULL)
+	struct point *copy = malloc((n + 1) * sizeof *copy);
+	if (copy != NULL) memcpy(copy, path, (n + 1) * sizeof *copy);
+	return copy;
+}
+
+static struct astar_cache *astar_cache_get(struct level_t *level)
+{
+	if (level->path_cache != NULL) return level->path_cache;
+
+	struct astar_cache *cache = calloc(1, sizeof *cache);
+	if (cache == NULL) return NULL;
+	pthread_mutex_init(&cache->mutex, NULL);
+
+	/* Another worker may have got there first */
+	if (!__sync_bool_compare_and_swap(&level->path_cache, NULL, cache))
+	{
+		pthread_mutex_destroy(&cache->mutex);
+		free(cache);
+	}
+
+	return level->path_cache;
+}
+
+void astar_cache_free(struct level_t *level)
+{
+	struct astar_cache *cache = level->path_cache;
+	if (cache == NULL) return;
+
+	int i;
+	for (i = 0; i < ASTAR_CACHE_SIZE; i++)
 	{
-		struct point *path = as_find(job->level, &job->a, &job->b);
-		if (job->callback != NULL)
+		free(cache->entries[i].path);
+	}
+
+	pthread_mutex_destroy(&cache->mutex);
+	free(cache);
+	level->path_cache = NULL;
+}
+
+static struct astar_cache_entry *astar_cache_slot(struct astar_cache *cache, const struct point *a, const struct point *b)
+{
+	unsigned h = a->x * 73856093U ^ a->y * 19349663U ^ a->z * 83492791U;
+	h = h * 31 + (b->x * 73856093U ^ b->y * 19349663U ^ b->z * 83492791U);
+	return &cache->entries[(h * 2654435761U) >> 26];
+}
+
+static bool astar_cache_valid(const struct level_t *level, const struct astar_cache_entry *e)
+{
+	unsigned rx = level_regions_x(level);
+	unsigned rz = level_regions_z(level);
+	unsigned x, y, z;
+	for (y = e->ry1; y <= e->ry2; y++)
+	{
+		for (z = e->rz1; z <= e->rz2; z++)
 		{
-			job->callback(job->level, path, job->data);
+			for (x = e->rx1; x <= e->rx2; x++)
+			{
+				if (level->region_generation[x + (z + y * rz) * rx] > e->generation) return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+/* Look for a cached result, true if one was found. The path returned is
+ * the caller's to free, and may be NULL if no path exists. */
+static bool astar_cache_find(struct level_t *level, const struct point *a, const struct point *b, struct point **path)
+{
+	struct astar_cache *cache = astar_cache_get(level);
+	if (cache == NULL || level->region_generation == NULL) return false;
+
+	bool found = false;
+
+	pthread_mutex_lock(&cache->mutex);
+
+	struct astar_cache_entry *e = astar_cache_slot(cache, a, b);
+	if (e->used && point_equal(&e->a, a) && point_equal(&e->b, b))
+	{
+		if (astar_cache_valid(level, e))
+		{
+			*path = e->path == NULL ? NULL : path_copy(e->path);
+			found = e->path == NULL || *path != NULL;
 		}
 		else
 		{
-			free(path);
+			free(e->path);
+			e->path = NULL;
+			e->used = false;
 		}
 	}
 
-	level_inuse(job->level, false);
+	pthread_mutex_unlock(&cache->mutex);
+
+	return found;
+}
+
+static inline unsigned clamp_region(int v, int size)
+{
+	if (v < 0) v = 0;
+	if (v >= size) v = size - 1;
+	return v >> LEVEL_REGION_BITS;
+}
+
+/* Store the result of a search started at the given generation */
+static void astar_cache_store(struct level_t *level, const struct point *a, const struct point *b, const struct point *path, unsigned generation)
+{
+	struct astar_cache *cache = level->path_cache;
+	if (cache == NULL || level->region_generation == NULL) return;
+
+	struct point *copy = NULL;
+	if (path != NULL)
+	{
+		copy = path_copy(path);
+		if (copy == NULL) return;
+	}
+
+	/* Bounds of the path, with a block to spare for the walls and
+	 * floor it was checked against. Path points hold level x, z, y. */
+	int x1 = a->x, y1 = a->z, z1 = a->y;
+	int x2 = x1, y2 = y1, z2 = z1;
+	const struct point *p;
+	for (p = path; p != NULL && p->x != -1; p++)
+	{
+		if (p->x < x1) x1 = p->x;
+		if (p->x > x2) x2 = p->x;
+		if (p->z < y1) y1 = p->z;
+		if (p->z > y2) y2 = p->z;
+		if (p->y < z1) z1 = p->y;
+		if (p->y > z2) z2 = p->y;
+	}
+
+	pthread_mutex_lock(&cache->mutex);
+
+	struct astar_cache_entry *e = astar_cache_slot(cache, a, b);
+	free(e->path);
+	e->used = true;
+	e->a = *a;
+	e->b = *b;
+	e->path = copy;
+	e->generation = generation;
+
+	if (path == NULL)
+	{
+		e->rx1 = e->ry1 = e->rz1 = 0;
+		e->rx2 = level_regions_x(level) - 1;
+		e->ry2 = level_regions_y(level) - 1;
+		e->rz2 = level_regions_z(level) - 1;
+	}
+	else
+	{
+		e->rx1 = clamp_region(x1 - 1, level->x);
+		e->ry1 = clamp_region(y1 - 1, level->y);
+		e->rz1 = clamp_region(z1 - 1, level->z);
+		e->rx2 = clamp_region(x2 + 1, level->x);
+		e->ry2 = clamp_region(y2 + 2, level->y);
+		e->rz2 = clamp_region(z2 + 1, level->z);
+	}
+
+	pthread_mutex_unlock(&cache->mutex);
+}
+
+static void astar_worker(void *arg)
+{
+	struct astar_job *job = arg;
+	struct astar_waiter *w;
+	struct point *path = NULL;
+
+	pthread_mutex_lock(&s_astar_mutex);
+	bool wanted = false;
+	for (w = job->waiters; w != NULL; w = w->next)
+	{
+		if (w->callback != NULL) wanted = true;
+	}
+	pthread_mutex_unlock(&s_astar_mutex);
+
+	if (wanted && !astar_cache_find(job->level, &job->a, &job->b, &path))
+	{
+		unsigned generation = job->level->generation;
+		path = hpa_find(job->level, &job->a, &job->b);
+		astar_cache_store(job->level, &job->a, &job->b, path, generation);
+	}
+
+	/* No more waiters can join once the job is off the list */
+	pthread_mutex_lock(&s_astar_mutex);
+	astar_job_list_del_item(&s_astar_jobs, job);
+	pthread_mutex_unlock(&s_astar_mutex);
+
+	while (job->waiters != NULL)
+	{
+		w = job->waiters;
+		job->waiters = w->next;
+
+		if (w->callback != NULL)
+		{
+			/* The last waiter gets the original path */
+			struct point *p = path;
+			if (path != NULL && job->waiters != NULL) p = path_copy(path);
+			else path = NULL;
+
+			w->callback(job->level, p, w->data);
+		}
 
+		level_inuse(job->level, false);
+		free(w);
+	}
+
+	free(path);
 	free(job);
 }
 
 void astar_worker_init(void)
 {
-	worker_init(&s_astar_worker, "astar", 30000, 5, astar_worker);
+	int threads;
+	if (!config_get_int("astar_threads", &threads)) threads = worker_cpus();
+	worker_init(&s_astar_worker, "astar", 30000, 5, threads, astar_worker);
 }
 
 void astar_worker_deinit(void)
 {
 	worker_deinit(&s_astar_worker);
+	astar_job_list_free(&s_astar_jobs);
 }
 
 void *astar_queue(struct level_t *level, const struct point *a, const struct point *b, astar_callback callback, void *data)
@@ -58,19 +304,47 @@ void *astar_queue(struct level_t *level, const struct point *a, const struct poi
 
 	if (!level_inuse(level, true)) return NULL;
 
-	struct astar_job *job = malloc(sizeof *job);
-	job->level = level;
-	job->a = *a;
-	job->b = *b;
-	job->callback = callback;
-	job->data = data;
+	struct astar_waiter *w = malloc(sizeof *w);
+	w->callback = callback;
+	w->data = data;
+
+	pthread_mutex_lock(&s_astar_mutex);
+
+	/* Join a search for the same path if there is one */
+	struct astar_job *job = NULL;
+	size_t i;
+	for (i = 0; i < s_astar_jobs.used; i++)
+	{
+		struct astar_job *j = s_astar_jobs.items[i];
+		if (j->level == level && point_equal(&j->a, a) && point_equal(&j->b, b))
+		{
+			job = j;
+			break;
+		}
+	}
+
+	bool queue = (job == NULL);
+	if (queue)
+	{
+		job = malloc(sizeof *job);
+		job->level = level;
+		job->a = *a;
+		job->b = *b;
+		job->waiters = NULL;
+		astar_job_list_add(&s_astar_jobs, job);
+	}
+
+	w->next = job->waiters;
+	job->waiters = w;
+
+	pthread_mutex_unlock(&s_astar_mutex);
 
-	worker_queue(&s_astar_worker, job);
-	return job;
+	if (queue) worker_queue(&s_astar_worker, job);
+	return w;
 }
 
 void astar_cancel(void *data)
 {
-	struct astar_job *job = data;
-	if (job != NULL) job->callback = NULL;
+	struct astar_waiter *w = data;
+	if (w != NULL) w->callback = NULL;
 }
@@ -11,5 +11,6 @@ void astar_worker_deinit(void);
 
 void *astar_queue(struct level_t *level, const struct point *a, const struct point *b, astar_callback callback, void *data);
 void astar_cancel(void *data);
+void astar_cache_free(struct level_t *level);
 
 #endif /* ASTAR_WORKER_H */
@@ -4,12 +4,22 @@
 #include "mcc.h"
 #include "block.h"
 #include "level.h"
+#include "level_profile.h"
 #include "client.h"
 #include "colour.h"
 #include "player.h"
 
 static struct blocktype_desc_list_t s_blocks;
 
+/* Bumped whenever a block type is (de)registered, as convert() results may
+ * change without any block in a level changing. */
+static unsigned s_blocktype_serial;
+
+unsigned blocktype_serial(void)
+{
+	return s_blocktype_serial;
+}
+
 void preregister_blocktype(const char *name)
 {
 	struct blocktype_desc_t desc;
@@ -73,6 +83,7 @@ int register_blocktype(enum blocktype_t type, const char *name, enum rank_t min_
 	descp->trigger_func = trigger_func;
 	descp->delete_func = delete_func;
 	descp->physics_func = physics_func;
+	s_blocktype_serial++;
 	LOG("Registered %s as %d\n", descp->name, type);
 
 	return type;
@@ -88,6 +99,7 @@ void deregister_blocktype(enum blocktype_t type)
 	descp->trigger_func = NULL;
 	descp->delete_func = NULL;
 	descp->physics_func = NULL;
+	s_blocktype_serial++;
 	LOG("Deregistered %s / %d\n", descp->name, type);
 }
 
@@ -98,7 +110,13 @@ enum blocktype_t convert(struct level_t *level, unsigned index, const struct blo
 	const struct blocktype_desc_t *btd = &s_blocks.items[block->type];
 	if (btd->convert_func != NULL)
 	{
-		return btd->convert_func(level, index, block);
+		struct level_profile_t *p = level->profile;
+		if (p == NULL || !p->enabled) return btd->convert_func(level, index, block);
+
+		uint64_t start = level_profile_now();
+		enum blocktype_t type = btd->convert_func(level, index, block);
+		level_profile_record(p, LEVEL_PROFILE_CONVERT, block->type, start);
+		return type;
 	}
 
 	/* Non-standard block that no longer exists? Show as red... */
@@ -107,6 +125,22 @@ enum blocktype_t convert(struct level_t *level, unsigned index, const struct blo
 	return block->type;
 }
 
+/* As convert(), but the rest of the block is only read if its blocktype has
+ * a convert function, so plain blocks cost a type lookup */
+enum blocktype_t convert_index(struct level_t *level, unsigned index)
+{
+	enum blocktype_t type = level_block_type(level, index);
+	if (type >= s_blocks.used) return RED;
+
+	if (s_blocks.items[type].convert_func == NULL)
+	{
+		return type >= BLOCK_END ? RED : type;
+	}
+
+	struct block_t block = level_block_get(level, index);
+	return convert(level, index, &block);
+}
+
 int trigger(struct level_t *l, unsigned index, const struct block_t *block, struct client_t *c, enum blocktype_t heldblock)
 {
 	if (block->type >= s_blocks.used) return TRIG_NONE;
@@ -126,7 +160,16 @@ void delete(struct level_t *l, unsigned index, const struct block_t *block)
 	const struct blocktype_desc_t *btd = &s_blocks.items[block->type];
 	if (btd->delete_func != NULL)
 	{
+		struct level_profile_t *p = l->profile;
+		if (p == NULL || !p->enabled)
+		{
+			btd->delete_func(l, index, block);
+			return;
+		}
+
+		uint64_t start = level_profile_now();
 		btd->delete_func(l, index, block);
+		level_profile_record(p, LEVEL_PROFILE_DELETE, block->type, start);
 	}
 }
 
@@ -136,10 +179,21 @@ void physics(struct level_t *level, unsigned index, const struct block_t *block)
 
 	const struct blocktype_desc_t *btd = &s_blocks.items[block->type];
 
-	level->blocks[index].physics = false;
+	level_block_set_physics(level, index, false);
 	if (btd->physics_func != NULL)
 	{
+		struct level_profile_t *p = level->profile;
+		if (p == NULL || !p->enabled)
+		{
+			btd->physics_func(level, index, block);
+			return;
+		}
+
+		/* The block may change under us, so note its type first */
+		unsigned type = block->type;
+		uint64_t start = level_profile_now();
 		btd->physics_func(level, index, block);
+		level_profile_record(p, LEVEL_PROFILE_PHYSICS, type, start);
 	}
 }
 
@@ -151,7 +205,7 @@ bool light_check(struct level_t *level, unsigned index)
 	y++;
 	for (; y < level->y; y++)
 	{
-		enum blocktype_t type = level->blocks[level_get_index(level, x, y, z)].type;
+		enum blocktype_t type = level_block_type(level, level_get_index(level, x, y, z));
 		if (type >= s_blocks.used) return false;
 		const struct blocktype_desc_t *btd = &s_blocks.items[type];
 		if (!btd->clear) return false;
@@ -165,9 +219,9 @@ void physics_air_sub(struct level_t *l, unsigned index2, int16_t x, int16_t y, i
 	if (!level_valid_xyz(l, x, y, z)) return;
 
 	unsigned index = level_get_index(l, x, y, z);
-	if (l->blocks[index].fixed) return;
+	if (level_block_fixed(l, index)) return;
 
-	enum blocktype_t type = l->blocks[index].type;
+	enum blocktype_t type = level_block_type(l, index);
 	switch (type)
 	{
 		default: return;
@@ -207,7 +261,7 @@ bool sponge_test(struct level_t *l, int16_t x, int16_t y, int16_t z)
 				if (ax < 0 || ay < 0 || az < 0 || ax >= l->x || ay >= l->y || az >= l->z) continue;
 
 				unsigned index = level_get_index(l, ax, ay, az);
-				if (l->blocks[index].type == SPONGE) return true;
+				if (level_block_type(l, index) == SPONGE) return true;
 			}
 		}
 	}
@@ -230,19 +284,19 @@ void delete_air(struct level_t *l, unsigned index, const struct block_t *block)
 			y--;
 			index2 = level_get_index(l, x, y, z);
 		}
-//		while (y > 0 && s_blocks.items[l->blocks[index2].type].clear);
-		if (l->blocks[index2].fixed) return;
+//		while (y > 0 && s_blocks.items[level_block_type(l, index2)].clear);
+		if (level_block_fixed(l, index2)) return;
 
-		switch (l->blocks[index2].type)
+		switch (level_block_type(l, index2))
 		{
 			case GRASS:
-//				if (l->blocks[index2].data == 1)
+//				if (level_block_data(l, index2) == 1)
 					level_addupdate(l, index2, GRASS, 0);
 				break;
 
 //			case DIRT:
 				// We're not deleted yet, so just add update
-//				if (l->blocks[index2].data == 91)
+//				if (level_block_data(l, index2) == 91)
 //					level_addupdate(l, index2, BLOCK_INVALID, 0);
 //				break;
 		}
@@ -326,13 +380,13 @@ void physics_active_water_sub(struct level_t *l, int16_t x, int16_t y, int16_t z
 	if (!level_valid_xyz(l, x, y, z)) return;
 
 	unsigned index = level_get_index(l, x, y, z);
-	if (!l->blocks[index].fixed)
+	if (!level_block_fixed(l, index))
 	{
-		if (l->blocks[index].type == AIR)
+		if (level_block_type(l, index) == AIR)
 		{
-			if (l->blocks[index].data == 0 && !sponge_test(l, x, y, z)) level_addupdate(l, index, type, 0);
+			if (level_block_data(l, index) == 0 && !sponge_test(l, x, y, z)) level_addupdate(l, index, type, 0);
 		}
-		else if (l->blocks[index].type == clash)
+		else if (level_block_type(l, index) == clash)
 		{
 			level_addupdate(l, index, convert, 0);
 		}
@@ -377,7 +431,7 @@ void physics_active_lava(struct level_t *l, unsigned index, const struct block_t
 
 void physics_gravity(struct level_t *l, unsigned index, const struct block_t *block)
 {
-	if (l->blocks[index].fixed) return;
+	if (level_block_fixed(l, index)) return;
 
 	int16_t x, y, z;
 	level_get_xyz(l, index, &x, &y, &z);
@@ -385,9 +439,9 @@ void physics_gravity(struct level_t *l, unsigned index, const struct block_t *bl
 	if (y == 0) return;
 
 	unsigned index2 = level_get_index(l, x, y - 1, z);
-	if (l->blocks[index2].fixed) return;
+	if (level_block_fixed(l, index2)) return;
 
-	switch (l->blocks[index2].type)
+	switch (level_block_type(l, index2))
 	{
 		case AIR:
 		case WATER:
@@ -423,7 +477,7 @@ void delete_sponge(struct level_t *l, unsigned index, const struct block_t *bloc
 				if (ax < 0 || ay < 0 || az < 0 || ax >= l->x || ay >= l->y || az >= l->z) continue;
 
 				unsigned index2 = level_get_index(l, ax, ay, az);
-				if (l->blocks[index2].type == AIR)
+				if (level_block_type(l, index2) == AIR)
 				{
 					level_addupdate(l, index2, AIR, 0);
 				}
@@ -452,7 +506,7 @@ void physics_sponge(struct level_t *l, unsigned index, const struct block_t *blo
 				if (ax < 0 || ay < 0 || az < 0 || ax >= l->x || ay >= l->y || az >= l->z) continue;
 
 				unsigned index2 = level_get_index(l, ax, ay, az);
-				switch (l->blocks[index2].type)
+				switch (level_block_type(l, index2))
 				{
 					case WATER:
 					case WATERSTILL:
@@ -475,7 +529,7 @@ void physics_active_sponge_sub(struct level_t *l, int16_t x, int16_t y, int16_t
 	if (!level_valid_xyz(l, x, y, z)) return;
 
 	unsigned index = level_get_index(l, x, y, z);
-	switch (l->blocks[index].type)
+	switch (level_block_type(l, index))
 	{
 		case WATER:
 		case WATERSTILL:
@@ -541,8 +595,7 @@ void physics_stair(struct level_t *l, unsigned index, const struct block_t *bloc
 	{
 		unsigned index2 = level_get_index(l, x, y - 1, z);
 
-		const struct block_t *below = &l->blocks[index2];
-		if (below->type == STAIRCASESTEP)
+		if (level_block_type(l, index2) == STAIRCASESTEP)
 		{
 			level_addupdate(l, index, AIR, 0);
 			level_addupdate(l, index2, STAIRCASEFULL, 0);
@@ -90,6 +90,9 @@ struct block_t
 typedef enum blocktype_t(*convert_func_t)(struct level_t *level, unsigned index, const struct block_t *block);
 typedef int(*trigger_func_t)(struct level_t *l, unsigned index, const struct block_t *block, struct client_t *c, enum blocktype_t heldblock);
 typedef void(*delete_func_t)(struct level_t *l, unsigned index, const struct block_t *block);
+/* Physics may run for several regions of a level at once (see
+ * level_physics.c), so a physics function must only read and update blocks
+ * within LEVEL_REGION_SIZE blocks of index on each axis. */
 typedef void(*physics_func_t)(struct level_t *l, unsigned index, const struct block_t *block);
 
 struct blocktype_desc_t
@@ -125,10 +128,12 @@ bool blocktype_has_physics(enum blocktype_t type);
 enum rank_t blocktype_min_rank(enum blocktype_t type);
 bool blocktype_passable(enum blocktype_t type);
 bool blocktype_swim(enum blocktype_t type);
+unsigned blocktype_serial(void);
 
 int register_blocktype(enum blocktype_t type, const char *name, enum rank_t min_rank, convert_func_t convert_func, trigger_func_t trigger_func, delete_func_t delete_func, physics_func_t physics_func, bool clear, bool passable, bool swim);
 void deregister_blocktype(enum blocktype_t type);
 enum blocktype_t convert(struct level_t *level, unsigned index, const struct block_t *block);
+enum blocktype_t convert_index(struct level_t *level, unsigned index);
 int trigger(struct level_t *level, unsigned index, const struct block_t *block, struct client_t *c, enum blocktype_t heldblock);
 void delete(struct level_t *level, unsigned index, const struct block_t *block);
 void physics(struct level_t *level, unsigned index, const struct block_t *block);
@@ -1,4 +1,5 @@
 #include <math.h>
+#include <string.h>
 #include "block.h"
 #include "client.h"
 #include "level.h"
@@ -10,8 +11,6 @@ static enum blocktype_t s_cannon_ball;
 static enum blocktype_t s_active_tnt;
 static enum blocktype_t s_explosion;
 
-static struct block_t s_block;
-
 static enum blocktype_t convert_cannon(struct level_t *level, unsigned index, const struct block_t *block)
 {
 	return DARKGREY;
@@ -50,6 +49,10 @@ struct cannons
 
 static void cannons_handle_tick(struct level_t *l, struct client_t *c, void *data, struct cannons *cg)
 {
+	/* Tick hooks of different levels run at once, so this can't be shared */
+	struct block_t block;
+	memset(&block, 0, sizeof block);
+
 	int i, j;
 	for (i = 0; i < MAX_CLIENTS_PER_LEVEL; i++)
 	{
@@ -78,8 +81,8 @@ static void cannons_handle_tick(struct level_t *l, struct client_t *c, void *dat
 				unsigned newloc = level_get_index(l, cg->c[i].x, cg->c[i].y, cg->c[i].z);
 				if (newloc == loc) continue;
 
-				if (l->blocks[newloc].type == AIR || l->blocks[newloc].type == s_explosion ||
-					l->blocks[newloc].type == WATER || l->blocks[newloc].type == WATERSTILL)
+				if (level_block_type(l, newloc) == AIR || level_block_type(l, newloc) == s_explosion ||
+					level_block_type(l, newloc) == WATER || level_block_type(l, newloc) == WATERSTILL)
 				{
 					loc = newloc;
 				}
@@ -111,10 +114,10 @@ static void cannons_handle_tick(struct level_t *l, struct client_t *c, void *dat
 
 		if (cg->c[i].loc != -1 && cg->c[i].loc != cg->c[i].origin && cg->c[i].loc != loc)
 		{
-			s_block.type = AIR;
-			s_block.owner = cg->c[i].owner;
-			s_block.physics = 1;
-			level_change_block_force(l, &s_block, cg->c[i].loc);
+			block.type = AIR;
+			block.owner = cg->c[i].owner;
+			block.physics = 1;
+			level_change_block_force(l, &block, cg->c[i].loc);
 			physics_list_update(l, cg->c[i].loc, 1);
 		}
 
@@ -127,11 +130,12 @@ static void cannons_handle_tick(struct level_t *l, struct client_t *c, void *dat
 
 		if (cg->c[i].loc != -1 && loc != cg->c[i].origin)
 		{
-			s_block.type = s_cannon_ball;
-			s_block.owner = 0;
-			s_block.physics = 0;
-			delete(l, loc, &l->blocks[loc]);
-			level_change_block_force(l, &s_block, loc);
+			block.type = s_cannon_ball;
+			block.owner = 0;
+			block.physics = 0;
+			struct block_t b = level_block_get(l, loc);
+			delete(l, loc, &b);
+			level_change_block_force(l, &block, loc);
 			physics_list_update(l, loc, 0);
 			cg->c[i].loc = loc;
 			cg->c[i].origin = -1;
@@ -146,7 +150,7 @@ static void cannons_handle_block(struct level_t *l, struct client_t *c, struct b
 		be->nt = be->bt;
 
 		unsigned index = level_get_index(l, be->x, be->y, be->z);
-		if (l->blocks[index].data != 0)
+		if (level_block_data(l, index) != 0)
 		{
 			client_notify(c, TAG_YELLOW "Cannot fire, reloading...");
 			return;
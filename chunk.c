@@ -1,4 +1,7 @@
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <zlib.h>
 #include "chunk.h"
 #include "landscape.h"
@@ -21,15 +24,17 @@ void chunk_generate(struct chunk_t *chunk, struct landscape_t *landscape)
 
 bool chunk_load(const char *name, struct chunk_t *chunk)
 {
-    char filename[64];
-    chunk_format_name(filename, sizeof filename, name, chunk->x, chunk->y, chunk->z);
+    char filename[128];
+    if (!chunk_format_name(filename, sizeof filename, name, chunk->x, chunk->y, chunk->z)) return false;
 
     gzFile gz = gzopen(filename, "rb");
     if (gz == NULL) return false;
 
-    gzread(gz, chunk->blocks, sizeof chunk->blocks);
+    int n = gzread(gz, chunk->blocks, sizeof chunk->blocks);
     gzclose(gz);
 
+    if (n != sizeof chunk->blocks) return false;
+
     chunk->dirty = false;
 
     return true;
@@ -37,8 +42,8 @@ bool chunk_load(const char *name, struct chunk_t *chunk)
 
 bool chunk_save(const char *name, struct chunk_t *chunk)
 {
-    char filename[64];
-    chunk_format_name(filename, sizeof filename, name, chunk->x, chunk->y, chunk->z);
+    char filename[128];
+    if (!chunk_format_name(filename, sizeof filename, name, chunk->x, chunk->y, chunk->z)) return false;
 
     gzFile gz = gzopen(filename, "wb");
     if (gz == NULL) return false;
@@ -50,3 +55,12 @@ bool chunk_save(const char *name, struct chunk_t *chunk)
 
     return true;
 }
+
+void chunk_remove(const char *name, struct chunk_t *chunk)
+{
+    char filename[128];
+    if (!chunk_format_name(filename, sizeof filename, name, chunk->x, chunk->y, chunk->z)) return;
+
+    unlink(filename);
+    chunk->legacy = false;
+}
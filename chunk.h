@@ -27,6 +27,14 @@ struct chunk_t
     bool ready;
     bool inuse;
     bool purge;
+    bool saving;
+
+    /* Loaded from an old per-chunk file, removed once in a region */
+    bool legacy;
+
+    /* Load order, lowest first, and when it was first requested */
+    unsigned priority;
+    unsigned requested;
 
     struct chunk_t *hash_next;
 };
@@ -34,5 +42,6 @@ struct chunk_t
 void chunk_generate(struct chunk_t *chunk, struct landscape_t *landscape);
 bool chunk_load(const char *name, struct chunk_t *chunk);
 bool chunk_save(const char *name, struct chunk_t *chunk);
+void chunk_remove(const char *name, struct chunk_t *chunk);
 
 #endif
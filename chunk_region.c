@@ -0,0 +1,296 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#ifdef CHUNK_REGION_MMAP
+#include <sys/mman.h>
+#endif
+#include "chunk.h"
+#include "chunk_region.h"
+#include "mcc.h"
+
+static const char s_magic[4] = { 'M', 'C', 'C', 'R' };
+
+/* Sectors taken by the header */
+#define CHUNK_REGION_HEADER_SECTORS ((sizeof (struct chunk_region_header_t) + CHUNK_REGION_SECTOR - 1) / CHUNK_REGION_SECTOR)
+
+static inline uint32_t chunk_region_sectors(uint32_t length)
+{
+    return (length + CHUNK_REGION_SECTOR - 1) / CHUNK_REGION_SECTOR;
+}
+
+static inline unsigned chunk_region_index(const struct chunk_t *chunk)
+{
+    return (chunk->x & CHUNK_REGION_MASK) | (chunk->z & CHUNK_REGION_MASK) << CHUNK_REGION_BITS;
+}
+
+void chunk_regions_init(struct chunk_regions_t *rs, const char *name)
+{
+    snprintf(rs->name, sizeof rs->name, "%s", name);
+    chunk_region_list_init(&rs->regions);
+    rs->clock = 0;
+    pthread_mutex_init(&rs->mutex, NULL);
+}
+
+static void chunk_region_close(struct chunk_region_t *r)
+{
+#ifdef CHUNK_REGION_MMAP
+    if (r->map != NULL) munmap((void *)r->map, CHUNK_REGION_MAP_SIZE);
+#endif
+    close(r->fd);
+    free(r);
+}
+
+void chunk_regions_free(struct chunk_regions_t *rs)
+{
+    size_t i;
+    for (i = 0; i < rs->regions.used; i++)
+    {
+        chunk_region_close(rs->regions.items[i]);
+    }
+
+    chunk_region_list_free(&rs->regions);
+    pthread_mutex_destroy(&rs->mutex);
+}
+
+/* Close the least recently used idle region if too many are open. Called
+ * with the mutex held. */
+static void chunk_region_evict(struct chunk_regions_t *rs)
+{
+    if (rs->regions.used < CHUNK_REGION_OPEN_MAX) return;
+
+    size_t i, lru = rs->regions.used;
+    for (i = 0; i < rs->regions.used; i++)
+    {
+        const struct chunk_region_t *r = rs->regions.items[i];
+        if (r->users > 0) continue;
+        if (lru == rs->regions.used || r->last_used < rs->regions.items[lru]->last_used) lru = i;
+    }
+
+    /* Every region is being read from, go over until one is done */
+    if (lru == rs->regions.used) return;
+
+    chunk_region_close(rs->regions.items[lru]);
+    chunk_region_list_del_index(&rs->regions, lru);
+}
+
+/* Find or open the region holding a chunk. Called with the mutex held. */
+static struct chunk_region_t *chunk_region_get(struct chunk_regions_t *rs, const struct chunk_t *chunk, bool create)
+{
+    int32_t x = chunk->x >> CHUNK_REGION_BITS;
+    int32_t y = chunk->y;
+    int32_t z = chunk->z >> CHUNK_REGION_BITS;
+    size_t i;
+
+    for (i = 0; i < rs->regions.used; i++)
+    {
+        struct chunk_region_t *r = rs->regions.items[i];
+        if (r->x == x && r->y == y && r->z == z)
+        {
+            r->last_used = ++rs->clock;
+            return r;
+        }
+    }
+
+    char filename[128];
+    snprintf(filename, sizeof filename, "%s/region_%d_%d_%d", rs->name, x, y, z);
+
+    int fd = open(filename, O_RDWR | (create ? O_CREAT : 0), 0644);
+    if (fd == -1)
+    {
+        if (errno != ENOENT) LOG("[chunk_region] Unable to open %s: %s\n", filename, strerror(errno));
+        return NULL;
+    }
+
+    struct chunk_region_t *r = calloc(1, sizeof *r);
+    if (r == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    r->x = x;
+    r->y = y;
+    r->z = z;
+    r->fd = fd;
+    r->last_used = ++rs->clock;
+
+    ssize_t n = pread(fd, &r->header, sizeof r->header, 0);
+    if (n == 0)
+    {
+        memcpy(r->header.magic, s_magic, sizeof s_magic);
+        r->header.version = CHUNK_REGION_VERSION;
+        if (pwrite(fd, &r->header, sizeof r->header, 0) != sizeof r->header)
+        {
+            LOG("[chunk_region] Unable to write header of %s\n", filename);
+            close(fd);
+            free(r);
+            return NULL;
+        }
+    }
+    else if (n != sizeof r->header || memcmp(r->header.magic, s_magic, sizeof s_magic) != 0 || r->header.version != CHUNK_REGION_VERSION)
+    {
+        LOG("[chunk_region] %s is not a region file\n", filename);
+        close(fd);
+        free(r);
+        return NULL;
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    r->sectors = chunk_region_sectors(st.st_size);
+    if (r->sectors < CHUNK_REGION_HEADER_SECTORS) r->sectors = CHUNK_REGION_HEADER_SECTORS;
+
+#ifdef CHUNK_REGION_MMAP
+    /* Only pages the file already covers are read, so the mapping can run
+     * past its end and need not change as it grows */
+    void *map = mmap(NULL, CHUNK_REGION_MAP_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    r->map = (map == MAP_FAILED) ? NULL : map;
+#endif
+
+    chunk_region_evict(rs);
+    chunk_region_list_add(&rs->regions, r);
+
+    return r;
+}
+
+/* Read and decompress a chunk from its entry. The mutex need not be held. */
+static bool chunk_region_read_entry(const struct chunk_region_t *r, struct chunk_region_entry_t e, struct chunk_t *chunk)
+{
+    off_t offset = (off_t)e.sector * CHUNK_REGION_SECTOR;
+    const uint8_t *data = NULL;
+    uint8_t *buf = NULL;
+
+#ifdef CHUNK_REGION_MMAP
+    if (r->map != NULL && offset + e.length <= CHUNK_REGION_MAP_SIZE) data = r->map + offset;
+#endif
+
+    if (data == NULL)
+    {
+        buf = malloc(e.length);
+        if (buf == NULL) return false;
+
+        if (pread(r->fd, buf, e.length, offset) != (ssize_t)e.length)
+        {
+            free(buf);
+            return false;
+        }
+        data = buf;
+    }
+
+    uLongf length = sizeof chunk->blocks;
+    int res = uncompress((Bytef *)chunk->blocks, &length, data, e.length);
+    free(buf);
+
+    if (res != Z_OK || length != sizeof chunk->blocks)
+    {
+        LOG("[chunk_region] Chunk at %d x %d x %d is damaged\n", chunk->x, chunk->y, chunk->z);
+        return false;
+    }
+
+    chunk->dirty = false;
+
+    return true;
+}
+
+bool chunk_region_read(struct chunk_regions_t *rs, struct chunk_t *chunk)
+{
+    pthread_mutex_lock(&rs->mutex);
+
+    struct chunk_region_t *r = chunk_region_get(rs, chunk, false);
+    if (r == NULL)
+    {
+        pthread_mutex_unlock(&rs->mutex);
+        return false;
+    }
+
+    /* A chunk being read is never being written, so its entry and data
+     * stay put once the mutex is released. The region stays open until
+     * we're done with it. */
+    struct chunk_region_entry_t e = r->header.entries[chunk_region_index(chunk)];
+    if (e.sector == 0)
+    {
+        pthread_mutex_unlock(&rs->mutex);
+        return false;
+    }
+
+    r->users++;
+
+    pthread_mutex_unlock(&rs->mutex);
+
+    bool ok = chunk_region_read_entry(r, e, chunk);
+
+    pthread_mutex_lock(&rs->mutex);
+    r->users--;
+    pthread_mutex_unlock(&rs->mutex);
+
+    return ok;
+}
+
+bool chunk_region_write(struct chunk_regions_t *rs, struct chunk_t *chunk)
+{
+    uLongf length = compressBound(sizeof chunk->blocks);
+    Bytef *buf = malloc(length);
+    if (buf == NULL) return false;
+
+    if (compress(buf, &length, (const Bytef *)chunk->blocks, sizeof chunk->blocks) != Z_OK)
+    {
+        free(buf);
+        return false;
+    }
+
+    pthread_mutex_lock(&rs->mutex);
+
+    struct chunk_region_t *r = chunk_region_get(rs, chunk, true);
+    if (r == NULL)
+    {
+        pthread_mutex_unlock(&rs->mutex);
+        free(buf);
+        return false;
+    }
+
+    unsigned index = chunk_region_index(chunk);
+    struct chunk_region_entry_t e = r->header.entries[index];
+
+    /* Rewrite in place if it still fits, else move to the end */
+    uint32_t sectors = chunk_region_sectors(length);
+    if (e.sector == 0 || sectors > chunk_region_sectors(e.length))
+    {
+        e.sector = r->sectors;
+        r->sectors += sectors;
+    }
+    e.length = length;
+
+    bool ok = pwrite(r->fd, buf, length, (off_t)e.sector * CHUNK_REGION_SECTOR) == (ssize_t)length;
+    if (ok)
+    {
+        /* Keep the file a whole number of sectors, so the next chunk
+         * appended starts where r->sectors says */
+        off_t end = (off_t)(e.sector + sectors) * CHUNK_REGION_SECTOR;
+        struct stat st;
+        if (fstat(r->fd, &st) == 0 && st.st_size < end) ok = ftruncate(r->fd, end) == 0;
+    }
+    if (ok)
+    {
+        off_t offset = offsetof(struct chunk_region_header_t, entries) + index * sizeof e;
+        ok = pwrite(r->fd, &e, sizeof e, offset) == sizeof e;
+    }
+    if (ok) r->header.entries[index] = e;
+
+    pthread_mutex_unlock(&rs->mutex);
+    free(buf);
+
+    if (!ok)
+    {
+        LOG("[chunk_region] Unable to write chunk at %d x %d x %d\n", chunk->x, chunk->y, chunk->z);
+        return false;
+    }
+
+    chunk->dirty = false;
+
+    return true;
+}
@@ -0,0 +1,87 @@
+#ifndef CHUNK_REGION_H
+#define CHUNK_REGION_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "list.h"
+
+/* Chunks are stored in region files of 32x32 chunks, each a header with an
+ * offset table followed by the chunks, compressed separately and aligned to
+ * sectors. A chunk that grows past its sectors is moved to the end of the
+ * file; the space it leaves is not reused. Building with CHUNK_REGION_MMAP
+ * reads chunks through a mapping of the file instead of pread(). */
+
+#define CHUNK_REGION_BITS 5
+#define CHUNK_REGION_SIZE (1 << CHUNK_REGION_BITS)
+#define CHUNK_REGION_MASK (CHUNK_REGION_SIZE - 1)
+#define CHUNK_REGION_CHUNKS (CHUNK_REGION_SIZE * CHUNK_REGION_SIZE)
+#define CHUNK_REGION_SECTOR 4096
+#define CHUNK_REGION_VERSION 1
+
+/* Directory of a chunked level, room for "levels/" and a level name */
+#define CHUNK_DIR_SIZE (sizeof "levels/" + 64)
+
+/* Address space reserved for each mapped region. Chunks beyond it are read
+ * with pread(). */
+#define CHUNK_REGION_MAP_SIZE (1UL << 30)
+
+/* Regions kept open per level. Past this the least recently used region
+ * that no read is using is closed to make room. */
+#define CHUNK_REGION_OPEN_MAX 16
+
+struct chunk_t;
+
+struct chunk_region_entry_t
+{
+    uint32_t sector;
+    uint32_t length;
+};
+
+struct chunk_region_header_t
+{
+    char magic[4];
+    uint32_t version;
+    struct chunk_region_entry_t entries[CHUNK_REGION_CHUNKS];
+};
+
+struct chunk_region_t
+{
+    int32_t x, y, z;
+    int fd;
+
+    /* Reads using fd or map outside the mutex, and when last used */
+    unsigned users;
+    unsigned long last_used;
+
+    /* Sectors in the file, new chunks go at the end */
+    uint32_t sectors;
+    struct chunk_region_header_t header;
+
+#ifdef CHUNK_REGION_MMAP
+    const uint8_t *map;
+#endif
+};
+
+static inline bool chunk_region_t_compare(struct chunk_region_t **a, struct chunk_region_t **b)
+{
+    return *a == *b;
+}
+LIST(chunk_region, struct chunk_region_t *, chunk_region_t_compare)
+
+/* Open region files of one chunked level */
+struct chunk_regions_t
+{
+    char name[CHUNK_DIR_SIZE];
+    struct chunk_region_list_t regions;
+    unsigned long clock;
+    pthread_mutex_t mutex;
+};
+
+void chunk_regions_init(struct chunk_regions_t *rs, const char *name);
+void chunk_regions_free(struct chunk_regions_t *rs);
+bool chunk_region_read(struct chunk_regions_t *rs, struct chunk_t *chunk);
+bool chunk_region_write(struct chunk_regions_t *rs, struct chunk_t *chunk);
+
+#endif /* CHUNK_REGION_H */
@@ -1,27 +1,56 @@
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include "chunk.h"
 #include "chunked_level.h"
+#include "gettime.h"
+#include "mcc.h"
 
 #define HASH_BITS 12
 #define HASH_SIZE (1 << HASH_BITS)
 #define HASH_MASK (HASH_SIZE - 1)
 
-void *chunked_level_save_thread(void *arg);
-void *chunked_level_get_chunk_thread(void *arg);
+struct chunked_level_job_t
+{
+    struct chunked_level_t *cl;
+    struct chunk_t *chunk;
+};
+
+static void chunked_level_load_job(void *arg);
+static void chunked_level_save_job(void *arg);
+static void chunked_level_purge_job(void *arg);
+static void chunked_level_write(struct chunked_level_t *cl, struct chunk_t *chunk);
 
 bool chunked_level_init(struct chunked_level_t *cl, const char *name)
 {
     memset(cl, 0, sizeof *cl);
 
+    if (strlen(name) >= sizeof cl->name)
+    {
+        LOG("[chunked_level] Directory name %s is too long\n", name);
+        return false;
+    }
     snprintf(cl->name, sizeof cl->name, "%s", name);
 
+    if (mkdir(cl->name, 0755) != 0 && errno != EEXIST)
+    {
+        LOG("[chunked_level] Could not create %s\n", cl->name);
+        return false;
+    }
+
     cl->min_x = cl->min_y = cl->min_z = INT_MAX;
     cl->max_x = cl->max_y = cl->max_z = INT_MIN;
 
     cl->chunk_hash = calloc(sizeof *cl->chunk_hash, HASH_SIZE);
+    if (cl->chunk_hash == NULL) return false;
+
+    pthread_mutex_init(&cl->mutex, NULL);
+    chunk_list_init(&cl->load_list);
+    chunk_regions_init(&cl->regions, cl->name);
 
     cl->landscape.seed = rand();
     cl->landscape.height_range = 32;
@@ -32,35 +61,43 @@ bool chunked_level_init(struct chunked_level_t *cl, const char *name)
     cl->landscape.p2 = 0.75;
     cl->landscape.o2 = 6;
 
-    cl->load_queue = queue_new();
-    cl->save_queue = queue_new();
-    cl->purge_queue = queue_new();
+    worker_init(&cl->load_worker, "chunk load", 30000, 1, 4, &chunked_level_load_job);
+    worker_init(&cl->save_worker, "chunk save", 30000, 10, 1, &chunked_level_save_job);
+    worker_init(&cl->purge_worker, "chunk purge", 30000, 10, 1, &chunked_level_purge_job);
 
+    return true;
+}
+
+/* Stop the workers, save changed chunks and free everything */
+void chunked_level_deinit(struct chunked_level_t *cl)
+{
     int i;
-    for (i = 0; i < 4; i++)
+
+    /* Waiting loads are dropped, but queued saves and purges still run */
+    cl->exit = true;
+    worker_deinit(&cl->load_worker);
+    worker_deinit(&cl->save_worker);
+    worker_deinit(&cl->purge_worker);
+
+    for (i = 0; i < HASH_SIZE; i++)
     {
-        if (pthread_create(&cl->load_thread[i], NULL, &chunked_level_get_chunk_thread, cl) != 0)
+        struct chunk_t *chunk = cl->chunk_hash[i];
+        while (chunk != NULL)
         {
-            if (i == 0)
-            {
-                LOG("[chunked_level] Could not start chunk load thread, expect delays\n");
-                queue_delete(cl->load_queue);
-                cl->load_queue = NULL;
-            }
-            break;
+            struct chunk_t *next = chunk->hash_next;
+            if (chunk->ready && chunk->dirty) chunked_level_write(cl, chunk);
+            free(chunk);
+            chunk = next;
         }
     }
 
-    LOG("[chunked_level] Started %d consumer threads\n", i);
-
-    if (pthread_create(&cl->save_thread, NULL, &chunked_level_save_thread, cl) != 0)
-    {
-        LOG("[chunked_level] Could not start chunk save thread, expect delays\n");
-        queue_delete(cl->save_queue);
-        cl->save_queue = NULL;
-    }
+    free(cl->chunk_hash);
+    cl->chunk_hash = NULL;
+    cl->chunks = 0;
 
-    return true;
+    chunk_list_free(&cl->load_list);
+    chunk_regions_free(&cl->regions);
+    pthread_mutex_destroy(&cl->mutex);
 }
 
 static uint32_t mix(uint32_t a, uint32_t b, uint32_t c)
@@ -77,30 +114,64 @@ static uint32_t mix(uint32_t a, uint32_t b, uint32_t c)
     return c;
 }
 
-void *chunked_level_save_thread(void *arg)
+/* Read a chunk from its region, falling back to the per-chunk file of older
+ * versions. Such a chunk is left dirty so it gets moved into a region. */
+static bool chunked_level_read(struct chunked_level_t *cl, struct chunk_t *chunk)
 {
-    struct chunked_level_t *cl = arg;
+    if (chunk_region_read(&cl->regions, chunk)) return true;
+    if (!chunk_load(cl->name, chunk)) return false;
 
-    while (true)
-    {
-        struct chunk_t *chunk;
-        if (queue_consume(cl->save_queue, &chunk))
-        {
-            chunk_save(cl->name, chunk);
-        }
-        else
-        {
-            /* Sleep 10ms if there was nothing to consume */
-            usleep(10000);
-        }
-    }
+    chunk->dirty = true;
+    chunk->legacy = true;
+    return true;
+}
+
+static void chunked_level_write(struct chunked_level_t *cl, struct chunk_t *chunk)
+{
+    if (chunk_region_write(&cl->regions, chunk) && chunk->legacy) chunk_remove(cl->name, chunk);
 }
 
-void chunked_level_purge(struct chunked_level_t *cl, struct chunk_t *chunk)
+/* Queue a save or purge of a chunk. Called with the mutex held. */
+static bool chunked_level_queue(struct chunked_level_t *cl, struct worker *worker, struct chunk_t *chunk)
 {
-    /* Don't purge if the chunk is in use again */
-    if (chunk->inuse) {
+    struct chunked_level_job_t *job = malloc(sizeof *job);
+    if (job == NULL) return false;
+
+    job->cl = cl;
+    job->chunk = chunk;
+
+    if (worker == &cl->save_worker) cl->stats.save_queue++;
+    else cl->stats.purge_queue++;
+
+    worker_queue(worker, job);
+    return true;
+}
+
+static void chunked_level_save_job(void *arg)
+{
+    struct chunked_level_job_t *job = arg;
+    struct chunked_level_t *cl = job->cl;
+
+    pthread_mutex_lock(&cl->mutex);
+    chunked_level_write(cl, job->chunk);
+    job->chunk->saving = false;
+    cl->stats.save_queue--;
+    pthread_mutex_unlock(&cl->mutex);
+
+    free(job);
+}
+
+static void chunked_level_purge(struct chunked_level_t *cl, struct chunk_t *chunk)
+{
+    pthread_mutex_lock(&cl->mutex);
+
+    cl->stats.purge_queue--;
+
+    /* Don't purge if the chunk is in use again, or still waiting to be
+     * loaded or saved */
+    if (chunk->inuse || !chunk->ready || chunk->saving) {
         chunk->purge = false;
+        pthread_mutex_unlock(&cl->mutex);
         return;
     }
 
@@ -113,74 +184,141 @@ void chunked_level_purge(struct chunked_level_t *cl, struct chunk_t *chunk)
         if (chunkp == chunk)
         {
             *last = chunk->hash_next;
+            cl->chunks--;
+
+            if (chunk->dirty) chunked_level_write(cl, chunk);
 
             LOG("[chunked_level] Purge chunk at %d x %d x %d\n", chunk->x, chunk->y, chunk->z);
             free(chunk);
-            return;
+            break;
         }
 
         last = &chunkp->hash_next;
     }
+
+    pthread_mutex_unlock(&cl->mutex);
+}
+
+static void chunked_level_purge_job(void *arg)
+{
+    struct chunked_level_job_t *job = arg;
+    chunked_level_purge(job->cl, job->chunk);
+    free(job);
 }
 
-void *chunked_level_get_chunk_thread(void *arg)
+/* Load or generate the waiting chunk with the lowest priority value. There
+ * is one job queued for each chunk in the load list. */
+static void chunked_level_load_job(void *arg)
 {
     struct chunked_level_t *cl = arg;
+    struct chunk_t *chunk = NULL;
+    size_t i, best = 0;
 
-    while (true)
+    if (cl->exit) return;
+
+    pthread_mutex_lock(&cl->mutex);
+    for (i = 0; i < cl->load_list.used; i++)
     {
-        bool wait = true;
-        struct chunk_t *chunk;
-        if (queue_consume(cl->load_queue, &chunk))
+        if (chunk == NULL || cl->load_list.items[i]->priority < chunk->priority)
         {
-            if (!chunk_load(cl->name, chunk))
-            {
-                chunk_generate(chunk, &cl->landscape);
-                if (!queue_produce(cl->save_queue, chunk))
-                {
-                    chunk_save(cl->name, chunk);
-                }
-            }
-            chunk->ready = true;
-            wait = false;
+            chunk = cl->load_list.items[i];
+            best = i;
         }
-        if (queue_consume(cl->purge_queue, &chunk))
+    }
+    if (chunk != NULL)
+    {
+        chunk_list_del_index(&cl->load_list, best);
+        cl->stats.load_queue--;
+    }
+    pthread_mutex_unlock(&cl->mutex);
+
+    if (chunk == NULL) return;
+
+    if (!chunked_level_read(cl, chunk)) chunk_generate(chunk, &cl->landscape);
+
+    pthread_mutex_lock(&cl->mutex);
+
+    if (chunk->dirty)
+    {
+        chunk->saving = true;
+        if (!chunked_level_queue(cl, &cl->save_worker, chunk))
         {
-            chunked_level_purge(cl, chunk);
-            wait = false;
+            chunked_level_write(cl, chunk);
+            chunk->saving = false;
         }
-
-        /* Sleep 1ms if there was nothing to consume */
-        if (wait) usleep(1000);
     }
 
-    return NULL;
+    unsigned ms = gettime() - chunk->requested;
+    cl->stats.loads++;
+    cl->stats.load_ms += ms;
+    if (ms > cl->stats.load_ms_max) cl->stats.load_ms_max = ms;
+
+    /* Blocks must be in place before the chunk is seen as ready */
+    __sync_synchronize();
+    chunk->ready = true;
+
+    pthread_mutex_unlock(&cl->mutex);
 }
 
-struct chunk_t *chunked_level_get_chunk(struct chunked_level_t *cl, int32_t x, int32_t y, int32_t z, bool fill)
+static struct chunk_t *chunked_level_find(struct chunked_level_t *cl, int32_t x, int32_t y, int32_t z, bool fill, unsigned priority)
 {
     uint32_t bucket = mix(x, y, z) & HASH_MASK;
+
+    pthread_mutex_lock(&cl->mutex);
+
     struct chunk_t *chunk = cl->chunk_hash[bucket];
 
     for (; chunk != NULL; chunk = chunk->hash_next)
     {
-        if (chunk->x == x && chunk->y == y && chunk->z == z) return chunk;
+        if (chunk->x == x && chunk->y == y && chunk->z == z)
+        {
+            if (fill)
+            {
+                /* Wanted again, so keep it from being purged */
+                chunk->inuse = true;
+
+                /* Already waiting, only the order changes */
+                if (!chunk->ready)
+                {
+                    chunk->priority = priority;
+                    cl->stats.load_dupes++;
+                }
+            }
+            pthread_mutex_unlock(&cl->mutex);
+            return chunk;
+        }
         if (!chunk->inuse && !chunk->purge)
         {
             LOG("[chunked_level] Chunk at %d x %d x %d is not in use\n", chunk->x, chunk->y, chunk->z);
-            chunk->purge = true;
-            queue_produce(cl->purge_queue, chunk);
+            chunk->purge = chunked_level_queue(cl, &cl->purge_worker, chunk);
         }
     }
 
-    if (!fill) return NULL;
+    if (!fill)
+    {
+        pthread_mutex_unlock(&cl->mutex);
+        return NULL;
+    }
 
     chunk = malloc(sizeof *chunk);
+    if (chunk == NULL)
+    {
+        pthread_mutex_unlock(&cl->mutex);
+        LOG("[chunked_level] Could not allocate chunk at %d x %d x %d\n", x, y, z);
+        return NULL;
+    }
+
     chunk->x = x;
     chunk->y = y;
     chunk->z = z;
+    chunk->dirty = false;
     chunk->ready = false;
     chunk->inuse = true;
+    chunk->purge = false;
+    chunk->saving = false;
+    chunk->legacy = false;
+    chunk->priority = priority;
+    chunk->requested = gettime();
 
     memset(chunk->blocks, 0, sizeof chunk->blocks);
 
@@ -194,21 +332,60 @@ struct chunk_t *chunked_level_get_chunk(struct chunked_level_t *cl, int32_t x, i
     /* Insert chunk into hash */
     chunk->hash_next = cl->chunk_hash[bucket];
     cl->chunk_hash[bucket] = chunk;
+    cl->chunks++;
+
+    chunk_list_add(&cl->load_list, chunk);
+    if (++cl->stats.load_queue > cl->stats.load_queue_max) cl->stats.load_queue_max = cl->stats.load_queue;
+    worker_queue(&cl->load_worker, cl);
 
-    if (!queue_produce(cl->load_queue, chunk))
+    pthread_mutex_unlock(&cl->mutex);
+
+    return chunk;
+}
+
+struct chunk_t *chunked_level_get_chunk(struct chunked_level_t *cl, int32_t x, int32_t y, int32_t z, bool fill)
+{
+    return chunked_level_find(cl, x, y, z, fill, 0);
+}
+
+/* Get a chunk, loading it if needed. Waiting chunks with a lower priority
+ * value are loaded first. */
+struct chunk_t *chunked_level_request(struct chunked_level_t *cl, int32_t x, int32_t y, int32_t z, unsigned priority)
+{
+    return chunked_level_find(cl, x, y, z, true, priority);
+}
+
+/* The chunk is no longer wanted, and will be saved if changed and freed */
+void chunked_level_release(struct chunked_level_t *cl, struct chunk_t *chunk)
+{
+    pthread_mutex_lock(&cl->mutex);
+
+    chunk->inuse = false;
+    if (!chunk->purge)
+    {
+        chunk->purge = chunked_level_queue(cl, &cl->purge_worker, chunk);
+    }
+
+    pthread_mutex_unlock(&cl->mutex);
+}
+
+/* Save every changed chunk now */
+void chunked_level_save(struct chunked_level_t *cl)
+{
+    int i;
+
+    pthread_mutex_lock(&cl->mutex);
+
+    for (i = 0; i < HASH_SIZE; i++)
     {
-        if (!chunk_load(cl->name, chunk))
+        struct chunk_t *chunk = cl->chunk_hash[i];
+        for (; chunk != NULL; chunk = chunk->hash_next)
         {
-            chunk_generate(chunk, &cl->landscape);
-            if (!queue_produce(cl->save_queue, chunk))
-            {
-                chunk_save(cl->name, chunk);
-            }
+            if (chunk->ready && chunk->dirty) chunked_level_write(cl, chunk);
         }
-        chunk->ready = true;
     }
 
-    return chunk;
+    pthread_mutex_unlock(&cl->mutex);
 }
 
 void chunked_level_update_size(struct chunked_level_t *cl)
@@ -2,33 +2,71 @@
 #define CHUNKED_LEVEL_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <pthread.h>
+#include "chunk_region.h"
 #include "landscape.h"
-#include "queue.h"
+#include "list.h"
+#include "worker.h"
 
 struct chunk_t;
 
+static inline bool chunk_t_compare(struct chunk_t **a, struct chunk_t **b)
+{
+    return *a == *b;
+}
+LIST(chunk, struct chunk_t *, chunk_t_compare)
+
+struct chunked_level_stats_t
+{
+    /* Jobs waiting, and the most loads seen waiting */
+    unsigned load_queue, load_queue_max;
+    unsigned save_queue;
+    unsigned purge_queue;
+
+    /* Loads completed, requests for chunks already waiting to load, and
+     * time from first request to ready */
+    uint64_t loads, load_dupes;
+    uint64_t load_ms, load_ms_max;
+};
+
 struct chunked_level_t
 {
-    char name[32];
+    char name[CHUNK_DIR_SIZE];
     struct landscape_t landscape;
 
     struct chunk_t **chunk_hash;
+    unsigned chunks;
 
     int32_t min_x, max_x, size_x;
     int32_t min_y, max_y, size_y;
     int32_t min_z, max_z, size_z;
 
-    struct queue_t *load_queue;
-    pthread_t load_thread[4];
+    /* Chunks waiting to be loaded. Each load job takes the one with the
+     * lowest priority value. */
+    struct chunk_list_t load_list;
+    struct worker load_worker;
+    struct worker save_worker;
+    struct worker purge_worker;
+
+    /* Chunks are kept on disk in region files */
+    struct chunk_regions_t regions;
 
-    struct queue_t *save_queue;
-    pthread_t save_thread;
+    /* Held while changing the hash or load list, and while saving or
+     * purging a chunk */
+    pthread_mutex_t mutex;
+    bool exit;
 
-    struct queue_t *purge_queue;
+    struct chunked_level_stats_t stats;
 };
 
 bool chunked_level_init(struct chunked_level_t *cl, const char *name);
+void chunked_level_deinit(struct chunked_level_t *cl);
 struct chunk_t *chunked_level_get_chunk(struct chunked_level_t *cl, int32_t x, int32_t y, int32_t z, bool load);
+struct chunk_t *chunked_level_request(struct chunked_level_t *cl, int32_t x, int32_t y, int32_t z, unsigned priority);
+void chunked_level_release(struct chunked_level_t *cl, struct chunk_t *chunk);
+void chunked_level_save(struct chunked_level_t *cl);
+void chunked_level_set_area(struct chunked_level_t *cl, int32_t x, int32_t y, int32_t z, int rx, int ry, int rz);
+void chunked_level_hash_analysis(struct chunked_level_t *cl);
 
 #endif /* CHUNKED_LEVEL_H */
@@ -24,30 +24,74 @@ struct client_list_t s_clients;
 	return NULL;
 }*/
 
-void client_add_packet(struct client_t *c, struct packet_t *p)
+/* Grow the send buffer so that at least len more bytes fit, unwrapping the
+ * existing contents to the start of the new buffer. Called with
+ * packet_send_mutex held. */
+static bool client_send_grow(struct client_t *c, size_t len)
 {
-	/* Don't add packets for closed sockets */
-	if (c->close) {
-		free(p);
-		return;
+	size_t size = c->send_size == 0 ? CLIENT_SEND_INITIAL : c->send_size;
+	while (size - c->send_len < len) size *= 2;
+
+	uint8_t *buf = malloc(size);
+	if (buf == NULL)
+	{
+		LOG("[client] client_send_grow(): couldn't allocate %zu bytes\n", size);
+		return false;
 	}
 
-	if (p == NULL)
+	if (c->send_len > 0)
 	{
-		LOG("[client] client_add_packet(): Tried to queue NULL packet\n");
-		return;
+		size_t first = c->send_size - c->send_head;
+		if (first > c->send_len) first = c->send_len;
+		memcpy(buf, c->send_buf + c->send_head, first);
+		memcpy(buf + first, c->send_buf, c->send_len - first);
 	}
 
+	free(c->send_buf);
+	c->send_buf = buf;
+	c->send_size = size;
+	c->send_head = 0;
+
+	return true;
+}
+
+void client_add_packet(struct client_t *c, const uint8_t *data, size_t len)
+{
+	/* Don't add packets for closed sockets */
+	if (c->close) return;
+
 	pthread_mutex_lock(&c->packet_send_mutex);
-	*c->packet_send_end = p;
-	c->packet_send_end = &p->next;
 
-	if (c->packet_send_count == 0)
+	if (c->send_size - c->send_len < len && !client_send_grow(c, len))
+	{
+		pthread_mutex_unlock(&c->packet_send_mutex);
+		return;
+	}
+
+	size_t tail = (c->send_head + c->send_len) & (c->send_size - 1);
+	size_t first = c->send_size - tail;
+	if (first > len) first = len;
+	memcpy(c->send_buf + tail, data, first);
+	memcpy(c->send_buf, data + first, len - first);
+
+	if (c->send_len == 0)
 	{
 		socket_flag_write(c->sock);
 	}
 
-	c->packet_send_count++;
+	c->send_len += len;
+	pthread_mutex_unlock(&c->packet_send_mutex);
+}
+
+void client_clear_packets(struct client_t *c)
+{
+	pthread_mutex_lock(&c->packet_send_mutex);
+	if (c->send_len > 0)
+	{
+		LOG("[network] removed %zu bytes from queue\n", c->send_len);
+	}
+	c->send_head = 0;
+	c->send_len = 0;
 	pthread_mutex_unlock(&c->packet_send_mutex);
 }
 
@@ -115,7 +159,7 @@ void client_notify(struct client_t *c, const char *message)
 
 		last_colour[0] = last_colour[1];
 
-		client_add_packet(c, packet_send_message(0, buf));
+		packet_send_message(c, 0, buf);
 
 		switch (*last_space)
 		{
@@ -343,7 +387,7 @@ void client_send_spawn(struct client_t *c, bool hiding)
 		struct client_t *c2 = level->clients[i];
 		if (c2 != NULL && c2 != c && !c2->sending_level)
 		{
-			client_add_packet(c2, packet_send_spawn_player(c->player->levelid, playername(c->player, c2->player->namemode), &c->player->pos));
+			packet_send_spawn_player(c2, c->player->levelid, playername(c->player, c2->player->namemode), &c->player->pos);
 			//printf("Told %s (%d) about %s joining %s\n", level->clients[i]->player->username, i, c->player->username, level->name);
 		}
 	}
@@ -360,7 +404,7 @@ void client_send_despawn(struct client_t *c, bool hiding)
 		struct client_t *c2 = level->clients[i];
 		if (c2 != NULL && c2 != c && !c2->sending_level)
 		{
-			client_add_packet(c2, packet_send_despawn_player(c->player->levelid));
+			packet_send_despawn_player(c2, c->player->levelid);
 			//printf("Told %s (%d) about %s leaving %s\n", level->clients[i]->player->username, i, c->player->username, level->name);
 		}
 	}
@@ -377,7 +421,7 @@ void client_spawn_players(struct client_t *c)
 		struct client_t *c2 = l->clients[i];
 		if (c2 != NULL && c2 != c && !c2->hidden && !c2->sending_level)
 		{
-			client_add_packet(c, packet_send_spawn_player(c2->player->levelid, playername(c2->player, c->player->namemode), &c2->player->pos));
+			packet_send_spawn_player(c, c2->player->levelid, playername(c2->player, c->player->namemode), &c2->player->pos);
 		}
 	}
 }
@@ -393,7 +437,7 @@ void client_despawn_players(struct client_t *c)
 		struct client_t *c2 = l->clients[i];
 		if (c2 != NULL && c2 != c && !c2->hidden && !c2->sending_level)
 		{
-			client_add_packet(c, packet_send_despawn_player(c2->player->levelid));
+			packet_send_despawn_player(c, c2->player->levelid);
 		}
 	}
 }
@@ -8,6 +8,13 @@
 #include "list.h"
 #include "packet.h"
 
+/* Initial size of a client's send buffer, must be a power of two. */
+#define CLIENT_SEND_INITIAL  4096
+/* Send buffers larger than this are released once drained. */
+#define CLIENT_SEND_KEEP     65536
+/* Clients with more than this many bytes queued are disconnected. */
+#define CLIENT_SEND_LIMIT    (12 * 1024 * 1024)
+
 struct packet_t;
 struct player_t;
 
@@ -25,13 +32,15 @@ struct client_t
 	char *close_reason;
 
 	struct packet_t *packet_recv;
-	struct packet_t *packet_send;
-	struct packet_t **packet_send_end;
 	struct player_t *player;
 
+	/* Ring buffer of serialized packets waiting to be sent */
 	pthread_mutex_t packet_send_mutex;
+	uint8_t *send_buf;
+	size_t send_size;
+	size_t send_head;
+	size_t send_len;
 
-	int packet_send_count;
 	int inuse;
 };
 
@@ -46,7 +55,8 @@ extern pthread_mutex_t s_client_list_mutex;
 
 struct client_t *client_get_by_player(struct player_t *p);
 
-void client_add_packet(struct client_t *c, struct packet_t *p);
+void client_add_packet(struct client_t *c, const uint8_t *data, size_t len);
+void client_clear_packets(struct client_t *c);
 void client_process(struct client_t *c, char *message);
 void client_send_spawn(struct client_t *c, bool hiding);
 void client_send_despawn(struct client_t *c, bool hiding);
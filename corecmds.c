@@ -11,6 +11,7 @@
 #include "commands.h"
 #include "cuboid.h"
 #include "level.h"
+#include "level_profile.h"
 #include "packet.h"
 #include "player.h"
 #include "playerdb.h"
@@ -685,7 +686,7 @@ CMD(follow)
 		snprintf(buf, sizeof buf, "Stopped following %s", c->player->following->username);
 		client_notify(c, buf);
 
-		client_add_packet(c, packet_send_spawn_player(c->player->following->levelid, c->player->following->colourusername, &c->player->following->pos));
+		packet_send_spawn_player(c, c->player->following->levelid, c->player->following->colourusername, &c->player->following->pos);
 
 		c->player->following = NULL;
 		return false;
@@ -725,7 +726,7 @@ CMD(follow)
 	}
 
 	/* Despawn followed player to prevent following player jitter */
-	client_add_packet(c, packet_send_despawn_player(p->levelid));
+	packet_send_despawn_player(c, p->levelid);
 
 	snprintf(buf, sizeof buf, "Hidden %s", c->hidden ? s_on : s_off);
 	client_notify(c, buf);
@@ -962,12 +963,12 @@ CMD(identify)
 	if (oldrank >= RANK_OP)
 	{
 		/* Remove op status */
-		client_add_packet(c, packet_send_update_user_type(0x00));
+		packet_send_update_user_type(c, 0x00);
 	}
 	if (c->player->rank >= RANK_OP)
 	{
 		/* Give op status */
-		client_add_packet(c, packet_send_update_user_type(0x64));
+		packet_send_update_user_type(c, 0x64);
 	}
 
 	return false;
@@ -1035,7 +1036,6 @@ CMD(instant)
 	return false;
 }
 
-static bool undo_real(int16_t x, int16_t y, int16_t z, int oldtype, int olddata, int newtype, void *arg);
 
 static const char help_kbu[] =
 "/kbu <user> [<message>]\n"
@@ -1095,18 +1095,7 @@ CMD(kbu)
 	snprintf(buf, sizeof buf, TAG_AQUA "%s kbu'd by %s", name, c->player->username);
 	net_notify_ops(buf);
 
-	if (l->undo == NULL) l->undo = undodb_init(l->name);
-	if (l->undo != NULL)
-	{
-		int count = undodb_undo_player(l->undo, globalid, 10000, &undo_real, c);
-		if (count > 0)
-		{
-			l->changed = true;
-			snprintf(buf, sizeof buf, TAG_YELLOW "%d blocks changed by undo", count);
-			client_notify(c, buf);
-		}
-	}
-
+	level_undo_player(l, globalid, 10000, c);
 	level_user_undo(l, globalid, c);
 
 	return false;
@@ -1760,6 +1749,47 @@ CMD(physics)
 	client_notify(c, buf);
 	snprintf(buf, sizeof buf, "Updates runtime: %ums  count: %u", l->updates_runtime_last, l->updates_count_last);
 	client_notify(c, buf);
+	snprintf(buf, sizeof buf, "Tick runtime: %ums  max: %ums  ticks: %u", l->tick_runtime_last, l->tick_runtime_max, l->ticks);
+	client_notify(c, buf);
+
+	return false;
+}
+
+static const char help_profile[] =
+"/profile [on|off|reset]\n"
+"Show or control profiling of physics, block callbacks and ticks for this level.";
+
+CMD(profile)
+{
+	struct level_t *l = c->player->level;
+
+	if (params > 2) return true;
+
+	if (params == 2)
+	{
+		if (strcasecmp(param[1], "on") == 0)
+		{
+			level_profile_enable(l, true);
+			client_notify(c, TAG_YELLOW "Profiling enabled");
+		}
+		else if (strcasecmp(param[1], "off") == 0)
+		{
+			level_profile_enable(l, false);
+			client_notify(c, TAG_YELLOW "Profiling disabled");
+		}
+		else if (strcasecmp(param[1], "reset") == 0)
+		{
+			level_profile_reset(l);
+			client_notify(c, TAG_YELLOW "Profile reset");
+		}
+		else
+		{
+			return true;
+		}
+		return false;
+	}
+
+	level_profile_show(l, c);
 
 	return false;
 }
@@ -2002,9 +2032,9 @@ CMD(resetlvl)
 //	block_update_list_free(&l->updates);
 
 	/* Reset physics for level */
-	l->physics.used = 0;
-	l->physics2.used = 0;
+	physics_list_reset(l);
 	l->updates.used = 0;
+	block_update_map_reset(&l->updates_map);
 	l->physics_iter = 0;
 	l->updates_iter = 0;
 	l->physics_done = 0;
@@ -2219,12 +2249,12 @@ CMD(setrank)
 		if (oldrank >= RANK_OP)
 		{
 			/* Remove op status */
-			client_add_packet(p->client, packet_send_update_user_type(0x00));
+			packet_send_update_user_type(p->client, 0x00);
 		}
 		if (newrank >= RANK_OP)
 		{
 			/* Give op status */
-			client_add_packet(p->client, packet_send_update_user_type(0x64));
+			packet_send_update_user_type(p->client, 0x64);
 		}
 
 		client_send_despawn(p->client, false);
@@ -2449,19 +2479,7 @@ CMD(u)
 
 	if (l == NULL) return false;
 
-	if (l->undo == NULL) l->undo = undodb_init(l->name);
-	if (l->undo != NULL)
-	{
-		int count = undodb_undo_player(l->undo, globalid, 10000, &undo_real, c);
-		if (count > 0)
-		{
-			l->changed = true;
-			char buf[64];
-			snprintf(buf, sizeof buf, TAG_YELLOW "%d blocks changed by undo", count);
-			client_notify(c, buf);
-		}
-	}
-
+	level_undo_player(l, globalid, 10000, c);
 	level_user_undo(l, globalid, c);
 
 	return false;
@@ -2490,29 +2508,12 @@ static bool undo_show(int16_t x, int16_t y, int16_t z, int oldtype, int olddata,
 
 	if (x >= l->x || y >= l->y || z >= l->z) return false;
 	unsigned index = level_get_index(l, x, y, z);
-	struct block_t *b = &l->blocks[index];
-
-	if (b->type != newtype) return false;
-	struct block_t backup = *b;
-	b->type = oldtype;
-	b->data = olddata;
-	client_add_packet(client, packet_send_set_block(x, y, z, convert(l, index, b)));
-	*b = backup;
-
-	return true;
-}
-
-static bool undo_real(int16_t x, int16_t y, int16_t z, int oldtype, int olddata, int newtype, void *arg)
-{
-	struct client_t *client = arg;
-	struct level_t *l = client->player->level;
-
-	if (x >= l->x || y >= l->y || z >= l->z) return false;
-	unsigned index = level_get_index(l, x, y, z);
-	const struct block_t *b = &l->blocks[index];
+	if (level_block_type(l, index) != newtype) return false;
 
-	if (b->type != newtype) return false;
-	level_addupdate_with_owner(l, index, oldtype, olddata, 0);
+	struct block_t b = level_block_get(l, index);
+	b.type = oldtype;
+	b.data = olddata;
+	packet_send_set_block(client, x, y, z, convert(l, index, &b));
 
 	return true;
 }
@@ -2575,15 +2576,20 @@ CMD(undo)
 		return false;
 	}
 
-	//client_add_packet(client, packet_send_set_block(x, y, z, pt));
+	//packet_send_set_block(client, x, y, z, pt);
 	int limit = strtol(param[3], NULL, 10);
 
-	int count = undodb_undo_player(l->undo, globalid, limit, params == 4 ? &undo_show : &undo_real, c);
+	if (params == 5)
+	{
+		level_undo_player(l, globalid, limit, c);
+		return false;
+	}
+
+	int count = undodb_undo_player(l->undo, globalid, limit, &undo_show, c);
 	if (count > 0)
 	{
-		l->changed = true;
 		char buf[64];
-		snprintf(buf, sizeof buf, TAG_YELLOW "%d blocks changed by undo", count);
+		snprintf(buf, sizeof buf, TAG_YELLOW "%d blocks shown by undo preview", count);
 		client_notify(c, buf);
 	}
 
@@ -2821,6 +2827,7 @@ static const struct command s_core_commands[] = {
 	{ "physics", RANK_OP, &cmd_physics, help_physics },
 	{ "place", RANK_ADV_BUILDER, &cmd_place, help_place },
 	{ "players", RANK_GUEST, &cmd_players, help_players },
+	{ "profile", RANK_OP, &cmd_profile, help_profile },
 	{ "r", RANK_ADV_BUILDER, &cmd_replace, help_replace },
 	{ "ra", RANK_OP, &cmd_replaceall, help_replaceall },
 	{ "ranks", RANK_GUEST, &cmd_ranks, help_ranks },
@@ -3,9 +3,122 @@
 #include "client.h"
 #include "level.h"
 #include "player.h"
+#include "undodb.h"
 
 struct cuboid_list_t s_cuboids;
 
+/* Store a block changed by a cuboid and finish it off. Returns true if
+ * clients were sent the change. */
+static bool cuboid_changed(struct cuboid_t *c, unsigned index, struct block_t *b, bool oldphysics, enum blocktype_t pt1, int16_t x, int16_t y, int16_t z)
+{
+	bool sent = false;
+
+	if (!level_block_put(c->level, index, b)) return false;
+
+	if (oldphysics != b->physics)
+	{
+		physics_list_update(c->level, index, b->physics);
+	}
+
+	enum blocktype_t pt2 = convert(c->level, index, b);
+
+	if (!c->level->instant && pt1 != pt2)
+	{
+		unsigned j;
+		for (j = 0; j < s_clients.used; j++)
+		{
+			struct client_t *client = s_clients.items[j];
+			if (client == NULL || client->player == NULL) continue;
+			if (client->player->level == c->level)
+			{
+				packet_send_set_block(client, x, y, z, pt2);
+			}
+		}
+
+		sent = true;
+	}
+
+	c->count++;
+	c->level->changed = true;
+	level_block_changed(c->level, index);
+
+	return sent;
+}
+
+struct cuboid_rollback_t
+{
+	struct cuboid_t *c;
+	int max;
+};
+
+/* Revert a logged change, unless the block has since been changed again by
+ * someone else. Older changes by the same player are reverted later in the
+ * stream, so reverted blocks are left without an owner. */
+static bool cuboid_rollback_block(int16_t x, int16_t y, int16_t z, int oldtype, int olddata, int newtype, void *arg)
+{
+	struct cuboid_rollback_t *r = arg;
+	struct cuboid_t *c = r->c;
+
+	if (!level_valid_xyz(c->level, x, y, z)) return false;
+
+	unsigned index = level_get_index(c->level, x, y, z);
+	struct block_t block = level_block_get(c->level, index);
+	struct block_t *b = &block;
+
+	if (b->type != newtype) return false;
+	if (b->owner != c->owner && b->owner != 0) return false;
+
+	enum blocktype_t pt1 = convert(c->level, index, b);
+
+	delete(c->level, index, b);
+
+	bool oldphysics = b->physics;
+
+	b->type = oldtype;
+	b->data = olddata;
+	b->owner = 0;
+	b->physics = blocktype_has_physics(oldtype);
+	b->touched = 0;
+
+	if (cuboid_changed(c, index, b, oldphysics, pt1, x, y, z)) r->max--;
+
+	return true;
+}
+
+/* Stream the next batches of a rollback from the undo log. Returns true once
+ * the rollback is complete. */
+static bool cuboid_rollback(struct cuboid_t *c, int max)
+{
+	struct cuboid_rollback_t r = { c, max };
+	int budget = UNDODB_BATCH;
+
+	if (c->level->undo == NULL) return true;
+
+	while (r.max > 0 && budget > 0 && c->rollback_limit > 0)
+	{
+		int n = r.max < c->rollback_limit ? r.max : c->rollback_limit;
+		int rows = undodb_undo_player_batch(c->level->undo, c->owner, &c->rollback_cursor, n, &cuboid_rollback_block, &r);
+		if (rows == 0) return true;
+
+		c->rollback_limit -= rows;
+		budget -= rows;
+	}
+
+	return c->rollback_limit <= 0;
+}
+
+static void cuboid_finish(struct cuboid_t *c)
+{
+	if (c->count > 0 && c->client != NULL && client_is_valid(c->client))
+	{
+		char buf[64];
+		snprintf(buf, sizeof buf, TAG_YELLOW "%d block%s changed", c->count, c->count == 1 ? "" : "s");
+		client_notify(c->client, buf);
+	}
+
+	level_inuse(c->level, false);
+}
+
 void cuboid_process(void)
 {
 	unsigned i;
@@ -14,6 +127,17 @@ void cuboid_process(void)
 		struct cuboid_t *c = &s_cuboids.items[i];
 		int max = g_server.cuboid_max;
 
+		if (c->rollback)
+		{
+			if (cuboid_rollback(c, max))
+			{
+				cuboid_finish(c);
+				cuboid_list_del_index(&s_cuboids, i);
+				i--;
+			}
+			continue;
+		}
+
 		if (c->srclevel != NULL)
 		{
 			/* Check mutexes when copying levels */
@@ -36,15 +160,17 @@ void cuboid_process(void)
 		while (max)
 		{
 			unsigned index = level_get_index(c->level, c->cx, c->cy, c->cz);
-			struct block_t *b = &c->level->blocks[index];
-			enum blocktype_t bt = b->type;
-
-			enum blocktype_t pt1 = convert(c->level, index, b);
+			enum blocktype_t bt = level_block_type(c->level, index);
 
 			if (c->old_type == BLOCK_INVALID || bt == c->old_type)
 			{
+				struct block_t block = level_block_get(c->level, index);
+				struct block_t *b = &block;
+
 				if ((!c->undo && (c->owner_is_op || b->owner == 0)) || b->owner == c->owner)
 				{
+					enum blocktype_t pt1 = convert(c->level, index, b);
+
 					delete(c->level, index, b);
 
 					bool oldphysics = b->physics;
@@ -53,7 +179,7 @@ void cuboid_process(void)
 					if (c->srclevel != NULL)
 					{
 						unsigned index2 = level_get_index(c->srclevel, c->cx, c->cy, c->cz);
-						*b = c->srclevel->blocks[index2];
+						*b = level_block_get(c->srclevel, index2);
 						b->touched = 0;
 					}
 					else
@@ -67,31 +193,7 @@ void cuboid_process(void)
 						b->touched = 0;
 					}
 
-					if (oldphysics != b->physics)
-					{
-						physics_list_update(c->level, index, b->physics);
-					}
-
-					enum blocktype_t pt2 = convert(c->level, index, b);
-
-					if (!c->level->instant && pt1 != pt2)
-					{
-						unsigned j;
-						for (j = 0; j < s_clients.used; j++)
-						{
-							struct client_t *client = s_clients.items[j];
-							if (client == NULL || client->player == NULL) continue;
-							if (client->player->level == c->level)
-							{
-								client_add_packet(client, packet_send_set_block(c->cx, c->cy, c->cz, pt2));
-							}
-						}
-
-						max--;
-					}
-
-					c->count++;
-					c->level->changed = true;
+					if (cuboid_changed(c, index, b, oldphysics, pt1, c->cx, c->cy, c->cz)) max--;
 				}
 			}
 
@@ -114,14 +216,7 @@ void cuboid_process(void)
 							level_inuse(c->srclevel, false);
 						}
 
-						if (c->count > 0 && c->client != NULL && client_is_valid(c->client))
-						{
-							char buf[64];
-							snprintf(buf, sizeof buf, TAG_YELLOW "%d block%s changed", c->count, c->count == 1 ? "" : "s");
-							client_notify(c->client, buf);
-						}
-
-						level_inuse(c->level, false);
+						cuboid_finish(c);
 						cuboid_list_del_index(&s_cuboids, i);
 						i--;
 						break;
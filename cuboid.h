@@ -20,6 +20,10 @@ struct cuboid_t
 	bool fixed;
 	bool owner_is_op;
 	bool undo;
+	/* Roll back changes in the undo log by owner, newest first */
+	bool rollback;
+	int64_t rollback_cursor;
+	int rollback_limit;
 	int count;
 	struct level_t *srclevel;
 	struct client_t *client;
@@ -71,7 +71,7 @@ static void trigger_door_sub(struct level_t *l, int16_t x, int16_t y, int16_t z,
 	if (!level_valid_xyz(l, x, y, z)) return;
 
 	unsigned index = level_get_index(l, x, y, z);
-	if (l->blocks[index].type == type && l->blocks[index].data == 0)
+	if (level_block_type(l, index) == type && level_block_data(l, index) == 0)
 	{
 		level_addupdate(l, index, type, 20);
 	}
@@ -0,0 +1,42 @@
+#include "epoch.h"
+
+/* Running sections are counted by the parity of the epoch they started in.
+ * The epoch only moves on once every section of the one before it has ended,
+ * so running sections all started in the current or the previous epoch. */
+static volatile unsigned s_epoch;
+static unsigned s_sections[2];
+
+unsigned epoch_enter(void)
+{
+	while (true)
+	{
+		unsigned e = s_epoch;
+		__sync_add_and_fetch(&s_sections[e & 1], 1);
+		if (s_epoch == e) return e;
+
+		/* It moved on before we were counted, try again in the new one */
+		__sync_sub_and_fetch(&s_sections[e & 1], 1);
+	}
+}
+
+void epoch_exit(unsigned epoch)
+{
+	__sync_sub_and_fetch(&s_sections[epoch & 1], 1);
+
+	unsigned e = s_epoch;
+	if (__sync_add_and_fetch(&s_sections[(e - 1) & 1], 0) == 0)
+	{
+		__sync_bool_compare_and_swap(&s_epoch, e, e + 1);
+	}
+}
+
+unsigned epoch_current(void)
+{
+	__sync_synchronize();
+	return s_epoch;
+}
+
+bool epoch_safe(unsigned epoch)
+{
+	return (int)(s_epoch - epoch) >= 2;
+}
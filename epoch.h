@@ -0,0 +1,18 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdbool.h>
+
+/* Epochs for freeing memory that other threads read without locking. Such
+ * reads are only made inside a section, between epoch_enter() and
+ * epoch_exit(). Each worker job, and each pass of the main and physics loops,
+ * is a section. Memory unpublished in epoch_current() may be freed once
+ * epoch_safe() says so for that epoch, as every section that could have seen
+ * it has ended by then. */
+
+unsigned epoch_enter(void);
+void epoch_exit(unsigned epoch);
+unsigned epoch_current(void);
+bool epoch_safe(unsigned epoch);
+
+#endif /* EPOCH_H */
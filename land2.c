@@ -34,7 +34,7 @@ static bool tree_check(const struct level_t *level, int x, int y, int z, int dis
 			{
 				if (!level_valid_xyz(level, x + xx, y + yy, z + zz)) continue;
 
-				if (level->blocks[level_get_index(level, x + xx, y + yy, z + zz)].type == TRUNK) return true;
+				if (level_block_type(level, level_get_index(level, x + xx, y + yy, z + zz)) == TRUNK) return true;
 			}
 		}
 	}
@@ -56,7 +56,7 @@ static void add_tree(struct level_t *level, int x, int y, int z)
 		if (!level_valid_xyz(level, x, y + yy, z)) return;
 
 		unsigned index = level_get_index(level, x, y + yy, z);
-		if (level->blocks[index].type == AIR)
+		if (level_block_type(level, index) == AIR)
 		{
 			level_set_block(level, &block, index);
 		}
@@ -78,7 +78,7 @@ static void add_tree(struct level_t *level, int x, int y, int z)
 				if (!level_valid_xyz(level, x + xx, y + yy + h, z + zz)) continue;
 
 				unsigned index = level_get_index(level, x + xx, y + yy + h, z + zz);
-				if (level->blocks[index].type == AIR)
+				if (level_block_type(level, index) == AIR)
 				{
 					int dist = xx * xx + yy * yy + zz * zz;
 					if (dist <= t * t)
@@ -105,7 +105,7 @@ void level_gen_mcsharp(struct level_t *level, const char *type)
 	struct block_t block;
 	memset(&block, 0, sizeof block);
 
-	memset(level->blocks, 0, sizeof *level->blocks * mx * my * mz);
+	level_blocks_clear(level);
 
 	const float *terrain;
 	const float *overlay;
@@ -268,9 +268,9 @@ void level_gen_mcsharp(struct level_t *level, const char *type)
 				/* Trees */
 				if (overlay[bb] < 0.65f && overlay2[bb] < treedens)
 				{
-					if (level->blocks[level_get_index(level, x, y + 1, z)].type == AIR)
+					if (level_block_type(level, level_get_index(level, x, y + 1, z)) == AIR)
 					{
-						if (level->blocks[level_get_index(level, x, y, z)].type == GRASS)
+						if (level_block_type(level, level_get_index(level, x, y, z)) == GRASS)
 						{
 							if (rand() % 13 == 0)
 							{
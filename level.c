@@ -12,9 +12,18 @@
 #include "filter.h"
 #include "level.h"
 #include "level_worker.h"
+#include "level_backup.h"
+#include "level_grid.h"
+#include "level_physics.h"
+#include "level_profile.h"
+#include "level_snapshot.h"
+#include "astar_hpa.h"
+#include "astar_worker.h"
 #include "block.h"
 #include "client.h"
+#include "config.h"
 #include "cuboid.h"
+#include "epoch.h"
 #include "faultgen.h"
 #include "mcc.h"
 #include "packet.h"
@@ -23,19 +32,311 @@
 #include "playerdb.h"
 #include "network.h"
 #include "undodb.h"
+#include "undojournal.h"
 #include "util.h"
+#include "worker.h"
 #include "gettime.h"
 
 #define TAG(a, b, c, d) (((a)<<24)|((b)<<16)|((c)<<8)|(d))
 #define TAG_MCLV TAG('M', 'C', 'L', 'V')
+#define TAG_MCLD TAG('M', 'C', 'L', 'D')
+#define TAG_MCLR TAG('M', 'C', 'L', 'R')
+#define TAG_MCLE TAG('M', 'C', 'L', 'E')
+
+/* Delta journal limits before the level is compacted into a full save */
+#define LEVEL_DELTA_MAX_RECORDS 32
+#define LEVEL_DELTA_MAX_FRACTION 2
 
 struct level_list_t s_levels;
 
+/* Send workers run in parallel; this serializes the join bookkeeping */
+static pthread_mutex_t s_level_send_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 bool level_t_compare(struct level_t **a, struct level_t **b)
 {
 	return *a == *b;
 }
 
+/* Removed blocks are left in the physics list until it is next taken, unless
+ * they outnumber the active blocks by this many */
+#define PHYSICS_LIST_SLACK 4096
+
+static inline bool physics_active_test(const struct level_t *level, unsigned index)
+{
+	return (level->physics_active[index >> 6] >> (index & 63)) & 1;
+}
+
+/* Add a block to the physics list, unless it is already there. The caller
+ * must hold physics_mutex, or own the level as when loading. */
+static void physics_list_set(struct level_t *level, unsigned index)
+{
+	if (physics_active_test(level, index)) return;
+
+	level->physics_active[index >> 6] |= 1ULL << (index & 63);
+	level->physics_active_count++;
+	physics_list_add(&level->physics, index);
+}
+
+/* Drop removed blocks from the physics list. A block that was removed and
+ * added again is in the list twice, so only its first entry is kept. */
+static void physics_list_compact(struct level_t *level)
+{
+	struct physics_list_t *list = &level->physics;
+	size_t i, used = 0;
+
+	for (i = 0; i < list->used; i++)
+	{
+		unsigned index = list->items[i];
+		if (!physics_active_test(level, index)) continue;
+
+		level->physics_active[index >> 6] &= ~(1ULL << (index & 63));
+		list->items[used++] = index;
+	}
+
+	list->used = used;
+
+	for (i = 0; i < list->used; i++)
+	{
+		unsigned index = list->items[i];
+		level->physics_active[index >> 6] |= 1ULL << (index & 63);
+	}
+}
+
+static void physics_list_clear(struct level_t *level, unsigned index)
+{
+	if (!physics_active_test(level, index)) return;
+
+	level->physics_active[index >> 6] &= ~(1ULL << (index & 63));
+	level->physics_active_count--;
+
+	if (level->physics.used > level->physics_active_count * 2 + PHYSICS_LIST_SLACK) physics_list_compact(level);
+}
+
+/* Move the active blocks into physics2 for a run, leaving the physics list
+ * empty. If the active blocks are dense, they are found by scanning the map,
+ * which is cheaper than the list and gives them in index order. */
+static void physics_list_take(struct level_t *level)
+{
+	struct physics_list_t *list = &level->physics;
+	struct physics_list_t *run = &level->physics2;
+	size_t volume = (size_t)level->x * level->y * level->z;
+	size_t i;
+
+	run->used = 0;
+
+	if (run->size < level->physics_active_count)
+	{
+		unsigned *items = realloc(run->items, sizeof *items * level->physics_active_count);
+		if (items != NULL)
+		{
+			run->items = items;
+			run->size = level->physics_active_count;
+		}
+	}
+
+	if (level->physics_active_count * 64 >= volume)
+	{
+		size_t words = (volume + 63) / 64;
+		for (i = 0; i < words; i++)
+		{
+			uint64_t w = level->physics_active[i];
+			if (w == 0) continue;
+
+			level->physics_active[i] = 0;
+			while (w != 0)
+			{
+				physics_list_add(run, i * 64 + __builtin_ctzll(w));
+				w &= w - 1;
+			}
+		}
+	}
+	else
+	{
+		for (i = 0; i < list->used; i++)
+		{
+			unsigned index = list->items[i];
+			if (!physics_active_test(level, index)) continue;
+
+			level->physics_active[index >> 6] &= ~(1ULL << (index & 63));
+			physics_list_add(run, index);
+		}
+	}
+
+	list->used = 0;
+	level->physics_active_count = 0;
+}
+
+#if defined(LEVEL_SOA)
+static void level_blocks_free(struct level_t *level)
+{
+	free(level->block_types);
+	free(level->block_data);
+	free(level->block_owners);
+	free(level->block_fixed);
+	free(level->block_physics);
+	free(level->block_touched);
+	level->block_types = NULL;
+	level->block_data = NULL;
+	level->block_owners = NULL;
+	level->block_fixed = NULL;
+	level->block_physics = NULL;
+	level->block_touched = NULL;
+}
+
+static bool level_blocks_alloc(struct level_t *level)
+{
+	size_t count = level->x * level->y * level->z;
+	size_t words = (count + 63) / 64;
+
+	level->block_types = calloc(count, sizeof *level->block_types);
+	level->block_data = calloc(count, sizeof *level->block_data);
+	level->block_owners = calloc(count, sizeof *level->block_owners);
+	level->block_fixed = calloc(words, sizeof *level->block_fixed);
+	level->block_physics = calloc(words, sizeof *level->block_physics);
+	level->block_touched = calloc(words, sizeof *level->block_touched);
+
+	if (level->block_types == NULL || level->block_data == NULL || level->block_owners == NULL ||
+	    level->block_fixed == NULL || level->block_physics == NULL || level->block_touched == NULL)
+	{
+		level_blocks_free(level);
+		return false;
+	}
+
+	return true;
+}
+
+void level_blocks_clear(struct level_t *level)
+{
+	size_t count = level->x * level->y * level->z;
+	size_t words = (count + 63) / 64;
+
+	memset(level->block_types, 0, count * sizeof *level->block_types);
+	memset(level->block_data, 0, count * sizeof *level->block_data);
+	memset(level->block_owners, 0, count * sizeof *level->block_owners);
+	memset(level->block_fixed, 0, words * sizeof *level->block_fixed);
+	memset(level->block_physics, 0, words * sizeof *level->block_physics);
+	memset(level->block_touched, 0, words * sizeof *level->block_touched);
+}
+
+#elif defined(LEVEL_CHUNKED)
+static void level_blocks_free(struct level_t *level)
+{
+	level_chunks_free(&level->chunks);
+}
+
+static bool level_blocks_alloc(struct level_t *level)
+{
+	return level_chunks_alloc(&level->chunks, level_region_count(level), level->x * level->y * level->z);
+}
+
+void level_blocks_clear(struct level_t *level)
+{
+	level_chunks_clear(&level->chunks, level->x * level->y * level->z);
+}
+
+/* Collapse chunks once a level is loaded or generated, and when saved */
+static void level_blocks_compact(struct level_t *level)
+{
+	level_chunks_compact(&level->chunks);
+
+	unsigned uniform;
+	size_t bytes = level_chunks_memory(&level->chunks, &uniform);
+	LOG("Level '%s' blocks use %zu KiB, %u of %u chunks uniform\n", level->name, bytes / 1024, uniform, level->chunks.count);
+}
+
+static void level_blocks_reclaim(struct level_t *level)
+{
+	level_chunks_reclaim(&level->chunks);
+}
+#else
+static void level_blocks_free(struct level_t *level)
+{
+	free(level->blocks);
+	level->blocks = NULL;
+}
+
+static bool level_blocks_alloc(struct level_t *level)
+{
+	level->blocks = calloc(level->x * level->y * level->z, sizeof *level->blocks);
+	return level->blocks != NULL;
+}
+
+void level_blocks_clear(struct level_t *level)
+{
+	memset(level->blocks, 0, sizeof *level->blocks * level->x * level->y * level->z);
+}
+
+static bool level_blocks_read(gzFile gz, struct level_t *l, unsigned index, unsigned count)
+{
+	int len = count * sizeof *l->blocks;
+	return gzread(gz, &l->blocks[index], len) == len;
+}
+
+static void level_blocks_write(gzFile gz, const struct level_t *l, unsigned index, unsigned count)
+{
+	gzwrite(gz, &l->blocks[index], count * sizeof *l->blocks);
+}
+#endif
+
+#ifndef LEVEL_CHUNKED
+static void level_blocks_compact(struct level_t *level)
+{
+}
+
+static void level_blocks_reclaim(struct level_t *level)
+{
+}
+#endif
+
+#if defined(LEVEL_SOA) || defined(LEVEL_CHUNKED)
+/* Saved levels hold blocks as struct block_t, so runs of blocks are packed
+ * into and out of that form a buffer at a time */
+#define LEVEL_BLOCKS_IO 4096
+
+static bool level_blocks_read(gzFile gz, struct level_t *l, unsigned index, unsigned count)
+{
+	struct block_t buf[LEVEL_BLOCKS_IO];
+
+	while (count > 0)
+	{
+		unsigned n = count < LEVEL_BLOCKS_IO ? count : LEVEL_BLOCKS_IO;
+		int len = n * sizeof *buf;
+		if (gzread(gz, buf, len) != len) return false;
+
+		unsigned i;
+		for (i = 0; i < n; i++)
+		{
+			if (!level_block_put(l, index + i, &buf[i])) return false;
+		}
+
+		index += n;
+		count -= n;
+	}
+
+	return true;
+}
+
+static void level_blocks_write(gzFile gz, const struct level_t *l, unsigned index, unsigned count)
+{
+	struct block_t buf[LEVEL_BLOCKS_IO];
+
+	while (count > 0)
+	{
+		unsigned n = count < LEVEL_BLOCKS_IO ? count : LEVEL_BLOCKS_IO;
+
+		unsigned i;
+		for (i = 0; i < n; i++)
+		{
+			buf[i] = level_block_get(l, index + i);
+		}
+		gzwrite(gz, buf, n * sizeof *buf);
+
+		index += n;
+		count -= n;
+	}
+}
+#endif
+
 bool level_init(struct level_t *level, int16_t x, int16_t y, int16_t z, const char *name, bool zero)
 {
 	if (zero)
@@ -45,6 +346,7 @@ bool level_init(struct level_t *level, int16_t x, int16_t y, int16_t z, const ch
 		pthread_mutex_init(&level->inuse_mutex, NULL);
 		pthread_mutex_init(&level->hook_mutex, NULL);
 		pthread_mutex_init(&level->physics_mutex, NULL);
+		pthread_mutex_init(&level->snapshot_mutex, NULL);
 	}
 
 	if (name != NULL)
@@ -56,10 +358,36 @@ bool level_init(struct level_t *level, int16_t x, int16_t y, int16_t z, const ch
 	level->y = y;
 	level->z = z;
 
-	level->blocks = calloc(x * y * z, sizeof *level->blocks);
-	if (level->blocks == NULL)
+	if (!level_blocks_alloc(level))
+	{
+		LOG("level_init: allocation of %zu bytes failed\n", x * y * z * sizeof (struct block_t));
+		return false;
+	}
+
+	level->dirty = calloc((level_region_count(level) + 7) / 8, 1);
+	level->region_generation = calloc(level_region_count(level), sizeof *level->region_generation);
+	if (level->dirty == NULL || level->region_generation == NULL)
+	{
+		LOG("level_init: allocation of dirty region map failed\n");
+		free(level->dirty);
+		free(level->region_generation);
+		level->dirty = NULL;
+		level->region_generation = NULL;
+		level_blocks_free(level);
+		return false;
+	}
+
+	level->physics_active = calloc((x * y * z + 63) / 64, sizeof *level->physics_active);
+	if (level->physics_active == NULL || !level_grid_init(level))
 	{
-		LOG("level_init: allocation of %zu bytes failed\n", x * y * z * sizeof *level->blocks);
+		LOG("level_init: allocation of physics map failed\n");
+		free(level->physics_active);
+		level->physics_active = NULL;
+		free(level->dirty);
+		free(level->region_generation);
+		level->dirty = NULL;
+		level->region_generation = NULL;
+		level_blocks_free(level);
 		return false;
 	}
 
@@ -84,12 +412,13 @@ void level_notify_all(struct level_t *level, const char *message)
 
 void level_set_block(struct level_t *level, struct block_t *block, unsigned index)
 {
-	level->blocks[index] = *block;
+	if (!level_block_put(level, index, block)) return;
+	level_block_changed(level, index);
 }
 
 void level_set_block_if(struct level_t *level, struct block_t *block, unsigned index, enum blocktype_t type)
 {
-	if (level->blocks[index].type == type)
+	if (level_block_type(level, index) == type)
 	{
 		level_set_block(level, block, index);
 	}
@@ -191,10 +520,7 @@ bool level_send(struct client_t *c)
 		c->player->new_level = newlevel;
 	}
 
-	unsigned length = newlevel->x * newlevel->y * newlevel->z;
-	unsigned x;
 	int i;
-	z_stream z;
 
 	/* If we can't lock the mutex then the thread is already locked */
 	if (pthread_mutex_trylock(&newlevel->mutex))
@@ -216,6 +542,20 @@ bool level_send(struct client_t *c)
 		return false;
 	}
 
+	c->sending_level = true;
+
+	/* Players with a filter get their own copy, everyone else shares the
+	 * level's cached snapshot */
+	struct level_snapshot_t *snapshot = level_snapshot_get(newlevel, c->player->filter);
+	if (snapshot == NULL)
+	{
+		LOG("level_send: Unable to create snapshot of %s\n", newlevel->name);
+		c->sending_level = false;
+		return false;
+	}
+
+	pthread_mutex_lock(&s_level_send_mutex);
+
 	int levelid;
 	if (oldlevel == newlevel)
 	{
@@ -226,49 +566,16 @@ bool level_send(struct client_t *c)
 		levelid = level_get_new_id(newlevel, c);
 		if (levelid == -1)
 		{
+			pthread_mutex_unlock(&s_level_send_mutex);
+			level_snapshot_release(snapshot);
 			c->waiting_for_level = false;
+			c->sending_level = false;
 			c->player->new_level = oldlevel;
 			client_notify(c, "Uh, level is full, sorry...");
 			return false;
 		}
 	}
 
-	memset(&z, 0, sizeof z);
-	if (deflateInit2(&z, 5, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY) != Z_OK)
-	{
-		LOG("level_send: deflateInit2() failed\n");
-		return false;
-	}
-
-	uint8_t *buffer = malloc(4 + length);
-	if (buffer == NULL)
-	{
-		LOG("level_send: Unable to allocate %u bytes\n", 4 + length);
-		deflateEnd(&z);
-		return false;
-	}
-
-	c->sending_level = true;
-
-	uint8_t *bufp = buffer;
-	*bufp++ = (length >> 24) & 0xFF;
-	*bufp++ = (length >> 16) & 0xFF;
-	*bufp++ = (length >>  8) & 0xFF;
-	*bufp++ =  length	& 0xFF;
-
-	/* Serialize map data */
-	for (x = 0; x < length; x++)
-	{
-		if (c->player->filter > 0)
-		{
-			*bufp++ = (newlevel->blocks[x].owner == c->player->filter) ? convert(newlevel, x, &newlevel->blocks[x]) : AIR;
-		}
-		else
-		{
-			*bufp++ = convert(newlevel, x, &newlevel->blocks[x]);
-		}
-	}
-
 	if (oldlevel != NULL)
 	{
 		if (oldlevel != newlevel)
@@ -280,6 +587,7 @@ bool level_send(struct client_t *c)
 			/* Despawn this user for all users */
 			if (!c->hidden) client_send_despawn(c->player->client, false);
 			oldlevel->clients[c->player->levelid] = NULL;
+			level_grid_player_remove(oldlevel, c->player->levelid);
 
 			if (!c->hidden)
 			{
@@ -300,7 +608,7 @@ bool level_send(struct client_t *c)
 		{
 			if (oldlevel->npcs[i] != NULL)
 			{
-				client_add_packet(c, packet_send_despawn_player(MAX_CLIENTS_PER_LEVEL + i));
+				packet_send_despawn_player(c, MAX_CLIENTS_PER_LEVEL + i);
 			}
 		}
 	}
@@ -308,51 +616,25 @@ bool level_send(struct client_t *c)
 	c->player->level = newlevel;
 	c->player->levelid = levelid;
 
-	client_add_packet(c, packet_send_level_initialize());
-
-	uint8_t outbuf[1024];
-	length += 4;
-
-	z.next_in = buffer;
-	z.avail_in = length;
-
-	do
-	{
-		z.next_out = outbuf;
-		z.avail_out = sizeof outbuf;
-
-		int r = deflate(&z, Z_FINISH);
-		unsigned n = sizeof outbuf - z.avail_out;
-		if (n != 0)
-		{
-			client_add_packet(c, packet_send_level_data_chunk(n, outbuf, (length - z.avail_in) * 100 / length));
-		}
-
-		if (r == Z_STREAM_END) break;
-		if (r != Z_OK)
-		{
-			free(buffer);
-			return false;
-		}
-	}
-	while (z.avail_in > 0 || z.avail_out == 0);
-
-	free(buffer);
+	packet_send_level_initialize(c);
 
-	deflateEnd(&z);
+	client_add_packet(c, snapshot->data, snapshot->length);
+	level_snapshot_release(snapshot);
 
-	client_add_packet(c, packet_send_level_finalize(newlevel->x, newlevel->y, newlevel->z));
+	packet_send_level_finalize(c, newlevel->x, newlevel->y, newlevel->z);
 
 	if (oldlevel != newlevel)
 	{
 		c->player->pos = newlevel->spawn;
 		c->player->lastpos = newlevel->spawn;
 		c->player->teleport = true;
+		c->player->synced = 0;
+		level_grid_player_move(newlevel, levelid, &newlevel->spawn);
 		call_level_hook(EVENT_SPAWN, newlevel, c, (void*)c->player->hook_data);
 		c->player->hook_data = NULL;
 	}
 
-	client_add_packet(c, packet_send_spawn_player(0xFF, c->player->username, &c->player->pos));
+	packet_send_spawn_player(c, 0xFF, c->player->username, &c->player->pos);
 
 	client_spawn_players(c);
 
@@ -360,7 +642,7 @@ bool level_send(struct client_t *c)
 	{
 		if (newlevel->npcs[i] != NULL)
 		{
-			client_add_packet(c, packet_send_spawn_player(MAX_CLIENTS_PER_LEVEL + i, newlevel->npcs[i]->name, &newlevel->npcs[i]->pos));
+			packet_send_spawn_player(c, MAX_CLIENTS_PER_LEVEL + i, newlevel->npcs[i]->name, &newlevel->npcs[i]->pos);
 		}
 	}
 
@@ -372,6 +654,8 @@ bool level_send(struct client_t *c)
 		}
 	}
 
+	pthread_mutex_unlock(&s_level_send_mutex);
+
 	c->waiting_for_level = false;
 	c->sending_level = false;
 
@@ -396,7 +680,7 @@ void *level_gen_thread(struct level_t *level, const char *type)
 
 	memset(&block, 0, sizeof block);
 
-	memset(level->blocks, 0, sizeof *level->blocks * mx * my * mz);
+	level_blocks_clear(level);
 
 	if (!strcmp(type, "flat") || !strcmp(type, "adminium"))
 	{
@@ -593,14 +877,14 @@ void *level_gen_thread(struct level_t *level, const char *type)
 					for (y = my / 2 - 1; y > 1; y--)
 					{
 						unsigned index = level_get_index(level, x, y, z);
-						if (y > my / 2 - 3 && level->blocks[index].type == AIR)
+						if (y > my / 2 - 3 && level_block_type(level, index) == AIR)
 						{
 							if (x == 0 || x == mx - 1 || z == 0 || z == mz - 1)
 							{
 								level_set_block(level, &block, index);
 							}
 						}
-						else if (level->blocks[index].type == WATER)
+						else if (level_block_type(level, index) == WATER)
 						{
 							level_set_block_if(level, &block, level_get_index(level, x, y - 1, z), AIR);
 							if (x > 0) level_set_block_if(level, &block, level_get_index(level, x - 1, y, z), AIR);
@@ -623,12 +907,12 @@ void *level_gen_thread(struct level_t *level, const char *type)
 				for (y = my - 1; y > 0; y--)
 				{
 					unsigned index = level_get_index(level, x, y, z);
-					if (level->blocks[index].type == DIRT)
+					if (level_block_type(level, index) == DIRT)
 					{
-						level->blocks[index].type = GRASS;
+						level_block_set_type(level, index, GRASS);
 						break;
 					}
-					if (level->blocks[index].type != AIR) break;
+					if (level_block_type(level, index) != AIR) break;
 				}
 			}
 		}
@@ -645,7 +929,7 @@ void *level_gen_thread(struct level_t *level, const char *type)
 	for (y = my - 5; y > 0; y--)
 	{
 		unsigned index = level_get_index(level, mx / 2, y, mz / 2);
-		if (level->blocks[index].type != AIR)
+		if (level_block_type(level, index) != AIR)
 		{
 			level->spawn.y = (y + 4) * 32;
 			break;
@@ -688,33 +972,29 @@ void *level_gen_thread(struct level_t *level, const char *type)
 		level_set_block(level, &block, level_get_index(level, x, y, z));
 	}*/
 
-	level->physics.used = 0;
-
 	LOG("levelgen: activating physics\n");
 
-	/* Activate physics */
-	int count = mx * my * mz;
-	for (i = 0; i < count; i++)
-	{
-		struct block_t *b = &level->blocks[i];
-		b->physics = blocktype_has_physics(b->type);
-		if (b->physics) physics_list_add(&level->physics, i);
-	}
+	level_activate_physics(level);
 
-	LOG("levelgen: %llu physics blocks, prerunning\n", (long long unsigned)level->physics.used);
+	LOG("levelgen: %llu physics blocks, prerunning\n", (long long unsigned)level->physics_active_count);
 
 	level_prerun(level);
 
-	LOG("levelgen: %llu physics blocks remaining\n", (long long unsigned)level->physics.used);
+	LOG("levelgen: %llu physics blocks remaining\n", (long long unsigned)level->physics_active_count);
+
+	level_blocks_compact(level);
 
 	LOG("levelgen: complete\n");
 
 	level->changed = true;
+	level_blocks_replaced(level);
+	level->save_stamp = 0;
 
 	snprintf(buf, sizeof buf, "Created level '%s'", level->name);
 	net_notify_ops(buf);
 
 	pthread_mutex_unlock(&level->mutex);
+	level_send_wake(level);
 
 	for (i = 0; i < MAX_CLIENTS_PER_LEVEL; i++)
 	{
@@ -734,6 +1014,7 @@ level_error:
 	LOG(buf);
 
 	pthread_mutex_unlock(&level->mutex);
+	level_send_wake(level);
 
 	return NULL;
 }
@@ -762,6 +1043,7 @@ void level_unload(struct level_t *level)
 	physics_list_free(&level->physics);
 	physics_list_free(&level->physics2);
 	block_update_list_free(&level->updates);
+	block_update_map_free(&level->updates_map);
 
 	undodb_close(level->undo);
 
@@ -772,20 +1054,43 @@ void level_unload(struct level_t *level)
 		lcase(filename);
 		unlink(filename);
 
+		snprintf(filename, sizeof filename, "levels/%s.mcd", level->name);
+		lcase(filename);
+		unlink(filename);
+
 		snprintf(filename, sizeof filename, "undo/%s.db", level->name);
 		lcase(filename);
 		unlink(filename);
 
+		undojournal_delete(level->name);
+
 		LOG("Level '%s' deleted\n", level->name);
 	}
 
 	int i;
+	pthread_mutex_lock(&level->hook_mutex);
 	for (i = 0; i < MAX_HOOKS_PER_LEVEL; i++)
 	{
+		/* Let attached hooks release anything tied to the level */
+		if (level->level_hook[i].func != NULL)
+		{
+			level->level_hook[i].func(EVENT_DEINIT, level, NULL, NULL, &level->level_hook[i].data);
+			level->level_hook[i].func = NULL;
+		}
 		free(level->level_hook[i].data.data);
 	}
+	pthread_mutex_unlock(&level->hook_mutex);
 
-	free(level->blocks);
+	level_blocks_free(level);
+	free(level->dirty);
+	free(level->region_generation);
+	astar_cache_free(level);
+	hpa_free(level);
+	level_grid_free(level);
+	free(level->physics_active);
+	free(level->profile);
+
+	level_snapshot_clear(level);
 
 	pthread_mutex_unlock(&level->mutex);
 
@@ -814,10 +1119,152 @@ static void *level_load_thread_abort(struct level_t *level, const char *reason)
 	}
 
 	pthread_mutex_unlock(&level->mutex);
+	level_send_wake(level);
 
 	return NULL;
 }
 
+static void level_region_bounds(const struct level_t *l, unsigned r, unsigned *x1, unsigned *y1, unsigned *z1, unsigned *x2, unsigned *y2, unsigned *z2)
+{
+	unsigned rx = level_regions_x(l);
+	unsigned rz = level_regions_z(l);
+
+	*x1 = (r % rx) << LEVEL_REGION_BITS;
+	*z1 = (r / rx % rz) << LEVEL_REGION_BITS;
+	*y1 = (r / rx / rz) << LEVEL_REGION_BITS;
+	*x2 = (*x1 + LEVEL_REGION_SIZE < (unsigned)l->x) ? *x1 + LEVEL_REGION_SIZE : (unsigned)l->x;
+	*y2 = (*y1 + LEVEL_REGION_SIZE < (unsigned)l->y) ? *y1 + LEVEL_REGION_SIZE : (unsigned)l->y;
+	*z2 = (*z1 + LEVEL_REGION_SIZE < (unsigned)l->z) ? *z1 + LEVEL_REGION_SIZE : (unsigned)l->z;
+}
+
+/* Read the metadata written by level_save_meta() from a delta record,
+ * replacing what is currently loaded. Hooks are attached by the caller. */
+static bool level_load_meta(gzFile gz, struct level_t *l)
+{
+	unsigned i, n, u;
+
+	if (gzread(gz, &l->spawn, sizeof l->spawn) != sizeof l->spawn) return false;
+	if (gzread(gz, &l->owner, sizeof l->owner) != sizeof l->owner) return false;
+	if (gzread(gz, &l->rankvisit, sizeof l->rankvisit) != sizeof l->rankvisit) return false;
+	if (gzread(gz, &l->rankbuild, sizeof l->rankbuild) != sizeof l->rankbuild) return false;
+	if (gzread(gz, &l->rankown, sizeof l->rankown) != sizeof l->rankown) return false;
+
+	struct user_list_t *lists[] = { &l->uservisit, &l->userbuild, &l->userown };
+	unsigned j;
+	for (j = 0; j < 3; j++)
+	{
+		lists[j]->used = 0;
+		if (gzread(gz, &n, sizeof n) != sizeof n) return false;
+		for (i = 0; i < n; i++)
+		{
+			if (gzread(gz, &u, sizeof u) != sizeof u) return false;
+			user_list_add(lists[j], u);
+		}
+	}
+
+	if (gzread(gz, &n, sizeof n) != sizeof n || n > MAX_HOOKS_PER_LEVEL) return false;
+	for (i = 0; i < n; i++)
+	{
+		struct level_hooks_t *h = &l->level_hook[i];
+
+		free(h->data.data);
+		h->data.data = NULL;
+		h->data.size = 0;
+
+		if (gzread(gz, h->name, sizeof h->name) != sizeof h->name) return false;
+		if (gzread(gz, &h->data.size, sizeof h->data.size) != sizeof h->data.size) return false;
+		if (h->data.size == 0) continue;
+
+		h->data.data = malloc(h->data.size);
+		if (h->data.data == NULL || gzread(gz, h->data.data, h->data.size) != (int)h->data.size)
+		{
+			h->data.size = 0;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool level_load_delta_record(gzFile gz, struct level_t *l)
+{
+	unsigned n, i, r, end;
+
+	if (gzread(gz, &n, sizeof n) != sizeof n) return false;
+
+	for (i = 0; i < n; i++)
+	{
+		if (gzread(gz, &r, sizeof r) != sizeof r || r >= level_region_count(l)) return false;
+
+		unsigned x1, y1, z1, x2, y2, z2;
+		level_region_bounds(l, r, &x1, &y1, &z1, &x2, &y2, &z2);
+		unsigned y, z;
+
+		for (y = y1; y < y2; y++)
+		{
+			for (z = z1; z < z2; z++)
+			{
+				if (!level_blocks_read(gz, l, level_get_index(l, x1, y, z), x2 - x1)) return false;
+				l->delta_bytes += (x2 - x1) * sizeof (struct block_t);
+			}
+		}
+	}
+
+	if (!level_load_meta(gz, l)) return false;
+	if (gzread(gz, &end, sizeof end) != sizeof end || end != TAG_MCLE) return false;
+
+	return true;
+}
+
+/* Replay the delta journal of a level on top of its last full save. If the
+ * journal is missing, stale or damaged the next save is a full one. */
+static void level_load_delta(struct level_t *l)
+{
+	char filename[64];
+	snprintf(filename, sizeof filename, "levels/%s.mcd", l->name);
+	lcase(filename);
+
+	gzFile gz = gzopen(filename, "rb");
+	if (gz == NULL)
+	{
+		l->save_stamp = 0;
+		return;
+	}
+
+	unsigned header, version, stamp;
+	if (gzread(gz, &header, sizeof header) != sizeof header || header != TAG_MCLD ||
+	    gzread(gz, &version, sizeof version) != sizeof version || version != 1 ||
+	    gzread(gz, &stamp, sizeof stamp) != sizeof stamp || stamp != l->save_stamp)
+	{
+		LOG("Ignoring stale delta journal for level '%s'\n", l->name);
+		gzclose(gz);
+		l->save_stamp = 0;
+		return;
+	}
+
+	unsigned tag;
+	while (gzread(gz, &tag, sizeof tag) == sizeof tag)
+	{
+		if (tag != TAG_MCLR || !level_load_delta_record(gz, l))
+		{
+			LOG("Delta journal for level '%s' damaged after %u records\n", l->name, l->delta_records);
+			l->save_stamp = 0;
+			break;
+		}
+
+		l->delta_records++;
+	}
+
+	gzclose(gz);
+
+	l->changed = l->save_stamp == 0;
+
+	if (l->delta_records > 0)
+	{
+		LOG("Applied %u delta records to level '%s'\n", l->delta_records, l->name);
+	}
+}
+
 void *level_load_thread(void *arg)
 {
 	int i;
@@ -891,7 +1338,12 @@ void *level_load_thread(void *arg)
 
 		for (i = 0; i < s; i++)
 		{
-			l->blocks[i] = block_convert_from_mcs(blocks[i]);
+			struct block_t b = block_convert_from_mcs(blocks[i]);
+			if (!level_block_put(l, i, &b))
+			{
+				free(blocks);
+				return level_load_thread_abort(l, "blocks");
+			}
 		}
 
 		free(blocks);
@@ -899,11 +1351,12 @@ void *level_load_thread(void *arg)
 		int count = l->x * l->y * l->z;
 		for (i = 0; i < count; i++)
 		{
-			struct block_t *b = &l->blocks[i];
-			b->touched = 0;
-			if (b->type == AIR || b->type == WATER || b->type == LAVA) continue;
-			b->physics = blocktype_has_physics(b->type);
-			if (b->physics) physics_list_add(&l->physics, i);
+			enum blocktype_t type = level_block_type(l, i);
+			level_block_set_touched(l, i, false);
+			if (type == AIR || type == WATER || type == LAVA) continue;
+			bool physics = blocktype_has_physics(type);
+			level_block_set_physics(l, i, physics);
+			if (physics) physics_list_set(l, i);
 		}
 	}
 	else
@@ -913,6 +1366,9 @@ void *level_load_thread(void *arg)
 		if (header != TAG_MCLV) return level_load_thread_abort(l, "invalid header");
 		if (gzread(gz, &version, sizeof version) != sizeof version) return level_load_thread_abort(l, "version");
 
+		unsigned stamp = 0;
+		if (version >= 7 && gzread(gz, &stamp, sizeof stamp) != sizeof stamp) return level_load_thread_abort(l, "stamp");
+
 		if (version < 2)
 		{
 			unsigned x, y, z;
@@ -932,8 +1388,7 @@ void *level_load_thread(void *arg)
 
 		if (gzread(gz, &l->spawn, sizeof l->spawn) != sizeof l->spawn) return level_load_thread_abort(l, "spawn");
 
-		int s = sizeof *l->blocks * l->x * l->y * l->z;
-		if (gzread(gz, l->blocks, s) != s) return level_load_thread_abort(l, "blocks");
+		if (!level_blocks_read(gz, l, 0, l->x * l->y * l->z)) return level_load_thread_abort(l, "blocks");
 
 		if (version == 0)
 		{
@@ -1011,28 +1466,37 @@ void *level_load_thread(void *arg)
 					l->level_hook[i].data.data = malloc(l->level_hook[i].data.size);
 				}
 				gzread(gz, l->level_hook[i].data.data, l->level_hook[i].data.size);
+			}
+		}
 
-				if (*l->level_hook[i].name != '\0')
-				{
-					level_hook_attach(l, l->level_hook[i].name);
-				}
+		/* Apply changes saved since the last full save */
+		l->save_stamp = stamp;
+		if (stamp != 0) level_load_delta(l);
+
+		for (i = 0; i < MAX_HOOKS_PER_LEVEL; i++)
+		{
+			if (*l->level_hook[i].name != '\0')
+			{
+				level_hook_attach(l, l->level_hook[i].name);
 			}
 		}
 
 		int count = l->x * l->y * l->z;
 		for (i = 0; i < count; i++)
 		{
-			struct block_t *b = &l->blocks[i];
-			b->touched = 0;
-			if (b->physics) physics_list_add(&l->physics, i);
+			level_block_set_touched(l, i, false);
+			if (level_block_physics(l, i)) physics_list_set(l, i);
 		}
 	}
 
 	gzclose(gz);
 
+	level_blocks_compact(l);
+
 	LOG("Level '%s' loaded\n", l->name);
 
 	pthread_mutex_unlock(&l->mutex);
+	level_send_wake(l);
 
 	return NULL;
 }
@@ -1063,6 +1527,7 @@ bool level_load(const char *name, struct level_t **levelp)
 	pthread_mutex_init(&level->inuse_mutex, NULL);
 	pthread_mutex_init(&level->hook_mutex, NULL);
 	pthread_mutex_init(&level->physics_mutex, NULL);
+	pthread_mutex_init(&level->snapshot_mutex, NULL);
 
 	level_list_add(&s_levels, level);
 	if (levelp != NULL) *levelp = level;
@@ -1076,6 +1541,132 @@ bool level_load(const char *name, struct level_t **levelp)
 	return true;
 }
 
+/* Metadata following the block data, in the format shared by full saves and
+ * delta records */
+static void level_save_meta(gzFile gz, const struct level_t *l)
+{
+	gzwrite(gz, &l->owner, sizeof l->owner);
+	gzwrite(gz, &l->rankvisit, sizeof l->rankvisit);
+	gzwrite(gz, &l->rankbuild, sizeof l->rankbuild);
+	gzwrite(gz, &l->rankown, sizeof l->rankown);
+
+	unsigned i;
+	i = l->uservisit.used;
+	gzwrite(gz, &i, sizeof i);
+	for (i = 0; i < l->uservisit.used; i++)
+	{
+		gzwrite(gz, &l->uservisit.items[i], sizeof l->uservisit.items[i]);
+	}
+
+	i = l->userbuild.used;
+	gzwrite(gz, &i, sizeof i);
+	for (i = 0; i < l->userbuild.used; i++)
+	{
+		gzwrite(gz, &l->userbuild.items[i], sizeof l->userbuild.items[i]);
+	}
+
+	i = l->userown.used;
+	gzwrite(gz, &i, sizeof i);
+	for (i = 0; i < l->userown.used; i++)
+	{
+		gzwrite(gz, &l->userown.items[i], sizeof l->userown.items[i]);
+	}
+
+	i = MAX_HOOKS_PER_LEVEL;
+	gzwrite(gz, &i, sizeof i);
+	for (i = 0; i < MAX_HOOKS_PER_LEVEL; i++)
+	{
+		gzwrite(gz, l->level_hook[i].name, sizeof l->level_hook[i].name);
+		gzwrite(gz, &l->level_hook[i].data.size, sizeof l->level_hook[i].data.size);
+		gzwrite(gz, l->level_hook[i].data.data, l->level_hook[i].data.size);
+	}
+}
+
+/* Append the regions changed since the last save to the level's delta
+ * journal. Returns false if a full save should be done instead, either
+ * because the journal is due for compaction or it couldn't be written. */
+static bool level_save_delta(struct level_t *l)
+{
+	unsigned count = level_region_count(l);
+	unsigned *regions = malloc(sizeof *regions * count);
+	unsigned n = 0, r;
+	size_t bytes = 0;
+
+	if (regions == NULL) return false;
+
+	/* Clear each bit before its region is written out, so changes made
+	 * during the save are caught next time. */
+	for (r = 0; r < count; r++)
+	{
+		uint8_t bit = 1 << (r & 7);
+		if ((__sync_fetch_and_and(&l->dirty[r >> 3], ~bit) & bit) == 0) continue;
+
+		unsigned x1, y1, z1, x2, y2, z2;
+		level_region_bounds(l, r, &x1, &y1, &z1, &x2, &y2, &z2);
+
+		regions[n++] = r;
+		bytes += (x2 - x1) * (y2 - y1) * (z2 - z1) * sizeof (struct block_t);
+	}
+
+	size_t total = sizeof (struct block_t) * l->x * l->y * l->z;
+	if (l->save_stamp == 0 || l->delta_records >= LEVEL_DELTA_MAX_RECORDS ||
+	    l->delta_bytes + bytes > total / LEVEL_DELTA_MAX_FRACTION ||
+	    level_backup_due(l->backup_time))
+	{
+		free(regions);
+		return false;
+	}
+
+	char filename[256];
+	snprintf(filename, sizeof filename, "levels/%s.mcd", l->name);
+	lcase(filename);
+
+	/* Each record is a separate gzip member appended to the journal */
+	gzFile gz = gzopen(filename, "ab");
+	if (gz == NULL)
+	{
+		free(regions);
+		return false;
+	}
+
+	unsigned tag = TAG_MCLR;
+	gzwrite(gz, &tag, sizeof tag);
+	gzwrite(gz, &n, sizeof n);
+
+	unsigned i;
+	for (i = 0; i < n; i++)
+	{
+		unsigned x1, y1, z1, x2, y2, z2, y, z;
+		level_region_bounds(l, regions[i], &x1, &y1, &z1, &x2, &y2, &z2);
+
+		gzwrite(gz, &regions[i], sizeof regions[i]);
+		for (y = y1; y < y2; y++)
+		{
+			for (z = z1; z < z2; z++)
+			{
+				level_blocks_write(gz, l, level_get_index(l, x1, y, z), x2 - x1);
+			}
+		}
+	}
+
+	gzwrite(gz, &l->spawn, sizeof l->spawn);
+	level_save_meta(gz, l);
+
+	tag = TAG_MCLE;
+	gzwrite(gz, &tag, sizeof tag);
+
+	free(regions);
+
+	if (gzclose(gz) != Z_OK) return false;
+
+	l->delta_records++;
+	l->delta_bytes += bytes;
+
+	LOG("Level '%s' saved %u changed regions (%u/%u delta records)\n", l->name, n, l->delta_records, LEVEL_DELTA_MAX_RECORDS);
+
+	return true;
+}
+
 void *level_save_thread(void *arg)
 {
 	struct level_t *l = arg;
@@ -1086,76 +1677,79 @@ void *level_save_thread(void *arg)
 
 	call_level_hook(EVENT_SAVE, l, NULL, NULL);
 
+	if (level_save_delta(l))
+	{
+		pthread_mutex_unlock(&l->mutex);
+		level_send_wake(l);
+		level_inuse(l, false);
+		return NULL;
+	}
+
 	char filenametmp[256];
 	snprintf(filenametmp, sizeof filenametmp, "levels/%s.mcl.tmp", l->name);
 	lcase(filenametmp);
 
+	char deltatmp[256];
+	snprintf(deltatmp, sizeof deltatmp, "levels/%s.mcd.tmp", l->name);
+	lcase(deltatmp);
+
 	gzFile gz = gzopen(filenametmp, "wb");
 	if (gz == NULL)
 	{
+		l->changed = true;
 		pthread_mutex_unlock(&l->mutex);
+		level_send_wake(l);
 		level_inuse(l, false);
 		return NULL;
 	}
 
 	LOG("Saving level '%s'\n", l->name);
 
+	/* A new stamp invalidates any existing delta journal */
+	unsigned stamp = time(NULL);
+	if (stamp == 0 || stamp == l->save_stamp) stamp = l->save_stamp + 1;
+
 	unsigned header  = TAG_MCLV;
-	unsigned version = 6;
+	unsigned version = 7;
 	gzwrite(gz, &header, sizeof header);
 	gzwrite(gz, &version, sizeof version);
+	gzwrite(gz, &stamp, sizeof stamp);
 
 	gzwrite(gz, &l->x, sizeof l->x);
 	gzwrite(gz, &l->y, sizeof l->y);
 	gzwrite(gz, &l->z, sizeof l->z);
 	gzwrite(gz, &l->spawn, sizeof l->spawn);
-	gzwrite(gz, l->blocks, sizeof *l->blocks * l->x * l->y * l->z);
 
-	gzwrite(gz, &l->owner, sizeof l->owner);
-	gzwrite(gz, &l->rankvisit, sizeof l->rankvisit);
-	gzwrite(gz, &l->rankbuild, sizeof l->rankbuild);
-	gzwrite(gz, &l->rankown, sizeof l->rankown);
+	/* Everything is written, so nothing is dirty any more */
+	memset(l->dirty, 0, (level_region_count(l) + 7) / 8);
+	level_blocks_compact(l);
+	level_blocks_write(gz, l, 0, l->x * l->y * l->z);
 
-	unsigned i;
-	i = l->uservisit.used;
-	gzwrite(gz, &i, sizeof i);
-	for (i = 0; i < l->uservisit.used; i++)
-	{
-		gzwrite(gz, &l->uservisit.items[i], sizeof l->uservisit.items[i]);
-	}
+	level_save_meta(gz, l);
 
-	i = l->userbuild.used;
-	gzwrite(gz, &i, sizeof i);
-	for (i = 0; i < l->userbuild.used; i++)
-	{
-		gzwrite(gz, &l->userbuild.items[i], sizeof l->userbuild.items[i]);
-	}
+	gzclose(gz);
 
-	i = l->userown.used;
-	gzwrite(gz, &i, sizeof i);
-	for (i = 0; i < l->userown.used; i++)
+	/* Start an empty delta journal for the new stamp */
+	bool delta = false;
+	gz = gzopen(deltatmp, "wb");
+	if (gz != NULL)
 	{
-		gzwrite(gz, &l->userown.items[i], sizeof l->userown.items[i]);
+		header = TAG_MCLD;
+		version = 1;
+		gzwrite(gz, &header, sizeof header);
+		gzwrite(gz, &version, sizeof version);
+		gzwrite(gz, &stamp, sizeof stamp);
+		delta = gzclose(gz) == Z_OK;
 	}
 
-	i = MAX_HOOKS_PER_LEVEL;
-	gzwrite(gz, &i, sizeof i);
-	for (i = 0; i < MAX_HOOKS_PER_LEVEL; i++)
-	{
-		gzwrite(gz, l->level_hook[i].name, sizeof l->level_hook[i].name);
-		gzwrite(gz, &l->level_hook[i].data.size, sizeof l->level_hook[i].data.size);
-		gzwrite(gz, l->level_hook[i].data.data, l->level_hook[i].data.size);
-	}
-
-	gzclose(gz);
+	l->save_stamp = delta ? stamp : 0;
+	l->delta_records = 0;
+	l->delta_bytes = 0;
 
 	LOG("Level '%s' saved\n", l->name);
 
-	char backup[256];
-	snprintf(backup, sizeof backup, "levels/backups/%s-%lld.mcl", l->name, (long long int)time(NULL));
-	lcase(backup);
-
 	pthread_mutex_unlock(&l->mutex);
+	level_send_wake(l);
 
 	char filename[256];
 	snprintf(filename, sizeof filename, "levels/%s.mcl", l->name);
@@ -1163,22 +1757,19 @@ void *level_save_thread(void *arg)
 
 	rename(filenametmp, filename);
 
-	level_inuse(l, false);
-
-	/* Copy the file to back up */
-	int src = open(filename, O_RDONLY);
-	int dst = open(backup, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
-	char buf[1024];
-	size_t len;
-	while ((len = read(src, buf, sizeof buf)) > 0)
+	if (delta)
 	{
-		write(dst, buf, len);
+		char deltafile[256];
+		snprintf(deltafile, sizeof deltafile, "levels/%s.mcd", l->name);
+		lcase(deltafile);
+
+		rename(deltatmp, deltafile);
 	}
 
-	close(src);
-	close(dst);
+	l->backup_time = time(NULL);
+	level_inuse(l, false);
 
-	LOG("Backed up %s to %s\n", filename, backup);
+	level_backup(l->name, filename);
 
 	return NULL;
 }
@@ -1333,6 +1924,9 @@ void level_copy(struct level_t *src, struct level_t *dst)
 	c.owner_is_op = true;
 	c.fixed = false;
 	c.undo = false;
+	c.rollback = false;
+	c.rollback_cursor = 0;
+	c.rollback_limit = 0;
 	c.client = NULL;
 
 	cuboid_list_add(&s_cuboids, c);
@@ -1366,6 +1960,9 @@ void level_cuboid(struct level_t *level, unsigned start, unsigned end, enum bloc
 	c.owner_is_op = (p->rank >= RANK_OP) || level_user_can_own(level, p);
 	c.fixed = HasBit(p->flags, FLAG_PLACE_FIXED);
 	c.undo = false;
+	c.rollback = false;
+	c.rollback_cursor = 0;
+	c.rollback_limit = 0;
 	c.client = p->client;
 
 	cuboid_list_add(&s_cuboids, c);
@@ -1395,6 +1992,32 @@ void level_user_undo(struct level_t *level, unsigned globalid, struct client_t *
 	c.owner_is_op = false;
 	c.fixed = false;
 	c.undo = true;
+	c.rollback = false;
+	c.rollback_cursor = 0;
+	c.rollback_limit = 0;
+	c.client = client;
+
+	cuboid_list_add(&s_cuboids, c);
+}
+
+/* Roll back up to limit logged changes by a player via the cuboid queue */
+void level_undo_player(struct level_t *level, unsigned globalid, int limit, struct client_t *client)
+{
+	if (level->undo == NULL) level->undo = undodb_init(level->name);
+	if (level->undo == NULL) return;
+
+	if (!level_inuse(level, true)) return;
+
+	struct cuboid_t c;
+	memset(&c, 0, sizeof c);
+
+	c.level = level;
+	c.old_type = BLOCK_INVALID;
+	c.new_type = BLOCK_INVALID;
+	c.owner = globalid;
+	c.rollback = true;
+	c.rollback_cursor = UNDODB_CURSOR_START;
+	c.rollback_limit = limit;
 	c.client = client;
 
 	cuboid_list_add(&s_cuboids, c);
@@ -1402,9 +2025,9 @@ void level_user_undo(struct level_t *level, unsigned globalid, struct client_t *
 
 void level_reset_physics(struct level_t *level)
 {
-	level->physics.used = 0;
-	level->physics2.used = 0;
+	physics_list_reset(level);
 	level->updates.used = 0;
+	block_update_map_reset(&level->updates_map);
 	level->physics_iter = 0;
 	level->updates_iter = 0;
 	level->physics_done = 0;
@@ -1413,17 +2036,38 @@ void level_reset_physics(struct level_t *level)
 	unsigned count = level->x * level->y * level->z;
 	for (i = 0; i < count; i++)
 	{
-		struct block_t *b = &level->blocks[i];
-		b->touched = 0;
-		b->physics = 0;
+		level_block_set_touched(level, i, false);
+		level_block_set_physics(level, i, false);
+	}
+}
+
+/* Queue physics for every block that has it. Physics must not be running
+ * on the level. */
+void level_activate_physics(struct level_t *level)
+{
+	physics_list_reset(level);
+	level->updates.used = 0;
+	block_update_map_reset(&level->updates_map);
+	level->physics_iter = 0;
+	level->updates_iter = 0;
+	level->physics_done = 0;
+
+	unsigned i;
+	unsigned count = level->x * level->y * level->z;
+	for (i = 0; i < count; i++)
+	{
+		bool physics = blocktype_has_physics(level_block_type(level, i));
+		level_block_set_touched(level, i, false);
+		level_block_set_physics(level, i, physics);
+		if (physics) physics_list_set(level, i);
 	}
 }
 
 void level_reinit_physics(struct level_t *level)
 {
-	level->physics.used = 0;
-	level->physics2.used = 0;
+	physics_list_reset(level);
 	level->updates.used = 0;
+	block_update_map_reset(&level->updates_map);
 	level->physics_iter = 0;
 	level->updates_iter = 0;
 	level->physics_done = 0;
@@ -1435,10 +2079,10 @@ void level_reinit_physics(struct level_t *level)
 	unsigned count = level->x * level->y * level->z;
 	for (i = 0; i < count; i++)
 	{
-		struct block_t *b = &level->blocks[i];
-		b->touched = 0;
-		b->physics = blocktype_has_physics(b->type);
-		if (b->physics) physics_list_add(&level->physics, i);
+		bool physics = blocktype_has_physics(level_block_type(level, i));
+		level_block_set_touched(level, i, false);
+		level_block_set_physics(level, i, physics);
+		if (physics) physics_list_set(level, i);
 	}
 */
 }
@@ -1463,13 +2107,14 @@ void level_change_block(struct level_t *level, struct client_t *client, int16_t
 	}
 
 	unsigned index = level_get_index(level, x, y, z);
-	struct block_t *b = &level->blocks[index];
+	struct block_t block = level_block_get(level, index);
+	struct block_t *b = &block;
 	enum blocktype_t bt = b->type;
 	bool ingame = HasBit(client->player->flags, FLAG_GAMES);
 
 	if (level->no_changes)
 	{
-		client_add_packet(client, packet_send_set_block(x, y, z, convert(level, index, b)));
+		packet_send_set_block(client, x, y, z, convert(level, index, b));
 		return;
 	}
 
@@ -1479,7 +2124,7 @@ void level_change_block(struct level_t *level, struct client_t *client, int16_t
 		{
 //			net_close(client, "Anti-grief: tried to place invalid block");
 			client_notify(client, "Tried to place invalid block");
-			client_add_packet(client, packet_send_set_block(x, y, z, convert(level, index, b)));
+			packet_send_set_block(client, x, y, z, convert(level, index, b));
 			return;
 		}
 
@@ -1496,7 +2141,7 @@ void level_change_block(struct level_t *level, struct client_t *client, int16_t
 		if (distance > 10)
 		{
 			client_notify(client, "You cannot build that far away");
-			client_add_packet(client, packet_send_set_block(x, y, z, convert(level, index, b)));
+			packet_send_set_block(client, x, y, z, convert(level, index, b));
 			return;
 		}
 	}
@@ -1516,7 +2161,7 @@ void level_change_block(struct level_t *level, struct client_t *client, int16_t
 		snprintf(buf, sizeof buf, "Physics: %s  Data 0x%04X", b->physics ? "yes" : "no", b->data);
 		client_notify(client, buf);
 
-		client_add_packet(client, packet_send_set_block(x, y, z, convert(level, index, b)));
+		packet_send_set_block(client, x, y, z, convert(level, index, b));
 		return;
 	}
 
@@ -1526,7 +2171,7 @@ void level_change_block(struct level_t *level, struct client_t *client, int16_t
 	{
 		if (client->player->mode == MODE_CUBOID)
 		{
-			client_add_packet(client, packet_send_set_block(x, y, z, convert(level, index, b)));
+			packet_send_set_block(client, x, y, z, convert(level, index, b));
 
 			if (client->player->cuboid_start == UINT_MAX)
 			{
@@ -1552,7 +2197,7 @@ void level_change_block(struct level_t *level, struct client_t *client, int16_t
 		}
 		else if (client->player->mode == MODE_REPLACE)
 		{
-			client_add_packet(client, packet_send_set_block(x, y, z, convert(level, index, b)));
+			packet_send_set_block(client, x, y, z, convert(level, index, b));
 
 			if (client->player->cuboid_start == UINT_MAX)
 			{
@@ -1584,8 +2229,7 @@ void level_change_block(struct level_t *level, struct client_t *client, int16_t
 			for (ey = y; ey < level->y; ey++)
 			{
 				index = level_get_index(level, x, ey, z);
-				struct block_t *b2 = &level->blocks[index];
-				enum blocktype_t bt2 = b2->type;
+				enum blocktype_t bt2 = level_block_type(level, index);
 				if (bt != bt2) break;
 				indexe = index;
 			}
@@ -1593,8 +2237,7 @@ void level_change_block(struct level_t *level, struct client_t *client, int16_t
 			for (sy = y; sy > 0; sy--)
 			{
 				index = level_get_index(level, x, sy, z);
-				struct block_t *b2 = &level->blocks[index];
-				enum blocktype_t bt2 = b2->type;
+				enum blocktype_t bt2 = level_block_type(level, index);
 				if (bt != bt2) break;
 				indexs = index;
 			}
@@ -1628,7 +2271,7 @@ void level_change_block(struct level_t *level, struct client_t *client, int16_t
 			int r = trigger(level, index, b, client, t);
 			if (r != TRIG_NONE)
 			{
-				if (r == TRIG_FILL) client_add_packet(client, packet_send_set_block(x, y, z, convert(level, index, b)));
+				if (r == TRIG_FILL) packet_send_set_block(client, x, y, z, convert(level, index, b));
 
 				//LOG("Triggered!");
 				return;
@@ -1640,7 +2283,7 @@ void level_change_block(struct level_t *level, struct client_t *client, int16_t
 		if (m == 1 && bt != AIR && bt != WATER && bt != LAVA && bt != WATERSTILL && bt != LAVASTILL)
 		{
 			client_notify(client, "Active physics block cannot be changed");
-			client_add_packet(client, packet_send_set_block(x, y, z, convert(level, index, b)));
+			packet_send_set_block(client, x, y, z, convert(level, index, b));
 			return;
 		}
 	}
@@ -1648,7 +2291,7 @@ void level_change_block(struct level_t *level, struct client_t *client, int16_t
 	if (!can_build)
 	{
 		client_notify(client, "You can't build on this level");
-		client_add_packet(client, packet_send_set_block(x, y, z, convert(level, index, b)));
+		packet_send_set_block(client, x, y, z, convert(level, index, b));
 		return;
 	}
 
@@ -1660,7 +2303,7 @@ void level_change_block(struct level_t *level, struct client_t *client, int16_t
 			// || (b->owner != 0 && b->owner != client->player->globalid)))
 		{
 			client_notify(client, "Block cannot be changed");
-			client_add_packet(client, packet_send_set_block(x, y, z, convert(level, index, b)));
+			packet_send_set_block(client, x, y, z, convert(level, index, b));
 			return;
 		}
 
@@ -1676,11 +2319,11 @@ void level_change_block(struct level_t *level, struct client_t *client, int16_t
 					case LAVA:
 //						net_close(client, "Anti-grief: tried to place special block");
 						client_notify(client, "Tried to place special block");
-						client_add_packet(client, packet_send_set_block(x, y, z, convert(level, index, b)));
+						packet_send_set_block(client, x, y, z, convert(level, index, b));
 						return;
 				}
 			}
-			client_add_packet(client, packet_send_set_block(x, y, z, convert(level, index, b)));
+			packet_send_set_block(client, x, y, z, convert(level, index, b));
 			return;
 		}
 
@@ -1688,7 +2331,7 @@ void level_change_block(struct level_t *level, struct client_t *client, int16_t
 		if ((b->owner != 0 && b->owner != client->player->globalid && b->type != AIR) && !level_user_can_own(level, client->player))
 		{
 			client_notify(client, "Block cannot be changed");
-			client_add_packet(client, packet_send_set_block(x, y, z, convert(level, index, b)));
+			packet_send_set_block(client, x, y, z, convert(level, index, b));
 			return;
 		}
 	}
@@ -1699,21 +2342,15 @@ void level_change_block(struct level_t *level, struct client_t *client, int16_t
 
 	call_level_hook(EVENT_BLOCK, level, client, &be);
 
+	/* The hook may have changed the block */
+	block = level_block_get(level, index);
+
 	/* Client thinks it has changed to air */
 	if (m == 0) t = AIR;
 
 	if (bt != be.nt)
 	{
-		if (level->undo == NULL)
-		{
-			level->undo = undodb_init(level->name);
-		}
-		undodb_log(level->undo, client->player->globalid, x, y, z, b->type, b->data, be.nt);
-//		player_undo_log(client->player, index);
-
-		delete(level, index, b);
-
-		bool oldphysics = b->physics;
+		struct block_t old = *b;
 
 		b->type = be.nt;
 		b->data = be.data;
@@ -1722,12 +2359,31 @@ void level_change_block(struct level_t *level, struct client_t *client, int16_t
 		b->touched = 0;
 		b->physics = blocktype_has_physics(be.nt);
 
-		if (oldphysics != b->physics)
+		/* Store it first, so nothing is logged or deleted for a change
+		 * that didn't happen */
+		if (!level_block_put(level, index, b))
+		{
+			client_notify(client, "Block could not be changed");
+			packet_send_set_block(client, x, y, z, convert(level, index, &old));
+			return;
+		}
+
+		if (level->undo == NULL)
+		{
+			level->undo = undodb_init(level->name);
+		}
+		undodb_log(level->undo, client->player->globalid, x, y, z, old.type, old.data, be.nt);
+//		player_undo_log(client->player, index);
+
+		delete(level, index, &old);
+
+		if (old.physics != b->physics)
 		{
 			physics_list_update(level, index, b->physics);
 		}
 
 		level->changed = true;
+		level_block_changed(level, index);
 
 		enum blocktype_t pt = convert(level, index, b);
 
@@ -1739,7 +2395,7 @@ void level_change_block(struct level_t *level, struct client_t *client, int16_t
 
 			if (client != c || pt != t || !click)
 			{
-				client_add_packet(c, packet_send_set_block(x, y, z, pt));
+				packet_send_set_block(c, x, y, z, pt);
 			}
 		}
 	}
@@ -1750,7 +2406,7 @@ void level_change_block(struct level_t *level, struct client_t *client, int16_t
 		if (pt != t)
 		{
 			/* Block hasn't changed but client thinks it has? */
-			client_add_packet(client, packet_send_set_block(x, y, z, pt));
+			packet_send_set_block(client, x, y, z, pt);
 		}
 	}
 }
@@ -1758,9 +2414,9 @@ void level_change_block(struct level_t *level, struct client_t *client, int16_t
 void level_change_block_force(struct level_t *level, struct block_t *block, unsigned index)
 {
 	unsigned i;
-	struct block_t *b = &level->blocks[index];
-	*b = *block;
+	if (!level_block_put(level, index, block)) return;
 	level->changed = true;
+	level_block_changed(level, index);
 
 	int16_t x, y, z;
 	if (!level_get_xyz(level, index, &x, &y, &z)) return;
@@ -1771,7 +2427,7 @@ void level_change_block_force(struct level_t *level, struct block_t *block, unsi
 		if (c->player == NULL) continue;
 		if (c->player->level == level)
 		{
-			client_add_packet(c, packet_send_set_block(x, y, z, convert(level, index, b)));
+			packet_send_set_block(c, x, y, z, convert(level, index, block));
 		}
 	}
 }
@@ -1789,20 +2445,7 @@ static void level_run_physics(struct level_t *level, bool can_init, bool limit)
 		level->physics_runtime = 0;
 
 		pthread_mutex_lock(&level->physics_mutex);
-
-		/* Swap physics list */
-		unsigned *p = level->physics2.items;
-		level->physics2.items = level->physics.items;
-		level->physics.items = p;
-
-		size_t u = level->physics2.used;
-		level->physics2.used = level->physics.used;
-		level->physics.used = u;
-
-		u = level->physics2.size;
-		level->physics2.size = level->physics.size;
-		level->physics.size = u;
-
+		physics_list_take(level);
 		pthread_mutex_unlock(&level->physics_mutex);
 	}
 
@@ -1810,13 +2453,21 @@ static void level_run_physics(struct level_t *level, bool can_init, bool limit)
 
 	int s = gettime();
 
+	/* Large runs are done all at once in parallel, rather than spread over
+	 * ticks */
+	if (level->physics_iter == 0 && limit && level_physics_run_parallel(level))
+	{
+		level->physics_iter = level->physics2.used;
+		level->physics_runtime += gettime() - s;
+	}
+
 	//LOG("%lu physics blocks, iterator at %d\n", level->physics.used, level->physics_iter);
 	for (; level->physics_iter < level->physics2.used; level->physics_iter++)
 	{
 		unsigned index = level->physics2.items[level->physics_iter];
-		struct block_t *b = &level->blocks[index];
+		struct block_t b = level_block_get(level, index);
 
-		physics(level, index, b);
+		physics(level, index, &b);
 
 		if (limit && gettime() - s > 40) {
 			level->physics_runtime += gettime() - s;
@@ -1864,17 +2515,16 @@ static void level_run_updates(struct level_t *level, bool can_init, bool limit)
 		int16_t x, y, z;
 		level_get_xyz(level, bu->index, &x, &y, &z);
 
-		struct block_t *b = &level->blocks[bu->index];
-
 		/* Skip if block updated outside of physics */
-		if (!b->touched) continue;
+		if (!level_block_touched(level, bu->index)) continue;
 
-		*b = bu->block;
+		if (!level_block_put(level, bu->index, &bu->block)) continue;
+		level_block_changed(level, bu->index);
 
-		if (b->physics) physics_list_update(level, bu->index, b->physics);
+		if (bu->block.physics) physics_list_update(level, bu->index, bu->block.physics);
 
 		if (limit) {
-			enum blocktype_t nt = convert(level, bu->index, b);
+			enum blocktype_t nt = convert(level, bu->index, &bu->block);
 
 			unsigned j;
 			for (j = 0; j < MAX_CLIENTS_PER_LEVEL; j++)
@@ -1883,7 +2533,7 @@ static void level_run_updates(struct level_t *level, bool can_init, bool limit)
 				if (c == NULL || c->player == NULL) continue;
 				if (!c->waiting_for_level && !c->sending_level)
 				{
-					client_add_packet(c, packet_send_set_block(x, y, z, nt));
+					packet_send_set_block(c, x, y, z, nt);
 				}
 			}
 		}
@@ -1905,69 +2555,77 @@ static void level_run_updates(struct level_t *level, bool can_init, bool limit)
 	//LOG("Hmm (%lu / %lu blocks)\n", level->physics.used, level->physics2.used);
 
 	level->updates.used = 0;
+	block_update_map_reset(&level->updates_map);
 	level->updates_iter = 0;
 	level->physics_iter = 0;
 
 	level->physics_done = 0;
 }
 
+/* Updates go to the level, unless physics for the level is being run in
+ * parallel, in which case each thread has its own list */
+static inline void level_push_update(struct level_t *level, struct block_update_t bu)
+{
+	if (g_physics_updates != NULL)
+	{
+		block_update_list_add_mapped(g_physics_updates, g_physics_updates_map, bu);
+	}
+	else
+	{
+		block_update_list_add_mapped(&level->updates, &level->updates_map, bu);
+	}
+}
+
 void level_addupdate(struct level_t *level, unsigned index, enum blocktype_t newtype, uint16_t newdata)
 {
-	struct block_t *b = &level->blocks[index];
-	if (b->touched) return;
+	if (level_block_touched(level, index)) return;
 
 	struct block_update_t bu;
 	bu.index = index;
-	bu.block = *b;
+	bu.block = level_block_get(level, index);
 	bu.block.type = newtype;
 	bu.block.data = newdata;
 	bu.block.physics = blocktype_has_physics(newtype);
 
-	b->touched = 1;
+	level_block_set_touched(level, index, true);
 
-	block_update_list_add(&level->updates, bu);
+	level_push_update(level, bu);
 }
 
 void level_addupdate_force(struct level_t *level, unsigned index, enum blocktype_t newtype, uint16_t newdata)
 {
-	struct block_t *b = &level->blocks[index];
-	if (!b->touched)
+	if (!level_block_touched(level, index))
 	{
 		level_addupdate(level, index, newtype, newdata);
 	}
 	else
 	{
-		unsigned i;
-		for (i = 0; i < level->updates.used; i++)
-		{
-			struct block_update_t *bu = &level->updates.items[i];	
-			if (bu->index != index) continue;
-			
-			bu->block.type = newtype;
-			bu->block.data = newdata;
-			bu->block.physics = blocktype_has_physics(bu->block.type);
-	
-			return;
-		}
+		struct block_update_t *bu = NULL;
+		if (g_physics_updates != NULL) bu = block_update_map_find(g_physics_updates_map, g_physics_updates, index);
+		if (bu == NULL) bu = block_update_map_find(&level->updates_map, &level->updates, index);
+		if (bu == NULL) return;
+
+		bu->block.type = newtype;
+		bu->block.data = newdata;
+		bu->block.physics = blocktype_has_physics(bu->block.type);
 	}
 }
 
 void level_addupdate_with_owner(struct level_t *level, unsigned index, enum blocktype_t newtype, uint16_t newdata, unsigned owner)
 {
-	struct block_t *b = &level->blocks[index];
-	if (b->touched) return;
+	if (level_block_touched(level, index)) return;
 
 	struct block_update_t bu;
 	bu.index = index;
-	bu.block = *b;
+	bu.block = level_block_get(level, index);
 	bu.block.type = newtype;
 	bu.block.data = newdata;
 	bu.block.owner = owner;
 	bu.block.physics = blocktype_has_physics(newtype);
 
-	b->touched = 1;
+	level_block_set_touched(level, index, true);
 
-	block_update_list_add(&level->updates, bu);
+	level_push_update(level, bu);
 }
 
 void level_prerun(struct level_t *l)
@@ -1981,37 +2639,51 @@ void level_prerun(struct level_t *l)
 	}
 }
 
-void level_process_physics(bool can_init)
+struct level_tick_job_t
 {
-	unsigned i;
-	for (i = 0; i < s_levels.used; i++)
-	{
-		struct level_t *level = s_levels.items[i];
-		if (level == NULL) continue;
+	struct level_t *level;
+	bool can_init;
+};
 
-		if (!level_inuse(level, true)) continue;
+static struct worker s_physics_worker;
 
-		/* Don't run physics for empty levels, else it will never unload */
-		if (level_is_empty(level)) {
-			level_inuse(level, false);
-			continue;
-		}
+/* Level ticks queued to the physics workers but not yet finished */
+static pthread_mutex_t s_tick_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_tick_cond = PTHREAD_COND_INITIALIZER;
+static unsigned s_tick_pending;
 
-		/* Test if another thread is accessing... */
-		if (pthread_mutex_trylock(&level->mutex) != 0) {
-			level_inuse(level, false);
-			continue;
-		}
-		pthread_mutex_unlock(&level->mutex);
+/* Run one tick of a level, on a physics worker */
+static void level_tick(void *arg)
+{
+	struct level_tick_job_t *job = arg;
+	struct level_t *level = job->level;
 
-		level_run_physics(level, can_init, true);
+	int s = gettime();
+	size_t physics = level->physics_active_count;
+	size_t updates = level->updates.used;
 
-		call_level_hook(EVENT_TICK, level, NULL, NULL);
-		level_inuse(level, false);
-	}
+	level_run_physics(level, job->can_init, true);
+	call_level_hook(EVENT_TICK, level, NULL, NULL);
+	level_run_updates(level, true, !level->instant);
+
+	level->tick_runtime_last = gettime() - s;
+	level_profile_tick(level, level->tick_runtime_last, physics, updates);
+	if (level->tick_runtime_last > level->tick_runtime_max) level->tick_runtime_max = level->tick_runtime_last;
+	level->ticks++;
+
+	level_inuse(level, false);
+	free(job);
+
+	pthread_mutex_lock(&s_tick_mutex);
+	if (--s_tick_pending == 0) pthread_cond_signal(&s_tick_cond);
+	pthread_mutex_unlock(&s_tick_mutex);
 }
 
-void level_process_updates(bool can_init)
+/* Queue a tick of every active level to the physics workers, and wait for
+ * them all to finish. Levels tick in parallel, but the next tick of every
+ * level waits for the slowest one; level_run_physics() limits itself to 40ms
+ * per tick to bound that. */
+static void level_process_ticks(bool can_init)
 {
 	unsigned i;
 	for (i = 0; i < s_levels.used; i++)
@@ -2021,6 +2693,9 @@ void level_process_updates(bool can_init)
 
 		if (!level_inuse(level, true)) continue;
 
+		/* Even for empty levels, as saving compacts chunks too */
+		level_blocks_reclaim(level);
+
 		/* Don't run physics for empty levels, else it will never unload */
 		if (level_is_empty(level)) {
 			level_inuse(level, false);
@@ -2034,9 +2709,24 @@ void level_process_updates(bool can_init)
 		}
 		pthread_mutex_unlock(&level->mutex);
 
-		level_run_updates(level, can_init, !level->instant);
-		level_inuse(level, false);
+		struct level_tick_job_t *job = malloc(sizeof *job);
+		if (job == NULL) {
+			level_inuse(level, false);
+			continue;
+		}
+		job->level = level;
+		job->can_init = can_init;
+
+		pthread_mutex_lock(&s_tick_mutex);
+		s_tick_pending++;
+		pthread_mutex_unlock(&s_tick_mutex);
+
+		worker_queue(&s_physics_worker, job);
 	}
+
+	pthread_mutex_lock(&s_tick_mutex);
+	while (s_tick_pending > 0) pthread_cond_wait(&s_tick_cond, &s_tick_mutex);
+	pthread_mutex_unlock(&s_tick_mutex);
 }
 
 
@@ -2311,9 +3001,11 @@ void *physics_thread(void *arg)
 			next_tick = cur_ticks + TICK_INTERVAL;
 			i = (i + 1) % 2;
 
-			level_process_physics(i);
-			level_process_updates(true);
+			level_process_ticks(i);
+
+			unsigned epoch = epoch_enter();
 			cuboid_process();
+			epoch_exit(epoch);
 		}
 		usleep(g_server.physics_usleep);
 	}
@@ -2325,6 +3017,11 @@ void *physics_thread(void *arg)
 
 void physics_init(void)
 {
+	int threads;
+	if (!config_get_int("physics_threads", &threads)) threads = worker_cpus();
+	worker_init(&s_physics_worker, "physics", 30000, 10, threads, &level_tick);
+	level_physics_init();
+
 	s_physics_exit = false;
 	pthread_create(&s_physics_thread, NULL, &physics_thread, NULL);
 }
@@ -2333,6 +3030,9 @@ void physics_deinit(void)
 {
 	s_physics_exit = true;
 	pthread_join(s_physics_thread, NULL);
+
+	worker_deinit(&s_physics_worker);
+	level_physics_deinit();
 }
 
 void physics_list_update(struct level_t *level, unsigned index, int state)
@@ -2340,17 +3040,21 @@ void physics_list_update(struct level_t *level, unsigned index, int state)
 	pthread_mutex_lock(&level->physics_mutex);
 	if (state)
 	{
-		physics_list_add(&level->physics, index);
-		if (level->physics.used > level->x * level->y * level->z)
-		{
-			LOG("ERROR: physics list on %s larger than level size\n", level->name);
-			level->physics_pause = true;
-			level_notify_all(level, TAG_RED "RUNAWAY PHYSICS BUG! " TAG_YELLOW "Physics paused");
-		}
+		physics_list_set(level, index);
 	}
 	else
 	{
-		physics_list_del_item(&level->physics, index);
+		physics_list_clear(level, index);
 	}
 	pthread_mutex_unlock(&level->physics_mutex);
 }
+
+void physics_list_reset(struct level_t *level)
+{
+	pthread_mutex_lock(&level->physics_mutex);
+	memset(level->physics_active, 0, (level->x * level->y * level->z + 63) / 64 * sizeof *level->physics_active);
+	level->physics_active_count = 0;
+	level->physics.used = 0;
+	level->physics2.used = 0;
+	pthread_mutex_unlock(&level->physics_mutex);
+}
@@ -9,13 +9,33 @@
 #include "list.h"
 #include "npc.h"
 
+#if defined(LEVEL_SOA) && defined(LEVEL_CHUNKED)
+#error LEVEL_SOA and LEVEL_CHUNKED cannot both be used
+#endif
+
+#ifdef LEVEL_CHUNKED
+#include "level_chunk.h"
+#endif
+
 #define MAX_CLIENTS_PER_LEVEL 64
 #define MAX_NPCS_PER_LEVEL 128
 #define MAX_HOOKS_PER_LEVEL 8
 
+/* Changes are tracked in regions of 16x16x16 blocks for delta saves */
+#define LEVEL_REGION_BITS 4
+#define LEVEL_REGION_SIZE (1 << LEVEL_REGION_BITS)
+
+#if defined(LEVEL_CHUNKED) && LEVEL_CHUNK_BITS != LEVEL_REGION_BITS
+#error Level chunks must be the same size as regions
+#endif
+
 struct player_t;
 struct client_t;
 struct undodb_t;
+struct level_snapshot_t;
+struct astar_cache;
+struct astar_hpa;
+struct level_profile_t;
 
 static inline bool user_compare(unsigned *a, unsigned *b)
 {
@@ -76,9 +96,24 @@ struct level_t
 	struct user_list_t userbuild;
 	struct user_list_t userown;
 
+#if defined(LEVEL_SOA)
+	/* Each block field in its own array, see level_block_get() */
+	uint16_t *block_types;
+	uint16_t *block_data;
+	uint32_t *block_owners;
+	uint64_t *block_fixed, *block_physics, *block_touched;
+#elif defined(LEVEL_CHUNKED)
+	struct level_chunks_t chunks;
+#else
 	struct block_t *blocks;
+#endif
 	struct physics_list_t physics, physics2;
+	/* One bit per block in the physics list. Removing a block only clears
+	 * its bit, and the list is compacted when it is taken for a run. */
+	uint64_t *physics_active;
+	size_t physics_active_count;
 	struct block_update_list_t updates;
+	struct block_update_map_t updates_map;
 
 	unsigned physics_iter, physics_done;
 	unsigned updates_iter;
@@ -87,6 +122,11 @@ struct level_t
 	unsigned physics_runtime_last, updates_runtime_last;
 	unsigned physics_count_last, updates_count_last;
 
+	/* Whole ticks, including hooks, as run by the physics workers */
+	unsigned ticks;
+	unsigned tick_runtime_last, tick_runtime_max;
+	struct level_profile_t *profile;
+
 	struct level_hooks_t level_hook[MAX_HOOKS_PER_LEVEL];
 
 	/* Max players on a level */
@@ -95,6 +135,27 @@ struct level_t
 
 	struct undodb_t *undo;
 
+	/* Incremented whenever block contents change */
+	unsigned generation;
+	struct level_snapshot_t *snapshot;
+
+	/* One bit per region changed since the last save */
+	uint8_t *dirty;
+	/* Generation each region last changed at, so cached results can tell
+	 * whether the blocks they were made from are unchanged */
+	unsigned *region_generation;
+	struct astar_cache *path_cache;
+	struct astar_hpa *path_hpa;
+	/* Players and hook triggers by position, see level_grid.h */
+	struct level_grid_t *grid;
+	/* Identifies the full save that the delta journal applies to, 0 if
+	 * the next save must be a full one */
+	unsigned save_stamp;
+	unsigned delta_records;
+	size_t delta_bytes;
+	/* When the last full save was backed up */
+	time_t backup_time;
+
 	uint8_t changed:1;
 	uint8_t instant:1;
 	uint8_t physics_pause:1;
@@ -108,6 +169,7 @@ struct level_t
 	pthread_mutex_t inuse_mutex;
 	pthread_mutex_t hook_mutex;
 	pthread_mutex_t physics_mutex;
+	pthread_mutex_t snapshot_mutex;
 };
 
 bool level_t_compare(struct level_t **a, struct level_t **b);
@@ -127,6 +189,166 @@ static inline bool level_valid_xyz(const struct level_t *level, int x, int y, in
 	return x >= 0 && x < level->x && y >= 0 && y < level->y && z >= 0 && z < level->z;
 }
 
+static inline unsigned level_regions_x(const struct level_t *level) { return (level->x + LEVEL_REGION_SIZE - 1) >> LEVEL_REGION_BITS; }
+static inline unsigned level_regions_y(const struct level_t *level) { return (level->y + LEVEL_REGION_SIZE - 1) >> LEVEL_REGION_BITS; }
+static inline unsigned level_regions_z(const struct level_t *level) { return (level->z + LEVEL_REGION_SIZE - 1) >> LEVEL_REGION_BITS; }
+
+static inline unsigned level_region_count(const struct level_t *level)
+{
+	return level_regions_x(level) * level_regions_y(level) * level_regions_z(level);
+}
+
+static inline unsigned level_get_region(const struct level_t *level, unsigned x, unsigned y, unsigned z)
+{
+	x >>= LEVEL_REGION_BITS;
+	y >>= LEVEL_REGION_BITS;
+	z >>= LEVEL_REGION_BITS;
+	return x + (z + y * level_regions_z(level)) * level_regions_x(level);
+}
+
+/* Blocks are normally kept as an array of struct block_t. Building with
+ * LEVEL_SOA keeps each field in a separate array instead, so scans that only
+ * look at block types touch a quarter of the memory. LEVEL_CHUNKED keeps
+ * them in compressed chunks, see level_chunk.h. Either way blocks are read
+ * and written through these functions. Flag bits are shared between
+ * neighbouring blocks, so they are set atomically for parallel physics. */
+static inline bool level_bit_test(const uint64_t *bits, unsigned index)
+{
+	return (bits[index >> 6] >> (index & 63)) & 1;
+}
+
+static inline void level_bit_set(uint64_t *bits, unsigned index, bool value)
+{
+	uint64_t bit = 1ULL << (index & 63);
+	if (value)
+	{
+		if (!(bits[index >> 6] & bit)) __sync_fetch_and_or(&bits[index >> 6], bit);
+	}
+	else
+	{
+		if (bits[index >> 6] & bit) __sync_fetch_and_and(&bits[index >> 6], ~bit);
+	}
+}
+
+#ifdef LEVEL_SOA
+
+static inline unsigned level_block_type(const struct level_t *level, unsigned index) { return level->block_types[index]; }
+static inline unsigned level_block_data(const struct level_t *level, unsigned index) { return level->block_data[index]; }
+static inline unsigned level_block_owner(const struct level_t *level, unsigned index) { return level->block_owners[index]; }
+static inline bool level_block_fixed(const struct level_t *level, unsigned index) { return level_bit_test(level->block_fixed, index); }
+static inline bool level_block_physics(const struct level_t *level, unsigned index) { return level_bit_test(level->block_physics, index); }
+static inline bool level_block_touched(const struct level_t *level, unsigned index) { return level_bit_test(level->block_touched, index); }
+
+static inline void level_block_set_type(struct level_t *level, unsigned index, enum blocktype_t type) { level->block_types[index] = type; }
+static inline void level_block_set_data(struct level_t *level, unsigned index, unsigned data) { level->block_data[index] = data; }
+static inline void level_block_set_owner(struct level_t *level, unsigned index, unsigned owner) { level->block_owners[index] = owner; }
+static inline void level_block_set_fixed(struct level_t *level, unsigned index, bool fixed) { level_bit_set(level->block_fixed, index, fixed); }
+static inline void level_block_set_physics(struct level_t *level, unsigned index, bool physics) { level_bit_set(level->block_physics, index, physics); }
+static inline void level_block_set_touched(struct level_t *level, unsigned index, bool touched) { level_bit_set(level->block_touched, index, touched); }
+
+static inline struct block_t level_block_get(const struct level_t *level, unsigned index)
+{
+	struct block_t b;
+	memset(&b, 0, sizeof b);
+	b.type = level->block_types[index];
+	b.data = level->block_data[index];
+	b.owner = level->block_owners[index];
+	b.fixed = level_bit_test(level->block_fixed, index);
+	b.physics = level_bit_test(level->block_physics, index);
+	b.touched = level_bit_test(level->block_touched, index);
+	return b;
+}
+
+static inline bool level_block_put(struct level_t *level, unsigned index, const struct block_t *block)
+{
+	level->block_types[index] = block->type;
+	level->block_data[index] = block->data;
+	level->block_owners[index] = block->owner;
+	level_bit_set(level->block_fixed, index, block->fixed);
+	level_bit_set(level->block_physics, index, block->physics);
+	level_bit_set(level->block_touched, index, block->touched);
+	return true;
+}
+#elif defined(LEVEL_CHUNKED)
+static inline unsigned level_block_chunk(const struct level_t *level, unsigned index, unsigned *offset)
+{
+	unsigned x = index % level->x;
+	unsigned z = (index / level->x) % level->z;
+	unsigned y = index / level->x / level->z;
+	unsigned mask = LEVEL_CHUNK_SIZE - 1;
+
+	*offset = (x & mask) | (z & mask) << LEVEL_CHUNK_BITS | (y & mask) << (LEVEL_CHUNK_BITS * 2);
+	return level_get_region(level, x, y, z);
+}
+
+static inline struct block_t level_block_get(const struct level_t *level, unsigned index)
+{
+	unsigned offset;
+	unsigned chunk = level_block_chunk(level, index, &offset);
+	struct block_t b = level_chunk_get(level->chunks.chunks[chunk], offset);
+	b.physics = level_bit_test(level->chunks.physics, index);
+	b.touched = level_bit_test(level->chunks.touched, index);
+	return b;
+}
+
+/* Returns false, leaving the block as it was, if its chunk had to grow and
+ * memory for that couldn't be found */
+static inline bool level_block_put(struct level_t *level, unsigned index, const struct block_t *block)
+{
+	unsigned offset;
+	unsigned chunk = level_block_chunk(level, index, &offset);
+	if (!level_chunk_put(&level->chunks, chunk, offset, block)) return false;
+	level_bit_set(level->chunks.physics, index, block->physics);
+	level_bit_set(level->chunks.touched, index, block->touched);
+	return true;
+}
+
+static inline unsigned level_block_type(const struct level_t *level, unsigned index)
+{
+	unsigned offset;
+	unsigned chunk = level_block_chunk(level, index, &offset);
+	return level_chunk_get(level->chunks.chunks[chunk], offset).type;
+}
+
+static inline unsigned level_block_data(const struct level_t *level, unsigned index) { return level_block_get(level, index).data; }
+static inline unsigned level_block_owner(const struct level_t *level, unsigned index) { return level_block_get(level, index).owner; }
+static inline bool level_block_fixed(const struct level_t *level, unsigned index) { return level_block_get(level, index).fixed; }
+static inline bool level_block_physics(const struct level_t *level, unsigned index) { return level_bit_test(level->chunks.physics, index); }
+static inline bool level_block_touched(const struct level_t *level, unsigned index) { return level_bit_test(level->chunks.touched, index); }
+
+static inline void level_block_set_type(struct level_t *level, unsigned index, enum blocktype_t type) { struct block_t b = level_block_get(level, index); b.type = type; level_block_put(level, index, &b); }
+static inline void level_block_set_data(struct level_t *level, unsigned index, unsigned data) { struct block_t b = level_block_get(level, index); b.data = data; level_block_put(level, index, &b); }
+static inline void level_block_set_owner(struct level_t *level, unsigned index, unsigned owner) { struct block_t b = level_block_get(level, index); b.owner = owner; level_block_put(level, index, &b); }
+static inline void level_block_set_fixed(struct level_t *level, unsigned index, bool fixed) { struct block_t b = level_block_get(level, index); b.fixed = fixed; level_block_put(level, index, &b); }
+static inline void level_block_set_physics(struct level_t *level, unsigned index, bool physics) { level_bit_set(level->chunks.physics, index, physics); }
+static inline void level_block_set_touched(struct level_t *level, unsigned index, bool touched) { level_bit_set(level->chunks.touched, index, touched); }
+#else
+static inline unsigned level_block_type(const struct level_t *level, unsigned index) { return level->blocks[index].type; }
+static inline unsigned level_block_data(const struct level_t *level, unsigned index) { return level->blocks[index].data; }
+static inline unsigned level_block_owner(const struct level_t *level, unsigned index) { return level->blocks[index].owner; }
+static inline bool level_block_fixed(const struct level_t *level, unsigned index) { return level->blocks[index].fixed; }
+static inline bool level_block_physics(const struct level_t *level, unsigned index) { return level->blocks[index].physics; }
+static inline bool level_block_touched(const struct level_t *level, unsigned index) { return level->blocks[index].touched; }
+
+static inline void level_block_set_type(struct level_t *level, unsigned index, enum blocktype_t type) { level->blocks[index].type = type; }
+static inline void level_block_set_data(struct level_t *level, unsigned index, unsigned data) { level->blocks[index].data = data; }
+static inline void level_block_set_owner(struct level_t *level, unsigned index, unsigned owner) { level->blocks[index].owner = owner; }
+static inline void level_block_set_fixed(struct level_t *level, unsigned index, bool fixed) { level->blocks[index].fixed = fixed; }
+static inline void level_block_set_physics(struct level_t *level, unsigned index, bool physics) { level->blocks[index].physics = physics; }
+static inline void level_block_set_touched(struct level_t *level, unsigned index, bool touched) { level->blocks[index].touched = touched; }
+
+static inline struct block_t level_block_get(const struct level_t *level, unsigned index)
+{
+	return level->blocks[index];
+}
+
+static inline bool level_block_put(struct level_t *level, unsigned index, const struct block_t *block)
+{
+	level->blocks[index] = *block;
+	return true;
+}
+#endif
+
 static inline enum blocktype_t level_get_blocktype(const struct level_t *level, int x, int y, int z)
 {
 	if (y >= level->y) {
@@ -134,15 +356,55 @@ static inline enum blocktype_t level_get_blocktype(const struct level_t *level,
 		return AIR;
 	}
 	if (!level_valid_xyz(level, x, y, z)) return ADMINIUM;
-	return level->blocks[level_get_index(level, x, y, z)].type;
+	return level_block_type(level, level_get_index(level, x, y, z));
 }
 
 static inline unsigned level_get_blockowner(const struct level_t *level, int x, int y, int z)
 {
-	return level->blocks[level_get_index(level, x, y, z)].owner;
+	return level_block_owner(level, level_get_index(level, x, y, z));
+}
+
+/* Record that a block has been changed, invalidating any cached snapshot
+ * and marking its region for the next save */
+static inline void level_block_changed(struct level_t *level, unsigned index)
+{
+	/* Physics threads may get here at once, so a region is only ever moved
+	 * to a newer generation */
+	unsigned g = __sync_add_and_fetch(&level->generation, 1);
+
+	if (level->dirty == NULL) return;
+
+	unsigned x = index % level->x;
+	unsigned z = (index / level->x) % level->z;
+	unsigned y = index / level->x / level->z;
+	unsigned r = level_get_region(level, x, y, z);
+	unsigned old = level->region_generation[r];
+	while (g > old)
+	{
+		unsigned cur = __sync_val_compare_and_swap(&level->region_generation[r], old, g);
+		if (cur == old) break;
+		old = cur;
+	}
+	__sync_fetch_and_or(&level->dirty[r >> 3], 1 << (r & 7));
+}
+
+/* Record that blocks may have changed anywhere, after the level has been
+ * generated or replaced. Saving is left to the caller. */
+static inline void level_blocks_replaced(struct level_t *level)
+{
+	unsigned g = __sync_add_and_fetch(&level->generation, 1);
+
+	if (level->region_generation == NULL) return;
+
+	unsigned r;
+	for (r = 0; r < level_region_count(level); r++)
+	{
+		level->region_generation[r] = g;
+	}
 }
 
 bool level_init(struct level_t *level, int16_t x, int16_t y, int16_t z, const char *name, bool zero);
+void level_blocks_clear(struct level_t *level);
 void level_set_block(struct level_t *level, struct block_t *block, unsigned index);
 bool level_send(struct client_t *client);
 void level_gen(struct level_t *level, const char *type, int height_range, int sea_height);
@@ -164,8 +426,6 @@ void level_addupdate(struct level_t *level, unsigned index, enum blocktype_t new
 void level_addupdate_with_owner(struct level_t *level, unsigned index, enum blocktype_t newtype, uint16_t newdata, unsigned owner);
 void level_addupdate_force(struct level_t *level, unsigned index, enum blocktype_t newtype, uint16_t newdata);
 
-void level_process_physics(bool can_init);
-void level_process_updates(bool can_init);
 
 void register_level_hook_func(const char *name, level_hook_func_t level_hook_func);
 void deregister_level_hook_func(const char *name);
@@ -184,16 +444,19 @@ bool level_user_can_own(const struct level_t *l, const struct player_t *p);
 
 void level_cuboid(struct level_t *level, unsigned start, unsigned end, enum blocktype_t old_type, enum blocktype_t new_type, const struct player_t *p);
 void level_user_undo(struct level_t *level, unsigned globalid, struct client_t *client);
+void level_undo_player(struct level_t *level, unsigned globalid, int limit, struct client_t *client);
 
 bool level_inuse(struct level_t *level, bool inuse);
 
 void level_reset_physics(struct level_t *level);
+void level_activate_physics(struct level_t *level);
 void level_reinit_physics(struct level_t *level);
 
 void physics_init(void);
 void physics_deinit(void);
 
 void physics_list_update(struct level_t *level, unsigned index, int state);
+void physics_list_reset(struct level_t *level);
 
 void *level_save_thread(void *arg);
 void *level_load_thread(void *arg);
@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include "config.h"
+#include "level_backup.h"
+#include "level_worker.h"
+#include "mcc.h"
+#include "util.h"
+
+/* Retention defaults, overridden by backup.keep and backup.days */
+#define BACKUP_KEEP 10
+#define BACKUP_DAYS 7
+
+/* Only full saves are backed up, so one is forced at least this often,
+ * overridden by backup.interval (seconds) */
+#define BACKUP_INTERVAL 3600
+
+#define BACKUP_COPY_BUFFER (1 << 20)
+
+struct level_backup_job_t
+{
+	char name[64];
+	char backup[256];
+	/* Saved level to copy from, or -1 if the backup is already linked */
+	int src;
+};
+
+static bool level_backup_copy(int src, int dst)
+{
+#ifdef FICLONE
+	/* Share extents on filesystems that support it */
+	if (ioctl(dst, FICLONE, src) == 0) return true;
+#endif
+
+	/* Let the kernel copy, avoiding the round trip through userspace */
+	ssize_t res;
+	while ((res = copy_file_range(src, NULL, dst, NULL, 1 << 30, 0)) > 0);
+	if (res == 0) return true;
+
+	if (lseek(src, 0, SEEK_SET) != 0 || ftruncate(dst, 0) != 0 || lseek(dst, 0, SEEK_SET) != 0) return false;
+
+	char *buf = malloc(BACKUP_COPY_BUFFER);
+	if (buf == NULL) return false;
+
+	while ((res = read(src, buf, BACKUP_COPY_BUFFER)) > 0)
+	{
+		if (write(dst, buf, res) != res)
+		{
+			res = -1;
+			break;
+		}
+	}
+
+	free(buf);
+
+	return res == 0;
+}
+
+struct level_backup_entry_t
+{
+	/* Room for any name readdir() can return */
+	char filename[sizeof "levels/backups/" + NAME_MAX];
+	long long time;
+};
+
+static int level_backup_entry_compare(const void *a, const void *b)
+{
+	const struct level_backup_entry_t *ea = a;
+	const struct level_backup_entry_t *eb = b;
+
+	if (ea->time == eb->time) return 0;
+	return ea->time < eb->time ? 1 : -1;
+}
+
+/* Keep the newest backups of a level, then the newest backup of each day for
+ * a number of days, and delete the rest. */
+static void level_backup_prune(const char *name)
+{
+	int keep = BACKUP_KEEP;
+	int days = BACKUP_DAYS;
+	config_get_int("backup.keep", &keep);
+	config_get_int("backup.days", &days);
+
+	DIR *dir = opendir("levels/backups");
+	if (dir == NULL) return;
+
+	struct level_backup_entry_t *entries = NULL;
+	size_t used = 0, size = 0;
+	size_t namelen = strlen(name);
+
+	struct dirent *d;
+	while ((d = readdir(dir)) != NULL)
+	{
+		/* <name>-<time>.mcl */
+		if (strncmp(d->d_name, name, namelen) != 0 || d->d_name[namelen] != '-') continue;
+
+		char *end;
+		long long t = strtoll(d->d_name + namelen + 1, &end, 10);
+		if (end == d->d_name + namelen + 1 || strcmp(end, ".mcl") != 0) continue;
+
+		if (used >= size)
+		{
+			size += 64;
+			struct level_backup_entry_t *n = realloc(entries, sizeof *entries * size);
+			if (n == NULL) break;
+			entries = n;
+		}
+
+		snprintf(entries[used].filename, sizeof entries[used].filename, "levels/backups/%s", d->d_name);
+		entries[used].time = t;
+		used++;
+	}
+
+	closedir(dir);
+
+	qsort(entries, used, sizeof *entries, &level_backup_entry_compare);
+
+	long long now = time(NULL);
+	long long last_day = -1;
+	size_t i;
+	unsigned removed = 0;
+
+	for (i = 0; i < used; i++)
+	{
+		long long day = entries[i].time / 86400;
+
+		if (i < (size_t)keep) { last_day = day; continue; }
+		if (day != last_day && now - entries[i].time < (long long)days * 86400) { last_day = day; continue; }
+
+		if (unlink(entries[i].filename) == 0) removed++;
+	}
+
+	free(entries);
+
+	if (removed > 0) LOG("Removed %u old backups of %s\n", removed, name);
+}
+
+/* Whether a level last backed up at the given time is due another backup */
+bool level_backup_due(time_t last)
+{
+	int interval = BACKUP_INTERVAL;
+	config_get_int("backup.interval", &interval);
+
+	return time(NULL) - last >= interval;
+}
+
+/* Back up a freshly saved level. Saves replace the level file rather than
+ * writing it in place, so a hard link is a stable snapshot. Otherwise the
+ * copy is left to the backup worker. */
+void level_backup(const char *name, const char *filename)
+{
+	struct level_backup_job_t *job = malloc(sizeof *job);
+	if (job == NULL) return;
+
+	snprintf(job->name, sizeof job->name, "%s", name);
+	lcase(job->name);
+	snprintf(job->backup, sizeof job->backup, "levels/backups/%s-%lld.mcl", job->name, (long long int)time(NULL));
+	job->src = -1;
+
+	if (link(filename, job->backup) == 0)
+	{
+		LOG("Backed up %s to %s\n", filename, job->backup);
+	}
+	else
+	{
+		/* Hold on to this version of the file in case it is replaced
+		 * before the copy is made */
+		job->src = open(filename, O_RDONLY);
+		if (job->src == -1)
+		{
+			LOG("Unable to back up %s: %s\n", filename, strerror(errno));
+			free(job);
+			return;
+		}
+	}
+
+	level_backup_queue(job);
+}
+
+void level_backup_run(void *arg)
+{
+	struct level_backup_job_t *job = arg;
+
+	if (job->src != -1)
+	{
+		int dst = open(job->backup, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+		if (dst == -1 || !level_backup_copy(job->src, dst))
+		{
+			LOG("Unable to back up %s to %s\n", job->name, job->backup);
+			if (dst != -1) unlink(job->backup);
+		}
+		else
+		{
+			LOG("Backed up %s to %s\n", job->name, job->backup);
+		}
+
+		if (dst != -1) close(dst);
+		close(job->src);
+	}
+
+	level_backup_prune(job->name);
+
+	free(job);
+}
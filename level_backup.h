@@ -0,0 +1,11 @@
+#ifndef LEVEL_BACKUP_H
+#define LEVEL_BACKUP_H
+
+#include <stdbool.h>
+#include <time.h>
+
+bool level_backup_due(time_t last);
+void level_backup(const char *name, const char *filename);
+void level_backup_run(void *arg);
+
+#endif /* LEVEL_BACKUP_H */
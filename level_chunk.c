@@ -0,0 +1,389 @@
+#ifdef LEVEL_CHUNKED
+
+#include <stdlib.h>
+#include <string.h>
+#include "epoch.h"
+#include "level_chunk.h"
+#include "mcc.h"
+
+/* Distinct blocks are counted with a hash table twice the palette size */
+#define LEVEL_CHUNK_HASH (LEVEL_CHUNK_PALETTE * 2)
+
+/* A full palette is repacked if the live blocks would leave a quarter of
+ * it free, otherwise the chunk is stored as plain blocks */
+#define LEVEL_CHUNK_REPACK (LEVEL_CHUNK_PALETTE * 3 / 4)
+
+static size_t level_chunk_size(int kind)
+{
+	switch (kind)
+	{
+		case LEVEL_CHUNK_UNIFORM: return sizeof (struct level_chunk_uniform_t);
+		case LEVEL_CHUNK_PALETTE_8: return sizeof (struct level_chunk_palette_t);
+		default: return sizeof (struct level_chunk_raw_t);
+	}
+}
+
+static struct level_chunk_t *level_chunk_new(int kind)
+{
+	struct level_chunk_t *c = calloc(1, level_chunk_size(kind));
+	if (c == NULL)
+	{
+		LOG("level_chunk: allocation of %zu bytes failed\n", level_chunk_size(kind));
+		return NULL;
+	}
+
+	c->kind = kind;
+	return c;
+}
+
+/* Blocks are stored without their physics and touched flags */
+static struct block_t level_chunk_block(const struct block_t *block)
+{
+	struct block_t b;
+	memset(&b, 0, sizeof b);
+	b.fixed = block->fixed;
+	b.type = block->type;
+	b.data = block->data;
+	b.owner = block->owner;
+	return b;
+}
+
+static void level_chunk_retire(struct level_chunks_t *lc, struct level_chunk_t *c)
+{
+	struct level_chunk_retired_t r = { c, epoch_current() };
+	level_chunk_retired_list_add(&lc->retired, r);
+}
+
+/* Replace a chunk. Readers may still be looking at the old one. */
+static void level_chunk_replace(struct level_chunks_t *lc, unsigned chunk, struct level_chunk_t *c)
+{
+	struct level_chunk_t *old = lc->chunks[chunk];
+
+	__sync_synchronize();
+	lc->chunks[chunk] = c;
+
+	level_chunk_retire(lc, old);
+}
+
+/* Build the smallest chunk holding the blocks of c, with the block at offset
+ * replaced if block is not NULL. Returns NULL if that would be no smaller
+ * than c, or on allocation failure. */
+static struct level_chunk_t *level_chunk_pack(const struct level_chunk_t *c, unsigned offset, const struct block_t *block)
+{
+	struct block_t palette[LEVEL_CHUNK_PALETTE];
+	uint8_t indices[LEVEL_CHUNK_BLOCKS];
+	uint64_t keys[LEVEL_CHUNK_HASH];
+	int16_t slots[LEVEL_CHUNK_HASH];
+	unsigned used = 0;
+	unsigned i;
+
+	memset(slots, -1, sizeof slots);
+
+	for (i = 0; i < LEVEL_CHUNK_BLOCKS; i++)
+	{
+		struct block_t b = (block != NULL && i == offset) ? level_chunk_block(block) : level_chunk_get(c, i);
+		uint64_t key = level_chunk_key(&b);
+
+		unsigned h = ((key * 0x9E3779B97F4A7C15ULL) >> 32) % LEVEL_CHUNK_HASH;
+		while (slots[h] != -1 && keys[h] != key)
+		{
+			h = (h + 1) % LEVEL_CHUNK_HASH;
+		}
+
+		if (slots[h] == -1)
+		{
+			/* Too many distinct blocks to pack */
+			if (used == LEVEL_CHUNK_PALETTE) break;
+
+			keys[h] = key;
+			slots[h] = used;
+			palette[used++] = b;
+		}
+
+		indices[i] = slots[h];
+	}
+
+	struct level_chunk_t *n;
+
+	if (used == 1)
+	{
+		if (c->kind == LEVEL_CHUNK_UNIFORM && block == NULL) return NULL;
+
+		n = level_chunk_new(LEVEL_CHUNK_UNIFORM);
+		if (n == NULL) return NULL;
+
+		((struct level_chunk_uniform_t *)n)->block = palette[0];
+	}
+	else if (i == LEVEL_CHUNK_BLOCKS && (block == NULL || used <= LEVEL_CHUNK_REPACK))
+	{
+		if (c->kind == LEVEL_CHUNK_PALETTE_8 && block == NULL && used >= ((const struct level_chunk_palette_t *)c)->used) return NULL;
+
+		n = level_chunk_new(LEVEL_CHUNK_PALETTE_8);
+		if (n == NULL) return NULL;
+
+		struct level_chunk_palette_t *p = (struct level_chunk_palette_t *)n;
+		memcpy(p->palette, palette, sizeof *palette * used);
+		memcpy(p->indices, indices, sizeof indices);
+		p->used = used;
+	}
+	else
+	{
+		if (c->kind == LEVEL_CHUNK_RAW) return NULL;
+
+		n = level_chunk_new(LEVEL_CHUNK_RAW);
+		if (n == NULL) return NULL;
+
+		struct level_chunk_raw_t *raw = (struct level_chunk_raw_t *)n;
+		for (i = 0; i < LEVEL_CHUNK_BLOCKS; i++)
+		{
+			raw->blocks[i] = (block != NULL && i == offset) ? level_chunk_block(block) : level_chunk_get(c, i);
+		}
+	}
+
+	return n;
+}
+
+bool level_chunks_alloc(struct level_chunks_t *lc, unsigned count, size_t blocks)
+{
+	unsigned i;
+
+	memset(lc, 0, sizeof *lc);
+	pthread_mutex_init(&lc->mutex, NULL);
+	level_chunk_retired_list_init(&lc->retired);
+
+	lc->count = count;
+	lc->chunks = calloc(count, sizeof *lc->chunks);
+	lc->physics = calloc((blocks + 63) / 64, sizeof *lc->physics);
+	lc->touched = calloc((blocks + 63) / 64, sizeof *lc->touched);
+	if (lc->chunks == NULL || lc->physics == NULL || lc->touched == NULL)
+	{
+		level_chunks_free(lc);
+		return false;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		lc->chunks[i] = level_chunk_new(LEVEL_CHUNK_UNIFORM);
+		if (lc->chunks[i] == NULL)
+		{
+			level_chunks_free(lc);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void level_chunks_free(struct level_chunks_t *lc)
+{
+	size_t i;
+
+	if (lc->chunks != NULL)
+	{
+		for (i = 0; i < lc->count; i++)
+		{
+			free(lc->chunks[i]);
+		}
+	}
+
+	for (i = 0; i < lc->retired.used; i++)
+	{
+		free(lc->retired.items[i].chunk);
+	}
+
+	free(lc->chunks);
+	free(lc->physics);
+	free(lc->touched);
+	level_chunk_retired_list_free(&lc->retired);
+	pthread_mutex_destroy(&lc->mutex);
+
+	lc->chunks = NULL;
+	lc->physics = NULL;
+	lc->touched = NULL;
+	lc->count = 0;
+}
+
+void level_chunks_clear(struct level_chunks_t *lc, size_t blocks)
+{
+	unsigned i;
+
+	pthread_mutex_lock(&lc->mutex);
+
+	for (i = 0; i < lc->count; i++)
+	{
+		struct level_chunk_t *c = lc->chunks[i];
+		if (c->kind == LEVEL_CHUNK_UNIFORM && level_chunk_key(&((struct level_chunk_uniform_t *)c)->block) == 0) continue;
+
+		struct level_chunk_t *n = level_chunk_new(LEVEL_CHUNK_UNIFORM);
+		if (n == NULL) continue;
+
+		level_chunk_replace(lc, i, n);
+	}
+
+	memset(lc->physics, 0, (blocks + 63) / 64 * sizeof *lc->physics);
+	memset(lc->touched, 0, (blocks + 63) / 64 * sizeof *lc->touched);
+
+	pthread_mutex_unlock(&lc->mutex);
+}
+
+/* Replace a chunk with plain blocks holding the change, for when a smaller
+ * chunk couldn't be allocated. Called with the mutex held. */
+static bool level_chunk_put_raw(struct level_chunks_t *lc, unsigned chunk, unsigned offset, const struct block_t *b)
+{
+	struct level_chunk_t *c = lc->chunks[chunk];
+	struct level_chunk_t *n = level_chunk_new(LEVEL_CHUNK_RAW);
+	if (n == NULL) return false;
+
+	struct level_chunk_raw_t *raw = (struct level_chunk_raw_t *)n;
+	unsigned i;
+	for (i = 0; i < LEVEL_CHUNK_BLOCKS; i++)
+	{
+		raw->blocks[i] = (i == offset) ? *b : level_chunk_get(c, i);
+	}
+
+	level_chunk_replace(lc, chunk, n);
+	return true;
+}
+
+/* Store a block. Returns false, leaving the chunk as it was, if memory for
+ * a bigger chunk couldn't be found. */
+bool level_chunk_put(struct level_chunks_t *lc, unsigned chunk, unsigned offset, const struct block_t *block)
+{
+	struct block_t b = level_chunk_block(block);
+	uint64_t key = level_chunk_key(&b);
+	bool ok = true;
+	unsigned i;
+
+	pthread_mutex_lock(&lc->mutex);
+
+	struct level_chunk_t *c = lc->chunks[chunk];
+	switch (c->kind)
+	{
+		case LEVEL_CHUNK_UNIFORM:
+		{
+			const struct level_chunk_uniform_t *u = (const struct level_chunk_uniform_t *)c;
+			if (level_chunk_key(&u->block) == key) break;
+
+			struct level_chunk_t *n = level_chunk_new(LEVEL_CHUNK_PALETTE_8);
+			if (n == NULL)
+			{
+				ok = level_chunk_put_raw(lc, chunk, offset, &b);
+				break;
+			}
+
+			struct level_chunk_palette_t *p = (struct level_chunk_palette_t *)n;
+			p->palette[0] = u->block;
+			p->palette[1] = b;
+			p->indices[offset] = 1;
+			p->used = 2;
+			level_chunk_replace(lc, chunk, n);
+			break;
+		}
+
+		case LEVEL_CHUNK_PALETTE_8:
+		{
+			struct level_chunk_palette_t *p = (struct level_chunk_palette_t *)c;
+			for (i = 0; i < p->used; i++)
+			{
+				if (level_chunk_key(&p->palette[i]) == key) break;
+			}
+
+			if (i < p->used)
+			{
+				p->indices[offset] = i;
+			}
+			else if (i < LEVEL_CHUNK_PALETTE)
+			{
+				/* The entry must be in place before anything refers to it */
+				p->palette[i] = b;
+				__sync_synchronize();
+				p->indices[offset] = i;
+				p->used++;
+			}
+			else
+			{
+				struct level_chunk_t *n = level_chunk_pack(c, offset, &b);
+				if (n != NULL)
+				{
+					level_chunk_replace(lc, chunk, n);
+				}
+				else
+				{
+					ok = level_chunk_put_raw(lc, chunk, offset, &b);
+				}
+			}
+			break;
+		}
+
+		default:
+			((struct level_chunk_raw_t *)c)->blocks[offset] = b;
+			break;
+	}
+
+	pthread_mutex_unlock(&lc->mutex);
+
+	if (!ok) LOG("level_chunk: Unable to store block in chunk %u\n", chunk);
+
+	return ok;
+}
+
+/* Shrink chunks that have become uniform, or have fewer distinct blocks
+ * than their storage allows for */
+void level_chunks_compact(struct level_chunks_t *lc)
+{
+	unsigned i;
+
+	pthread_mutex_lock(&lc->mutex);
+
+	for (i = 0; i < lc->count; i++)
+	{
+		struct level_chunk_t *c = lc->chunks[i];
+		if (c->kind == LEVEL_CHUNK_UNIFORM) continue;
+
+		struct level_chunk_t *n = level_chunk_pack(c, 0, NULL);
+		if (n != NULL) level_chunk_replace(lc, i, n);
+	}
+
+	pthread_mutex_unlock(&lc->mutex);
+}
+
+/* Free replaced chunks once readers are done with them */
+void level_chunks_reclaim(struct level_chunks_t *lc)
+{
+	if (lc->retired.used == 0) return;
+
+	size_t i;
+
+	pthread_mutex_lock(&lc->mutex);
+
+	for (i = 0; i < lc->retired.used; )
+	{
+		if (!epoch_safe(lc->retired.items[i].epoch))
+		{
+			i++;
+			continue;
+		}
+
+		free(lc->retired.items[i].chunk);
+		level_chunk_retired_list_del_index(&lc->retired, i);
+	}
+
+	pthread_mutex_unlock(&lc->mutex);
+}
+
+size_t level_chunks_memory(const struct level_chunks_t *lc, unsigned *uniform)
+{
+	size_t bytes = sizeof *lc->chunks * lc->count;
+	unsigned i;
+
+	*uniform = 0;
+	for (i = 0; i < lc->count; i++)
+	{
+		bytes += level_chunk_size(lc->chunks[i]->kind);
+		if (lc->chunks[i]->kind == LEVEL_CHUNK_UNIFORM) (*uniform)++;
+	}
+
+	return bytes;
+}
+
+#endif /* LEVEL_CHUNKED */
@@ -0,0 +1,116 @@
+#ifndef LEVEL_CHUNK_H
+#define LEVEL_CHUNK_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "block.h"
+#include "list.h"
+
+/* Chunked block storage, used when built with LEVEL_CHUNKED. Each region of
+ * LEVEL_REGION_SIZE cubed blocks is held as a single block if uniform, as a
+ * palette of up to 256 distinct blocks and a byte per block, or failing that
+ * as plain blocks. Physics and touched flags change too often to be worth
+ * compressing, so are kept as bitsets over the whole level. */
+
+#define LEVEL_CHUNK_BITS 4
+#define LEVEL_CHUNK_SIZE (1 << LEVEL_CHUNK_BITS)
+#define LEVEL_CHUNK_BLOCKS (LEVEL_CHUNK_SIZE * LEVEL_CHUNK_SIZE * LEVEL_CHUNK_SIZE)
+#define LEVEL_CHUNK_PALETTE 256
+
+/* Replaced chunks may still be in use by readers, which don't lock, so are
+ * only freed once every epoch section that could have seen them has ended,
+ * see epoch.h */
+
+enum
+{
+	LEVEL_CHUNK_UNIFORM,
+	LEVEL_CHUNK_PALETTE_8,
+	LEVEL_CHUNK_RAW,
+};
+
+/* A chunk's kind never changes; growing or shrinking a chunk replaces it.
+ * Each kind starts with struct level_chunk_t. */
+struct level_chunk_t
+{
+	int kind;
+};
+
+struct level_chunk_uniform_t
+{
+	struct level_chunk_t chunk;
+	struct block_t block;
+};
+
+struct level_chunk_palette_t
+{
+	struct level_chunk_t chunk;
+	unsigned used;
+	struct block_t palette[LEVEL_CHUNK_PALETTE];
+	uint8_t indices[LEVEL_CHUNK_BLOCKS];
+};
+
+struct level_chunk_raw_t
+{
+	struct level_chunk_t chunk;
+	struct block_t blocks[LEVEL_CHUNK_BLOCKS];
+};
+
+struct level_chunk_retired_t
+{
+	struct level_chunk_t *chunk;
+	unsigned epoch;
+};
+
+static inline bool level_chunk_retired_compare(struct level_chunk_retired_t *a, struct level_chunk_retired_t *b)
+{
+	return a->chunk == b->chunk;
+}
+LIST(level_chunk_retired, struct level_chunk_retired_t, level_chunk_retired_compare)
+
+struct level_chunks_t
+{
+	struct level_chunk_t **chunks;
+	unsigned count;
+	uint64_t *physics, *touched;
+
+	/* Held while changing chunks */
+	pthread_mutex_t mutex;
+	struct level_chunk_retired_list_t retired;
+};
+
+struct level_t;
+
+/* The parts of a block kept in chunks, packed for comparison */
+static inline uint64_t level_chunk_key(const struct block_t *b)
+{
+	return b->type | (uint64_t)b->data << 12 | (uint64_t)b->owner << 28 | (uint64_t)b->fixed << 59;
+}
+
+static inline struct block_t level_chunk_get(const struct level_chunk_t *c, unsigned offset)
+{
+	switch (c->kind)
+	{
+		case LEVEL_CHUNK_UNIFORM:
+			return ((const struct level_chunk_uniform_t *)c)->block;
+
+		case LEVEL_CHUNK_PALETTE_8:
+		{
+			const struct level_chunk_palette_t *p = (const struct level_chunk_palette_t *)c;
+			return p->palette[p->indices[offset]];
+		}
+
+		default:
+			return ((const struct level_chunk_raw_t *)c)->blocks[offset];
+	}
+}
+
+bool level_chunks_alloc(struct level_chunks_t *lc, unsigned count, size_t blocks);
+void level_chunks_free(struct level_chunks_t *lc);
+void level_chunks_clear(struct level_chunks_t *lc, size_t blocks);
+bool level_chunk_put(struct level_chunks_t *lc, unsigned chunk, unsigned offset, const struct block_t *block);
+void level_chunks_compact(struct level_chunks_t *lc);
+void level_chunks_reclaim(struct level_chunks_t *lc);
+size_t level_chunks_memory(const struct level_chunks_t *lc, unsigned *uniform);
+
+#endif /* LEVEL_CHUNK_H */
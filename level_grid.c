@@ -0,0 +1,265 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "level.h"
+#include "level_grid.h"
+#include "list.h"
+
+struct level_grid_entry_t
+{
+	const void *owner;
+	int id;
+};
+
+static inline bool level_grid_entry_compare(struct level_grid_entry_t *a, struct level_grid_entry_t *b)
+{
+	return a->owner == b->owner && a->id == b->id;
+}
+LIST(level_grid_entry, struct level_grid_entry_t, level_grid_entry_compare)
+
+struct level_grid_t
+{
+	pthread_mutex_t mutex;
+	int cx, cz;
+	/* Cell each player is in, -1 if none */
+	int player_cell[MAX_CLIENTS_PER_LEVEL];
+	struct level_grid_entry_list_t cells[];
+};
+
+bool level_grid_init(struct level_t *level)
+{
+	int cx = (level->x + (1 << LEVEL_GRID_BITS) - 1) >> LEVEL_GRID_BITS;
+	int cz = (level->z + (1 << LEVEL_GRID_BITS) - 1) >> LEVEL_GRID_BITS;
+
+	struct level_grid_t *grid = calloc(1, sizeof *grid + cx * cz * sizeof *grid->cells);
+	if (grid == NULL) return false;
+
+	pthread_mutex_init(&grid->mutex, NULL);
+	grid->cx = cx;
+	grid->cz = cz;
+
+	int i;
+	for (i = 0; i < MAX_CLIENTS_PER_LEVEL; i++)
+	{
+		grid->player_cell[i] = -1;
+	}
+
+	level->grid = grid;
+
+	return true;
+}
+
+void level_grid_free(struct level_t *level)
+{
+	struct level_grid_t *grid = level->grid;
+	if (grid == NULL) return;
+
+	int i;
+	for (i = 0; i < grid->cx * grid->cz; i++)
+	{
+		level_grid_entry_list_free(&grid->cells[i]);
+	}
+
+	pthread_mutex_destroy(&grid->mutex);
+	free(grid);
+	level->grid = NULL;
+}
+
+/* Cell column or row of a position, clamped to the level */
+static inline int level_grid_cell(int v, int size, int cells)
+{
+	v >>= 5;
+	if (v < 0) v = 0;
+	if (v >= size) v = size - 1;
+	v >>= LEVEL_GRID_BITS;
+	return v < cells ? v : cells - 1;
+}
+
+struct level_grid_range_t
+{
+	int x1, z1, x2, z2;
+};
+
+static struct level_grid_range_t level_grid_range(const struct level_t *level, const struct position_t *pos, int area)
+{
+	const struct level_grid_t *grid = level->grid;
+	if (area < 0) area = -area;
+
+	struct level_grid_range_t r;
+	r.x1 = level_grid_cell(pos->x - area, level->x, grid->cx);
+	r.z1 = level_grid_cell(pos->z - area, level->z, grid->cz);
+	r.x2 = level_grid_cell(pos->x + area, level->x, grid->cx);
+	r.z2 = level_grid_cell(pos->z + area, level->z, grid->cz);
+	return r;
+}
+
+void level_grid_add(struct level_t *level, const void *owner, int id, const struct position_t *pos, int area)
+{
+	struct level_grid_t *grid = level->grid;
+	if (grid == NULL) return;
+
+	struct level_grid_entry_t e = { owner, id };
+	struct level_grid_range_t r = level_grid_range(level, pos, area);
+	int x, z;
+
+	pthread_mutex_lock(&grid->mutex);
+	for (z = r.z1; z <= r.z2; z++)
+	{
+		for (x = r.x1; x <= r.x2; x++)
+		{
+			level_grid_entry_list_add(&grid->cells[x + z * grid->cx], e);
+		}
+	}
+	pthread_mutex_unlock(&grid->mutex);
+}
+
+/* Remove matching entries from every cell. Triggers change rarely enough
+ * that this is cheaper than remembering where each one went. */
+static void level_grid_remove_if(struct level_grid_t *grid, const void *owner, int id, bool all)
+{
+	int i;
+	for (i = 0; i < grid->cx * grid->cz; i++)
+	{
+		struct level_grid_entry_list_t *list = &grid->cells[i];
+		size_t j;
+		for (j = 0; j < list->used; )
+		{
+			const struct level_grid_entry_t *e = &list->items[j];
+			if (e->owner == owner && (all || e->id == id))
+			{
+				level_grid_entry_list_del_index(list, j);
+			}
+			else
+			{
+				j++;
+			}
+		}
+	}
+}
+
+void level_grid_remove(struct level_t *level, const void *owner, int id)
+{
+	struct level_grid_t *grid = level->grid;
+	if (grid == NULL) return;
+
+	pthread_mutex_lock(&grid->mutex);
+	level_grid_remove_if(grid, owner, id, false);
+	pthread_mutex_unlock(&grid->mutex);
+}
+
+void level_grid_remove_owner(struct level_t *level, const void *owner)
+{
+	struct level_grid_t *grid = level->grid;
+	if (grid == NULL) return;
+
+	pthread_mutex_lock(&grid->mutex);
+	level_grid_remove_if(grid, owner, 0, true);
+	pthread_mutex_unlock(&grid->mutex);
+}
+
+void level_grid_player_move(struct level_t *level, int levelid, const struct position_t *pos)
+{
+	struct level_grid_t *grid = level->grid;
+	if (grid == NULL || levelid < 0 || levelid >= MAX_CLIENTS_PER_LEVEL) return;
+
+	int cell = level_grid_cell(pos->x, level->x, grid->cx) + level_grid_cell(pos->z, level->z, grid->cz) * grid->cx;
+	struct level_grid_entry_t e = { NULL, levelid };
+
+	pthread_mutex_lock(&grid->mutex);
+
+	int old = grid->player_cell[levelid];
+	if (old != cell)
+	{
+		if (old != -1) level_grid_entry_list_del_item(&grid->cells[old], e);
+		level_grid_entry_list_add(&grid->cells[cell], e);
+		grid->player_cell[levelid] = cell;
+	}
+
+	pthread_mutex_unlock(&grid->mutex);
+}
+
+void level_grid_player_remove(struct level_t *level, int levelid)
+{
+	struct level_grid_t *grid = level->grid;
+	if (grid == NULL || levelid < 0 || levelid >= MAX_CLIENTS_PER_LEVEL) return;
+
+	struct level_grid_entry_t e = { NULL, levelid };
+
+	pthread_mutex_lock(&grid->mutex);
+
+	int old = grid->player_cell[levelid];
+	if (old != -1)
+	{
+		level_grid_entry_list_del_item(&grid->cells[old], e);
+		grid->player_cell[levelid] = -1;
+	}
+
+	pthread_mutex_unlock(&grid->mutex);
+}
+
+uint64_t level_grid_players(struct level_t *level, const struct position_t *pos, int area)
+{
+	struct level_grid_t *grid = level->grid;
+	if (grid == NULL) return ~0ULL;
+
+	struct level_grid_range_t r = level_grid_range(level, pos, area);
+	uint64_t players = 0;
+	int x, z;
+
+	pthread_mutex_lock(&grid->mutex);
+	for (z = r.z1; z <= r.z2; z++)
+	{
+		for (x = r.x1; x <= r.x2; x++)
+		{
+			const struct level_grid_entry_list_t *list = &grid->cells[x + z * grid->cx];
+			size_t j;
+			for (j = 0; j < list->used; j++)
+			{
+				if (list->items[j].owner == NULL) players |= 1ULL << list->items[j].id;
+			}
+		}
+	}
+	pthread_mutex_unlock(&grid->mutex);
+
+	return players;
+}
+
+int level_grid_query(struct level_t *level, const void *owner, const struct position_t *pos, int area, int *ids, int max)
+{
+	struct level_grid_t *grid = level->grid;
+	if (grid == NULL) return 0;
+
+	struct level_grid_range_t r = level_grid_range(level, pos, area);
+	int n = 0;
+	int x, z;
+
+	pthread_mutex_lock(&grid->mutex);
+	for (z = r.z1; z <= r.z2; z++)
+	{
+		for (x = r.x1; x <= r.x2; x++)
+		{
+			const struct level_grid_entry_list_t *list = &grid->cells[x + z * grid->cx];
+			size_t j;
+			for (j = 0; j < list->used; j++)
+			{
+				if (list->items[j].owner != owner) continue;
+
+				/* Insert in order, skipping ids already seen in
+				 * another cell */
+				int id = list->items[j].id;
+				int k = n;
+				while (k > 0 && ids[k - 1] > id) k--;
+				if (k > 0 && ids[k - 1] == id) continue;
+				if (k == max) continue;
+
+				/* When full, the highest id makes way */
+				int m;
+				for (m = n < max ? n : max - 1; m > k; m--) ids[m] = ids[m - 1];
+				ids[k] = id;
+				if (n < max) n++;
+			}
+		}
+	}
+	pthread_mutex_unlock(&grid->mutex);
+
+	return n;
+}
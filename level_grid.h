@@ -0,0 +1,37 @@
+#ifndef LEVEL_GRID_H
+#define LEVEL_GRID_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "position.h"
+
+/* Columns of 16x16 blocks, the full height of the level */
+#define LEVEL_GRID_BITS 4
+
+struct level_t;
+
+/* A uniform grid over each level, so position triggers only need to test
+ * things in the cells around a position. Hooks register trigger volumes
+ * under their own owner pointer; players are kept in it by the core, under
+ * a NULL owner with their level id. */
+
+bool level_grid_init(struct level_t *level);
+void level_grid_free(struct level_t *level);
+
+/* Add a trigger covering area (in position units) around pos */
+void level_grid_add(struct level_t *level, const void *owner, int id, const struct position_t *pos, int area);
+void level_grid_remove(struct level_t *level, const void *owner, int id);
+void level_grid_remove_owner(struct level_t *level, const void *owner);
+
+void level_grid_player_move(struct level_t *level, int levelid, const struct position_t *pos);
+void level_grid_player_remove(struct level_t *level, int levelid);
+/* Bit mask of the level ids of players in the cells within area of pos */
+uint64_t level_grid_players(struct level_t *level, const struct position_t *pos, int area);
+
+/* Fill ids with the owner's entries in the cells within area of pos, in
+ * ascending order and each once. Returns how many were found, up to max;
+ * past that the lowest max ids are kept. Entries are only candidates and
+ * still need an exact test. */
+int level_grid_query(struct level_t *level, const void *owner, const struct position_t *pos, int area, int *ids, int max);
+
+#endif /* LEVEL_GRID_H */
@@ -0,0 +1,272 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "level.h"
+#include "config.h"
+#include "level_physics.h"
+#include "mcc.h"
+#include "worker.h"
+
+/* Parallel physics for levels with many active blocks. The active blocks are
+ * bucketed by region, and regions are processed in eight phases by the
+ * parity of their region coordinates. Regions in the same phase are at
+ * least a whole region apart, so as long as no physics reaches further than
+ * LEVEL_REGION_SIZE blocks, no two threads touch the same block. Each thread
+ * collects its updates in its own list, and these are appended to the level's
+ * updates after every phase, so the usual touched rule still applies and
+ * level_run_updates() sees a single list as before. */
+
+__thread struct block_update_list_t *g_physics_updates;
+__thread struct block_update_map_t *g_physics_updates_map;
+
+struct level_physics_run_t;
+
+struct level_physics_job_t
+{
+	struct level_physics_run_t *run;
+	struct block_update_list_t updates;
+	struct block_update_map_t map;
+};
+
+struct level_physics_run_t
+{
+	struct level_t *level;
+
+	/* Active blocks ordered by region. Region r covers
+	 * order[offset[r]] to order[offset[r + 1] - 1] */
+	unsigned *order;
+	unsigned *offset;
+
+	/* Non-empty regions of the current phase, and the next to be taken */
+	unsigned *regions;
+	unsigned nregions;
+	unsigned next;
+
+	unsigned threads;
+	struct level_physics_job_t *jobs;
+
+	unsigned pending;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+static struct worker s_region_worker;
+static unsigned s_region_threads;
+
+static void level_physics_run_regions(struct level_physics_job_t *job)
+{
+	struct level_physics_run_t *run = job->run;
+	struct level_t *level = run->level;
+
+	g_physics_updates = &job->updates;
+	g_physics_updates_map = &job->map;
+
+	for (;;)
+	{
+		unsigned i = __sync_fetch_and_add(&run->next, 1);
+		if (i >= run->nregions) break;
+
+		unsigned r = run->regions[i];
+		unsigned j;
+		for (j = run->offset[r]; j < run->offset[r + 1]; j++)
+		{
+			unsigned index = run->order[j];
+			struct block_t b = level_block_get(level, index);
+			physics(level, index, &b);
+		}
+	}
+
+	g_physics_updates = NULL;
+	g_physics_updates_map = NULL;
+}
+
+static void level_physics_worker(void *arg)
+{
+	struct level_physics_job_t *job = arg;
+	struct level_physics_run_t *run = job->run;
+
+	level_physics_run_regions(job);
+
+	pthread_mutex_lock(&run->mutex);
+	if (--run->pending == 0) pthread_cond_signal(&run->cond);
+	pthread_mutex_unlock(&run->mutex);
+}
+
+/* Bucket the physics list by region, keeping list order within a region */
+static bool level_physics_sort(struct level_physics_run_t *run)
+{
+	struct level_t *level = run->level;
+	const struct physics_list_t *list = &level->physics2;
+	unsigned regions = level_region_count(level);
+	unsigned i;
+
+	run->order = malloc(sizeof *run->order * list->used);
+	run->offset = calloc(regions + 1, sizeof *run->offset);
+	run->regions = malloc(sizeof *run->regions * regions);
+	if (run->order == NULL || run->offset == NULL || run->regions == NULL) return false;
+
+	/* Count blocks per region, then turn counts into start offsets */
+	for (i = 0; i < list->used; i++)
+	{
+		int16_t x, y, z;
+		level_get_xyz(level, list->items[i], &x, &y, &z);
+		run->offset[level_get_region(level, x, y, z) + 1]++;
+	}
+
+	for (i = 0; i < regions; i++)
+	{
+		run->offset[i + 1] += run->offset[i];
+	}
+
+	for (i = 0; i < list->used; i++)
+	{
+		int16_t x, y, z;
+		level_get_xyz(level, list->items[i], &x, &y, &z);
+		run->order[run->offset[level_get_region(level, x, y, z)]++] = list->items[i];
+	}
+
+	/* Filling shifted each offset to the start of the next region */
+	memmove(run->offset + 1, run->offset, sizeof *run->offset * regions);
+	run->offset[0] = 0;
+
+	return true;
+}
+
+static void level_physics_merge(struct level_physics_run_t *run)
+{
+	struct level_t *level = run->level;
+	unsigned t;
+	size_t i;
+
+	for (t = 0; t < run->threads; t++)
+	{
+		struct block_update_list_t *updates = &run->jobs[t].updates;
+		for (i = 0; i < updates->used; i++)
+		{
+			block_update_list_add_mapped(&level->updates, &level->updates_map, updates->items[i]);
+		}
+		updates->used = 0;
+		block_update_map_reset(&run->jobs[t].map);
+	}
+}
+
+static void level_physics_run_phase(struct level_physics_run_t *run, unsigned phase)
+{
+	struct level_t *level = run->level;
+	unsigned rx = level_regions_x(level);
+	unsigned ry = level_regions_y(level);
+	unsigned rz = level_regions_z(level);
+	unsigned x, y, z, t;
+
+	run->nregions = 0;
+	run->next = 0;
+
+	for (y = (phase >> 2) & 1; y < ry; y += 2)
+	{
+		for (z = (phase >> 1) & 1; z < rz; z += 2)
+		{
+			for (x = phase & 1; x < rx; x += 2)
+			{
+				unsigned r = x + (z + y * rz) * rx;
+				if (run->offset[r] < run->offset[r + 1]) run->regions[run->nregions++] = r;
+			}
+		}
+	}
+
+	if (run->nregions == 0) return;
+
+	/* Don't wake more threads than there are regions to go around */
+	unsigned threads = run->threads < run->nregions ? run->threads : run->nregions;
+
+	run->pending = threads - 1;
+	for (t = 1; t < threads; t++)
+	{
+		worker_queue(&s_region_worker, &run->jobs[t]);
+	}
+
+	level_physics_run_regions(&run->jobs[0]);
+
+	pthread_mutex_lock(&run->mutex);
+	while (run->pending > 0) pthread_cond_wait(&run->cond, &run->mutex);
+	pthread_mutex_unlock(&run->mutex);
+
+	level_physics_merge(run);
+}
+
+/* Run the whole of a level's swapped physics list in parallel. Returns false
+ * without running anything if the list is too small or parallel physics is
+ * disabled, in which case physics should be run as usual. */
+bool level_physics_run_parallel(struct level_t *level)
+{
+	if (s_region_threads < 2) return false;
+	if (level->physics2.used < LEVEL_PHYSICS_PARALLEL_MIN) return false;
+
+	struct level_physics_run_t run;
+	memset(&run, 0, sizeof run);
+	run.level = level;
+	run.threads = s_region_threads;
+
+	bool ok = false;
+	struct level_physics_job_t jobs[run.threads];
+	memset(jobs, 0, sizeof jobs);
+	run.jobs = jobs;
+
+	if (level_physics_sort(&run))
+	{
+		unsigned phase, t;
+
+		for (t = 0; t < run.threads; t++)
+		{
+			jobs[t].run = &run;
+		}
+
+		pthread_mutex_init(&run.mutex, NULL);
+		pthread_cond_init(&run.cond, NULL);
+
+		for (phase = 0; phase < 8; phase++)
+		{
+			level_physics_run_phase(&run, phase);
+		}
+
+		pthread_cond_destroy(&run.cond);
+		pthread_mutex_destroy(&run.mutex);
+
+		for (t = 0; t < run.threads; t++)
+		{
+			block_update_list_free(&jobs[t].updates);
+			block_update_map_free(&jobs[t].map);
+		}
+
+		ok = true;
+	}
+	else
+	{
+		LOG("Unable to allocate parallel physics run for %s\n", level->name);
+	}
+
+	free(run.order);
+	free(run.offset);
+	free(run.regions);
+
+	return ok;
+}
+
+void level_physics_init(void)
+{
+	int threads;
+	if (!config_get_int("physics_region_threads", &threads) || threads < 2) return;
+	if (threads > WORKER_MAX_THREADS) threads = WORKER_MAX_THREADS;
+
+	s_region_threads = threads;
+
+	/* The thread running the level's tick takes a share of the regions */
+	worker_init(&s_region_worker, "region", 30000, 10, threads - 1, &level_physics_worker);
+}
+
+void level_physics_deinit(void)
+{
+	if (s_region_threads < 2) return;
+
+	s_region_threads = 0;
+	worker_deinit(&s_region_worker);
+}
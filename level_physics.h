@@ -0,0 +1,24 @@
+#ifndef LEVEL_PHYSICS_H
+#define LEVEL_PHYSICS_H
+
+#include <stdbool.h>
+#include "block.h"
+#include "physics.h"
+
+/* Physics runs with at least this many active blocks are split by region
+ * and processed in parallel, if physics_region_threads is set */
+#define LEVEL_PHYSICS_PARALLEL_MIN 16384
+
+struct level_t;
+
+/* Set while a thread runs physics for part of a level, so its block updates
+ * are kept apart from those of other threads until they are merged */
+extern __thread struct block_update_list_t *g_physics_updates;
+extern __thread struct block_update_map_t *g_physics_updates_map;
+
+void level_physics_init(void);
+void level_physics_deinit(void);
+
+bool level_physics_run_parallel(struct level_t *level);
+
+#endif /* LEVEL_PHYSICS_H */
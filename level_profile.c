@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "block.h"
+#include "client.h"
+#include "level.h"
+#include "level_profile.h"
+#include "mcc.h"
+
+/* Upper bounds of the tick duration buckets, the last is open ended */
+static const unsigned level_profile_bucket_ms[LEVEL_PROFILE_BUCKETS] = { 1, 2, 5, 10, 20, 40, 80, 0 };
+static const char *level_profile_func_names[LEVEL_PROFILE_FUNCS] = { "physics", "convert", "delete" };
+
+/* The profile is kept once allocated, as callbacks on other threads may be
+ * using it, and is only freed when the level is unloaded. */
+void level_profile_enable(struct level_t *level, bool enabled)
+{
+	if (level->profile == NULL)
+	{
+		if (!enabled) return;
+
+		struct level_profile_t *p = calloc(1, sizeof *p);
+		if (p == NULL)
+		{
+			LOG("Unable to allocate profile for %s\n", level->name);
+			return;
+		}
+		p->start = time(NULL);
+		level->profile = p;
+	}
+
+	level->profile->enabled = enabled;
+}
+
+void level_profile_reset(struct level_t *level)
+{
+	struct level_profile_t *p = level->profile;
+	if (p == NULL) return;
+
+	memset(p->blocktypes, 0, sizeof p->blocktypes);
+	memset(p->ticks, 0, sizeof p->ticks);
+	p->physics_max = 0;
+	p->updates_max = 0;
+	p->start = time(NULL);
+}
+
+void level_profile_tick(struct level_t *level, unsigned ms, size_t physics, size_t updates)
+{
+	struct level_profile_t *p = level->profile;
+	if (p == NULL || !p->enabled) return;
+
+	int i;
+	for (i = 0; i < LEVEL_PROFILE_BUCKETS - 1; i++)
+	{
+		if (ms < level_profile_bucket_ms[i]) break;
+	}
+	p->ticks[i]++;
+
+	if (physics > p->physics_max) p->physics_max = physics;
+	if (updates > p->updates_max) p->updates_max = updates;
+}
+
+static const char *level_profile_blocktype_name(int type)
+{
+	const char *name = blocktype_get_name(type);
+	return name == NULL ? "unknown" : name;
+}
+
+static uint64_t level_profile_total(const struct level_profile_blocktype_t *bt)
+{
+	return bt->ns[LEVEL_PROFILE_PHYSICS] + bt->ns[LEVEL_PROFILE_CONVERT] + bt->ns[LEVEL_PROFILE_DELETE];
+}
+
+/* Show tick durations, queue lengths and the blocktypes taking the most time */
+void level_profile_show(struct level_t *level, struct client_t *c)
+{
+	struct level_profile_t *p = level->profile;
+	char buf[128];
+	int i, j;
+
+	if (p == NULL)
+	{
+		client_notify(c, "Profiling is not enabled for this level");
+		return;
+	}
+
+	snprintf(buf, sizeof buf, "Profile for %s, %s, over %llds", level->name, p->enabled ? "on" : "off", (long long)(time(NULL) - p->start));
+	client_notify(c, buf);
+
+	char *bufp = buf;
+	bufp += snprintf(bufp, sizeof buf, "Ticks:");
+	for (i = 0; i < LEVEL_PROFILE_BUCKETS; i++)
+	{
+		if (level_profile_bucket_ms[i] == 0)
+		{
+			bufp += snprintf(bufp, sizeof buf - (bufp - buf), " %u+ %u", level_profile_bucket_ms[i - 1], p->ticks[i]);
+		}
+		else
+		{
+			bufp += snprintf(bufp, sizeof buf - (bufp - buf), " <%u %u", level_profile_bucket_ms[i], p->ticks[i]);
+		}
+	}
+	client_notify(c, buf);
+
+	snprintf(buf, sizeof buf, "Max physics: %zu  updates: %zu", p->physics_max, p->updates_max);
+	client_notify(c, buf);
+
+	/* Top five blocktypes by total time */
+	int top[5];
+	int n = 0;
+	for (i = 0; i < LEVEL_PROFILE_BLOCKTYPES; i++)
+	{
+		uint64_t t = level_profile_total(&p->blocktypes[i]);
+		if (t == 0) continue;
+
+		for (j = n; j > 0 && level_profile_total(&p->blocktypes[top[j - 1]]) < t; j--)
+		{
+			if (j < 5) top[j] = top[j - 1];
+		}
+		if (j < 5)
+		{
+			top[j] = i;
+			if (n < 5) n++;
+		}
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		const struct level_profile_blocktype_t *bt = &p->blocktypes[top[i]];
+		snprintf(buf, sizeof buf, "%s: p %llu/%llums c %llu/%llums d %llu/%llums",
+				level_profile_blocktype_name(top[i]),
+				(unsigned long long)bt->count[LEVEL_PROFILE_PHYSICS], (unsigned long long)bt->ns[LEVEL_PROFILE_PHYSICS] / 1000000,
+				(unsigned long long)bt->count[LEVEL_PROFILE_CONVERT], (unsigned long long)bt->ns[LEVEL_PROFILE_CONVERT] / 1000000,
+				(unsigned long long)bt->count[LEVEL_PROFILE_DELETE], (unsigned long long)bt->ns[LEVEL_PROFILE_DELETE] / 1000000);
+		client_notify(c, buf);
+	}
+}
+
+/* Append every level's profile to profile.log, one record per line as
+ * space separated key value pairs. Counters are cumulative since the
+ * profile was started or reset. Levels without a profile get one. */
+void level_profile_dump(void *arg)
+{
+	FILE *f = fopen("profile.log", "a");
+	if (f == NULL)
+	{
+		LOG("Unable to open profile.log\n");
+		return;
+	}
+
+	long long now = time(NULL);
+	unsigned i;
+	int j, k;
+
+	for (i = 0; i < s_levels.used; i++)
+	{
+		struct level_t *l = s_levels.items[i];
+		if (l == NULL) continue;
+
+		if (l->profile == NULL) level_profile_enable(l, true);
+		struct level_profile_t *p = l->profile;
+		if (p == NULL || !p->enabled) continue;
+
+		fprintf(f, "time %lld level %s since %lld physics_max %zu updates_max %zu", now, l->name, (long long)p->start, p->physics_max, p->updates_max);
+		for (j = 0; j < LEVEL_PROFILE_BUCKETS; j++)
+		{
+			if (level_profile_bucket_ms[j] == 0)
+			{
+				fprintf(f, " ticks_ge%u %u", level_profile_bucket_ms[j - 1], p->ticks[j]);
+			}
+			else
+			{
+				fprintf(f, " ticks_lt%u %u", level_profile_bucket_ms[j], p->ticks[j]);
+			}
+		}
+		fprintf(f, "\n");
+
+		for (j = 0; j < LEVEL_PROFILE_BLOCKTYPES; j++)
+		{
+			const struct level_profile_blocktype_t *bt = &p->blocktypes[j];
+			if (bt->count[LEVEL_PROFILE_PHYSICS] == 0 && bt->count[LEVEL_PROFILE_CONVERT] == 0 && bt->count[LEVEL_PROFILE_DELETE] == 0) continue;
+
+			fprintf(f, "time %lld level %s blocktype %s", now, l->name, level_profile_blocktype_name(j));
+			for (k = 0; k < LEVEL_PROFILE_FUNCS; k++)
+			{
+				fprintf(f, " %s_count %llu %s_ns %llu",
+						level_profile_func_names[k], (unsigned long long)bt->count[k],
+						level_profile_func_names[k], (unsigned long long)bt->ns[k]);
+			}
+			fprintf(f, "\n");
+		}
+	}
+
+	fclose(f);
+}
@@ -0,0 +1,67 @@
+#ifndef LEVEL_PROFILE_H
+#define LEVEL_PROFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Per level counts and times of blocktype callbacks, tick durations and
+ * queue lengths. Enabled per level with /profile, or for every level by
+ * setting profile_interval, which also dumps them to profile.log every that
+ * many milliseconds. */
+
+enum
+{
+	LEVEL_PROFILE_PHYSICS,
+	LEVEL_PROFILE_CONVERT,
+	LEVEL_PROFILE_DELETE,
+	LEVEL_PROFILE_FUNCS,
+};
+
+/* Block types are 12 bits */
+#define LEVEL_PROFILE_BLOCKTYPES 4096
+#define LEVEL_PROFILE_BUCKETS 8
+
+struct client_t;
+struct level_t;
+
+struct level_profile_blocktype_t
+{
+	uint64_t count[LEVEL_PROFILE_FUNCS];
+	uint64_t ns[LEVEL_PROFILE_FUNCS];
+};
+
+struct level_profile_t
+{
+	bool enabled;
+	time_t start;
+
+	struct level_profile_blocktype_t blocktypes[LEVEL_PROFILE_BLOCKTYPES];
+
+	/* Ticks by duration, see level_profile_bucket_ms */
+	unsigned ticks[LEVEL_PROFILE_BUCKETS];
+	size_t physics_max, updates_max;
+};
+
+static inline uint64_t level_profile_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Callbacks may run on several threads at once */
+static inline void level_profile_record(struct level_profile_t *p, int func, unsigned type, uint64_t start)
+{
+	struct level_profile_blocktype_t *bt = &p->blocktypes[type % LEVEL_PROFILE_BLOCKTYPES];
+	__sync_fetch_and_add(&bt->count[func], 1);
+	__sync_fetch_and_add(&bt->ns[func], level_profile_now() - start);
+}
+
+void level_profile_enable(struct level_t *level, bool enabled);
+void level_profile_reset(struct level_t *level);
+void level_profile_tick(struct level_t *level, unsigned ms, size_t physics, size_t updates);
+void level_profile_show(struct level_t *level, struct client_t *c);
+void level_profile_dump(void *arg);
+
+#endif /* LEVEL_PROFILE_H */
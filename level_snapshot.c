@@ -0,0 +1,364 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "block.h"
+#include "level.h"
+#include "level_snapshot.h"
+#include "mcc.h"
+#include "packet.h"
+#include "worker.h"
+
+/* Levels are split into slabs of at least this many blocks, which are
+ * serialized and compressed in parallel. */
+#define SNAPSHOT_SLAB_MIN (1 << 20)
+/* Amount of preceding data used to prime each slab's compressor */
+#define SNAPSHOT_DICT_SIZE 32768
+
+struct level_snapshot_slab_t;
+
+/* One pass over every slab of a snapshot */
+struct level_snapshot_run_t
+{
+	void (*func)(struct level_snapshot_slab_t *slab);
+
+	unsigned pending;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+struct level_snapshot_slab_t
+{
+	struct level_snapshot_run_t *run;
+	struct level_t *level;
+	unsigned filter;
+
+	/* Serialized level, shared by all slabs. Offset 0 is the 4 byte length
+	 * header, so block n lives at offset n + 4. */
+	uint8_t *buffer;
+	unsigned start, end;
+	bool last;
+
+	uint8_t *out;
+	size_t out_len;
+	uLong crc;
+	bool ok;
+};
+
+static struct worker s_snapshot_worker;
+static unsigned s_snapshot_threads;
+
+static void level_snapshot_serialize_slab(struct level_snapshot_slab_t *slab)
+{
+	struct level_t *level = slab->level;
+	unsigned x;
+
+	unsigned start = slab->start < 4 ? 0 : slab->start - 4;
+	unsigned end = slab->end - 4;
+	uint8_t *bufp = slab->buffer + start + 4;
+
+	for (x = start; x < end; x++)
+	{
+		if (slab->filter > 0)
+		{
+			*bufp++ = (level_block_owner(level, x) == slab->filter) ? convert_index(level, x) : AIR;
+		}
+		else
+		{
+			*bufp++ = convert_index(level, x);
+		}
+	}
+}
+
+/* Raw deflate one slab. All but the last end on a sync flush so the slabs
+ * can be concatenated into a single deflate stream. */
+static void level_snapshot_compress_slab(struct level_snapshot_slab_t *slab)
+{
+	unsigned len = slab->end - slab->start;
+	z_stream z;
+
+	slab->crc = crc32(0L, slab->buffer + slab->start, len);
+
+	memset(&z, 0, sizeof z);
+	if (deflateInit2(&z, 5, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		LOG("level_snapshot: deflateInit2() failed\n");
+		return;
+	}
+
+	if (slab->start > 0)
+	{
+		unsigned dict = slab->start < SNAPSHOT_DICT_SIZE ? slab->start : SNAPSHOT_DICT_SIZE;
+		deflateSetDictionary(&z, slab->buffer + slab->start - dict, dict);
+	}
+
+	/* Room for the sync flush marker on top of the worst case */
+	size_t size = deflateBound(&z, len) + 16;
+	slab->out = malloc(size);
+	if (slab->out == NULL)
+	{
+		LOG("level_snapshot: Unable to allocate %zu bytes\n", size);
+		deflateEnd(&z);
+		return;
+	}
+
+	z.next_in = slab->buffer + slab->start;
+	z.avail_in = len;
+	z.next_out = slab->out;
+	z.avail_out = size;
+
+	int r = deflate(&z, slab->last ? Z_FINISH : Z_SYNC_FLUSH);
+	slab->out_len = size - z.avail_out;
+	slab->ok = slab->last ? r == Z_STREAM_END : (r == Z_OK && z.avail_in == 0 && z.avail_out > 0);
+
+	deflateEnd(&z);
+}
+
+static void level_snapshot_worker(void *arg)
+{
+	struct level_snapshot_slab_t *slab = arg;
+	struct level_snapshot_run_t *run = slab->run;
+
+	run->func(slab);
+
+	pthread_mutex_lock(&run->mutex);
+	if (--run->pending == 0) pthread_cond_signal(&run->cond);
+	pthread_mutex_unlock(&run->mutex);
+}
+
+/* Run func over every slab. The calling thread takes the first slab itself,
+ * the rest are queued to the snapshot workers. */
+static void level_snapshot_run_slabs(struct level_snapshot_slab_t *slabs, unsigned n, void (*func)(struct level_snapshot_slab_t *slab))
+{
+	struct level_snapshot_run_t run;
+	unsigned i;
+
+	run.func = func;
+	run.pending = n - 1;
+	pthread_mutex_init(&run.mutex, NULL);
+	pthread_cond_init(&run.cond, NULL);
+
+	for (i = 1; i < n; i++)
+	{
+		slabs[i].run = &run;
+		worker_queue(&s_snapshot_worker, &slabs[i]);
+	}
+
+	func(&slabs[0]);
+
+	pthread_mutex_lock(&run.mutex);
+	while (run.pending > 0) pthread_cond_wait(&run.cond, &run.mutex);
+	pthread_mutex_unlock(&run.mutex);
+
+	pthread_cond_destroy(&run.cond);
+	pthread_mutex_destroy(&run.mutex);
+}
+
+/* Frame compressed data into level data chunk packets */
+struct level_snapshot_framer_t
+{
+	struct level_snapshot_t *s;
+	uint8_t chunk[sizeof (data_t)];
+	unsigned used;
+	size_t pos, total;
+};
+
+static void level_snapshot_frame_flush(struct level_snapshot_framer_t *f)
+{
+	if (f->used == 0) return;
+
+	f->s->length += packet_write_level_data_chunk(f->s->data + f->s->length, f->used, f->chunk, f->pos * 100 / f->total);
+	f->used = 0;
+}
+
+static void level_snapshot_frame(struct level_snapshot_framer_t *f, const uint8_t *data, size_t len)
+{
+	while (len > 0)
+	{
+		size_t n = sizeof f->chunk - f->used;
+		if (n > len) n = len;
+
+		memcpy(f->chunk + f->used, data, n);
+		f->used += n;
+		f->pos += n;
+		data += n;
+		len -= n;
+
+		if (f->used == sizeof f->chunk) level_snapshot_frame_flush(f);
+	}
+}
+
+static struct level_snapshot_t *level_snapshot_build(struct level_t *level, unsigned filter)
+{
+	unsigned length = level->x * level->y * level->z;
+	unsigned i;
+
+	struct level_snapshot_t *s = calloc(1, sizeof *s);
+	if (s == NULL) return NULL;
+
+	s->refcount = 1;
+	s->generation = level->generation;
+	s->blocktype_serial = blocktype_serial();
+
+	uint8_t *buffer = malloc(4 + length);
+	if (buffer == NULL)
+	{
+		LOG("level_snapshot: Unable to allocate %u bytes\n", 4 + length);
+		level_snapshot_release(s);
+		return NULL;
+	}
+
+	buffer[0] = (length >> 24) & 0xFF;
+	buffer[1] = (length >> 16) & 0xFF;
+	buffer[2] = (length >>  8) & 0xFF;
+	buffer[3] =  length	& 0xFF;
+
+	unsigned n = length / SNAPSHOT_SLAB_MIN;
+	if (n > s_snapshot_threads + 1) n = s_snapshot_threads + 1;
+	if (n < 1) n = 1;
+
+	struct level_snapshot_slab_t slabs[n];
+	memset(slabs, 0, sizeof slabs);
+
+	unsigned slab_size = (4 + length) / n;
+	for (i = 0; i < n; i++)
+	{
+		slabs[i].level = level;
+		slabs[i].filter = filter;
+		slabs[i].buffer = buffer;
+		slabs[i].start = i * slab_size;
+		slabs[i].end = (i == n - 1) ? 4 + length : (i + 1) * slab_size;
+		slabs[i].last = (i == n - 1);
+	}
+
+	/* Serialize everything before compressing anything, as each slab is
+	 * primed with the tail of the previous one. */
+	level_snapshot_run_slabs(slabs, n, &level_snapshot_serialize_slab);
+	level_snapshot_run_slabs(slabs, n, &level_snapshot_compress_slab);
+
+	free(buffer);
+
+	/* Stitch the slabs together into a gzip stream */
+	static const uint8_t header[10] = { 0x1F, 0x8B, 0x08, 0, 0, 0, 0, 0, 0, 0x03 };
+	uint8_t trailer[8];
+	uLong crc = crc32(0L, Z_NULL, 0);
+	size_t total = sizeof header + sizeof trailer;
+	bool ok = true;
+
+	for (i = 0; i < n; i++)
+	{
+		ok &= slabs[i].ok;
+		crc = crc32_combine(crc, slabs[i].crc, slabs[i].end - slabs[i].start);
+		total += slabs[i].out_len;
+	}
+
+	size_t chunks = (total + sizeof (data_t) - 1) / sizeof (data_t);
+	s->data = ok ? malloc(chunks * PACKET_LEVEL_DATA_CHUNK_SIZE) : NULL;
+	if (s->data != NULL)
+	{
+		for (i = 0; i < 4; i++)
+		{
+			trailer[i]     = (crc >> (i * 8)) & 0xFF;
+			trailer[i + 4] = ((4 + length) >> (i * 8)) & 0xFF;
+		}
+
+		struct level_snapshot_framer_t f;
+		f.s = s;
+		f.used = 0;
+		f.pos = 0;
+		f.total = total;
+
+		level_snapshot_frame(&f, header, sizeof header);
+		for (i = 0; i < n; i++)
+		{
+			level_snapshot_frame(&f, slabs[i].out, slabs[i].out_len);
+		}
+		level_snapshot_frame(&f, trailer, sizeof trailer);
+		level_snapshot_frame_flush(&f);
+	}
+	else if (ok)
+	{
+		LOG("level_snapshot: Unable to allocate %zu bytes\n", chunks * PACKET_LEVEL_DATA_CHUNK_SIZE);
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		free(slabs[i].out);
+	}
+
+	if (s->data == NULL)
+	{
+		level_snapshot_release(s);
+		return NULL;
+	}
+
+	return s;
+}
+
+static inline bool level_snapshot_valid(const struct level_t *level, const struct level_snapshot_t *s)
+{
+	return s->generation == level->generation && s->blocktype_serial == blocktype_serial();
+}
+
+/* Get a snapshot of a level for sending to a client. Unfiltered snapshots are
+ * cached on the level and shared until the level changes, filtered snapshots
+ * are built for the caller alone. Release with level_snapshot_release().
+ *
+ * Concurrent joiners of the same level wait for a single build, joiners of
+ * different levels build in parallel. */
+struct level_snapshot_t *level_snapshot_get(struct level_t *level, unsigned filter)
+{
+	if (filter > 0) return level_snapshot_build(level, filter);
+
+	pthread_mutex_lock(&level->snapshot_mutex);
+	struct level_snapshot_t *s = level->snapshot;
+	if (s == NULL || !level_snapshot_valid(level, s))
+	{
+		level_snapshot_release(s);
+		level->snapshot = s = level_snapshot_build(level, 0);
+	}
+	if (s != NULL) __sync_add_and_fetch(&s->refcount, 1);
+	pthread_mutex_unlock(&level->snapshot_mutex);
+
+	return s;
+}
+
+void level_snapshot_release(struct level_snapshot_t *s)
+{
+	if (s == NULL) return;
+	if (__sync_sub_and_fetch(&s->refcount, 1) > 0) return;
+
+	free(s->data);
+	free(s);
+}
+
+/* Drop the cached snapshot of a level, e.g. when it is unloaded. */
+void level_snapshot_clear(struct level_t *level)
+{
+	pthread_mutex_lock(&level->snapshot_mutex);
+	level_snapshot_release(level->snapshot);
+	level->snapshot = NULL;
+	pthread_mutex_unlock(&level->snapshot_mutex);
+}
+
+void level_snapshot_init(void)
+{
+	unsigned threads = worker_cpus();
+	if (threads > WORKER_MAX_THREADS + 1) threads = WORKER_MAX_THREADS + 1;
+	if (threads < 2) return;
+
+	/* The thread building the snapshot takes a slab of its own. Builders
+	 * block until their slabs are done, so keep the threads rather than
+	 * rely on them being restarted. */
+	s_snapshot_threads = threads - 1;
+	worker_init(&s_snapshot_worker, "snapshot", 0, 1, s_snapshot_threads, &level_snapshot_worker);
+}
+
+void level_snapshot_deinit(void)
+{
+	if (s_snapshot_threads == 0) return;
+
+	s_snapshot_threads = 0;
+	worker_deinit(&s_snapshot_worker);
+}
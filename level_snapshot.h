@@ -0,0 +1,29 @@
+#ifndef LEVEL_SNAPSHOT_H
+#define LEVEL_SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct level_t;
+
+/* A serialized, compressed and framed copy of a level, ready to be copied
+ * straight into a client's send buffer. Shared between joining clients until
+ * the level changes. */
+struct level_snapshot_t
+{
+	int refcount;
+	unsigned generation;
+	unsigned blocktype_serial;
+
+	size_t length;
+	uint8_t *data;
+};
+
+void level_snapshot_init(void);
+void level_snapshot_deinit(void);
+
+struct level_snapshot_t *level_snapshot_get(struct level_t *level, unsigned filter);
+void level_snapshot_release(struct level_snapshot_t *snapshot);
+void level_snapshot_clear(struct level_t *level);
+
+#endif /* LEVEL_SNAPSHOT_H */
@@ -1,6 +1,10 @@
+#include <pthread.h>
 #include "worker.h"
 #include "client.h"
 #include "level.h"
+#include "level_backup.h"
+#include "level_snapshot.h"
+#include "player.h"
 #include "level_worker.h"
 
 struct {
@@ -8,8 +12,16 @@ struct {
 	struct worker load;
 	struct worker make;
 	struct worker send;
+	struct worker backup;
 } s_level_workers;
 
+/* Clients currently being sent a level, clients queued again while being
+ * sent, and clients parked until the level they want is available. */
+static pthread_mutex_t s_send_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct client_list_t s_send_active;
+static struct client_list_t s_send_again;
+static struct client_list_t s_send_waiting;
+
 struct level_make_job
 {
 	struct level_t *level;
@@ -34,24 +46,67 @@ void make_worker(void *data)
 	free(job);
 }
 
+void backup_worker(void *data)
+{
+	level_backup_run(data);
+}
+
 void send_worker(void *data)
 {
 	struct client_t *client = data;
 
-	if (client_inuse(client, true))
+	if (!client_inuse(client, true)) return;
+
+	/* Only one thread may send to a client at a time */
+	pthread_mutex_lock(&s_send_mutex);
+	if (client_list_contains(&s_send_active, client))
 	{
-		level_send(client);
-		if (client->waiting_for_level) level_send_queue(client);
+		if (!client_list_contains(&s_send_again, client)) client_list_add(&s_send_again, client);
+		pthread_mutex_unlock(&s_send_mutex);
 		client_inuse(client, false);
+		return;
+	}
+	client_list_add(&s_send_active, client);
+	pthread_mutex_unlock(&s_send_mutex);
+
+	level_send(client);
+
+	bool wait = client->waiting_for_level && !client->close;
+	bool again;
+
+	pthread_mutex_lock(&s_send_mutex);
+	client_list_del_item(&s_send_active, client);
+	again = client_list_contains(&s_send_again, client);
+	if (again) client_list_del_item(&s_send_again, client);
+	else if (wait) client_list_add(&s_send_waiting, client);
+	pthread_mutex_unlock(&s_send_mutex);
+
+	if (again)
+	{
+		level_send_queue(client);
 	}
+	else if (wait)
+	{
+		/* The level may have become free before we were parked */
+		struct level_t *level = client->player->new_level;
+		if (level != NULL && pthread_mutex_trylock(&level->mutex) == 0)
+		{
+			pthread_mutex_unlock(&level->mutex);
+			level_send_wake(level);
+		}
+	}
+
+	client_inuse(client, false);
 }
 
 void level_worker_init(void)
 {
-	worker_init(&s_level_workers.save, "save", 30000, 10, &save_worker);
-	worker_init(&s_level_workers.load, "load", 30000, 1, &load_worker);
-	worker_init(&s_level_workers.make, "make", 30000, 10, &make_worker);
-	worker_init(&s_level_workers.send, "send", 30000, 1, &send_worker);
+	worker_init(&s_level_workers.save, "save", 30000, 10, 1, &save_worker);
+	worker_init(&s_level_workers.load, "load", 30000, 1, 1, &load_worker);
+	worker_init(&s_level_workers.make, "make", 30000, 10, 1, &make_worker);
+	worker_init(&s_level_workers.send, "send", 30000, 1, worker_cpus(), &send_worker);
+	worker_init(&s_level_workers.backup, "backup", 30000, 15, 1, &backup_worker);
+	level_snapshot_init();
 }
 
 void level_worker_deinit(void)
@@ -60,6 +115,12 @@ void level_worker_deinit(void)
 	worker_deinit(&s_level_workers.load);
 	worker_deinit(&s_level_workers.make);
 	worker_deinit(&s_level_workers.send);
+	worker_deinit(&s_level_workers.backup);
+	level_snapshot_deinit();
+
+	client_list_free(&s_send_active);
+	client_list_free(&s_send_again);
+	client_list_free(&s_send_waiting);
 }
 
 void level_save_queue(struct level_t *level)
@@ -85,3 +146,44 @@ void level_send_queue(struct client_t *client)
 {
 	worker_queue(&s_level_workers.send, client);
 }
+
+void level_backup_queue(struct level_backup_job_t *job)
+{
+	worker_queue(&s_level_workers.backup, job);
+}
+
+/* Queue sends for clients parked waiting on a level, once that level's
+ * mutex has been released. */
+void level_send_wake(struct level_t *level)
+{
+	size_t i;
+
+	pthread_mutex_lock(&s_send_mutex);
+	for (i = 0; i < s_send_waiting.used; )
+	{
+		struct client_t *c = s_send_waiting.items[i];
+
+		if (!client_inuse(c, true))
+		{
+			client_list_del_index(&s_send_waiting, i);
+			continue;
+		}
+
+		if (!c->waiting_for_level || c->close || c->player == NULL)
+		{
+			client_list_del_index(&s_send_waiting, i);
+		}
+		else if (c->player->new_level == level)
+		{
+			client_list_del_index(&s_send_waiting, i);
+			level_send_queue(c);
+		}
+		else
+		{
+			i++;
+		}
+
+		client_inuse(c, false);
+	}
+	pthread_mutex_unlock(&s_send_mutex);
+}
@@ -3,6 +3,7 @@
 
 struct client_t;
 struct level_t;
+struct level_backup_job_t;
 
 void level_worker_init(void);
 void level_worker_deinit(void);
@@ -11,5 +12,7 @@ void level_save_queue(struct level_t *level);
 void level_load_queue(struct level_t *level);
 void level_make_queue(struct level_t *level, const char *type);
 void level_send_queue(struct client_t *client);
+void level_send_wake(struct level_t *level);
+void level_backup_queue(struct level_backup_job_t *job);
 
 #endif /* LEVEL_WORKER_H */
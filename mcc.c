@@ -4,9 +4,11 @@
 #include "block.h"
 #include "config.h"
 #include "commands.h"
+#include "epoch.h"
 #include "mcc.h"
 #include "level.h"
 #include "level_worker.h"
+#include "level_profile.h"
 #include "astar_worker.h"
 #include "module.h"
 #include "network.h"
@@ -16,6 +18,7 @@
 #include "client.h"
 #include "socket.h"
 #include "timer.h"
+#include "undodb.h"
 #include "gettime.h"
 
 struct server_t g_server;
@@ -42,6 +45,8 @@ void mcc_exit(void)
 		}
 	}
 
+	undodb_worker_deinit();
+
 	modules_deinit();
 	level_list_free(&s_levels);
 	level_hooks_deinit();
@@ -131,10 +136,13 @@ int main(int argc, char **argv)
 
 	if (!config_get_int("usleep", &g_server.usleep)) g_server.usleep = 50;
 	if (!config_get_int("physics_usleep", &g_server.physics_usleep)) g_server.physics_usleep = 1000;
+	if (!config_get_int("view_distance", &g_server.view_distance)) g_server.view_distance = 64;
+	if (!config_get_int("far_pos_interval", &g_server.far_pos_interval)) g_server.far_pos_interval = 400;
 
 	level_worker_init();
 	astar_worker_init();
 	network_worker_init();
+	undodb_worker_init();
 
 	commands_init();
 
@@ -155,10 +163,17 @@ int main(int argc, char **argv)
 
 	register_timer("save levels", 120000, &level_save_all, NULL, true);
 	register_timer("unload levels", 20000, &level_unload_empty, NULL, true);
+	register_timer("flush undo", UNDODB_FLUSH_INTERVAL, &undodb_flush_queue, NULL, true);
 	register_timer("salt", 15 * 60 * 1000, &generate_salt, NULL, false);
 	register_timer("positions", g_server.pos_interval, &update_positions, NULL, true);
 	register_timer("cputime", 1000, &update_cputime, NULL, true);
 
+	int profile_interval;
+	if (config_get_int("profile_interval", &profile_interval) && profile_interval > 0)
+	{
+		register_timer("profile", profile_interval, &level_profile_dump, NULL, true);
+	}
+
 	if (!level_load("main", NULL))
 	{
 		struct level_t *l = malloc(sizeof *l);
@@ -183,9 +198,12 @@ int main(int argc, char **argv)
 
 	while (!g_server.exit)
 	{
+		unsigned epoch = epoch_enter();
 		net_run();
 		socket_run();
 		process_timers(gettime());
+		epoch_exit(epoch);
+
 		usleep(g_server.usleep);
 	}
 
@@ -20,6 +20,10 @@ struct server_t
 	clock_t cpu_start;
 	double cpu_time;
 	int pos_interval;
+	/* Players further than this many blocks away get positions every
+	 * far_pos_interval ms instead of every update */
+	int view_distance;
+	int far_pos_interval;
 	int cuboid_max;
 	int usleep;
 	int physics_usleep;
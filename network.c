@@ -2,6 +2,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
@@ -11,6 +12,7 @@
 #include <pthread.h>
 #include "client.h"
 #include "level.h"
+#include "level_grid.h"
 #include "packet.h"
 #include "player.h"
 #include "network.h"
@@ -75,32 +77,16 @@ static struct sockaddr_in6 serv_addr;
 static void net_close_real(struct client_t *c)
 {
 	char buf[128];
-	struct packet_t *p;
-	unsigned packets = 0;
-
-	/* Remove all queued packets */
-	while (c->packet_send != NULL)
-	{
-		p = c->packet_send;
-		c->packet_send = p->next;
-		free(p);
-
-		packets++;
-	}
-
-	if (packets > 0)
-	{
-		LOG("[network] removed %u packets from queue\n", packets);
-	}
 
 	char *reason = c->close_reason;
 
-	/* Send client disconnect message straight away */
-	if (reason != NULL)
+	/* Send client disconnect message straight away. net_close() has already
+	 * discarded the rest of the queue, so only that message remains. */
+	if (reason != NULL && c->send_len > 0)
 	{
-		p = packet_send_disconnect_player(reason);
-		send(c->sock, p->buffer, p->loc - p->buffer, MSG_NOSIGNAL);
-		free(p);
+		size_t len = c->send_size - c->send_head;
+		if (len > c->send_len) len = c->send_len;
+		send(c->sock, c->send_buf + c->send_head, len, MSG_NOSIGNAL);
 	}
 
 	close(c->sock);
@@ -129,6 +115,7 @@ static void net_close_real(struct client_t *c)
 		{
 			client_send_despawn(c, false);
 			c->player->level->clients[c->player->levelid] = NULL;
+			level_grid_player_remove(c->player->level, c->player->levelid);
 		}
 
 		if (reason == NULL)
@@ -155,68 +142,91 @@ static void net_close_real(struct client_t *c)
 	}
 
 	free(c->packet_recv);
+	free(c->send_buf);
 	free(c);
 }
 
 void net_close(struct client_t *c, const char *reason)
 {
+	if (reason != NULL && !c->close)
+	{
+		/* Drop anything still queued so the disconnect message goes first */
+		client_clear_packets(c);
+		packet_send_disconnect_player(c, reason);
+	}
+
 	c->close = true;
 	c->close_reason = (reason == NULL) ? NULL : strdup(reason);
 }
 
 static void net_packetsend(struct client_t *c)
 {
-	int res;
-	struct packet_t *p = c->packet_send;
+	struct iovec iov[2];
+	struct msghdr msg;
+	ssize_t res;
+	int err = 0;
 
-	if (p == NULL) return;
+	pthread_mutex_lock(&c->packet_send_mutex);
 
-	while (true)
+	/* Drain as much of the send buffer as the kernel will take. The buffer
+	 * may wrap, in which case both halves go out in one sendmsg() call. */
+	while (c->send_len > 0)
 	{
-		p = c->packet_send;
+		size_t first = c->send_size - c->send_head;
+		if (first > c->send_len) first = c->send_len;
+
+		iov[0].iov_base = c->send_buf + c->send_head;
+		iov[0].iov_len  = first;
+		iov[1].iov_base = c->send_buf;
+		iov[1].iov_len  = c->send_len - first;
+
+		memset(&msg, 0, sizeof msg);
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iov[1].iov_len > 0 ? 2 : 1;
 
-		res = send(c->sock, p->buffer, p->loc - p->buffer, MSG_NOSIGNAL);
+		res = sendmsg(c->sock, &msg, MSG_NOSIGNAL);
 		if (res == -1)
 		{
-			if (errno == ECONNRESET)
-			{
-				/* Connection reset by peer... normal disconnect */
-				net_close(c, NULL);
-			}
-			else if (errno != EWOULDBLOCK && errno != EAGAIN)
-			{
-				/* Abnormal error */
-				char buf[128];
-				snprintf(buf, sizeof buf, "send: %s", strerror(errno));
-				net_close(c, buf);
-			}
+			if (errno == EINTR) continue;
+			err = errno;
 			break;
 		}
 
-		pthread_mutex_lock(&c->packet_send_mutex);
-
-		c->packet_send = p->next;
-		free(p);
+		c->send_head = (c->send_head + res) & (c->send_size - 1);
+		c->send_len -= res;
 
-		c->packet_send_count--;
+		/* Kernel didn't take everything we offered, wait for next EPOLLOUT */
+		if ((size_t)res < first + iov[1].iov_len) break;
+	}
 
-		if (c->packet_send == NULL)
-		{
-			/* Send queue is empty, reset packet_send_end */
-			if (c->packet_send_count != 0)
-			{
-				LOG("[network] Reached end of send queue but packet send count is %d for %s\n",
-					c->packet_send_count, c->player == NULL ? c->ip : c->player->username);
-				c->packet_send_count = 0;
-			}
+	if (c->send_len == 0)
+	{
+		socket_clear_write(c->sock);
 
-			socket_clear_write(c->sock);
+		c->send_head = 0;
 
-			c->packet_send_end = &c->packet_send;
+		/* Don't hold on to a large buffer after sending a level */
+		if (c->send_size > CLIENT_SEND_KEEP)
+		{
+			free(c->send_buf);
+			c->send_buf = NULL;
+			c->send_size = 0;
 		}
-		pthread_mutex_unlock(&c->packet_send_mutex);
+	}
 
-		break;
+	pthread_mutex_unlock(&c->packet_send_mutex);
+
+	if (err == ECONNRESET)
+	{
+		/* Connection reset by peer... normal disconnect */
+		net_close(c, NULL);
+	}
+	else if (err != 0 && err != EWOULDBLOCK && err != EAGAIN)
+	{
+		/* Abnormal error */
+		char buf[128];
+		snprintf(buf, sizeof buf, "send: %s", strerror(err));
+		net_close(c, buf);
 	}
 }
 
@@ -297,7 +307,7 @@ void net_run(void)
 	for (i = 0; i < s_clients.used; i++)
 	{
 		struct client_t *c = s_clients.items[i];
-		if (!c->close && c->packet_send_count > 12000)
+		if (!c->close && c->send_len > CLIENT_SEND_LIMIT)
 		{
 			net_close(c, "Excessive send queue");
 		}
@@ -356,7 +366,6 @@ void net_accept(int fd, bool can_write, bool can_read, void *arg)
 			LOG("[network] accepted connection from %s\n", c->ip);
 
 			pthread_mutex_init(&c->packet_send_mutex, NULL);
-			c->packet_send_end = &c->packet_send;
 
 			if (playerdb_check_ban(c->ip))
 			{
@@ -3,6 +3,7 @@
 #include "bitstuff.h"
 #include "client.h"
 #include "level.h"
+#include "level_grid.h"
 #include "packet.h"
 #include "player.h"
 #include "playerdb.h"
@@ -10,6 +11,7 @@
 #include "network.h"
 #include "util.h"
 #include "list.h"
+#include "gettime.h"
 
 static struct npc_list_t s_npcs;
 
@@ -30,7 +32,7 @@ static void npc_send_spawn(struct npc *npc)
 		struct client_t *c = level->clients[i];
 		if (c == NULL || c->sending_level) continue;
 
-		client_add_packet(c, packet_send_spawn_player(npc->levelid, npc->name, &npc->pos));
+		packet_send_spawn_player(c, npc->levelid, npc->name, &npc->pos);
 	}
 }
 
@@ -44,7 +46,7 @@ static void npc_send_despawn(struct npc *npc)
 		struct client_t *c = level->clients[i];
 		if (c == NULL || c->sending_level) continue;
 
-		client_add_packet(c, packet_send_despawn_player(npc->levelid));
+		packet_send_despawn_player(c, npc->levelid);
 	}
 }
 
@@ -89,7 +91,7 @@ void npc_del(struct npc *npc)
 	free(npc);
 }
 
-void npc_send_position(struct npc *npc)
+void npc_send_position(struct npc *npc, unsigned now)
 {
 	int changed = 0;
 	int dx = 0, dy = 0, dz = 0;
@@ -110,10 +112,27 @@ void npc_send_position(struct npc *npc)
 		changed |= 2;
 	}
 
-	if (changed == 0) return;
+	/* As with players, only nearby clients see every step */
+	bool far = (now - npc->fartime >= (unsigned)g_server.far_pos_interval) && !position_equal(&npc->pos, &npc->farpos);
 
-	npc->oldpos = npc->pos;
+	if (changed == 0 && !far) return;
 
+	if (changed != 0)
+	{
+		npc->oldpos = npc->pos;
+	}
+
+	if (far)
+	{
+		npc->farpos = npc->pos;
+		npc->fartime = now;
+	}
+
+	uint64_t near = ~0ULL;
+	if (g_server.view_distance > 0)
+	{
+		near = level_grid_players(npc->level, &npc->pos, g_server.view_distance * 32);
+	}
 
 	unsigned i;
 	for (i = 0; i < MAX_CLIENTS_PER_LEVEL; i++)
@@ -121,22 +140,41 @@ void npc_send_position(struct npc *npc)
 		struct client_t *c = npc->level->clients[i];
 		if (c == NULL || c->sending_level) continue;
 
+		uint64_t bit = 1ULL << i;
+		if ((near & bit) == 0)
+		{
+			npc->synced &= ~bit;
+			if (far) packet_send_teleport_player(c, npc->levelid, &npc->pos);
+			continue;
+		}
+
+		/* Resync before anything else, farpos has already moved on so
+		 * a later far send won't do it */
+		if ((npc->synced & bit) == 0)
+		{
+			npc->synced |= bit;
+			packet_send_teleport_player(c, npc->levelid, &npc->pos);
+			continue;
+		}
+
+		if (changed == 0) continue;
+
 		switch (changed)
 		{
 			case 1:
-				client_add_packet(c, packet_send_position_update(npc->levelid, dx, dy, dz));
+				packet_send_position_update(c, npc->levelid, dx, dy, dz);
 				break;
 
 			case 2:
-				client_add_packet(c, packet_send_orientation_update(npc->levelid, &npc->pos));
+				packet_send_orientation_update(c, npc->levelid, &npc->pos);
 				break;
 
 			case 3:
-				client_add_packet(c, packet_send_full_position_update(npc->levelid, dx, dy, dz, &npc->pos));
+				packet_send_full_position_update(c, npc->levelid, dx, dy, dz, &npc->pos);
 				break;
 
 			default:
-				client_add_packet(c, packet_send_teleport_player(npc->levelid, &npc->pos));
+				packet_send_teleport_player(c, npc->levelid, &npc->pos);
 				break;
 		}
 	}
@@ -144,11 +182,12 @@ void npc_send_position(struct npc *npc)
 
 void npc_send_positions(void)
 {
+	unsigned now = gettime();
 	unsigned i;
 	for (i = 0; i < s_npcs.used; i++)
 	{
 		struct npc *npc = s_npcs.items[i];
-		npc_send_position(npc);
+		npc_send_position(npc, now);
 	}
 }
 
@@ -12,6 +12,9 @@ struct npc
 
 	struct position_t pos;
 	struct position_t oldpos;
+	struct position_t farpos;
+	unsigned fartime;
+	uint64_t synced;
 };
 
 struct npc *npc_add(struct level_t *level, const char *name, struct position_t position);
@@ -24,7 +24,6 @@ struct packet_t *packet_init(size_t len)
 	p->loc = p->buffer;
 	p->size = 0;
 	p->pos = 0;
-	p->next = NULL;
 
 	return p;
 }
@@ -68,18 +67,18 @@ static char *packet_recv_string(struct packet_t *p)
 
 /* Low-level packet sending */
 
-static void packet_send_byte(struct packet_t *p, uint8_t data)
+static void packet_send_byte(uint8_t **loc, uint8_t data)
 {
-	*p->loc++ = data;
+	*(*loc)++ = data;
 }
 
-static void packet_send_short(struct packet_t *p, int16_t data)
+static void packet_send_short(uint8_t **loc, int16_t data)
 {
-	*p->loc++ = ((uint16_t)data >> 8) & 0xFF;;
-	*p->loc++ =  (uint16_t)data	   & 0xFF;
+	*(*loc)++ = ((uint16_t)data >> 8) & 0xFF;
+	*(*loc)++ =  (uint16_t)data	   & 0xFF;
 }
 
-static void packet_send_string(struct packet_t *p, const char *data)
+static void packet_send_string(uint8_t **loc, const char *data)
 {
 	size_t i;
 
@@ -87,17 +86,17 @@ static void packet_send_string(struct packet_t *p, const char *data)
 	if (len > sizeof (string_t)) len = sizeof (string_t);
 	for (i = 0; i < len; i++)
 	{
-		*p->loc++ = data[i];
+		*(*loc)++ = data[i];
 	}
 
 	/* Pad with spaces */
 	for (; i < sizeof (string_t); i++)
 	{
-		*p->loc++ = ' ';
+		*(*loc)++ = ' ';
 	}
 }
 
-static void packet_send_byte_array(struct packet_t *p, const uint8_t *data, int16_t length)
+static void packet_send_byte_array(uint8_t **loc, const uint8_t *data, int16_t length)
 {
 	size_t i;
 
@@ -105,13 +104,13 @@ static void packet_send_byte_array(struct packet_t *p, const uint8_t *data, int1
 	if (len > sizeof (data_t)) len = sizeof (data_t);
 	for (i = 0; i < len; i++)
 	{
-		*p->loc++ = data[i];
+		*(*loc)++ = data[i];
 	}
 
 	/* Pad with zeroes */
 	for (; i < sizeof (data_t); i++)
 	{
-		*p->loc++ = 0x00;
+		*(*loc)++ = 0x00;
 	}
 }
 
@@ -241,7 +240,7 @@ void packet_recv_player_id(struct client_t *c, struct packet_t *p)
 	c->player = player;
 	player->client = c;
 
-	client_add_packet(c, packet_send_player_id(7, g_server.name, g_server.motd, (c->player->rank >= RANK_OP) ? 0x64 : 0));
+	packet_send_player_id(c, 7, g_server.name, g_server.motd, (c->player->rank >= RANK_OP) ? 0x64 : 0);
 
 	call_hook(HOOK_CHAT, buf);
 	net_notify_all(buf);
@@ -373,198 +372,190 @@ void packet_recv(struct client_t *c, struct packet_t *p)
 
 /* Sending packets */
 
-struct packet_t *packet_send_player_id(uint8_t protocol, const char *server_name, const char *server_motd, uint8_t user_type)
+void packet_send_player_id(struct client_t *c, uint8_t protocol, const char *server_name, const char *server_motd, uint8_t user_type)
 {
-	struct packet_t *p = packet_init(131);
-	if (p == NULL) return NULL;
+	uint8_t buf[131], *p = buf;
 
-	packet_send_byte(p, 0x00);
-	packet_send_byte(p, protocol);
-	packet_send_string(p, server_name);
-	packet_send_string(p, server_motd);
-	packet_send_byte(p, user_type);
+	packet_send_byte(&p, 0x00);
+	packet_send_byte(&p, protocol);
+	packet_send_string(&p, server_name);
+	packet_send_string(&p, server_motd);
+	packet_send_byte(&p, user_type);
 
-	return p;
+	client_add_packet(c, buf, p - buf);
 }
 
-struct packet_t *packet_send_ping(void)
+void packet_send_ping(struct client_t *c)
 {
-	struct packet_t *p = packet_init(1);
-	if (p == NULL) return NULL;
+	uint8_t buf[1], *p = buf;
 
-	packet_send_byte(p, 0x01);
+	packet_send_byte(&p, 0x01);
 
-	return p;
+	client_add_packet(c, buf, p - buf);
 }
 
-struct packet_t *packet_send_level_initialize(void)
+void packet_send_level_initialize(struct client_t *c)
 {
-	struct packet_t *p = packet_init(1);
-	if (p == NULL) return NULL;
+	uint8_t buf[1], *p = buf;
 
-	packet_send_byte(p, 0x02);
+	packet_send_byte(&p, 0x02);
 
-	return p;
+	client_add_packet(c, buf, p - buf);
 }
 
-struct packet_t *packet_send_level_data_chunk(int16_t chunk_length, uint8_t *data, uint8_t percent)
+size_t packet_write_level_data_chunk(uint8_t *buf, int16_t chunk_length, const uint8_t *data, uint8_t percent)
 {
-	struct packet_t *p = packet_init(1028);
-	if (p == NULL) return NULL;
+	uint8_t *p = buf;
 
-	packet_send_byte(p, 0x03);
-	packet_send_short(p, chunk_length);
-	packet_send_byte_array(p, data, chunk_length);
-	packet_send_byte(p, percent);
+	packet_send_byte(&p, 0x03);
+	packet_send_short(&p, chunk_length);
+	packet_send_byte_array(&p, data, chunk_length);
+	packet_send_byte(&p, percent);
 
-	return p;
+	return p - buf;
 }
 
-struct packet_t *packet_send_level_finalize(int16_t x, int16_t y, int16_t z)
+void packet_send_level_data_chunk(struct client_t *c, int16_t chunk_length, const uint8_t *data, uint8_t percent)
 {
-	struct packet_t *p = packet_init(7);
-	if (p == NULL) return NULL;
-
-	packet_send_byte(p, 0x04);
-	packet_send_short(p, x);
-	packet_send_short(p, y);
-	packet_send_short(p, z);
+	uint8_t buf[PACKET_LEVEL_DATA_CHUNK_SIZE];
 
-	return p;
+	client_add_packet(c, buf, packet_write_level_data_chunk(buf, chunk_length, data, percent));
 }
 
-struct packet_t *packet_send_set_block(int16_t x, int16_t y, int16_t z, uint8_t type)
+void packet_send_level_finalize(struct client_t *c, int16_t x, int16_t y, int16_t z)
 {
-	struct packet_t *p = packet_init(8);
-	if (p == NULL) return NULL;
+	uint8_t buf[7], *p = buf;
 
-	packet_send_byte(p, 0x06);
-	packet_send_short(p, x);
-	packet_send_short(p, y);
-	packet_send_short(p, z);
-	packet_send_byte(p, type);
+	packet_send_byte(&p, 0x04);
+	packet_send_short(&p, x);
+	packet_send_short(&p, y);
+	packet_send_short(&p, z);
 
-	return p;
+	client_add_packet(c, buf, p - buf);
 }
 
-struct packet_t *packet_send_spawn_player(uint8_t player_id, const char *player_name, const struct position_t *pos)
+void packet_send_set_block(struct client_t *c, int16_t x, int16_t y, int16_t z, uint8_t type)
 {
-	struct packet_t *p = packet_init(74);
-	if (p == NULL) return NULL;
-
-	packet_send_byte(p, 0x07);
-	packet_send_byte(p, player_id);
-	packet_send_string(p, player_name);
-	packet_send_short(p, pos->x);
-	packet_send_short(p, pos->y);
-	packet_send_short(p, pos->z);
-	packet_send_byte(p, pos->h);
-	packet_send_byte(p, pos->p);
+	uint8_t buf[8], *p = buf;
 
-	return p;
+	packet_send_byte(&p, 0x06);
+	packet_send_short(&p, x);
+	packet_send_short(&p, y);
+	packet_send_short(&p, z);
+	packet_send_byte(&p, type);
+
+	client_add_packet(c, buf, p - buf);
+}
+
+void packet_send_spawn_player(struct client_t *c, uint8_t player_id, const char *player_name, const struct position_t *pos)
+{
+	uint8_t buf[74], *p = buf;
+
+	packet_send_byte(&p, 0x07);
+	packet_send_byte(&p, player_id);
+	packet_send_string(&p, player_name);
+	packet_send_short(&p, pos->x);
+	packet_send_short(&p, pos->y);
+	packet_send_short(&p, pos->z);
+	packet_send_byte(&p, pos->h);
+	packet_send_byte(&p, pos->p);
+
+	client_add_packet(c, buf, p - buf);
 }
 
-struct packet_t *packet_send_teleport_player(uint8_t player_id, const struct position_t *pos)
+void packet_send_teleport_player(struct client_t *c, uint8_t player_id, const struct position_t *pos)
 {
-	struct packet_t *p = packet_init(10);
-	if (p == NULL) return NULL;
+	uint8_t buf[10], *p = buf;
 
-	packet_send_byte(p, 0x08);
-	packet_send_byte(p, player_id);
-	packet_send_short(p, pos->x);
-	packet_send_short(p, pos->y);
-	packet_send_short(p, pos->z);
-	packet_send_byte(p, pos->h);
-	packet_send_byte(p, pos->p);
+	packet_send_byte(&p, 0x08);
+	packet_send_byte(&p, player_id);
+	packet_send_short(&p, pos->x);
+	packet_send_short(&p, pos->y);
+	packet_send_short(&p, pos->z);
+	packet_send_byte(&p, pos->h);
+	packet_send_byte(&p, pos->p);
 
-	return p;
+	client_add_packet(c, buf, p - buf);
 }
 
-struct packet_t *packet_send_full_position_update(uint8_t player_id, int8_t dx, int8_t dy, int8_t dz, const struct position_t *pos)
+void packet_send_full_position_update(struct client_t *c, uint8_t player_id, int8_t dx, int8_t dy, int8_t dz, const struct position_t *pos)
 {
-	struct packet_t *p = packet_init(7);
-	if (p == NULL) return NULL;
+	uint8_t buf[7], *p = buf;
 
-	packet_send_byte(p, 0x09);
-	packet_send_byte(p, player_id);
-	packet_send_byte(p, dx);
-	packet_send_byte(p, dy);
-	packet_send_byte(p, dz);
-	packet_send_byte(p, pos->h);
-	packet_send_byte(p, pos->p);
+	packet_send_byte(&p, 0x09);
+	packet_send_byte(&p, player_id);
+	packet_send_byte(&p, dx);
+	packet_send_byte(&p, dy);
+	packet_send_byte(&p, dz);
+	packet_send_byte(&p, pos->h);
+	packet_send_byte(&p, pos->p);
 
-	return p;
+	client_add_packet(c, buf, p - buf);
 }
 
-struct packet_t *packet_send_position_update(uint8_t player_id, int8_t dx, int8_t dy, int8_t dz)
+void packet_send_position_update(struct client_t *c, uint8_t player_id, int8_t dx, int8_t dy, int8_t dz)
 {
-	struct packet_t *p = packet_init(5);
-	if (p == NULL) return NULL;
+	uint8_t buf[5], *p = buf;
 
-	packet_send_byte(p, 0x0A);
-	packet_send_byte(p, player_id);
-	packet_send_byte(p, dx);
-	packet_send_byte(p, dy);
-	packet_send_byte(p, dz);
+	packet_send_byte(&p, 0x0A);
+	packet_send_byte(&p, player_id);
+	packet_send_byte(&p, dx);
+	packet_send_byte(&p, dy);
+	packet_send_byte(&p, dz);
 
-	return p;
+	client_add_packet(c, buf, p - buf);
 }
 
-struct packet_t *packet_send_orientation_update(uint8_t player_id, const struct position_t *pos)
+void packet_send_orientation_update(struct client_t *c, uint8_t player_id, const struct position_t *pos)
 {
-	struct packet_t *p = packet_init(4);
-	if (p == NULL) return NULL;
+	uint8_t buf[4], *p = buf;
 
-	packet_send_byte(p, 0x0B);
-	packet_send_byte(p, player_id);
-	packet_send_byte(p, pos->h);
-	packet_send_byte(p, pos->p);
+	packet_send_byte(&p, 0x0B);
+	packet_send_byte(&p, player_id);
+	packet_send_byte(&p, pos->h);
+	packet_send_byte(&p, pos->p);
 
-	return p;
+	client_add_packet(c, buf, p - buf);
 }
 
-struct packet_t *packet_send_despawn_player(uint8_t player_id)
+void packet_send_despawn_player(struct client_t *c, uint8_t player_id)
 {
-	struct packet_t *p = packet_init(2);
-	if (p == NULL) return NULL;
+	uint8_t buf[2], *p = buf;
 
-	packet_send_byte(p, 0x0C);
-	packet_send_byte(p, player_id);
+	packet_send_byte(&p, 0x0C);
+	packet_send_byte(&p, player_id);
 
-	return p;
+	client_add_packet(c, buf, p - buf);
 }
 
-struct packet_t *packet_send_message(uint8_t player_id, const char *message)
+void packet_send_message(struct client_t *c, uint8_t player_id, const char *message)
 {
-	struct packet_t *p = packet_init(66);
-	if (p == NULL) return NULL;
+	uint8_t buf[66], *p = buf;
 
-	packet_send_byte(p, 0x0D);
-	packet_send_byte(p, player_id);
-	packet_send_string(p, message);
+	packet_send_byte(&p, 0x0D);
+	packet_send_byte(&p, player_id);
+	packet_send_string(&p, message);
 
-	return p;
+	client_add_packet(c, buf, p - buf);
 }
 
-struct packet_t *packet_send_disconnect_player(const char *reason)
+void packet_send_disconnect_player(struct client_t *c, const char *reason)
 {
-	struct packet_t *p = packet_init(65);
-	if (p == NULL) return NULL;
+	uint8_t buf[65], *p = buf;
 
-	packet_send_byte(p, 0x0E);
-	packet_send_string(p, reason);
+	packet_send_byte(&p, 0x0E);
+	packet_send_string(&p, reason);
 
-	return p;
+	client_add_packet(c, buf, p - buf);
 }
 
-struct packet_t *packet_send_update_user_type(uint8_t user_type)
+void packet_send_update_user_type(struct client_t *c, uint8_t user_type)
 {
-	struct packet_t *p = packet_init(2);
-	if (p == NULL) return NULL;
+	uint8_t buf[2], *p = buf;
 
-	packet_send_byte(p, 0x0F);
-	packet_send_byte(p, user_type);
+	packet_send_byte(&p, 0x0F);
+	packet_send_byte(&p, user_type);
 
-	return p;
+	client_add_packet(c, buf, p - buf);
 }
 
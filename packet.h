@@ -7,6 +7,9 @@
 typedef char string_t[64];
 typedef uint8_t data_t[1024];
 
+/* Size of a framed level data chunk packet */
+#define PACKET_LEVEL_DATA_CHUNK_SIZE (4 + sizeof (data_t))
+
 struct client_t;
 
 struct packet_t
@@ -15,7 +18,6 @@ struct packet_t
 	size_t size;
 	size_t pos;
 
-	struct packet_t *next;
 	uint8_t buffer[0];
 };
 
@@ -24,20 +26,21 @@ struct packet_t *packet_init(size_t len);
 size_t packet_recv_size(uint8_t type);
 void packet_recv(struct client_t *c, struct packet_t *p);
 
-struct packet_t *packet_send_player_id(uint8_t protocol, const char *server_name, const char *server_motd, uint8_t user_type);
-struct packet_t *packet_send_ping(void);
-struct packet_t *packet_send_level_initialize(void);
-struct packet_t *packet_send_level_data_chunk(int16_t chunk_length, uint8_t *data, uint8_t percent);
-struct packet_t *packet_send_level_finalize(int16_t x, int16_t y, int16_t z);
-struct packet_t *packet_send_set_block(int16_t x, int16_t y, int16_t z, uint8_t type);
-struct packet_t *packet_send_spawn_player(uint8_t player_id, const char *player_name, const struct position_t *pos);
-struct packet_t *packet_send_teleport_player(uint8_t player_id, const struct position_t *pos);
-struct packet_t *packet_send_full_position_update(uint8_t player_id, int8_t dx, int8_t dy, int8_t dz, const struct position_t *pos);
-struct packet_t *packet_send_position_update(uint8_t player_id, int8_t dx, int8_t dy, int8_t dz);
-struct packet_t *packet_send_orientation_update(uint8_t player_id, const struct position_t *pos);
-struct packet_t *packet_send_despawn_player(uint8_t player_id);
-struct packet_t *packet_send_message(uint8_t player_id, const char *message);
-struct packet_t *packet_send_disconnect_player(const char *reason);
-struct packet_t *packet_send_update_user_type(uint8_t user_type);
+void packet_send_player_id(struct client_t *c, uint8_t protocol, const char *server_name, const char *server_motd, uint8_t user_type);
+void packet_send_ping(struct client_t *c);
+void packet_send_level_initialize(struct client_t *c);
+size_t packet_write_level_data_chunk(uint8_t *buf, int16_t chunk_length, const uint8_t *data, uint8_t percent);
+void packet_send_level_data_chunk(struct client_t *c, int16_t chunk_length, const uint8_t *data, uint8_t percent);
+void packet_send_level_finalize(struct client_t *c, int16_t x, int16_t y, int16_t z);
+void packet_send_set_block(struct client_t *c, int16_t x, int16_t y, int16_t z, uint8_t type);
+void packet_send_spawn_player(struct client_t *c, uint8_t player_id, const char *player_name, const struct position_t *pos);
+void packet_send_teleport_player(struct client_t *c, uint8_t player_id, const struct position_t *pos);
+void packet_send_full_position_update(struct client_t *c, uint8_t player_id, int8_t dx, int8_t dy, int8_t dz, const struct position_t *pos);
+void packet_send_position_update(struct client_t *c, uint8_t player_id, int8_t dx, int8_t dy, int8_t dz);
+void packet_send_orientation_update(struct client_t *c, uint8_t player_id, const struct position_t *pos);
+void packet_send_despawn_player(struct client_t *c, uint8_t player_id);
+void packet_send_message(struct client_t *c, uint8_t player_id, const char *message);
+void packet_send_disconnect_player(struct client_t *c, const char *reason);
+void packet_send_update_user_type(struct client_t *c, uint8_t user_type);
 
 #endif /* PACKET_H */
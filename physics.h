@@ -1,6 +1,7 @@
 #ifndef PHYSICS_H
 #define PHYSICS_H
 
+#include <string.h>
 #include "list.h"
 
 static inline bool unsigned_compare(unsigned *a, unsigned *b)
@@ -21,4 +22,113 @@ static inline bool block_update_t_compare(struct block_update_t *a, struct block
 }
 LIST(block_update, struct block_update_t, block_update_t_compare)
 
+/* Open addressed map from block index to position in an update list, so
+ * pending updates can be found without scanning the list */
+struct block_update_map_t
+{
+	/* List position + 1, or 0 if the slot is empty */
+	unsigned *slots;
+	size_t size;
+	size_t used;
+};
+
+static inline size_t block_update_map_hash(const struct block_update_map_t *map, unsigned index)
+{
+	return (index * 2654435761U) & (map->size - 1);
+}
+
+static inline struct block_update_t *block_update_map_find(const struct block_update_map_t *map, struct block_update_list_t *list, unsigned index)
+{
+	if (map->used == 0) return NULL;
+
+	size_t h;
+	for (h = block_update_map_hash(map, index); map->slots[h] != 0; h = (h + 1) & (map->size - 1))
+	{
+		struct block_update_t *bu = &list->items[map->slots[h] - 1];
+		if (bu->index == index) return bu;
+	}
+
+	return NULL;
+}
+
+/* Map the item at pos, unless its index is already mapped to an earlier one */
+static inline void block_update_map_insert(struct block_update_map_t *map, const struct block_update_list_t *list, size_t pos)
+{
+	unsigned index = list->items[pos].index;
+
+	size_t h;
+	for (h = block_update_map_hash(map, index); map->slots[h] != 0; h = (h + 1) & (map->size - 1))
+	{
+		if (list->items[map->slots[h] - 1].index == index) return;
+	}
+
+	map->slots[h] = pos + 1;
+	map->used++;
+}
+
+static inline void block_update_map_add(struct block_update_map_t *map, const struct block_update_list_t *list, size_t pos)
+{
+	if ((map->used + 1) * 2 <= map->size)
+	{
+		block_update_map_insert(map, list, pos);
+		return;
+	}
+
+	/* Grow, and map the whole list again */
+	size_t size = map->size == 0 ? 256 : map->size * 2;
+	unsigned *slots = calloc(size, sizeof *slots);
+	if (slots == NULL)
+	{
+		LOG("Allocating block update map of %zu slots failed\n", size);
+		return;
+	}
+
+	free(map->slots);
+	map->slots = slots;
+	map->size = size;
+	map->used = 0;
+
+	size_t i;
+	for (i = 0; i <= pos; i++)
+	{
+		block_update_map_insert(map, list, i);
+	}
+}
+
+/* Empty the map, for when its list is emptied */
+static inline void block_update_map_reset(struct block_update_map_t *map)
+{
+	if (map->used == 0) return;
+
+	/* Drop tables left large by a burst of updates, rather than clearing
+	 * them every tick */
+	if (map->size > 1024 && map->used * 8 < map->size)
+	{
+		free(map->slots);
+		map->slots = NULL;
+		map->size = 0;
+	}
+	else
+	{
+		memset(map->slots, 0, sizeof *map->slots * map->size);
+	}
+
+	map->used = 0;
+}
+
+static inline void block_update_map_free(struct block_update_map_t *map)
+{
+	free(map->slots);
+	map->slots = NULL;
+	map->size = 0;
+	map->used = 0;
+}
+
+static inline void block_update_list_add_mapped(struct block_update_list_t *list, struct block_update_map_t *map, struct block_update_t bu)
+{
+	size_t used = list->used;
+	block_update_list_add(list, bu);
+	if (list->used > used) block_update_map_add(map, list, used);
+}
+
 #endif /* PHYSICS_H */
@@ -3,6 +3,7 @@
 #include "bitstuff.h"
 #include "client.h"
 #include "level.h"
+#include "level_grid.h"
 #include "packet.h"
 #include "player.h"
 #include "playerdb.h"
@@ -69,8 +70,8 @@ void player_set_alias(struct player_t *p, const char *alias, bool send_spawn)
 	if (p->client != NULL && !p->client->hidden && send_spawn)
 	{
 		// Renaming own client doesn't work
-//		client_add_packet(p->client, packet_send_despawn_player(0xFF));
-//		client_add_packet(p->client, packet_send_spawn_player(0xFF, p->alias, &p->pos));
+//		packet_send_despawn_player(p->client, 0xFF);
+//		packet_send_spawn_player(p->client, 0xFF, p->alias, &p->pos);
 		client_send_despawn(p->client, false);
 		client_send_spawn(p->client, false);
 	}
@@ -177,6 +178,7 @@ void player_move(struct player_t *player, struct position_t *pos)
 
 	if (player->level != NULL)
 	{
+		level_grid_player_move(player->level, player->levelid, pos);
 		call_level_hook(EVENT_MOVE, player->level, player->client, &player->levelid);
 	}
 }
@@ -187,9 +189,14 @@ void player_teleport(struct player_t *player, const struct position_t *pos, bool
 	player->lastpos = *pos;
 	player->teleport = true;
 
+	if (player->level != NULL)
+	{
+		level_grid_player_move(player->level, player->levelid, pos);
+	}
+
 	if (instant)
 	{
-		client_add_packet(player->client, packet_send_teleport_player(0xFF, &player->pos));
+		packet_send_teleport_player(player->client, 0xFF, &player->pos);
 	}
 }
 
@@ -228,7 +235,7 @@ bool player_check_spam(struct player_t *player)
 	return false;
 }
 
-static void player_send_position(struct player_t *player, unsigned cur_tick)
+static void player_send_position(struct player_t *player, unsigned cur_tick, unsigned now)
 {
 	int changed = 0;
 	int dx = 0, dy = 0, dz = 0;
@@ -249,13 +256,35 @@ static void player_send_position(struct player_t *player, unsigned cur_tick)
 		changed |= 2;
 	}
 
-	if (changed == 0) return;
+	/* Players outside the view distance only get the latest position
+	 * every far_pos_interval */
+	bool far = (now - player->fartime >= (unsigned)g_server.far_pos_interval) && !position_equal(&player->pos, &player->farpos);
+
+	if (changed == 0 && !far) return;
 
-	player->oldpos = player->pos;
+	if (changed != 0)
+	{
+		player->oldpos = player->pos;
+	}
 
 	if (player->client->hidden) return;
 
-	player->last_active = cur_tick;
+	if (changed != 0)
+	{
+		player->last_active = cur_tick;
+	}
+
+	if (far)
+	{
+		player->farpos = player->pos;
+		player->fartime = now;
+	}
+
+	uint64_t near = ~0ULL;
+	if (g_server.view_distance > 0)
+	{
+		near = level_grid_players(player->level, &player->pos, g_server.view_distance * 32);
+	}
 
 	unsigned i;
 	for (i = 0; i < MAX_CLIENTS_PER_LEVEL; i++)
@@ -263,22 +292,43 @@ static void player_send_position(struct player_t *player, unsigned cur_tick)
 		struct client_t *c = player->level->clients[i];
 		if (c == NULL || c->sending_level || c->player == player) continue;
 
+		uint64_t bit = 1ULL << i;
+		if ((near & bit) == 0)
+		{
+			/* Deltas sent while out of view would be missed, so this
+			 * player is resynced when it comes back into view */
+			player->synced &= ~bit;
+			if (far) packet_send_teleport_player(c, player->levelid, &player->pos);
+			continue;
+		}
+
+		/* Resync before anything else, farpos has already moved on so
+		 * a later far send won't do it */
+		if ((player->synced & bit) == 0)
+		{
+			player->synced |= bit;
+			packet_send_teleport_player(c, player->levelid, &player->pos);
+			continue;
+		}
+
+		if (changed == 0) continue;
+
 		switch (changed)
 		{
 			case 1:
-				client_add_packet(c, packet_send_position_update(player->levelid, dx, dy, dz));
+				packet_send_position_update(c, player->levelid, dx, dy, dz);
 				break;
 
 			case 2:
-				client_add_packet(c, packet_send_orientation_update(player->levelid, &player->pos));
+				packet_send_orientation_update(c, player->levelid, &player->pos);
 				break;
 
 			case 3:
-				client_add_packet(c, packet_send_full_position_update(player->levelid, dx, dy, dz, &player->pos));
+				packet_send_full_position_update(c, player->levelid, dx, dy, dz, &player->pos);
 				break;
 
 			default:
-				client_add_packet(c, packet_send_teleport_player(player->levelid, &player->pos));
+				packet_send_teleport_player(c, player->levelid, &player->pos);
 				break;
 			}
 	}
@@ -286,6 +336,7 @@ static void player_send_position(struct player_t *player, unsigned cur_tick)
 
 void player_send_positions(unsigned cur_tick)
 {
+	unsigned now = gettime();
 	unsigned i;
 	for (i = 0; i < s_players.used; i++)
 	{
@@ -294,11 +345,12 @@ void player_send_positions(unsigned cur_tick)
 		{
 			player->pos = player->following->pos;
 			player->pos.y -= 23;
-			client_add_packet(player->client, packet_send_teleport_player(0xFF, &player->pos));
+			if (player->level != NULL) level_grid_player_move(player->level, player->levelid, &player->pos);
+			packet_send_teleport_player(player->client, 0xFF, &player->pos);
 			continue;
 		}
 
-		player_send_position(player, cur_tick);
+		player_send_position(player, cur_tick, now);
 	}
 }
 
@@ -56,6 +56,11 @@ struct player_t
 	struct position_t pos;
 	struct position_t oldpos;
 	struct position_t lastpos;
+	/* Position last sent to players outside the view distance, and which
+	 * players have been sent the current position */
+	struct position_t farpos;
+	unsigned fartime;
+	uint64_t synced;
 	int speed;
 	int speeds[10];
 	int warnings;
@@ -1,10 +1,12 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "bitstuff.h"
 #include "block.h"
 #include "colour.h"
 #include "client.h"
 #include "level.h"
+#include "level_grid.h"
 #include "player.h"
 #include "position.h"
 #include "mcc.h"
@@ -77,6 +79,7 @@ static bool portal_handle_chat(struct level_t *l, struct client_t *c, char *data
 	{
 		struct portal_t *p = portal_get_by_name(data + 14, arg, ld, false);
 		if (p == NULL) goto err;
+		level_grid_remove(l, ld, p - arg->portal);
 		memset(p, 0, sizeof *p);
 		client_notify(c, TAG_YELLOW "Portal deleted");
 		if (arg->edit == p) arg->edit = NULL;
@@ -95,6 +98,8 @@ static bool portal_handle_chat(struct level_t *l, struct client_t *c, char *data
 		struct portal_t *p = arg->edit;
 		if (p == NULL) goto err;
 		p->pos = c->player->pos;
+		level_grid_remove(l, ld, p - arg->portal);
+		level_grid_add(l, ld, p - arg->portal, &p->pos, 32);
 		client_notify(c, TAG_YELLOW "Portal position set");
 		l->changed = true;
 	}
@@ -179,7 +184,36 @@ static void portal_teleport(struct client_t *c, const char *target, struct porta
 	}
 }
 
-static void portal_handle_move(struct level_t *l, struct client_t *c, int index, struct portal_data_t *arg)
+/* Find the portal a position is in, or -1. Only portals in the position's
+ * grid cell can be in range, and the grid holds portal indexes, so there
+ * are never more candidates than portals. */
+static int portal_find(struct level_t *l, const struct position_t *pos, struct portal_data_t *arg, struct level_hook_data_t *ld)
+{
+	int buf[64];
+	int *ids = buf;
+	if (arg->portals > 64)
+	{
+		ids = malloc(arg->portals * sizeof *ids);
+		if (ids == NULL) return -1;
+	}
+
+	int i, n = level_grid_query(l, ld, pos, 0, ids, arg->portals);
+	int found = -1;
+	for (i = 0; i < n; i++)
+	{
+		if (ids[i] >= arg->portals) continue;
+		if (position_match(pos, &arg->portal[ids[i]].pos, 32))
+		{
+			found = ids[i];
+			break;
+		}
+	}
+
+	if (ids != buf) free(ids);
+	return found;
+}
+
+static void portal_handle_move(struct level_t *l, struct client_t *c, int index, struct portal_data_t *arg, struct level_hook_data_t *ld)
 {
 	/* Changing levels, don't handle teleports */
 	if (c->player->level != c->player->new_level) return;
@@ -188,40 +222,37 @@ static void portal_handle_move(struct level_t *l, struct client_t *c, int index,
 //	snprintf(buf, sizeof buf, "position on %s: %d %d %d\n", c->player->level->name, c->player->pos.x, c->player->pos.y, c->player->pos.z);
 //	client_notify(c, buf);
 
-	int i;
-	for (i = 0; i < arg->portals; i++)
+	int i = portal_find(l, &c->player->pos, arg, ld);
+	if (i != -1)
 	{
 		struct portal_t *p = &arg->portal[i];
-		if (position_match(&c->player->pos, &p->pos, 32))
-		{
-			if (HasBit(c->player->flags, 7)) return;
+		if (HasBit(c->player->flags, 7)) return;
 
-//			char buf[128];
-//			snprintf(buf, sizeof buf, "Reached portal %s", p->name);
-//			client_notify(c, buf);
+//		char buf[128];
+//		snprintf(buf, sizeof buf, "Reached portal %s", p->name);
+//		client_notify(c, buf);
 
-			SetBit(c->player->flags, 7);
+		SetBit(c->player->flags, 7);
 
-			/* Portal is exit only */
-			if (*p->target_level == '\0')
-			{
-				if (*p->target == '\0') return;
-				portal_teleport(c, p->target, arg, true);
-			}
-			else
+		/* Portal is exit only */
+		if (*p->target_level == '\0')
+		{
+			if (*p->target == '\0') return;
+			portal_teleport(c, p->target, arg, true);
+		}
+		else
+		{
+			/* Switch level */
+			struct level_t *l2;
+			if (level_get_by_name(p->target_level, &l2))
 			{
-				/* Switch level */
-				struct level_t *l2;
-				if (level_get_by_name(p->target_level, &l2))
+				if (player_change_level(c->player, l2))
 				{
-					if (player_change_level(c->player, l2))
-					{
-						if (*p->target != '\0') c->player->hook_data = p->target;
-					}
+					if (*p->target != '\0') c->player->hook_data = p->target;
 				}
 			}
-			return;
 		}
+		return;
 	}
 
 	if (HasBit(c->player->flags, 7))
@@ -243,7 +274,7 @@ static bool portal_level_hook(int event, struct level_t *l, struct client_t *c,
 	switch (event)
 	{
 		case EVENT_CHAT: return portal_handle_chat(l, c, data, arg->data, arg);
-		case EVENT_MOVE: portal_handle_move(l, c, *(int *)data, arg->data); break;
+		case EVENT_MOVE: portal_handle_move(l, c, *(int *)data, arg->data, arg); break;
 		case EVENT_SPAWN: portal_handle_spawn(l, c, data, arg->data); break;
 //		case EVENT_LOAD: portal->edit = NULL; break;
 		case EVENT_INIT:
@@ -262,9 +293,12 @@ static bool portal_level_hook(int event, struct level_t *l, struct client_t *c,
 					for (i = 0; i < pd->portals; i++)
 					{
 						struct portal_t *p = &pd->portal[i];
-						if (*p->name != '\0') continue;
-						if (p->pos.x == 0 && p->pos.y == 0 && p->pos.z == 0) continue;
-						snprintf(p->name, sizeof p->name, "unamed");
+						if (*p->name == '\0')
+						{
+							if (p->pos.x == 0 && p->pos.y == 0 && p->pos.z == 0) continue;
+							snprintf(p->name, sizeof p->name, "unamed");
+						}
+						level_grid_add(l, arg, i, &p->pos, 32);
 					}
 
 					/* Ensure portal edit isn't set after loading */
@@ -280,6 +314,12 @@ static bool portal_level_hook(int event, struct level_t *l, struct client_t *c,
 			arg->data = calloc(1, arg->size);
 			break;
 		}
+
+		case EVENT_DEINIT:
+			if (l == NULL) break;
+
+			level_grid_remove_owner(l, arg);
+			break;
 	}
 
 	return false;
@@ -12,6 +12,11 @@ struct position_t
 	uint8_t p;
 };
 
+static inline bool position_equal(const struct position_t *a, const struct position_t *b)
+{
+	return a->x == b->x && a->y == b->y && a->z == b->z && a->h == b->h && a->p == b->p;
+}
+
 static inline bool position_match(const struct position_t *a, const struct position_t *b, int area)
 {
 	int dx = a->x - b->x;
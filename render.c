@@ -128,9 +128,9 @@ enum blocktype_t level_get_blocktype2(const struct level_t *level, int16_t x, in
 {
 	if (x < 0 || y < 0 || z < 0 || x >= level->x || y >= level->y || z >= level->z) return AIR;
 	unsigned index = level_get_index(level, x, y, z);
-	const struct block_t *b = &level->blocks[index];
-	if (b->type == WATERSTILL) return WATER;
-	return b->type;
+	enum blocktype_t type = level_block_type(level, index);
+	if (type == WATERSTILL) return WATER;
+	return type;
 }
 
 static inline bool is_trans(enum blocktype_t block)
@@ -344,16 +344,16 @@ uint32_t *level_render_flat(const struct level_t *level, int rot, int *w, int *h
 			for (y = level->y - 1; y >= 0; y--)
 			{
 				unsigned index = level_get_index(level, x, y, z);
-				const struct block_t *b = &level->blocks[index];
+				enum blocktype_t type = level_block_type(level, index);
 
-				if (b->type == AIR) continue;
-				if (b->type == WATER || b->type == WATERSTILL)
+				if (type == AIR) continue;
+				if (type == WATER || type == WATERSTILL)
 				{
 					water++;
 					continue;
 				}
 
-				block = b->type;
+				block = type;
 				break;
 			}
 
@@ -1,10 +1,12 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "bitstuff.h"
 #include "block.h"
 #include "colour.h"
 #include "client.h"
 #include "level.h"
+#include "level_grid.h"
 #include "player.h"
 #include "position.h"
 #include "mcc.h"
@@ -79,6 +81,7 @@ static bool message_handle_chat(struct level_t *l, struct client_t *c, char *dat
 	{
 		struct message_t *s = message_get_by_name(data + 11, arg, ld, false);
 		if (s == NULL) goto err;
+		level_grid_remove(l, ld, s - arg->message);
 		memset(s, 0, sizeof *s);
 		client_notify(c, TAG_YELLOW "message deleted");
 		if (arg->edit == s) arg->edit = NULL;
@@ -97,6 +100,8 @@ static bool message_handle_chat(struct level_t *l, struct client_t *c, char *dat
 		struct message_t *s = arg->edit;
 		if (s == NULL) goto err;
 		s->pos = c->player->pos;
+		level_grid_remove(l, ld, s - arg->message);
+		level_grid_add(l, ld, s - arg->message, &s->pos, s->radius);
 		client_notify(c, TAG_YELLOW "message position set");
 		l->changed = true;
 	}
@@ -105,6 +110,8 @@ static bool message_handle_chat(struct level_t *l, struct client_t *c, char *dat
 		struct message_t *s = arg->edit;
 		if (s == NULL) goto err;
 		s->radius = strtol(data + 11, NULL, 10);
+		level_grid_remove(l, ld, s - arg->message);
+		level_grid_add(l, ld, s - arg->message, &s->pos, s->radius);
 		char buf[64];
 		snprintf(buf, sizeof buf, TAG_YELLOW "message radius set to %d", s->radius);
 		client_notify(c, buf);
@@ -168,31 +175,57 @@ err:
 	return true;
 }
 
-static void message_handle_move(struct level_t *l, struct client_t *c, int index, struct message_data_t *arg)
+/* Find the message a position is in, or -1. The grid holds message
+ * indexes, so there are never more candidates than messages. */
+static int message_find(struct level_t *l, const struct position_t *pos, struct message_data_t *arg, struct level_hook_data_t *ld)
+{
+	int buf[64];
+	int *ids = buf;
+	if (arg->messages > 64)
+	{
+		ids = malloc(arg->messages * sizeof *ids);
+		if (ids == NULL) return -1;
+	}
+
+	int i, n = level_grid_query(l, ld, pos, 0, ids, arg->messages);
+	int found = -1;
+	for (i = 0; i < n; i++)
+	{
+		if (ids[i] >= arg->messages) continue;
+		const struct message_t *s = &arg->message[ids[i]];
+		if (position_match(pos, &s->pos, s->radius))
+		{
+			found = ids[i];
+			break;
+		}
+	}
+
+	if (ids != buf) free(ids);
+	return found;
+}
+
+static void message_handle_move(struct level_t *l, struct client_t *c, int index, struct message_data_t *arg, struct level_hook_data_t *ld)
 {
 	/* Changing levels, don't handle messages */
 	if (c->player->level != c->player->new_level) return;
 
-	int i, j;
-	for (i = 0; i < arg->messages; i++)
+	int j, i = message_find(l, &c->player->pos, arg, ld);
+	if (i != -1)
 	{
-		struct message_t *s = &arg->message[i];
-		if (position_match(&c->player->pos, &s->pos, s->radius))
-		{
-			if (HasBit(c->player->flags, 6)) return;
+		const struct message_t *s = &arg->message[i];
+		if (HasBit(c->player->flags, 6)) return;
 
-			for (j = 0; j < LINES_PER_MESSAGE; j++)
+		for (j = 0; j < LINES_PER_MESSAGE; j++)
+		{
+			if (strlen(s->line[j]) > 0)
 			{
-				if (strlen(s->line[j]) > 0)
-				{
-					client_notify(c, s->line[j]);
-				}
+				client_notify(c, s->line[j]);
 			}
+		}
 
-			SetBit(c->player->flags, 6);
+		SetBit(c->player->flags, 6);
 
-			return;
-		}
+		return;
 	}
 
 	if (HasBit(c->player->flags, 6))
@@ -206,7 +239,7 @@ static bool message_level_hook(int event, struct level_t *l, struct client_t *c,
 	switch (event)
 	{
 		case EVENT_CHAT: return message_handle_chat(l, c, data, arg->data, arg);
-		case EVENT_MOVE: message_handle_move(l, c, *(int *)data, arg->data); break;
+		case EVENT_MOVE: message_handle_move(l, c, *(int *)data, arg->data, arg); break;
 		case EVENT_INIT:
 		{
 			if (arg->size == 0)
@@ -220,6 +253,13 @@ static bool message_level_hook(int event, struct level_t *l, struct client_t *c,
 				{
 					LOG("Found data for %d messages on %s\n", sd->messages, l->name);
 
+					unsigned i;
+					for (i = 0; i < sd->messages; i++)
+					{
+						struct message_t *s = &sd->message[i];
+						if (s->radius != 0) level_grid_add(l, arg, i, &s->pos, s->radius);
+					}
+
 					/* Ensure message edit isn't set after loading */
 					sd->edit = NULL;
 					break;
@@ -231,7 +271,14 @@ static bool message_level_hook(int event, struct level_t *l, struct client_t *c,
 
 			arg->size = sizeof (struct message_data_t);
 			arg->data = calloc(1, arg->size);
+			break;
 		}
+
+		case EVENT_DEINIT:
+			if (l == NULL) break;
+
+			level_grid_remove_owner(l, arg);
+			break;
 	}
 
 	return false;
@@ -44,10 +44,10 @@ static void physics_spleef_sub(struct level_t *level, int16_t x, int16_t y, int1
 	if (x < 0 || y < 0 || z < 0 || x >= level->x || y >= level->y || z >= level->z) return;
 
 	unsigned index = level_get_index(level, x, y, z);
-	enum blocktype_t type = level->blocks[index].type;
+	enum blocktype_t type = level_block_type(level, index);
 	if (type == s.spleef1 || type == s.spleef2)
 	{
-		if (level->blocks[index].data < 2)
+		if (level_block_data(level, index) < 2)
 			level_addupdate(level, index, type, 2);
 	}
 }
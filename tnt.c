@@ -66,17 +66,17 @@ static void physics_active_tnt(struct level_t *l, unsigned index, const struct b
 				if (d >= r1 && d < r2)
 				{
 					index = level_get_index(l, bx, by, bz);
-					const enum blocktype_t type = l->blocks[index].type;
-					if (l->blocks[index].fixed || l->blocks[index].touched || type == ADMINIUM || type == s.explosion || type == s.fire) continue;
+					const enum blocktype_t type = level_block_type(l, index);
+					if (level_block_fixed(l, index) || level_block_touched(l, index) || type == ADMINIUM || type == s.explosion || type == s.fire) continue;
 
 					if (type == s.active_tnt)
 					{
-						if (l->blocks[index].data == 0) level_addupdate_with_owner(l, index, type, ((rand() % 3 + 4) << 8) | 1, block->owner);
+						if (level_block_data(l, index) == 0) level_addupdate_with_owner(l, index, type, ((rand() % 3 + 4) << 8) | 1, block->owner);
 					}
 					else if (type == s.fuse)
 					{
 						/* Trigger fuse early */
-						if (l->blocks[index].data == 0) level_addupdate_with_owner(l, index, type, 2, block->owner);
+						if (level_block_data(l, index) == 0) level_addupdate_with_owner(l, index, type, 2, block->owner);
 					}
 					else if (rand() % 100 < 99)
 					{
@@ -108,14 +108,14 @@ static void physics_explosion_sub(struct level_t *l, int16_t x, int16_t y, int16
 	if (!level_valid_xyz(l, x, y, z)) return;
 
 	unsigned index = level_get_index(l, x, y, z);
-	if (l->blocks[index].fixed || l->blocks[index].type == ADMINIUM) return;
-	//if (l->blocks[index].owner != 0 && l->blocks[index].owner != owner) return;
+	if (level_block_fixed(l, index) || level_block_type(l, index) == ADMINIUM) return;
+	//if (level_block_owner(l, index) != 0 && level_block_owner(l, index) != owner) return;
 
-	if (l->blocks[index].type == s.active_tnt)
+	if (level_block_type(l, index) == s.active_tnt)
 	{
 		magnitude = 0x305;
 	}
-	else if (l->blocks[index].type == s.fuse)
+	else if (level_block_type(l, index) == s.fuse)
 	{
 		/* Trigger fuse early */
 		level_addupdate(l, index, -1, 2);
@@ -210,19 +210,19 @@ static void physics_fuse_sub(struct level_t *l, int16_t x, int16_t y, int16_t z,
 	unsigned index = level_get_index(l, x, y, z);
 
 	/* Don't mess with fixed blocks */
-	if (l->blocks[index].fixed) return;
+	if (level_block_fixed(l, index)) return;
 
-	enum blocktype_t type = l->blocks[index].type;
+	enum blocktype_t type = level_block_type(l, index);
 	if (type == s.fuse)
 	{
-		if (l->blocks[index].data == 0)
+		if (level_block_data(l, index) == 0)
 		{
 			level_addupdate_with_owner(l, index, type, 5, owner);
 		}
 	}
 	else if (type == s.active_tnt)
 	{
-		if (l->blocks[index].data == 0)
+		if (level_block_data(l, index) == 0)
 		{
 			level_addupdate_with_owner(l, index, type, ((rand() % 3 + 3) << 8) | 1, owner);
 		}
@@ -278,9 +278,9 @@ static bool physics_fire_sub(struct level_t *l, int x, int y, int z, int dy, int
 	if (!level_valid_xyz(l, x, y, z)) return false;
 
 	unsigned index = level_get_index(l, x, y, z);
-	if (l->blocks[index].fixed) return false;
+	if (level_block_fixed(l, index)) return false;
 
-	enum blocktype_t type = l->blocks[index].type;
+	enum blocktype_t type = level_block_type(l, index);
 	if (type == LEAF || type == WOOD || type == TRUNK || type == BOOKCASE)
 	{
 		level_addupdate_with_owner(l, index, s.fire, stage, owner);
@@ -293,14 +293,14 @@ static bool physics_fire_sub(struct level_t *l, int x, int y, int z, int dy, int
 	}
 	else if (type == s.fuse)
 	{
-		if (l->blocks[index].data == 0)
+		if (level_block_data(l, index) == 0)
 		{
 			level_addupdate_with_owner(l, index, type, 5, owner);
 		}
 	}
 	else if (type == s.active_tnt)
 	{
-		if (l->blocks[index].data == 0)
+		if (level_block_data(l, index) == 0)
 		{
 			level_addupdate_with_owner(l, index, type, ((rand() % 3 + 3) << 8) | 1, owner);
 		}
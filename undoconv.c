@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <sqlite3.h>
+#include "mcc.h"
+#include "undojournal.h"
+#include "util.h"
+
+struct server_t g_server;
+
+/* Copy a level's sqlite undo log into an undo journal, for switching
+ * undo.backend to journal. Run from the server directory. */
+int main(int argc, char **argv)
+{
+	g_server.logfile = stderr;
+
+	if (argc != 2)
+	{
+		LOG("Usage: undoconv <level>\n");
+		return 0;
+	}
+
+	char buf[256];
+	snprintf(buf, sizeof buf, "undo/%s.db", argv[1]);
+	lcase(buf);
+
+	sqlite3 *db;
+	if (sqlite3_open_v2(buf, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK)
+	{
+		LOG("Can't open database: %s\n", sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return 1;
+	}
+
+	sqlite3_stmt *stmt;
+	if (sqlite3_prepare_v2(db, "SELECT playerid, x, y, z, oldtype, olddata, newtype, time FROM undo ORDER BY id", -1, &stmt, NULL) != SQLITE_OK)
+	{
+		LOG("Can't prepare statement: %s\n", sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return 1;
+	}
+
+	struct undojournal_t *j = undojournal_open(argv[1]);
+	if (j == NULL)
+	{
+		sqlite3_finalize(stmt);
+		sqlite3_close(db);
+		return 1;
+	}
+
+	int rows = 0;
+	while (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		if (!undojournal_log(j,
+				sqlite3_column_int(stmt, 0),
+				sqlite3_column_int(stmt, 1),
+				sqlite3_column_int(stmt, 2),
+				sqlite3_column_int(stmt, 3),
+				sqlite3_column_int(stmt, 4),
+				sqlite3_column_int(stmt, 5),
+				sqlite3_column_int(stmt, 6),
+				sqlite3_column_int64(stmt, 7)))
+		{
+			LOG("Unable to write journal after %d rows\n", rows);
+			break;
+		}
+		rows++;
+	}
+
+	undojournal_close(j);
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+
+	LOG("Converted %d rows\n", rows);
+
+	return 0;
+}
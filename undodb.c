@@ -1,24 +1,65 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
 #include <time.h>
+#include <pthread.h>
 #include <sqlite3.h>
+#include "config.h"
+#include "list.h"
 #include "mcc.h"
 #include "undodb.h"
+#include "undojournal.h"
 #include "playerdb.h"
 #include "util.h"
+#include "worker.h"
+
+struct undodb_entry_t
+{
+	int playerid;
+	int16_t x, y, z;
+	int oldtype, olddata, newtype;
+	time_t time;
+};
 
 struct undodb_t
 {
+	/* Set if undo.backend is "journal", in which case there is no db */
+	struct undojournal_t *journal;
+
 	sqlite3 *db;
 	sqlite3_stmt *insert_stmt;
 	sqlite3_stmt *query1_stmt;
 	sqlite3_stmt *query2_stmt;
 	sqlite3_stmt *query3_stmt;
+	sqlite3_stmt *summary_stmt;
+
+	/* Serializes use of the database and statements */
+	pthread_mutex_t db_mutex;
+
+	/* Rows logged but not yet written. The writer swaps this with the
+	 * flushing buffer so logging never waits on sqlite. */
+	pthread_mutex_t pending_mutex;
+	struct undodb_entry_t *pending, *flushing;
+	size_t pending_used, pending_size, flushing_size;
 };
 
-struct undodb_t *undodb_init(const char *name)
+static bool undodb_t_compare(struct undodb_t **a, struct undodb_t **b)
 {
-	struct undodb_t u;
+	return *a == *b;
+}
+LIST(undodb, struct undodb_t *, undodb_t_compare)
+
+/* Open databases, for the flush worker */
+static struct undodb_list_t s_undodbs;
+static pthread_mutex_t s_undodbs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct worker s_undodb_worker;
+static int s_undodb_flush_queued;
+
+static bool undodb_open_sqlite(struct undodb_t *up, const char *name)
+{
+	struct undodb_t u = *up;
 
 	char buf[256];
 	snprintf(buf, sizeof buf, "undo/%s.db", name);
@@ -30,10 +71,19 @@ struct undodb_t *undodb_init(const char *name)
 	{
 		LOG("Can't open database: %s\n", sqlite3_errmsg(u.db));
 		sqlite3_close(u.db);
-		return NULL;
+		return false;
 	}
 
 	char *err;
+	/* WAL lets the writer commit without blocking readers, and only needs
+	 * to sync on checkpoints */
+	sqlite3_exec(u.db, "PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL", NULL, NULL, &err);
+	if (err != NULL)
+	{
+		LOG("Errrrr: %s\n", err);
+		sqlite3_free(err);
+	}
+
 	sqlite3_exec(u.db, "CREATE TABLE IF NOT EXISTS undo (id INTEGER PRIMARY KEY AUTOINCREMENT, playerid INT, x INT, y INT, z INT, oldtype INT, olddata INT, newtype INT, time DATETIME)", NULL, NULL, &err);
 	if (err != NULL)
 	{
@@ -41,53 +91,261 @@ struct undodb_t *undodb_init(const char *name)
 		sqlite3_free(err);
 	}
 
+	/* Version 1 adds indexes for per-player queries, and a summary of
+	 * changes per player per UNDODB_BUCKET seconds */
+	int version = 0;
+	sqlite3_stmt *stmt;
+	if (sqlite3_prepare_v2(u.db, "PRAGMA user_version", -1, &stmt, NULL) == SQLITE_OK)
+	{
+		if (sqlite3_step(stmt) == SQLITE_ROW) version = sqlite3_column_int(stmt, 0);
+		sqlite3_finalize(stmt);
+	}
+
+	if (version < 1)
+	{
+		LOG("Indexing undo log for %s\n", name);
+		sqlite3_exec(u.db,
+			"BEGIN;"
+			"CREATE INDEX IF NOT EXISTS undo_playerid ON undo (playerid, id);"
+			"CREATE INDEX IF NOT EXISTS undo_time ON undo (time);"
+			"CREATE TABLE IF NOT EXISTS undo_summary (playerid INT, bucket INT, count INT, PRIMARY KEY (playerid, bucket));"
+			"CREATE INDEX IF NOT EXISTS undo_summary_bucket ON undo_summary (bucket);"
+			"DELETE FROM undo_summary;"
+			"INSERT INTO undo_summary (playerid, bucket, count) SELECT playerid, time / " UNDODB_BUCKET_STR ", COUNT(*) FROM undo GROUP BY 1, 2;"
+			"PRAGMA user_version = 1;"
+			"COMMIT", NULL, NULL, &err);
+		if (err != NULL)
+		{
+			LOG("Errrrr: %s\n", err);
+			sqlite3_free(err);
+			sqlite3_exec(u.db, "ROLLBACK", NULL, NULL, NULL);
+		}
+	}
+
 	res = sqlite3_prepare_v2(u.db, "INSERT INTO undo (playerid, x, y, z, oldtype, olddata, newtype, time) VALUES (?, ?, ?, ?, ?, ?, ?, ?)", -1, &u.insert_stmt, NULL);
 	if (res != SQLITE_OK)
 	{
 		LOG("Can't prepare statement: %s\n", sqlite3_errmsg(u.db));
 		sqlite3_close(u.db);
-		return NULL;
+		return false;
 	}
 
-	res = sqlite3_prepare_v2(u.db, "SELECT playerid, time, COUNT(*) FROM undo GROUP BY playerid, time / 900 ORDER BY time DESC LIMIT 15", -1, &u.query1_stmt, NULL);
+	res = sqlite3_prepare_v2(u.db, "SELECT playerid, bucket * " UNDODB_BUCKET_STR ", count FROM undo_summary ORDER BY bucket DESC LIMIT 15", -1, &u.query1_stmt, NULL);
 	if (res != SQLITE_OK)
 	{
 		LOG("Can't prepare statement: %s\n", sqlite3_errmsg(u.db));
 		sqlite3_close(u.db);
-		return NULL;
+		return false;
 	}
 
-	res = sqlite3_prepare_v2(u.db, "SELECT time, COUNT(*) FROM undo WHERE playerid = ? GROUP BY time / 900 ORDER BY time DESC LIMIT 30", -1, &u.query2_stmt, NULL);
+	res = sqlite3_prepare_v2(u.db, "SELECT bucket * " UNDODB_BUCKET_STR ", count FROM undo_summary WHERE playerid = ? ORDER BY bucket DESC LIMIT 30", -1, &u.query2_stmt, NULL);
 	if (res != SQLITE_OK)
 	{
 		LOG("Can't prepare statement: %s\n", sqlite3_errmsg(u.db));
 		sqlite3_close(u.db);
-		return NULL;
+		return false;
+	}
+
+	res = sqlite3_prepare_v2(u.db, "SELECT id, x, y, z, oldtype, olddata, newtype FROM undo WHERE playerid = ? AND id < ? ORDER BY id DESC LIMIT ?", -1, &u.query3_stmt, NULL);
+	if (res != SQLITE_OK)
+	{
+		LOG("Can't prepare statement: %s\n", sqlite3_errmsg(u.db));
+		sqlite3_close(u.db);
+		return false;
 	}
 
-	res = sqlite3_prepare_v2(u.db, "SELECT x, y, z, oldtype, olddata, newtype FROM undo WHERE playerid = ? ORDER BY id DESC LIMIT ?", -1, &u.query3_stmt, NULL);
+	res = sqlite3_prepare_v2(u.db, "INSERT INTO undo_summary (playerid, bucket, count) VALUES (?, ?, ?) ON CONFLICT (playerid, bucket) DO UPDATE SET count = count + excluded.count", -1, &u.summary_stmt, NULL);
 	if (res != SQLITE_OK)
 	{
 		LOG("Can't prepare statement: %s\n", sqlite3_errmsg(u.db));
 		sqlite3_close(u.db);
+		return false;
+	}
+
+	*up = u;
+	return true;
+}
+
+struct undodb_t *undodb_init(const char *name)
+{
+	struct undodb_t u;
+	memset(&u, 0, sizeof u);
+
+	char *backend;
+	if (config_get_string("undo.backend", &backend) && strcmp(backend, "journal") == 0)
+	{
+		u.journal = undojournal_open(name);
+		if (u.journal == NULL) return NULL;
+	}
+	else if (!undodb_open_sqlite(&u, name))
+	{
 		return NULL;
 	}
 
+	pthread_mutex_init(&u.db_mutex, NULL);
+	pthread_mutex_init(&u.pending_mutex, NULL);
+	u.pending = u.flushing = NULL;
+	u.pending_used = u.pending_size = u.flushing_size = 0;
+
 	struct undodb_t *up = malloc(sizeof *up);
 	*up = u;
 
+	pthread_mutex_lock(&s_undodbs_mutex);
+	undodb_list_add(&s_undodbs, up);
+	pthread_mutex_unlock(&s_undodbs_mutex);
+
 	return up;
 }
 
+/* Write all pending rows in a single transaction */
+static void undodb_flush(struct undodb_t *u)
+{
+	pthread_mutex_lock(&u->db_mutex);
+
+	pthread_mutex_lock(&u->pending_mutex);
+	struct undodb_entry_t *entries = u->pending;
+	size_t used = u->pending_used;
+	size_t size = u->pending_size;
+	u->pending = u->flushing;
+	u->pending_size = u->flushing_size;
+	u->pending_used = 0;
+	pthread_mutex_unlock(&u->pending_mutex);
+
+	if (used > 0 && u->journal != NULL)
+	{
+		size_t i;
+		for (i = 0; i < used; i++)
+		{
+			const struct undodb_entry_t *e = &entries[i];
+			if (!undojournal_log(u->journal, e->playerid, e->x, e->y, e->z, e->oldtype, e->olddata, e->newtype, e->time))
+			{
+				LOG("Undo log failed: unable to write journal\n");
+				break;
+			}
+		}
+
+		undojournal_sync(u->journal);
+	}
+	else if (used > 0)
+	{
+		sqlite3_exec(u->db, "BEGIN", NULL, NULL, NULL);
+
+		size_t i, run = 0;
+		for (i = 0; i < used; i++)
+		{
+			const struct undodb_entry_t *e = &entries[i];
+
+			/* Summarise runs of changes by the same player in the same
+			 * bucket with a single update */
+			run++;
+			if (i + 1 == used || entries[i + 1].playerid != e->playerid || entries[i + 1].time / UNDODB_BUCKET != e->time / UNDODB_BUCKET)
+			{
+				sqlite3_reset(u->summary_stmt);
+				sqlite3_bind_int(u->summary_stmt, 1, e->playerid);
+				sqlite3_bind_int(u->summary_stmt, 2, e->time / UNDODB_BUCKET);
+				sqlite3_bind_int(u->summary_stmt, 3, run);
+				if (sqlite3_step(u->summary_stmt) != SQLITE_DONE)
+				{
+					LOG("Undo summary failed: %s\n", sqlite3_errmsg(u->db));
+				}
+				run = 0;
+			}
+
+			sqlite3_reset(u->insert_stmt);
+			sqlite3_bind_int(u->insert_stmt, 1, e->playerid);
+			sqlite3_bind_int(u->insert_stmt, 2, e->x);
+			sqlite3_bind_int(u->insert_stmt, 3, e->y);
+			sqlite3_bind_int(u->insert_stmt, 4, e->z);
+			sqlite3_bind_int(u->insert_stmt, 5, e->oldtype);
+			sqlite3_bind_int(u->insert_stmt, 6, e->olddata);
+			sqlite3_bind_int(u->insert_stmt, 7, e->newtype);
+			sqlite3_bind_int(u->insert_stmt, 8, e->time);
+
+			if (sqlite3_step(u->insert_stmt) != SQLITE_DONE)
+			{
+				LOG("Undo log failed: %s\n", sqlite3_errmsg(u->db));
+				break;
+			}
+		}
+
+		if (sqlite3_exec(u->db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK)
+		{
+			LOG("Undo log commit of %zu rows failed: %s\n", used, sqlite3_errmsg(u->db));
+			sqlite3_exec(u->db, "ROLLBACK", NULL, NULL, NULL);
+		}
+	}
+
+	/* Keep the emptied buffer for the next swap */
+	u->flushing = entries;
+	u->flushing_size = size;
+
+	pthread_mutex_unlock(&u->db_mutex);
+}
+
+void undodb_flush_all(void *arg)
+{
+	size_t i;
+
+	pthread_mutex_lock(&s_undodbs_mutex);
+	for (i = 0; i < s_undodbs.used; i++)
+	{
+		undodb_flush(s_undodbs.items[i]);
+	}
+	pthread_mutex_unlock(&s_undodbs_mutex);
+}
+
+static void undodb_worker(void *arg)
+{
+	__sync_lock_release(&s_undodb_flush_queued);
+	undodb_flush_all(NULL);
+}
+
+/* Hand a flush to the worker, unless one is already waiting */
+void undodb_flush_queue(void *arg)
+{
+	if (__sync_lock_test_and_set(&s_undodb_flush_queued, 1)) return;
+	worker_queue(&s_undodb_worker, &s_undodbs);
+}
+
+void undodb_worker_init(void)
+{
+	worker_init(&s_undodb_worker, "undo", 30000, 5, 1, &undodb_worker);
+}
+
+void undodb_worker_deinit(void)
+{
+	worker_deinit(&s_undodb_worker);
+	undodb_list_free(&s_undodbs);
+}
+
 void undodb_close(struct undodb_t *u)
 {
 	if (u == NULL) return;
 
-	sqlite3_finalize(u->insert_stmt);
-	sqlite3_finalize(u->query1_stmt);
-	sqlite3_finalize(u->query2_stmt);
-	sqlite3_finalize(u->query3_stmt);
-	sqlite3_close(u->db);
+	pthread_mutex_lock(&s_undodbs_mutex);
+	undodb_list_del_item(&s_undodbs, u);
+	pthread_mutex_unlock(&s_undodbs_mutex);
+
+	undodb_flush(u);
+
+	free(u->pending);
+	free(u->flushing);
+	pthread_mutex_destroy(&u->pending_mutex);
+	pthread_mutex_destroy(&u->db_mutex);
+
+	if (u->journal != NULL)
+	{
+		undojournal_close(u->journal);
+	}
+	else
+	{
+		sqlite3_finalize(u->insert_stmt);
+		sqlite3_finalize(u->query1_stmt);
+		sqlite3_finalize(u->query2_stmt);
+		sqlite3_finalize(u->query3_stmt);
+		sqlite3_finalize(u->summary_stmt);
+		sqlite3_close(u->db);
+	}
 	free(u);
 }
 
@@ -95,27 +353,84 @@ void undodb_log(struct undodb_t *u, int playerid, int16_t x, int16_t y, int16_t
 {
 	if (u == NULL) return;
 
-	sqlite3_reset(u->insert_stmt);
-	sqlite3_bind_int(u->insert_stmt, 1, playerid);
-	sqlite3_bind_int(u->insert_stmt, 2, x);
-	sqlite3_bind_int(u->insert_stmt, 3, y);
-	sqlite3_bind_int(u->insert_stmt, 4, z);
-	sqlite3_bind_int(u->insert_stmt, 5, oldtype);
-	sqlite3_bind_int(u->insert_stmt, 6, olddata);
-	sqlite3_bind_int(u->insert_stmt, 7, newtype);
-	sqlite3_bind_int(u->insert_stmt, 8, time(NULL));
+	pthread_mutex_lock(&u->pending_mutex);
 
-	int res = sqlite3_step(u->insert_stmt);
-	if (res != SQLITE_DONE)
+	if (u->pending_used >= u->pending_size)
 	{
-		LOG("Undo log failed\n");
+		size_t size = u->pending_size == 0 ? 1024 : u->pending_size * 2;
+		struct undodb_entry_t *n = realloc(u->pending, sizeof *n * size);
+		if (n == NULL)
+		{
+			pthread_mutex_unlock(&u->pending_mutex);
+			LOG("Undo log failed: unable to queue row\n");
+			return;
+		}
+		u->pending = n;
+		u->pending_size = size;
 	}
+
+	struct undodb_entry_t *e = &u->pending[u->pending_used++];
+	e->playerid = playerid;
+	e->x = x;
+	e->y = y;
+	e->z = z;
+	e->oldtype = oldtype;
+	e->olddata = olddata;
+	e->newtype = newtype;
+	e->time = time(NULL);
+
+	bool flush = u->pending_used >= UNDODB_FLUSH_ROWS;
+
+	pthread_mutex_unlock(&u->pending_mutex);
+
+	if (flush) undodb_flush_queue(NULL);
+}
+
+struct undodb_summary_t
+{
+	query_func_t func;
+	void *arg;
+};
+
+static void undodb_summary(int playerid, time_t time, int count, void *arg)
+{
+	struct undodb_summary_t *q = arg;
+
+	char stime[64];
+	strftime(stime, sizeof stime, "%H:%M", localtime(&time));
+	char buf[64];
+	snprintf(buf, sizeof buf, "%s (%d @ %s), ", playerdb_get_username(playerid), count, stime);
+	q->func(buf, q->arg);
+}
+
+static void undodb_summary_player(int playerid, time_t time, int count, void *arg)
+{
+	struct undodb_summary_t *q = arg;
+
+	char stime[64];
+	strftime(stime, sizeof stime, "%H:%M", localtime(&time));
+	char buf[64];
+	snprintf(buf, sizeof buf, "%d @ %s, ", count, stime);
+	q->func(buf, q->arg);
 }
 
 void undodb_query(struct undodb_t *u, query_func_t func, void *arg)
 {
 	if (u == NULL) return;
 
+	/* Make recent changes visible */
+	undodb_flush(u);
+
+	pthread_mutex_lock(&u->db_mutex);
+
+	if (u->journal != NULL)
+	{
+		struct undodb_summary_t q = { func, arg };
+		undojournal_summary(u->journal, -1, 15, &undodb_summary, &q);
+		pthread_mutex_unlock(&u->db_mutex);
+		return;
+	}
+
 	sqlite3_reset(u->query1_stmt);
 
 	int res;
@@ -131,12 +446,27 @@ void undodb_query(struct undodb_t *u, query_func_t func, void *arg)
 		snprintf(buf, sizeof buf, "%s (%d @ %s), ", playerdb_get_username(playerid), count, stime);
 		func(buf, arg);
 	}
+
+	pthread_mutex_unlock(&u->db_mutex);
 }
 
 void undodb_query_player(struct undodb_t *u, int playerid, query_func_t func, void *arg)
 {
 	if (u == NULL) return;
 
+	/* Make recent changes visible */
+	undodb_flush(u);
+
+	pthread_mutex_lock(&u->db_mutex);
+
+	if (u->journal != NULL)
+	{
+		struct undodb_summary_t q = { func, arg };
+		undojournal_summary(u->journal, playerid, 30, &undodb_summary_player, &q);
+		pthread_mutex_unlock(&u->db_mutex);
+		return;
+	}
+
 	sqlite3_reset(u->query2_stmt);
 	sqlite3_bind_int(u->query2_stmt, 1, playerid);
 
@@ -152,29 +482,78 @@ void undodb_query_player(struct undodb_t *u, int playerid, query_func_t func, vo
 		snprintf(buf, sizeof buf, "%d @ %s, ", count, stime);
 		func(buf, arg);
 	}
+
+	pthread_mutex_unlock(&u->db_mutex);
 }
 
-int undodb_undo_player(struct undodb_t *u, int playerid, int limit, undo_func_t func, void *arg)
+/* Read up to limit changes by a player older than *cursor, newest first.
+ * Start with a cursor of UNDODB_CURSOR_START. Returns the number of changes
+ * read, so 0 once they are exhausted. */
+int undodb_undo_player_batch(struct undodb_t *u, int playerid, int64_t *cursor, int limit, undo_func_t func, void *arg)
 {
 	if (u == NULL) return 0;
 
+	undodb_flush(u);
+
+	pthread_mutex_lock(&u->db_mutex);
+
+	if (u->journal != NULL)
+	{
+		int rows = undojournal_undo_player_batch(u->journal, playerid, cursor, limit, func, arg);
+		pthread_mutex_unlock(&u->db_mutex);
+		return rows;
+	}
+
 	sqlite3_reset(u->query3_stmt);
 	sqlite3_bind_int(u->query3_stmt, 1, playerid);
-	sqlite3_bind_int(u->query3_stmt, 2, limit);
+	sqlite3_bind_int64(u->query3_stmt, 2, *cursor);
+	sqlite3_bind_int(u->query3_stmt, 3, limit);
 
-	int count = 0;
-	int res;
-	while ((res = sqlite3_step(u->query3_stmt)) == SQLITE_ROW)
+	int rows = 0;
+	while (sqlite3_step(u->query3_stmt) == SQLITE_ROW)
 	{
-		int16_t x = sqlite3_column_int(u->query3_stmt, 0);
-		int16_t y = sqlite3_column_int(u->query3_stmt, 1);
-		int16_t z = sqlite3_column_int(u->query3_stmt, 2);
-		int oldtype = sqlite3_column_int(u->query3_stmt, 3);
-		int olddata = sqlite3_column_int(u->query3_stmt, 4);
-		int newtype = sqlite3_column_int(u->query3_stmt, 5);
+		*cursor = sqlite3_column_int64(u->query3_stmt, 0);
+		int16_t x = sqlite3_column_int(u->query3_stmt, 1);
+		int16_t y = sqlite3_column_int(u->query3_stmt, 2);
+		int16_t z = sqlite3_column_int(u->query3_stmt, 3);
+		int oldtype = sqlite3_column_int(u->query3_stmt, 4);
+		int olddata = sqlite3_column_int(u->query3_stmt, 5);
+		int newtype = sqlite3_column_int(u->query3_stmt, 6);
+
+		func(x, y, z, oldtype, olddata, newtype, arg);
+		rows++;
+	}
+
+	pthread_mutex_unlock(&u->db_mutex);
 
-		count += func(x, y, z, oldtype, olddata, newtype, arg);
+	return rows;
+}
+
+struct undodb_count_t
+{
+	undo_func_t func;
+	void *arg;
+	int count;
+};
+
+static bool undodb_count(int16_t x, int16_t y, int16_t z, int oldtype, int olddata, int newtype, void *arg)
+{
+	struct undodb_count_t *c = arg;
+	bool r = c->func(x, y, z, oldtype, olddata, newtype, c->arg);
+	c->count += r;
+	return r;
+}
+
+int undodb_undo_player(struct undodb_t *u, int playerid, int limit, undo_func_t func, void *arg)
+{
+	struct undodb_count_t c = { func, arg, 0 };
+	int64_t cursor = UNDODB_CURSOR_START;
+	int rows;
+
+	while (limit > 0 && (rows = undodb_undo_player_batch(u, playerid, &cursor, limit < UNDODB_BATCH ? limit : UNDODB_BATCH, &undodb_count, &c)) > 0)
+	{
+		limit -= rows;
 	}
 
-	return count;
+	return c.count;
 }
@@ -3,8 +3,26 @@
 
 #include <stdint.h>
 
+/* Undo rows are written in batches by a background worker, when this many
+ * are waiting or every UNDODB_FLUSH_INTERVAL ms */
+#define UNDODB_FLUSH_ROWS 4096
+#define UNDODB_FLUSH_INTERVAL 1000
+
+/* Changes are summarised per player in buckets of this many seconds */
+#define UNDODB_BUCKET 900
+#define UNDODB_BUCKET_STR "900"
+
+/* Undo reads changes in batches of this many */
+#define UNDODB_BATCH 1024
+#define UNDODB_CURSOR_START INT64_MAX
+
 struct undodb_t;
 
+void undodb_worker_init(void);
+void undodb_worker_deinit(void);
+void undodb_flush_queue(void *arg);
+void undodb_flush_all(void *arg);
+
 struct undodb_t *undodb_init(const char *name);
 void undodb_close(struct undodb_t *);
 void undodb_log(struct undodb_t *u, int playerid, int16_t x, int16_t y, int16_t z, int oldtype, int olddata, int newtype);
@@ -15,5 +33,6 @@ void undodb_query_player(struct undodb_t *u, int playerid, query_func_t func, vo
 
 typedef bool(*undo_func_t)(int16_t x, int16_t y, int16_t z, int oldtype, int olddata, int newtype, void *arg);
 int undodb_undo_player(struct undodb_t *u, int playerid, int limit, undo_func_t func, void *arg);
+int undodb_undo_player_batch(struct undodb_t *u, int playerid, int64_t *cursor, int limit, undo_func_t func, void *arg);
 
 #endif /* UNDODB_H */
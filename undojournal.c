@@ -0,0 +1,479 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "mcc.h"
+#include "undojournal.h"
+#include "util.h"
+
+/* Append-only undo log. Each level has a directory of segments named by the
+ * time they start, holding fixed size records. Sealed segments get a small
+ * index of changes per player per bucket, so queries can skip segments and
+ * summaries don't need to read any records. */
+
+struct undojournal_record_t
+{
+	uint16_t x, y, z;
+	uint16_t oldtype, newtype;
+	uint16_t olddata;
+	uint32_t playerid;
+	/* Seconds since the start of the segment */
+	uint16_t time;
+} __attribute__((packed));
+
+struct undojournal_index_t
+{
+	uint32_t playerid;
+	uint32_t bucket;
+	uint32_t count;
+};
+
+struct undojournal_index_list_t
+{
+	struct undojournal_index_t *items;
+	size_t used, size;
+	uint32_t records;
+};
+
+struct undojournal_t
+{
+	char dir[256];
+
+	/* Segment currently being appended to */
+	FILE *f;
+	long long start;
+	struct undojournal_index_list_t index;
+};
+
+#define UNDOJOURNAL_READ 256
+
+/* Build the path of a segment file, false if it doesn't fit */
+static bool undojournal_path(const struct undojournal_t *j, long long start, const char *ext, char *buf, size_t len)
+{
+	int n = snprintf(buf, len, "%s/%010lld.%s", j->dir, start, ext);
+	return n >= 0 && (size_t)n < len;
+}
+
+static bool undojournal_index_add(struct undojournal_index_list_t *l, uint32_t playerid, uint32_t bucket, uint32_t count)
+{
+	size_t i;
+	for (i = 0; i < l->used; i++)
+	{
+		if (l->items[i].playerid == playerid && l->items[i].bucket == bucket)
+		{
+			l->items[i].count += count;
+			return true;
+		}
+	}
+
+	if (l->used >= l->size)
+	{
+		size_t size = l->size + 16;
+		struct undojournal_index_t *n = realloc(l->items, sizeof *n * size);
+		if (n == NULL) return false;
+		l->items = n;
+		l->size = size;
+	}
+
+	l->items[l->used].playerid = playerid;
+	l->items[l->used].bucket = bucket;
+	l->items[l->used].count = count;
+	l->used++;
+
+	return true;
+}
+
+static bool undojournal_index_has_player(const struct undojournal_index_list_t *l, uint32_t playerid)
+{
+	size_t i;
+	for (i = 0; i < l->used; i++)
+	{
+		if (l->items[i].playerid == playerid) return true;
+	}
+	return false;
+}
+
+/* Rebuild the index of a segment from its records */
+static bool undojournal_scan(const struct undojournal_t *j, long long start, struct undojournal_index_list_t *l)
+{
+	char path[256];
+	if (!undojournal_path(j, start, "uj", path, sizeof path)) return false;
+
+	l->used = 0;
+	l->records = 0;
+
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) return false;
+
+	struct undojournal_record_t buf[UNDOJOURNAL_READ];
+	size_t n, i;
+	while ((n = fread(buf, sizeof *buf, UNDOJOURNAL_READ, f)) > 0)
+	{
+		for (i = 0; i < n; i++)
+		{
+			undojournal_index_add(l, buf[i].playerid, (start + buf[i].time) / UNDODB_BUCKET, 1);
+		}
+		l->records += n;
+	}
+
+	fclose(f);
+	return true;
+}
+
+static void undojournal_write_index(const struct undojournal_t *j, long long start, const struct undojournal_index_list_t *l)
+{
+	char path[256], tmp[256];
+	if (!undojournal_path(j, start, "ujx", path, sizeof path)) return;
+	if (!undojournal_path(j, start, "ujx.tmp", tmp, sizeof tmp)) return;
+
+	FILE *f = fopen(tmp, "wb");
+	if (f == NULL) return;
+
+	uint32_t used = l->used;
+	bool ok = fwrite(&l->records, sizeof l->records, 1, f) == 1;
+	ok &= fwrite(&used, sizeof used, 1, f) == 1;
+	ok &= fwrite(l->items, sizeof *l->items, l->used, f) == l->used;
+	ok &= fclose(f) == 0;
+
+	if (ok) rename(tmp, path);
+	else unlink(tmp);
+}
+
+/* Get the index of a segment. The index file is only trusted if it covers
+ * every record in the segment, otherwise the segment is scanned again. */
+static bool undojournal_load_index(const struct undojournal_t *j, long long start, struct undojournal_index_list_t *l)
+{
+	l->items = NULL;
+	l->used = l->size = 0;
+	l->records = 0;
+
+	if (j->f != NULL && start == j->start)
+	{
+		size_t i;
+		for (i = 0; i < j->index.used; i++)
+		{
+			const struct undojournal_index_t *e = &j->index.items[i];
+			undojournal_index_add(l, e->playerid, e->bucket, e->count);
+		}
+		l->records = j->index.records;
+		return true;
+	}
+
+	char path[256];
+	struct stat st;
+	if (!undojournal_path(j, start, "uj", path, sizeof path)) return false;
+	if (stat(path, &st) != 0) return false;
+
+	FILE *f = NULL;
+	if (undojournal_path(j, start, "ujx", path, sizeof path)) f = fopen(path, "rb");
+	if (f != NULL)
+	{
+		uint32_t records, used;
+		if (fread(&records, sizeof records, 1, f) == 1 && records == st.st_size / sizeof (struct undojournal_record_t) &&
+		    fread(&used, sizeof used, 1, f) == 1)
+		{
+			l->items = malloc(sizeof *l->items * used);
+			if (l->items != NULL && fread(l->items, sizeof *l->items, used, f) == used)
+			{
+				l->used = l->size = used;
+				l->records = records;
+				fclose(f);
+				return true;
+			}
+			free(l->items);
+			l->items = NULL;
+		}
+		fclose(f);
+	}
+
+	if (!undojournal_scan(j, start, l)) return false;
+	undojournal_write_index(j, start, l);
+	return true;
+}
+
+static int undojournal_compare_start(const void *a, const void *b)
+{
+	long long sa = *(const long long *)a;
+	long long sb = *(const long long *)b;
+	if (sa == sb) return 0;
+	return sa < sb ? 1 : -1;
+}
+
+/* List segment start times, newest first */
+static size_t undojournal_segments(const struct undojournal_t *j, long long **starts)
+{
+	size_t used = 0, size = 0;
+	*starts = NULL;
+
+	DIR *dir = opendir(j->dir);
+	if (dir == NULL) return 0;
+
+	struct dirent *d;
+	while ((d = readdir(dir)) != NULL)
+	{
+		char *end;
+		long long start = strtoll(d->d_name, &end, 10);
+		if (end == d->d_name || strcmp(end, ".uj") != 0) continue;
+
+		if (used >= size)
+		{
+			size += 64;
+			long long *n = realloc(*starts, sizeof *n * size);
+			if (n == NULL) break;
+			*starts = n;
+		}
+		(*starts)[used++] = start;
+	}
+
+	closedir(dir);
+
+	qsort(*starts, used, sizeof **starts, &undojournal_compare_start);
+	return used;
+}
+
+static void undojournal_seal(struct undojournal_t *j)
+{
+	if (j->f == NULL) return;
+
+	fclose(j->f);
+	j->f = NULL;
+
+	undojournal_write_index(j, j->start, &j->index);
+
+	free(j->index.items);
+	j->index.items = NULL;
+	j->index.used = j->index.size = 0;
+	j->index.records = 0;
+}
+
+static bool undojournal_open_segment(struct undojournal_t *j, long long start)
+{
+	undojournal_seal(j);
+
+	/* Continue a segment left by a previous run */
+	undojournal_scan(j, start, &j->index);
+
+	char path[256];
+	if (!undojournal_path(j, start, "uj", path, sizeof path))
+	{
+		LOG("Undo journal path for %s is too long\n", j->dir);
+		return false;
+	}
+
+	j->f = fopen(path, "ab");
+	if (j->f == NULL)
+	{
+		LOG("Unable to open undo journal %s\n", path);
+		return false;
+	}
+
+	/* Drop any partial record from an interrupted write */
+	long size = ftell(j->f);
+	if (size % sizeof (struct undojournal_record_t) != 0)
+	{
+		if (ftruncate(fileno(j->f), size - size % sizeof (struct undojournal_record_t)) != 0)
+		{
+			LOG("Unable to repair undo journal %s\n", path);
+		}
+		fseek(j->f, 0, SEEK_END);
+	}
+
+	j->start = start;
+	return true;
+}
+
+struct undojournal_t *undojournal_open(const char *name)
+{
+	struct undojournal_t *j = calloc(1, sizeof *j);
+	if (j == NULL) return NULL;
+
+	snprintf(j->dir, sizeof j->dir, "undo/%s", name);
+	lcase(j->dir);
+	mkdir(j->dir, 0755);
+
+	j->start = -1;
+
+	return j;
+}
+
+void undojournal_close(struct undojournal_t *j)
+{
+	if (j == NULL) return;
+
+	undojournal_seal(j);
+	free(j);
+}
+
+void undojournal_delete(const char *name)
+{
+	char dir[256];
+	snprintf(dir, sizeof dir, "undo/%s", name);
+	lcase(dir);
+
+	DIR *d = opendir(dir);
+	if (d == NULL) return;
+
+	struct dirent *e;
+	while ((e = readdir(d)) != NULL)
+	{
+		/* Only segments and their indexes, anything else is left alone */
+		char *end;
+		strtoll(e->d_name, &end, 10);
+		if (end == e->d_name) continue;
+		if (strcmp(end, ".uj") != 0 && strcmp(end, ".ujx") != 0 && strcmp(end, ".ujx.tmp") != 0) continue;
+
+		char path[sizeof dir + sizeof e->d_name];
+		snprintf(path, sizeof path, "%s/%s", dir, e->d_name);
+		unlink(path);
+	}
+
+	closedir(d);
+
+	if (rmdir(dir) != 0) LOG("Unable to remove undo journal %s\n", dir);
+}
+
+bool undojournal_log(struct undojournal_t *j, int playerid, int16_t x, int16_t y, int16_t z, int oldtype, int olddata, int newtype, time_t time)
+{
+	long long start = time - time % UNDOJOURNAL_SEGMENT;
+
+	if (j->f == NULL || start > j->start)
+	{
+		if (!undojournal_open_segment(j, start)) return false;
+	}
+
+	/* The clock went backwards, so file it at the start of this segment */
+	if (time < j->start) time = j->start;
+
+	struct undojournal_record_t r;
+	r.x = x;
+	r.y = y;
+	r.z = z;
+	r.oldtype = oldtype;
+	r.newtype = newtype;
+	r.olddata = olddata;
+	r.playerid = playerid;
+	r.time = time - j->start;
+
+	if (fwrite(&r, sizeof r, 1, j->f) != 1) return false;
+
+	j->index.records++;
+	undojournal_index_add(&j->index, playerid, time / UNDODB_BUCKET, 1);
+
+	return true;
+}
+
+bool undojournal_sync(struct undojournal_t *j)
+{
+	return j->f == NULL || fflush(j->f) == 0;
+}
+
+static int undojournal_compare_bucket(const void *a, const void *b)
+{
+	const struct undojournal_index_t *ea = a;
+	const struct undojournal_index_t *eb = b;
+	if (ea->bucket == eb->bucket) return 0;
+	return ea->bucket < eb->bucket ? 1 : -1;
+}
+
+/* Report change counts per bucket, newest first, for one player or for
+ * everyone if playerid is -1. */
+void undojournal_summary(struct undojournal_t *j, int playerid, int limit, undojournal_summary_func_t func, void *arg)
+{
+	long long *starts;
+	size_t n = undojournal_segments(j, &starts);
+	size_t s, i;
+
+	for (s = 0; s < n && limit > 0; s++)
+	{
+		struct undojournal_index_list_t l;
+		if (!undojournal_load_index(j, starts[s], &l)) continue;
+
+		qsort(l.items, l.used, sizeof *l.items, &undojournal_compare_bucket);
+
+		for (i = 0; i < l.used && limit > 0; i++)
+		{
+			if (playerid != -1 && l.items[i].playerid != (uint32_t)playerid) continue;
+
+			func(l.items[i].playerid, (time_t)l.items[i].bucket * UNDODB_BUCKET, l.items[i].count, arg);
+			limit--;
+		}
+
+		free(l.items);
+	}
+
+	free(starts);
+}
+
+/* Cursors hold the segment number, its start over UNDOJOURNAL_SEGMENT, in the
+ * high 32 bits and the record number in the low 32 bits. Segment starts
+ * themselves would overflow the high bits from 2038. */
+static inline int64_t undojournal_cursor(long long segment, uint32_t record)
+{
+	return (int64_t)segment << 32 | record;
+}
+
+/* Read up to limit changes by a player older than *cursor, newest first */
+int undojournal_undo_player_batch(struct undojournal_t *j, int playerid, int64_t *cursor, int limit, undo_func_t func, void *arg)
+{
+	long long *starts;
+	size_t n = undojournal_segments(j, &starts);
+	size_t s;
+	int rows = 0;
+
+	undojournal_sync(j);
+
+	for (s = 0; s < n && rows < limit; s++)
+	{
+		long long start = starts[s];
+		long long segment = start / UNDOJOURNAL_SEGMENT;
+		if (segment > (*cursor >> 32)) continue;
+
+		struct undojournal_index_list_t l;
+		if (!undojournal_load_index(j, start, &l)) continue;
+
+		bool has_player = undojournal_index_has_player(&l, playerid);
+		uint32_t end = l.records;
+		free(l.items);
+
+		if (segment == (*cursor >> 32) && (*cursor & 0xFFFFFFFF) < end) end = *cursor & 0xFFFFFFFF;
+
+		if (!has_player)
+		{
+			*cursor = undojournal_cursor(segment, 0);
+			continue;
+		}
+
+		char path[256];
+		if (!undojournal_path(j, start, "uj", path, sizeof path)) continue;
+		int fd = open(path, O_RDONLY);
+		if (fd == -1) continue;
+
+		struct undojournal_record_t buf[UNDOJOURNAL_READ];
+		while (end > 0 && rows < limit)
+		{
+			uint32_t from = end > UNDOJOURNAL_READ ? end - UNDOJOURNAL_READ : 0;
+			ssize_t len = pread(fd, buf, (end - from) * sizeof *buf, (off_t)from * sizeof *buf);
+			if (len != (ssize_t)((end - from) * sizeof *buf)) break;
+
+			while (end > from && rows < limit)
+			{
+				const struct undojournal_record_t *r = &buf[--end - from];
+				*cursor = undojournal_cursor(segment, end);
+
+				if (r->playerid != (uint32_t)playerid) continue;
+
+				func(r->x, r->y, r->z, r->oldtype, r->olddata, r->newtype, arg);
+				rows++;
+			}
+		}
+
+		close(fd);
+	}
+
+	free(starts);
+
+	return rows;
+}
@@ -0,0 +1,26 @@
+#ifndef UNDOJOURNAL_H
+#define UNDOJOURNAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include "undodb.h"
+
+/* Journal segments each cover this many seconds */
+#define UNDOJOURNAL_SEGMENT 3600
+
+struct undojournal_t;
+
+typedef void(*undojournal_summary_func_t)(int playerid, time_t time, int count, void *arg);
+
+struct undojournal_t *undojournal_open(const char *name);
+void undojournal_close(struct undojournal_t *j);
+/* Remove the journal of a deleted level. It must not be open. */
+void undojournal_delete(const char *name);
+bool undojournal_log(struct undojournal_t *j, int playerid, int16_t x, int16_t y, int16_t z, int oldtype, int olddata, int newtype, time_t time);
+bool undojournal_sync(struct undojournal_t *j);
+
+void undojournal_summary(struct undojournal_t *j, int playerid, int limit, undojournal_summary_func_t func, void *arg);
+int undojournal_undo_player_batch(struct undojournal_t *j, int playerid, int64_t *cursor, int limit, undo_func_t func, void *arg);
+
+#endif /* UNDOJOURNAL_H */
@@ -32,7 +32,7 @@ static int physics_wire_sub(struct level_t *l, int16_t x, int16_t y, int16_t z,
 	if (!level_valid_xyz(l, x, y, z)) return 0;
 
 	unsigned index = level_get_index(l, x, y, z);
-	if (l->blocks[index].type == type && l->blocks[index].data == 1)
+	if (level_block_type(l, index) == type && level_block_data(l, index) == 1)
 	{
 		return 1;
 	}
@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <sys/syscall.h>
 #include <errno.h>
+#include "epoch.h"
 #include "queue.h"
 #include "worker.h"
 #include "mcc.h"
@@ -12,7 +13,8 @@
 
 void *worker_thread(void *arg)
 {
-	struct worker *worker = arg;
+	struct worker_thread *thread = arg;
+	struct worker *worker = thread->worker;
 
 	bool timeout = false;
 	int jobs = 0;
@@ -24,20 +26,42 @@ void *worker_thread(void *arg)
 
 	while (true)
 	{
-		struct timespec ts;
-		clock_gettime(CLOCK_REALTIME, &ts);
-		ts.tv_sec += worker->timeout;
+		int s;
+		if (worker->timeout == 0)
+		{
+			s = sem_wait(&worker->sem);
+		}
+		else
+		{
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += worker->timeout;
 
-		int s = sem_timedwait(&worker->sem, &ts);
+			s = sem_timedwait(&worker->sem, &ts);
+		}
 		if (s == -1)
 		{
-			worker->thread_timeout = true;
-			if (errno == ETIMEDOUT) {
-				timeout = true;
+			int err = errno;
+			if (err == EINTR) continue;
+
+			/* A job may have been queued while we gave up waiting. The
+			 * queue is posted to under the thread mutex, so either we
+			 * see its post here or worker_queue() sees us gone and
+			 * starts another thread. */
+			pthread_mutex_lock(&worker->thread_mutex);
+			bool queued = sem_trywait(&worker->sem) == 0;
+			if (!queued) thread->thread_timeout = true;
+			pthread_mutex_unlock(&worker->thread_mutex);
+
+			if (!queued)
+			{
+				if (err == ETIMEDOUT) {
+					timeout = true;
+					break;
+				}
+				LOG("Queue worker %s thread (%u): %s\n", worker->name, tid, strerror(err));
 				break;
 			}
-			LOG("Queue worker %s thread (%u): %s\n", worker->name, tid, strerror(errno));
-			break;
 		}
 
 		void *data;
@@ -46,7 +70,9 @@ void *worker_thread(void *arg)
 			/* Null item added to the queue indicate we should exit. */
 			if (data == NULL) break;
 
+			unsigned epoch = epoch_enter();
 			worker->callback(data);
+			epoch_exit(epoch);
 			jobs++;
 		}
 	}
@@ -63,65 +89,99 @@ void *worker_thread(void *arg)
 	return NULL;
 }
 
-void worker_init(struct worker *worker, const char *name, unsigned timeout, int nice, worker_callback callback)
+/* Idle threads exit after timeout milliseconds and are restarted when work
+ * is queued. A timeout of 0 keeps them until worker_deinit(). */
+void worker_init(struct worker *worker, const char *name, unsigned timeout, int nice, unsigned threads, worker_callback callback)
 {
 	memset(worker, 0, sizeof *worker);
 
 	strncpy(worker->name, name, sizeof worker->name);
-	worker->thread_valid = false;
-	worker->thread_timeout = false;
 	worker->timeout = timeout / 1000;
 	worker->nice = nice;
+	worker->threads = threads < 1 ? 1 : threads > WORKER_MAX_THREADS ? WORKER_MAX_THREADS : threads;
+
+	unsigned i;
+	for (i = 0; i < worker->threads; i++)
+	{
+		worker->thread[i].worker = worker;
+		worker->thread[i].thread_valid = false;
+		worker->thread[i].thread_timeout = false;
+	}
+	pthread_mutex_init(&worker->thread_mutex, NULL);
 
 	worker->queue = queue_new();
 	worker->callback = callback;
 	sem_init(&worker->sem, 0, 0);
 
-	LOG("Queue worker %s initialised\n", worker->name);
+	LOG("Queue worker %s initialised with %u thread%s\n", worker->name, worker->threads, worker->threads == 1 ? "" : "s");
 }
 
 void worker_deinit(struct worker *worker)
 {
-	if (worker->thread_valid)
+	unsigned i;
+
+	/* One exit marker for each running thread */
+	for (i = 0; i < worker->threads; i++)
 	{
-		if (!worker->thread_timeout)
+		if (worker->thread[i].thread_valid && !worker->thread[i].thread_timeout)
 		{
 			if (queue_produce(worker->queue, NULL))
 			{
 				sem_post(&worker->sem);
 			}
 		}
+	}
 
-		pthread_join(worker->thread, NULL);
+	for (i = 0; i < worker->threads; i++)
+	{
+		if (worker->thread[i].thread_valid)
+		{
+			pthread_join(worker->thread[i].thread, NULL);
+		}
 	}
 
 	queue_delete(worker->queue);
+	pthread_mutex_destroy(&worker->thread_mutex);
 
 	LOG("Queue worker %s deinitialised\n", worker->name);
 }
 
 void worker_queue(struct worker *worker, void *data)
 {
-	if (worker->thread_timeout)
-	{
-		pthread_join(worker->thread, NULL);
-		worker->thread_timeout = false;
-		worker->thread_valid = false;
-	}
+	unsigned i;
 
-	if (!worker->thread_valid)
+	pthread_mutex_lock(&worker->thread_mutex);
+	for (i = 0; i < worker->threads; i++)
 	{
-		worker->thread_valid = (pthread_create(&worker->thread, NULL, &worker_thread, worker) == 0);
-	}
+		struct worker_thread *thread = &worker->thread[i];
 
-	if (queue_produce(worker->queue, data))
-	{
-		sem_post(&worker->sem);
+		if (thread->thread_timeout)
+		{
+			pthread_join(thread->thread, NULL);
+			thread->thread_timeout = false;
+			thread->thread_valid = false;
+		}
+
+		if (!thread->thread_valid)
+		{
+			thread->thread_valid = (pthread_create(&thread->thread, NULL, &worker_thread, thread) == 0);
+		}
 	}
-	else
+
+	/* Still under the mutex, so no thread can time out between the check
+	 * above and the post */
+	bool queued = queue_produce(worker->queue, data);
+	if (queued) sem_post(&worker->sem);
+	pthread_mutex_unlock(&worker->thread_mutex);
+
+	if (!queued)
 	{
 		LOG("Queue worker %s unable to queue\n", worker->name);
 	}
 }
 
-
+unsigned worker_cpus(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return cpus < 1 ? 1 : cpus;
+}
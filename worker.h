@@ -4,24 +4,39 @@
 #include <pthread.h>
 #include <semaphore.h>
 
+#define WORKER_MAX_THREADS 32
+
 typedef void(*worker_callback)(void *arg);
 
-struct worker
+struct worker;
+
+struct worker_thread
 {
-	char name[16];
+	struct worker *worker;
+	pthread_t thread;
 	int thread_valid;
 	int thread_timeout;
+};
+
+struct worker
+{
+	char name[16];
 	unsigned timeout;
 	int nice;
 
+	unsigned threads;
+	struct worker_thread thread[WORKER_MAX_THREADS];
+	pthread_mutex_t thread_mutex;
+
 	struct queue_t *queue;
-	pthread_t thread;
 	worker_callback callback;
 	sem_t sem;
 };
 
-void worker_init(struct worker *worker, const char *name, unsigned timeout, int nice, worker_callback callback);
+void worker_init(struct worker *worker, const char *name, unsigned timeout, int nice, unsigned threads, worker_callback callback);
 void worker_deinit(struct worker *worker);
 void worker_queue(struct worker* worker, void *data);
 
+unsigned worker_cpus(void);
+
 #endif /* WORKER_H */
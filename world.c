@@ -0,0 +1,524 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "block.h"
+#include "chunk.h"
+#include "chunked_level.h"
+#include "client.h"
+#include "colour.h"
+#include "level.h"
+#include "level_worker.h"
+#include "mcc.h"
+#include "npc.h"
+#include "player.h"
+#include "util.h"
+
+/* The world hook makes a level a window onto an endless chunked world. The
+ * level's blocks are the part of the world around its players, and the
+ * window is moved, and the level sent again, when players near its edge.
+ * Chunks outside the window are saved and dropped. Level width and depth
+ * must be a multiple of the chunk size, and height at most a chunk high. */
+
+/* Chunks between the players and the edge of the window before it moves */
+#define WORLD_MARGIN 2
+
+enum
+{
+	WORLD_READY,
+	WORLD_LOAD,
+	WORLD_FILL,
+	WORLD_MOVE,
+};
+
+struct world_temp_t
+{
+	struct chunked_level_t cl;
+	/* Set by moves on the network thread and ticks on a physics worker, so
+	 * only through world_state_get() and world_state_set() */
+	int state;
+
+	/* Chunks in the window, and those wanted for the next one */
+	struct chunk_t **chunks;
+	struct chunk_t **next;
+
+	/* Origin of the next window, in chunks */
+	int32_t x, z;
+
+	/* Height in the chunks of the bottom of the level */
+	int y;
+};
+
+struct world_t
+{
+	int32_t seed, seed2;
+
+	/* Origin of the window, in chunks */
+	int32_t x, z;
+
+	struct world_temp_t *temp;
+};
+
+static inline int world_chunks_x(const struct level_t *l) { return l->x >> CHUNK_BITS_X; }
+static inline int world_chunks_z(const struct level_t *l) { return l->z >> CHUNK_BITS_Z; }
+
+static inline unsigned world_chunk_index(const struct world_temp_t *t, int x, int y, int z)
+{
+	return x | ((y + t->y) | z << CHUNK_BITS_Y) << CHUNK_BITS_X;
+}
+
+/* Request the chunks of the next window, returns true once all are ready.
+ * Chunks nearest the middle, where the players are, are loaded first. */
+static bool world_request(struct level_t *l, struct world_temp_t *t)
+{
+	int nx = world_chunks_x(l);
+	int nz = world_chunks_z(l);
+	bool ready = true;
+	int cx, cz;
+
+	for (cz = 0; cz < nz; cz++)
+	{
+		for (cx = 0; cx < nx; cx++)
+		{
+			unsigned priority = abs(cx * 2 + 1 - nx) + abs(cz * 2 + 1 - nz);
+			struct chunk_t *chunk = chunked_level_request(&t->cl, t->x + cx, 0, t->z + cz, priority);
+			t->next[cx + cz * nx] = chunk;
+			if (chunk == NULL || !chunk->ready) ready = false;
+		}
+	}
+
+	return ready;
+}
+
+/* Copy the window's blocks into the level */
+static void world_copy_in(struct level_t *l, struct world_temp_t *t)
+{
+	int nx = world_chunks_x(l);
+	int cx, cz, x, y, z;
+	unsigned failed = 0;
+
+	for (cz = 0; cz < world_chunks_z(l); cz++)
+	{
+		for (cx = 0; cx < nx; cx++)
+		{
+			const struct chunk_t *chunk = t->chunks[cx + cz * nx];
+
+			for (z = 0; z < CHUNK_SIZE_Z; z++)
+			{
+				for (y = 0; y < l->y; y++)
+				{
+					for (x = 0; x < CHUNK_SIZE_X; x++)
+					{
+						struct block_t b = chunk->blocks[world_chunk_index(t, x, y, z)];
+						b.physics = 0;
+						b.touched = 0;
+
+						unsigned index = level_get_index(l, (cx << CHUNK_BITS_X) + x, y, (cz << CHUNK_BITS_Z) + z);
+						if (!level_block_put(l, index, &b)) failed++;
+					}
+				}
+			}
+		}
+	}
+
+	if (failed > 0) LOG("Unable to store %u blocks of world chunks in %s\n", failed, l->name);
+}
+
+/* Store changes made to the level back into the window's chunks */
+static void world_copy_out(struct level_t *l, struct world_temp_t *t)
+{
+	int nx = world_chunks_x(l);
+	int cx, cz, x, y, z;
+
+	pthread_mutex_lock(&t->cl.mutex);
+
+	for (cz = 0; cz < world_chunks_z(l); cz++)
+	{
+		for (cx = 0; cx < nx; cx++)
+		{
+			struct chunk_t *chunk = t->chunks[cx + cz * nx];
+
+			for (z = 0; z < CHUNK_SIZE_Z; z++)
+			{
+				for (y = 0; y < l->y; y++)
+				{
+					for (x = 0; x < CHUNK_SIZE_X; x++)
+					{
+						unsigned index = level_get_index(l, (cx << CHUNK_BITS_X) + x, y, (cz << CHUNK_BITS_Z) + z);
+						struct block_t b = level_block_get(l, index);
+						b.physics = 0;
+						b.touched = 0;
+
+						struct block_t *cb = &chunk->blocks[world_chunk_index(t, x, y, z)];
+						if (memcmp(cb, &b, sizeof b) == 0) continue;
+
+						*cb = b;
+						chunk->dirty = true;
+					}
+				}
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&t->cl.mutex);
+}
+
+/* Release chunks of the window that are not in the next one */
+static void world_release(struct level_t *l, struct world_t *w)
+{
+	struct world_temp_t *t = w->temp;
+	int nx = world_chunks_x(l);
+	int nz = world_chunks_z(l);
+	int cx, cz;
+
+	for (cz = 0; cz < nz; cz++)
+	{
+		for (cx = 0; cx < nx; cx++)
+		{
+			struct chunk_t *chunk = t->chunks[cx + cz * nx];
+			if (chunk == NULL) continue;
+			if (chunk->x >= t->x && chunk->x < t->x + nx && chunk->z >= t->z && chunk->z < t->z + nz) continue;
+
+			chunked_level_release(&t->cl, chunk);
+		}
+	}
+}
+
+static void world_clamp(int16_t *v, int16_t size)
+{
+	if (*v < 16) *v = 16;
+	if (*v > size * 32 - 16) *v = size * 32 - 16;
+}
+
+/* Move a position by the change in window origin, keeping it on the level */
+static void world_shift(const struct level_t *l, struct position_t *pos, int dx, int dz)
+{
+	pos->x -= dx * CHUNK_SIZE_X * 32;
+	pos->z -= dz * CHUNK_SIZE_Z * 32;
+	world_clamp(&pos->x, l->x);
+	world_clamp(&pos->z, l->z);
+}
+
+static void world_set_spawn(struct level_t *l)
+{
+	int y;
+
+	l->spawn.x = l->x * 16;
+	l->spawn.z = l->z * 16;
+	for (y = l->y - 5; y > 0; y--)
+	{
+		unsigned index = level_get_index(l, l->x / 2, y, l->z / 2);
+		if (level_block_type(l, index) != AIR)
+		{
+			l->spawn.y = (y + 4) * 32;
+			break;
+		}
+	}
+}
+
+/* The state publishes the window origin written before it, so a reader that
+ * sees WORLD_MOVE also sees the new t->x and t->z, and a mover that sees
+ * WORLD_READY sees the new w->x and w->z */
+static inline int world_state_get(const struct world_temp_t *t)
+{
+	return __atomic_load_n(&t->state, __ATOMIC_ACQUIRE);
+}
+
+static inline void world_state_set(struct world_temp_t *t, int state)
+{
+	__atomic_store_n(&t->state, state, __ATOMIC_RELEASE);
+}
+
+static void world_handle_tick(struct level_t *l, struct world_t *w)
+{
+	struct world_temp_t *t = w->temp;
+	int i;
+
+	if (t == NULL) return;
+
+	int state = world_state_get(t);
+	if (state == WORLD_READY) return;
+	if (!world_request(l, t)) return;
+
+	/* Try again next tick if the level is being saved or sent */
+	if (pthread_mutex_trylock(&l->mutex) != 0) return;
+	int dx = t->x - w->x;
+	int dz = t->z - w->z;
+
+	if (state == WORLD_MOVE)
+	{
+		world_copy_out(l, t);
+		world_release(l, w);
+	}
+
+	struct chunk_t **chunks = t->chunks;
+	t->chunks = t->next;
+	t->next = chunks;
+	w->x = t->x;
+	w->z = t->z;
+	world_state_set(t, WORLD_READY);
+
+	if (state == WORLD_LOAD)
+	{
+		/* The level already holds the window */
+		pthread_mutex_unlock(&l->mutex);
+		return;
+	}
+
+	world_copy_in(l, t);
+	level_activate_physics(l);
+
+	if (state == WORLD_FILL)
+	{
+		world_set_spawn(l);
+	}
+	else
+	{
+		world_shift(l, &l->spawn, dx, dz);
+	}
+
+	for (i = 0; i < MAX_CLIENTS_PER_LEVEL; i++)
+	{
+		struct client_t *c = l->clients[i];
+		if (c == NULL) continue;
+
+		struct position_t pos = c->player->pos;
+		if (state == WORLD_FILL)
+		{
+			pos = l->spawn;
+		}
+		else
+		{
+			world_shift(l, &pos, dx, dz);
+		}
+		player_teleport(c->player, &pos, false);
+	}
+
+	for (i = 0; i < MAX_NPCS_PER_LEVEL; i++)
+	{
+		if (l->npcs[i] != NULL) world_shift(l, &l->npcs[i]->pos, dx, dz);
+	}
+
+	l->changed = true;
+	level_blocks_replaced(l);
+	l->save_stamp = 0;
+
+	pthread_mutex_unlock(&l->mutex);
+
+	LOG("Level '%s' moved to world chunk %d x %d\n", l->name, w->x, w->z);
+
+	for (i = 0; i < MAX_CLIENTS_PER_LEVEL; i++)
+	{
+		struct client_t *c = l->clients[i];
+		if (c == NULL) continue;
+
+		c->waiting_for_level = true;
+		level_send_queue(c);
+	}
+
+	level_send_wake(l);
+}
+
+/* Centre the window on the players once any of them nears its edge */
+static void world_handle_move(struct level_t *l, struct client_t *c, struct world_t *w)
+{
+	struct world_temp_t *t = w->temp;
+	int nx = world_chunks_x(l);
+	int nz = world_chunks_z(l);
+	int i;
+
+	/* Changing levels, don't handle teleports */
+	if (c->player->level != c->player->new_level) return;
+	if (t == NULL || world_state_get(t) != WORLD_READY) return;
+
+	int x = c->player->pos.x / 32 >> CHUNK_BITS_X;
+	int z = c->player->pos.z / 32 >> CHUNK_BITS_Z;
+	if (x >= WORLD_MARGIN && x < nx - WORLD_MARGIN && z >= WORLD_MARGIN && z < nz - WORLD_MARGIN) return;
+
+	int sx = 0, sz = 0, n = 0;
+	for (i = 0; i < MAX_CLIENTS_PER_LEVEL; i++)
+	{
+		const struct client_t *c2 = l->clients[i];
+		if (c2 == NULL || c2->sending_level) continue;
+
+		sx += c2->player->pos.x / 32;
+		sz += c2->player->pos.z / 32;
+		n++;
+	}
+	if (n == 0) return;
+
+	int dx = (sx / n >> CHUNK_BITS_X) - nx / 2;
+	int dz = (sz / n >> CHUNK_BITS_Z) - nz / 2;
+	if (dx == 0 && dz == 0) return;
+
+	t->x = w->x + dx;
+	t->z = w->z + dz;
+	world_state_set(t, WORLD_MOVE);
+}
+
+static bool world_handle_chat(struct level_t *l, struct client_t *c, char *data, struct world_t *w)
+{
+	struct world_temp_t *t = w->temp;
+	char buf[65];
+
+	if (strcasecmp(data, "world stats") != 0) return false;
+
+	if (t == NULL)
+	{
+		client_notify(c, TAG_YELLOW "World is not active");
+		return true;
+	}
+
+	pthread_mutex_lock(&t->cl.mutex);
+	struct chunked_level_stats_t s = t->cl.stats;
+	unsigned chunks = t->cl.chunks;
+	pthread_mutex_unlock(&t->cl.mutex);
+
+	snprintf(buf, sizeof buf, TAG_YELLOW "World at %d x %d, %u chunks held", w->x, w->z, chunks);
+	client_notify(c, buf);
+	snprintf(buf, sizeof buf, TAG_YELLOW "Queued: load %u (max %u) save %u purge %u", s.load_queue, s.load_queue_max, s.save_queue, s.purge_queue);
+	client_notify(c, buf);
+	snprintf(buf, sizeof buf, TAG_YELLOW "Loads: %llu, %llu repeated, avg %llums max %llums",
+			(unsigned long long)s.loads, (unsigned long long)s.load_dupes,
+			(unsigned long long)(s.loads == 0 ? 0 : s.load_ms / s.loads), (unsigned long long)s.load_ms_max);
+	client_notify(c, buf);
+
+	return true;
+}
+
+static void world_handle_save(struct level_t *l, struct world_t *w)
+{
+	struct world_temp_t *t = w->temp;
+	if (t == NULL) return;
+
+	int state = world_state_get(t);
+	if (state == WORLD_LOAD || state == WORLD_FILL) return;
+
+	world_copy_out(l, t);
+	chunked_level_save(&t->cl);
+}
+
+static void world_init(struct level_t *l, struct world_t *w, bool fill)
+{
+	w->temp = NULL;
+
+	if ((l->x & CHUNK_MASK_X) != 0 || (l->z & CHUNK_MASK_Z) != 0 || l->y > CHUNK_SIZE_Y)
+	{
+		LOG("Level '%s' must be a multiple of %dx%d and at most %d high for world\n", l->name, CHUNK_SIZE_X, CHUNK_SIZE_Z, CHUNK_SIZE_Y);
+		return;
+	}
+
+	if (world_chunks_x(l) <= WORLD_MARGIN * 2 || world_chunks_z(l) <= WORLD_MARGIN * 2)
+	{
+		LOG("Level '%s' is too small for world\n", l->name);
+		return;
+	}
+
+	struct world_temp_t *t = calloc(1, sizeof *t);
+	if (t == NULL) return;
+
+	unsigned n = world_chunks_x(l) * world_chunks_z(l);
+	t->chunks = calloc(n, sizeof *t->chunks);
+	t->next = calloc(n, sizeof *t->next);
+
+	/* A truncated name could share another level's chunks */
+	char name[CHUNK_DIR_SIZE];
+	int len = snprintf(name, sizeof name, "levels/%s", l->name);
+	lcase(name);
+
+	bool fits = len >= 0 && (size_t)len < sizeof name;
+	if (!fits) LOG("Level name '%s' is too long for world\n", l->name);
+
+	if (!fits || t->chunks == NULL || t->next == NULL || !chunked_level_init(&t->cl, name))
+	{
+		free(t->chunks);
+		free(t->next);
+		free(t);
+		return;
+	}
+
+	if (fill)
+	{
+		w->seed = t->cl.landscape.seed;
+		w->seed2 = t->cl.landscape.seed2;
+	}
+	else
+	{
+		t->cl.landscape.seed = w->seed;
+		t->cl.landscape.seed2 = w->seed2;
+	}
+
+	/* Keep sea level at the middle of the level */
+	t->y = (CHUNK_SIZE_Y - l->y) / 2;
+	t->x = w->x;
+	t->z = w->z;
+	t->state = fill ? WORLD_FILL : WORLD_LOAD;
+
+	w->temp = t;
+}
+
+static void world_deinit(struct level_t *l, struct world_t *w)
+{
+	struct world_temp_t *t = w->temp;
+	if (t == NULL) return;
+
+	world_handle_save(l, w);
+	chunked_level_deinit(&t->cl);
+
+	free(t->chunks);
+	free(t->next);
+	free(t);
+	w->temp = NULL;
+}
+
+static bool world_level_hook(int event, struct level_t *l, struct client_t *c, void *data, struct level_hook_data_t *arg)
+{
+	switch (event)
+	{
+		case EVENT_TICK: world_handle_tick(l, arg->data); break;
+		case EVENT_CHAT: return world_handle_chat(l, c, data, arg->data);
+		case EVENT_MOVE: world_handle_move(l, c, arg->data); break;
+		case EVENT_SAVE: world_handle_save(l, arg->data); break;
+		case EVENT_INIT:
+		{
+			if (arg->size == 0)
+			{
+				LOG("Allocating new world data on %s\n", l->name);
+			}
+			else
+			{
+				if (arg->size == sizeof (struct world_t))
+				{
+					world_init(l, arg->data, false);
+					break;
+				}
+
+				LOG("Found invalid world data on %s, erasing\n", l->name);
+				free(arg->data);
+			}
+
+			arg->size = sizeof (struct world_t);
+			arg->data = calloc(1, arg->size);
+			world_init(l, arg->data, true);
+			break;
+		}
+		case EVENT_DEINIT:
+		{
+			if (l == NULL) break;
+
+			world_deinit(l, arg->data);
+			break;
+		}
+	}
+
+	return false;
+}
+
+void module_init(void **data)
+{
+	register_level_hook_func("world", &world_level_hook);
+}
+
+void module_deinit(void *data)
+{
+	deregister_level_hook_func("world");
+}
@@ -5,6 +5,7 @@
 #include "colour.h"
 #include "client.h"
 #include "level.h"
+#include "level_grid.h"
 #include "player.h"
 #include "position.h"
 #include "mcc.h"
@@ -240,10 +241,12 @@ static void zombie_handle_move(struct level_t *l, struct client_t *c, int index,
 
 	if (arg->temp->timer[c->player->levelid] > 0) return;
 
-	int i;
-	for (i = 0; i < MAX_CLIENTS_PER_LEVEL; i++)
+	/* Only players in the grid cells around the zombie can be in reach */
+	int ids[MAX_CLIENTS_PER_LEVEL];
+	int i, n = level_grid_query(l, NULL, &c->player->pos, 40, ids, MAX_CLIENTS_PER_LEVEL);
+	for (i = 0; i < n; i++)
 	{
-		struct client_t *cl = l->clients[i];
+		struct client_t *cl = l->clients[ids[i]];
 		/* cl is self, or already a zombie? */
 		if (cl == NULL || cl->sending_level || cl == c) continue;
 		if (is_zombie(cl->player) || is_mod(cl->player)) continue;